@@ -0,0 +1,141 @@
+#
+# Copyright (C) 2014  Mozilla Foundation
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+LOCAL_PATH := $(call my-dir)
+
+#
+# Multi-device stress benchmark
+#
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := nfcemu-stress.c bench-stub.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_CFLAGS := -m64
+LOCAL_LDFLAGS := -m64
+LOCAL_LDLIBS := -m64 -lpthread
+LOCAL_STATIC_LIBRARIES := lib64nfcemu
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := nfcemu-stress
+include $(BUILD_HOST_EXECUTABLE)
+
+#
+# SNEP throughput benchmark
+#
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := nfcemu-snep.c bench-stub.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_CFLAGS := -m64
+LOCAL_LDFLAGS := -m64
+LOCAL_LDLIBS := -m64
+LOCAL_STATIC_LIBRARIES := lib64nfcemu
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := nfcemu-snep
+include $(BUILD_HOST_EXECUTABLE)
+
+#
+# base64 throughput benchmark
+#
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := nfcemu-base64.c bench-stub.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include $(LOCAL_PATH)/../src
+LOCAL_CFLAGS := -m64
+LOCAL_LDFLAGS := -m64
+LOCAL_LDLIBS := -m64
+LOCAL_STATIC_LIBRARIES := lib64nfcemu
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := nfcemu-base64
+include $(BUILD_HOST_EXECUTABLE)
+
+#
+# Trace replay
+#
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := nfcemu-replay.c bench-stub.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_CFLAGS := -m64
+LOCAL_LDFLAGS := -m64
+LOCAL_LDLIBS := -m64 -lpthread
+LOCAL_STATIC_LIBRARIES := lib64nfcemu
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := nfcemu-replay
+include $(BUILD_HOST_EXECUTABLE)
+
+#
+# Microbenchmarks
+#
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := nfcemu-micro.c bench-stub.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include $(LOCAL_PATH)/../src
+LOCAL_CFLAGS := -m64
+LOCAL_LDFLAGS := -m64 -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+LOCAL_LDLIBS := -m64
+LOCAL_STATIC_LIBRARIES := lib64nfcemu
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := nfcemu-micro
+include $(BUILD_HOST_EXECUTABLE)
+
+#
+# Stress and microbenchmarks for the release and hardened libraries
+#
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := nfcemu-stress.c bench-stub.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_CFLAGS := -m64 -O3 -flto
+LOCAL_LDFLAGS := -m64 -O3 -flto
+LOCAL_LDLIBS := -m64 -lpthread
+LOCAL_STATIC_LIBRARIES := lib64nfcemu-release
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := nfcemu-stress-release
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := nfcemu-stress.c bench-stub.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_CFLAGS := -m64
+LOCAL_LDFLAGS := -m64
+LOCAL_LDLIBS := -m64 -lpthread
+LOCAL_STATIC_LIBRARIES := lib64nfcemu-hardened
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := nfcemu-stress-hardened
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := nfcemu-micro.c bench-stub.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include $(LOCAL_PATH)/../src
+LOCAL_CFLAGS := -m64 -O3 -flto -DNDEBUG -DDEBUG=0
+LOCAL_LDFLAGS := -m64 -O3 -flto \
+                 -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+LOCAL_LDLIBS := -m64
+LOCAL_STATIC_LIBRARIES := lib64nfcemu-release
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := nfcemu-micro-release
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := nfcemu-micro.c bench-stub.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include $(LOCAL_PATH)/../src
+LOCAL_CFLAGS := -m64
+LOCAL_LDFLAGS := -m64 -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+LOCAL_LDLIBS := -m64
+LOCAL_STATIC_LIBRARIES := lib64nfcemu-hardened
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := nfcemu-micro-hardened
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "bench-stub.h"
+
+void
+bench_log_msg(const char* fmtstr, ...)
+{
+    return;
+}
+
+void
+bench_log_err(const char* fmtstr, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmtstr);
+    vfprintf(stderr, fmtstr, ap);
+    va_end(ap);
+}
+
+nfcemu_timeout*
+bench_new_timeout(void (*cb)(void*), void* data)
+{
+    return (nfcemu_timeout*)data;
+}
+
+void
+bench_mod_timeout(nfcemu_timeout* t, unsigned long ms)
+{
+    return;
+}
+
+void
+bench_del_timeout(nfcemu_timeout* t)
+{
+    return;
+}
+
+int
+bench_timeout_is_pending(nfcemu_timeout* t)
+{
+    return 0;
+}
+
+void
+bench_store_pdu(struct bench_peer* peer, const uint8_t* pkt, size_t len)
+{
+    if ((len < BENCH_NCI_HDR_LEN) || (pkt[0] >> 5)) {
+        return; /* not a data packet */
+    }
+    peer->pdulen = pkt[2];
+    memcpy(peer->pdu, pkt + BENCH_NCI_HDR_LEN, peer->pdulen);
+}
+
+int
+bench_send_pkt(struct nfc_device* nfc,
+               ssize_t (*create)(void*, struct nfc_device*, size_t,
+                                 union nci_packet*),
+               void* data)
+{
+    struct bench_peer* peer = nfc_device_get_data(nfc);
+    uint8_t buf[BENCH_NCI_HDR_LEN + BENCH_NCI_MAX_PAYLOAD];
+    ssize_t res;
+
+    res = create(data, nfc, sizeof(buf), (union nci_packet*)buf);
+    if (res < 0) {
+        ++peer->nerrors;
+        return -1;
+    }
+    bench_store_pdu(peer, buf, res);
+    return 0;
+}
+
+int
+bench_recv_dta(struct nfc_device* nfc,
+               ssize_t (*handle)(void*, struct nfc_device*), void* data)
+{
+    return handle(data, nfc) < 0 ? -1 : 0;
+}
+
+struct nfcemu_ctx*
+bench_ctx_create(int (*send_pkt)(struct nfc_device*,
+                                 ssize_t (*)(void*, struct nfc_device*,
+                                             size_t, union nci_packet*),
+                                 void*))
+{
+    return nfcemu_ctx_create(bench_log_msg, bench_log_err,
+                             bench_new_timeout, bench_mod_timeout,
+                             bench_del_timeout, bench_timeout_is_pending,
+                             send_pkt, send_pkt, bench_recv_dta);
+}
+
+double
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <nfcemu/nfcemu.h>
+
+/*
+ * Host callbacks shared by the benchmarks. Messages are dropped,
+ * errors go to stderr and received data is handled right away. The
+ * benchmarks never wait for LLCP, so timeouts never fire.
+ */
+
+union nci_packet;
+
+enum {
+    BENCH_NCI_HDR_LEN = 3,
+    BENCH_NCI_MAX_PAYLOAD = 255
+};
+
+/* The device data of benchmarks that send packets with
+ * bench_send_pkt() starts with a peer. It holds the payload of the
+ * latest data packet from the device, e.g., an LLCP PDU. */
+struct bench_peer {
+    size_t pdulen;
+    uint8_t pdu[BENCH_NCI_MAX_PAYLOAD];
+    unsigned long nerrors;
+};
+
+void
+bench_log_msg(const char* fmtstr, ...);
+
+void
+bench_log_err(const char* fmtstr, ...);
+
+nfcemu_timeout*
+bench_new_timeout(void (*cb)(void*), void* data);
+
+void
+bench_mod_timeout(nfcemu_timeout* t, unsigned long ms);
+
+void
+bench_del_timeout(nfcemu_timeout* t);
+
+int
+bench_timeout_is_pending(nfcemu_timeout* t);
+
+/* stores the payload of a data packet in the peer */
+void
+bench_store_pdu(struct bench_peer* peer, const uint8_t* pkt, size_t len);
+
+int
+bench_send_pkt(struct nfc_device* nfc,
+               ssize_t (*create)(void*, struct nfc_device*, size_t,
+                                 union nci_packet*),
+               void* data);
+
+int
+bench_recv_dta(struct nfc_device* nfc,
+               ssize_t (*handle)(void*, struct nfc_device*), void* data);
+
+/* Creates a context with the stub callbacks that sends notifications
+ * and data with 'send_pkt', e.g., bench_send_pkt(). */
+struct nfcemu_ctx*
+bench_ctx_create(int (*send_pkt)(struct nfc_device*,
+                                 ssize_t (*)(void*, struct nfc_device*,
+                                             size_t, union nci_packet*),
+                                 void*));
+
+/* returns the monotonic time in seconds */
+double
+bench_now(void);
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures the throughput of the base64 encoder and decoder for
+ * inputs of various sizes. Each size runs with the default functions,
+ * which use vector instructions if the CPU supports them, and with the
+ * scalar reference implementations.
+ *
+ * Usage: nfcemu-base64 [seconds-per-run]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "base64.h"
+#include "bench-stub.h"
+
+enum {
+    MAXIMUM_INPUT_SIZE = 16 * 1024
+};
+
+struct impl {
+    const char* name;
+    ssize_t (*encode)(const unsigned char*, size_t, char*, size_t);
+    ssize_t (*decode)(const char*, size_t, unsigned char*, size_t);
+};
+
+static const struct impl impl[] = {
+    { "default", encode_base64, decode_base64 },
+    { "scalar", encode_base64_scalar, decode_base64_scalar }
+};
+
+static const size_t input_size[] = {
+    4, 8, 16, 32, 64, 256, 1024, MAXIMUM_INPUT_SIZE
+};
+
+static unsigned char raw[MAXIMUM_INPUT_SIZE];
+static char text[MAXIMUM_INPUT_SIZE / 3 * 4 + 4];
+
+/* prevents the compiler from removing the calls */
+static volatile ssize_t sink;
+
+/* returns MiB of raw data per second */
+static double
+run_encode(const struct impl* impl, size_t size, double seconds)
+{
+    unsigned long i, n;
+    double t0, t1;
+
+    t0 = bench_now();
+    for (n = 0, t1 = t0; t1 - t0 < seconds; t1 = bench_now()) {
+        for (i = 0; i < 1024; ++i, ++n) {
+            sink = impl->encode(raw, size, text, sizeof(text));
+        }
+    }
+    return n * size / (t1 - t0) / (1024 * 1024);
+}
+
+static double
+run_decode(const struct impl* impl, size_t size, double seconds)
+{
+    unsigned long i, n;
+    ssize_t len;
+    double t0, t1;
+
+    len = encode_base64_scalar(raw, size, text, sizeof(text));
+
+    t0 = bench_now();
+    for (n = 0, t1 = t0; t1 - t0 < seconds; t1 = bench_now()) {
+        for (i = 0; i < 1024; ++i, ++n) {
+            sink = impl->decode(text, len, raw, sizeof(raw));
+        }
+    }
+    return n * size / (t1 - t0) / (1024 * 1024);
+}
+
+int
+main(int argc, char* argv[])
+{
+    double seconds;
+    size_t i, j;
+
+    seconds = argc > 1 ? strtod(argv[1], NULL) : 0.5;
+
+    for (i = 0; i < sizeof(raw); ++i) {
+        raw[i] = rand();
+    }
+
+    printf("   bytes  implementation  encode MiB/s  decode MiB/s\n");
+
+    for (i = 0; i < sizeof(input_size)/sizeof(input_size[0]); ++i) {
+        for (j = 0; j < sizeof(impl)/sizeof(impl[0]); ++j) {
+            double enc = run_encode(impl + j, input_size[i], seconds);
+            double dec = run_decode(impl + j, input_size[i], seconds);
+
+            printf("%8zu  %14s  %12.1f  %12.1f\n", input_size[i],
+                   impl[j].name, enc, dec);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
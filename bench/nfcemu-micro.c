@@ -0,0 +1,588 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microbenchmarks for the library's hot paths. Each benchmark repeats
+ * a single operation and reports the time and the number of heap
+ * allocations per operation:
+ *
+ *  - nci-cycle: CORE_RESET, CORE_INIT, RF_DISCOVER, activation of
+ *    the T4T remote endpoint and RF_DEACTIVATE
+ *  - snep-put: a SNEP PUT request from the RE to the guest's SNEP
+ *    server, i.e., the console's 'snep put' command, including the
+ *    guest's answer
+ *  - t1t-read .. t4t-read: a single read command of the guest,
+ *    processed by nfc_re_process_data()
+ *  - base64-encode, base64-decode: 1 KiB of data
+ *  - ndef-encode, ndef-decode: a message of three records
+ *
+ * Allocations are counted by wrapping malloc(), calloc() and
+ * realloc() at link time (-Wl,--wrap=...), so only calls from the
+ * benchmark and the static library are counted.
+ *
+ * Usage: nfcemu-micro [-t seconds] [benchmark...]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <nfcemu/nfcemu.h>
+#include <nfcemu/cmdline.h>
+#include "base64.h"
+#include "bench-stub.h"
+#include "ndef.h"
+#include "nfc-re.h"
+#include "nfc.h"
+
+enum {
+    /* LLCP SAPs of the RE's SNEP client and the guest's SNEP server */
+    RE_SAP = 0x20,
+    SNEP_SAP = 0x04,
+    /* LLCP PDU types */
+    PTYPE_SYMM = 0x0,
+    PTYPE_CONNECT = 0x4,
+    PTYPE_CC = 0x6,
+    PTYPE_I = 0xc,
+    /* remote endpoints */
+    RE_NFC_DEP = 0,
+    RE_T1T = 2,
+    RE_T2T = 3,
+    RE_T3T = 4,
+    RE_T4T = 5,
+    /* number of operations between two checks of the clock */
+    BATCH_SIZE = 64,
+    BASE64_SIZE = 1024
+};
+
+struct fixture {
+    /* guest side of the LLCP link; last PDU received from the RE */
+    struct bench_peer peer;
+    struct nfc_device* nfc;
+    struct nfc_re* re;
+    unsigned int ns;
+    unsigned int nr;
+    /* command of the tag benchmarks */
+    size_t cmdlen;
+    uint8_t cmd[32];
+    size_t len;
+    uint8_t in[2 * BASE64_SIZE];
+    uint8_t out[2 * BASE64_SIZE];
+    uint8_t rsp[NFC_MAX_DTA_LENGTH];
+};
+
+struct benchmark {
+    const char* name;
+    int (*setup)(struct fixture* f);
+    int (*run)(struct fixture* f);
+};
+
+static unsigned long nallocs;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void*
+__wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void*
+__wrap_calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(nmemb, size);
+}
+
+void*
+__wrap_realloc(void* ptr, size_t size)
+{
+    __atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+static int
+process(struct fixture* f, const uint8_t* pkt, size_t len)
+{
+    struct nfc_delivery_cb cb = { .func = NULL };
+    uint8_t cmd[BENCH_NCI_HDR_LEN + 256];
+    uint8_t rsp[BENCH_NCI_HDR_LEN + 256];
+    int res;
+
+    memset(cmd, 0, sizeof(cmd));
+    memcpy(cmd, pkt, len);
+
+    res = nfc_device_process_nci_msg(f->nfc, cmd, rsp, &cb);
+    if (res < 0) {
+        return -1;
+    }
+    bench_store_pdu(&f->peer, rsp, res);
+    if (cb.func && (cb.func(cb.data, (union nci_packet*)rsp) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+init_nci(struct fixture* f)
+{
+    static const uint8_t init[][8] = {
+        { 0x20, 0x00, 0x01, 0x01 }, /* CORE_RESET_CMD */
+        { 0x20, 0x01, 0x00 }, /* CORE_INIT_CMD */
+        { 0x21, 0x03, 0x05, 0x02, 0x00, 0x01, 0x05, 0x01 } /* RF_DISCOVER */
+    };
+    static const size_t initlen[] = { 4, 3, 8 };
+    size_t i;
+
+    for (i = 0; i < sizeof(init)/sizeof(init[0]); ++i) {
+        if (process(f, init[i], initlen[i]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * NCI
+ */
+
+static int
+setup_nci_cycle(struct fixture* f)
+{
+    char tag[] = "set 5 [0,1,VA,,SGVsbG8sIHdvcmxkIQ]";
+
+    return nfc_device_cmd_tag(f->nfc, tag);
+}
+
+static int
+run_nci_cycle(struct fixture* f)
+{
+    static const uint8_t deactivate[] = { 0x21, 0x06, 0x01, 0x00 };
+    char activate[] = "rf_intf_activated_ntf 5";
+
+    if ((init_nci(f) < 0) || (nfc_device_cmd_nci(f->nfc, activate) < 0)) {
+        return -1;
+    }
+    return process(f, deactivate, sizeof(deactivate));
+}
+
+/*
+ * SNEP
+ */
+
+static int
+pdu_ptype(const struct fixture* f)
+{
+    if (f->peer.pdulen < 2) {
+        return PTYPE_SYMM;
+    }
+    return ((f->peer.pdu[0] & 0x03) << 2) | (f->peer.pdu[1] >> 6);
+}
+
+/* Sends an LLCP PDU in a single NCI data packet and returns the
+ * type of the RE's answer. */
+static int
+xmit_pdu(struct fixture* f, const uint8_t* pdu, size_t len)
+{
+    uint8_t pkt[BENCH_NCI_HDR_LEN + BENCH_NCI_MAX_PAYLOAD];
+
+    f->peer.pdulen = 0;
+
+    pkt[0] = 0;
+    pkt[1] = 0;
+    pkt[2] = len;
+    memcpy(pkt + BENCH_NCI_HDR_LEN, pdu, len);
+    if (process(f, pkt, BENCH_NCI_HDR_LEN + len) < 0) {
+        return -1;
+    }
+    return pdu_ptype(f);
+}
+
+static size_t
+create_hdr(uint8_t* pdu, unsigned int dsap, unsigned int ptype,
+           unsigned int ssap)
+{
+    pdu[0] = (dsap << 2) | (ptype >> 2);
+    pdu[1] = ((ptype & 0x03) << 6) | ssap;
+    return 2;
+}
+
+static int
+setup_snep_put(struct fixture* f)
+{
+    char activate[] = "rf_intf_activated_ntf 0";
+
+    if (init_nci(f) < 0) {
+        return -1;
+    }
+    return nfc_device_cmd_nci(f->nfc, activate);
+}
+
+/* The RE sends its next PDU right away if it's its turn, or else as
+ * the answer to the guest's next PDU. The guest polls with SYMM PDUs
+ * until the PUT request has arrived. */
+static int
+run_snep_put(struct fixture* f)
+{
+    char cmd[] = "put 4 32 [0,1,VA,,SGVsbG8sIHdvcmxkIQ]";
+    uint8_t pdu[16];
+    size_t len, i;
+    int ptype;
+
+    f->peer.pdulen = 0;
+
+    if (nfc_device_cmd_snep(f->nfc, cmd) < 0) {
+        return -1;
+    }
+    ptype = pdu_ptype(f);
+
+    for (i = 0; i < 4; ++i) {
+        if (ptype == PTYPE_CONNECT) {
+            /* the new data link starts with fresh sequence numbers */
+            f->ns = 0;
+            f->nr = 0;
+            len = create_hdr(pdu, RE_SAP, PTYPE_CC, SNEP_SAP);
+        } else if ((ptype == PTYPE_I) && (f->peer.pdulen > 4) &&
+                   (f->peer.pdu[4] == 0x02)) {
+            /* the message fits into a single I PDU; respond with
+             * Success */
+            f->nr = (f->nr + 1) % 16;
+            len = create_hdr(pdu, RE_SAP, PTYPE_I, SNEP_SAP);
+            pdu[len++] = (f->ns << 4) | f->nr;
+            memcpy(pdu + len, "\x10\x81\x00\x00\x00\x00", 6);
+            f->ns = (f->ns + 1) % 16;
+            return xmit_pdu(f, pdu, len + 6) < 0 ? -1 : 0;
+        } else if (ptype == PTYPE_SYMM) {
+            len = create_hdr(pdu, 0, PTYPE_SYMM, 0);
+        } else {
+            return -1;
+        }
+        ptype = xmit_pdu(f, pdu, len);
+    }
+    return -1;
+}
+
+/*
+ * Tags
+ */
+
+static int
+setup_tag(struct fixture* f, unsigned int id, const uint8_t* cmd,
+          size_t len)
+{
+    char tag[64];
+
+    snprintf(tag, sizeof(tag), "set %u [0,1,VA,,SGVsbG8sIHdvcmxkIQ]", id);
+    if (nfc_device_cmd_tag(f->nfc, tag) < 0) {
+        return -1;
+    }
+    f->re = nfc_device_get_re(f->nfc, id);
+    memcpy(f->cmd, cmd, len);
+    f->cmdlen = len;
+    return 0;
+}
+
+static int
+run_tag_read(struct fixture* f)
+{
+    size_t len = nfc_re_process_data(f->re, 0, f->cmd, f->cmdlen, f->rsp);
+
+    return len ? 0 : -1;
+}
+
+static int
+setup_t1t_read(struct fixture* f)
+{
+    /* RALL */
+    static const uint8_t rall[] = {
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+    return setup_tag(f, RE_T1T, rall, sizeof(rall));
+}
+
+static int
+setup_t2t_read(struct fixture* f)
+{
+    /* READ of blocks 4 to 7 */
+    static const uint8_t read[] = { 0x30, 0x04 };
+
+    return setup_tag(f, RE_T2T, read, sizeof(read));
+}
+
+static int
+setup_t3t_read(struct fixture* f)
+{
+    /* CHECK of block 1 */
+    static const uint8_t check[] = {
+        0x10, 0x06, 0x02, 0xfe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04,
+        0x01, 0x0b, 0x00, 0x01, 0x80, 0x01
+    };
+    return setup_tag(f, RE_T3T, check, sizeof(check));
+}
+
+static int
+setup_t4t_read(struct fixture* f)
+{
+    /* NDEF tag application select, NDEF file select */
+    static const uint8_t select[][13] = {
+        { 0x00, 0xa4, 0x04, 0x00, 0x07, 0xd2, 0x76, 0x00, 0x00, 0x85, 0x01,
+          0x01, 0x00 },
+        { 0x00, 0xa4, 0x00, 0x0c, 0x02, 0xe1, 0x04 }
+    };
+    static const size_t selectlen[] = { 13, 7 };
+    /* READ BINARY of the NLEN field and the message */
+    static const uint8_t read[] = { 0x00, 0xb0, 0x00, 0x00, 0x14 };
+    size_t i;
+
+    if (setup_tag(f, RE_T4T, read, sizeof(read)) < 0) {
+        return -1;
+    }
+    for (i = 0; i < sizeof(select)/sizeof(select[0]); ++i) {
+        if (!nfc_re_process_data(f->re, 0, select[i], selectlen[i], f->rsp)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * base64
+ */
+
+static int
+setup_base64(struct fixture* f)
+{
+    size_t i;
+    ssize_t res;
+
+    for (i = 0; i < BASE64_SIZE; ++i) {
+        f->in[i] = i * 7;
+    }
+    res = encode_base64(f->in, BASE64_SIZE, (char*)f->out, sizeof(f->out));
+    if (res < 0) {
+        return -1;
+    }
+    f->len = res;
+    return 0;
+}
+
+static int
+run_base64_encode(struct fixture* f)
+{
+    return encode_base64(f->in, BASE64_SIZE, (char*)f->out,
+                         sizeof(f->out)) < 0 ? -1 : 0;
+}
+
+static int
+run_base64_decode(struct fixture* f)
+{
+    return decode_base64((const char*)f->out, f->len, f->in,
+                         sizeof(f->in)) < 0 ? -1 : 0;
+}
+
+/*
+ * NDEF
+ */
+
+static size_t
+encode_ndef(uint8_t* buf)
+{
+    static const struct {
+        enum ndef_tnf tnf;
+        const char* type;
+        const char* payload;
+    } rec[] = {
+        { NDEF_TNF_WELL_KNOWN, "T", "\x02" "enHello, world!" },
+        { NDEF_TNF_WELL_KNOWN, "U", "\x01" "mozilla.org" },
+        { NDEF_TNF_MIME, "text/plain", "Hello, world!" }
+    };
+    size_t i, len;
+
+    for (i = 0, len = 0; i < sizeof(rec)/sizeof(rec[0]); ++i) {
+        struct ndef_rec* ndef = (struct ndef_rec*)(buf + len);
+        size_t tlen = strlen(rec[i].type);
+        size_t plen = strlen(rec[i].payload);
+        uint8_t flags = NDEF_FLAG_SR;
+
+        if (!i) {
+            flags |= NDEF_FLAG_MB;
+        }
+        if (i + 1 == sizeof(rec)/sizeof(rec[0])) {
+            flags |= NDEF_FLAG_ME;
+        }
+        ndef_create_rec(ndef, flags, rec[i].tnf, tlen, plen, 0);
+        memcpy(ndef_rec_type(ndef), rec[i].type, tlen);
+        memcpy(ndef_rec_payload(ndef), rec[i].payload, plen);
+        len += ndef_rec_len(ndef);
+    }
+    return len;
+}
+
+static int
+setup_ndef(struct fixture* f)
+{
+    f->len = encode_ndef(f->in);
+    return 0;
+}
+
+static int
+run_ndef_encode(struct fixture* f)
+{
+    return encode_ndef(f->out) == f->len ? 0 : -1;
+}
+
+static int
+run_ndef_decode(struct fixture* f)
+{
+    struct ndef_iter iter;
+    struct ndef_rec_view rec;
+    size_t plen = 0;
+    int res;
+
+    ndef_iter_init(&iter, f->in, f->len);
+
+    while ((res = ndef_iter_next(&iter, &rec)) > 0) {
+        plen += rec.plen;
+    }
+    return (res < 0) || !plen ? -1 : 0;
+}
+
+static const struct benchmark benchmark[] = {
+    { "nci-cycle", setup_nci_cycle, run_nci_cycle },
+    { "snep-put", setup_snep_put, run_snep_put },
+    { "t1t-read", setup_t1t_read, run_tag_read },
+    { "t2t-read", setup_t2t_read, run_tag_read },
+    { "t3t-read", setup_t3t_read, run_tag_read },
+    { "t4t-read", setup_t4t_read, run_tag_read },
+    { "base64-encode", setup_base64, run_base64_encode },
+    { "base64-decode", setup_base64, run_base64_decode },
+    { "ndef-encode", setup_ndef, run_ndef_encode },
+    { "ndef-decode", setup_ndef, run_ndef_decode }
+};
+
+static int
+run(struct nfcemu_ctx* ctx, const struct benchmark* b, double seconds)
+{
+    struct fixture* f;
+    unsigned long n, allocs0, allocs1;
+    double t0, t1;
+    size_t i;
+    int res = -1;
+
+    f = calloc(1, sizeof(*f));
+    if (!f) {
+        return -1;
+    }
+    f->nfc = nfc_device_create_ctx(ctx, f);
+    if (!f->nfc || (b->setup(f) < 0)) {
+        goto out;
+    }
+
+    /* warm up caches and pools */
+    for (i = 0; i < BATCH_SIZE; ++i) {
+        if (b->run(f) < 0) {
+            goto out;
+        }
+    }
+
+    allocs0 = __atomic_load_n(&nallocs, __ATOMIC_RELAXED);
+    t0 = bench_now();
+    for (n = 0, t1 = t0; t1 - t0 < seconds; t1 = bench_now()) {
+        for (i = 0; i < BATCH_SIZE; ++i, ++n) {
+            if (b->run(f) < 0) {
+                goto out;
+            }
+        }
+    }
+    allocs1 = __atomic_load_n(&nallocs, __ATOMIC_RELAXED);
+
+    if (f->peer.nerrors) {
+        goto out;
+    }
+
+    printf("%-16s %12lu %12.1f %12.2f\n", b->name, n,
+           (t1 - t0) * 1e9 / n, (double)(allocs1 - allocs0) / n);
+    res = 0;
+
+out:
+    if (f->nfc) {
+        nfc_device_destroy(f->nfc);
+    }
+    free(f);
+    return res;
+}
+
+static int
+selected(const char* name, int argc, char* argv[])
+{
+    int i;
+
+    if (optind == argc) {
+        return 1; /* run all benchmarks by default */
+    }
+    for (i = optind; i < argc; ++i) {
+        if (!strcmp(name, argv[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    struct nfcemu_ctx* ctx;
+    double seconds = 1;
+    size_t i;
+    int opt, res = EXIT_SUCCESS;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+            case 't':
+                seconds = strtod(optarg, NULL);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-t seconds] [benchmark...]\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    ctx = bench_ctx_create(bench_send_pkt);
+    if (!ctx) {
+        return EXIT_FAILURE;
+    }
+
+    printf("benchmark                 ops        ns/op    allocs/op\n");
+
+    for (i = 0; i < sizeof(benchmark)/sizeof(benchmark[0]); ++i) {
+        if (!selected(benchmark[i].name, argc, argv)) {
+            continue;
+        }
+        if (run(ctx, benchmark + i, seconds) < 0) {
+            fprintf(stderr, "%s failed\n", benchmark[i].name);
+            res = EXIT_FAILURE;
+        }
+    }
+
+    nfcemu_ctx_destroy(ctx);
+
+    return res;
+}
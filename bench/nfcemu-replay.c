@@ -0,0 +1,520 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Replays NCI and HCI traffic that was recorded with
+ * nfc_device_start_trace(). Packets from the guest and console
+ * commands are fed into a fresh device, and the device's packets are
+ * compared with the recorded ones. The tool serves as a regression
+ * check against a golden trace, and, with several threads that each
+ * replay the trace on their own device, as a load generator for the
+ * whole stack.
+ *
+ * Timestamps are ignored; the trace is replayed as fast as possible.
+ * Timeouts never fire during replay, so packets that were sent on
+ * LLCP timeouts in the recording show up as differences.
+ *
+ * Usage: nfcemu-replay [-t threads] [-r repeats] [-i id] [-o output]
+ *                      [-q] trace-file
+ *
+ *  -t  number of threads, each with its own device; default is 1
+ *  -r  number of times each thread replays the trace; default is 1
+ *  -i  replay the records of this device id; default is the id of
+ *      the trace's first record
+ *  -o  record the first replay into a new trace file with the same
+ *      id, e.g. to update a golden trace
+ *  -q  don't print differences
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <nfcemu/nfcemu.h>
+#include <nfcemu/cmdline.h>
+#include "bench-stub.h"
+
+enum {
+    MAX_PACKET_LENGTH = 512,
+    /* packets sent by the device before the replay checks them */
+    MAX_PENDING_PACKETS = 64,
+    /* differences printed per replay */
+    MAX_PRINTED_DIFFS = 10
+};
+
+struct record {
+    uint8_t type;
+    size_t len;
+    const uint8_t* data;
+};
+
+struct trace {
+    uint32_t id;
+    size_t nrecords;
+    struct record* record;
+};
+
+struct replay {
+    pthread_t thread;
+    const struct trace* trace;
+    struct nfcemu_ctx* ctx;
+    unsigned long nrepeats;
+    int verbose;
+    FILE* output;
+
+    /* packets sent by the device, in order */
+    size_t head;
+    size_t tail;
+    size_t len[MAX_PENDING_PACKETS];
+    uint8_t pkt[MAX_PENDING_PACKETS][MAX_PACKET_LENGTH];
+
+    unsigned long npackets;
+    unsigned long ndiffs;
+    unsigned long nerrors;
+};
+
+static uint8_t*
+push_pkt(struct replay* r)
+{
+    if (r->head - r->tail == MAX_PENDING_PACKETS) {
+        ++r->nerrors;
+        return NULL;
+    }
+    return r->pkt[r->head % MAX_PENDING_PACKETS];
+}
+
+static void
+commit_pkt(struct replay* r, size_t len)
+{
+    r->len[r->head % MAX_PENDING_PACKETS] = len;
+    ++r->head;
+}
+
+static int
+send_pkt(struct nfc_device* nfc,
+         ssize_t (*create)(void*, struct nfc_device*, size_t,
+                           union nci_packet*),
+         void* data)
+{
+    struct replay* r = nfc_device_get_data(nfc);
+    uint8_t* pkt;
+    ssize_t res;
+
+    pkt = push_pkt(r);
+    if (!pkt) {
+        return -1;
+    }
+    res = create(data, nfc, MAX_PACKET_LENGTH, (union nci_packet*)pkt);
+    if (res < 0) {
+        ++r->nerrors;
+        return -1;
+    }
+    if (res) {
+        commit_pkt(r, res);
+    }
+    return 0;
+}
+
+static void
+print_diff(struct replay* r, size_t i, const char* what,
+           const uint8_t* pkt, size_t len)
+{
+    size_t j;
+
+    if (!r->verbose || (r->ndiffs > MAX_PRINTED_DIFFS)) {
+        return;
+    }
+    printf("record %zu: %s", i, what);
+    for (j = 0; j < len; ++j) {
+        printf("%s%02x", j ? "" : " ", pkt[j]);
+    }
+    printf("\n");
+}
+
+/* device packets that the recording doesn't have */
+static void
+check_unexpected(struct replay* r, size_t i)
+{
+    for (; r->tail != r->head; ++r->tail) {
+        size_t slot = r->tail % MAX_PENDING_PACKETS;
+        ++r->ndiffs;
+        print_diff(r, i, "unexpected", r->pkt[slot], r->len[slot]);
+    }
+}
+
+static void
+check_expected(struct replay* r, size_t i, const struct record* rec)
+{
+    size_t slot;
+
+    ++r->npackets;
+
+    if (r->tail == r->head) {
+        ++r->ndiffs;
+        print_diff(r, i, "missing", rec->data, rec->len);
+        return;
+    }
+    slot = r->tail++ % MAX_PENDING_PACKETS;
+
+    if ((r->len[slot] != rec->len) ||
+        memcmp(r->pkt[slot], rec->data, rec->len)) {
+        ++r->ndiffs;
+        print_diff(r, i, "expected", rec->data, rec->len);
+        print_diff(r, i, "got", r->pkt[slot], r->len[slot]);
+    }
+}
+
+static void
+process_pkt(struct replay* r, struct nfc_device* nfc,
+            const struct record* rec)
+{
+    struct nfc_delivery_cb cb = { .func = NULL };
+    uint8_t cmd[MAX_PACKET_LENGTH];
+    uint8_t* rsp;
+    int res;
+
+    ++r->npackets;
+
+    rsp = push_pkt(r);
+    if (!rsp || (rec->len > sizeof(cmd))) {
+        ++r->nerrors;
+        return;
+    }
+    memset(cmd, 0, sizeof(cmd));
+    memcpy(cmd, rec->data, rec->len);
+
+    if (rec->type == NFCEMU_TRACE_NCI_RX) {
+        res = nfc_device_process_nci_msg(nfc, cmd, rsp, &cb);
+    } else {
+        res = nfc_device_process_hci_msg(nfc, cmd, rsp, &cb);
+    }
+    if (res > 0) {
+        commit_pkt(r, res);
+    }
+    if (cb.func) {
+        ssize_t len;
+
+        rsp = push_pkt(r);
+        if (!rsp) {
+            return;
+        }
+        len = cb.func(cb.data, (union nci_packet*)rsp);
+        if (len > 0) {
+            commit_pkt(r, len);
+        }
+    }
+}
+
+static void
+process_console(struct replay* r, struct nfc_device* nfc,
+                const struct record* rec)
+{
+    static const struct {
+        const char* name;
+        int (*run)(struct nfc_device*, char*);
+    } cmd[] = {
+        { "snep", nfc_device_cmd_snep },
+        { "nci", nfc_device_cmd_nci },
+        { "llcp", nfc_device_cmd_llcp },
+        { "tag", nfc_device_cmd_tag },
+        { "re", nfc_device_cmd_re },
+        { "nfcee", nfc_device_cmd_nfcee }
+    };
+    char* line;
+    char* args;
+    size_t i;
+
+    line = malloc(rec->len + 1);
+    if (!line) {
+        ++r->nerrors;
+        return;
+    }
+    memcpy(line, rec->data, rec->len);
+    line[rec->len] = '\0';
+
+    args = line;
+    strsep(&args, " ");
+
+    for (i = 0; i < sizeof(cmd)/sizeof(cmd[0]); ++i) {
+        if (!strcmp(line, cmd[i].name)) {
+            /* failed commands fail in the recording as well */
+            cmd[i].run(nfc, args && *args ? args : NULL);
+            break;
+        }
+    }
+    if (i == sizeof(cmd)/sizeof(cmd[0])) {
+        ++r->nerrors;
+    }
+    free(line);
+}
+
+static void
+write_trace(struct replay* r, struct nfc_device* nfc)
+{
+    static uint8_t buf[NFCEMU_TRACE_MAXIMUM_RECORD_LENGTH];
+    ssize_t res;
+
+    while ((res = nfc_device_read_trace(nfc, buf, sizeof(buf))) > 0) {
+        if (fwrite(buf, 1, res, r->output) != (size_t)res) {
+            ++r->nerrors;
+        }
+    }
+}
+
+static void
+replay_trace(struct replay* r, int record)
+{
+    struct nfc_device* nfc;
+    size_t i;
+
+    nfc = nfc_device_create_ctx(r->ctx, r);
+    if (!nfc) {
+        ++r->nerrors;
+        return;
+    }
+    if (record && (nfc_device_start_trace(nfc, r->trace->id, 1 << 20) < 0)) {
+        ++r->nerrors;
+    }
+    r->head = r->tail = 0;
+
+    for (i = 0; i < r->trace->nrecords; ++i) {
+        const struct record* rec = r->trace->record + i;
+
+        switch (rec->type) {
+            case NFCEMU_TRACE_NCI_RX:
+            case NFCEMU_TRACE_HCI_RX:
+                check_unexpected(r, i);
+                process_pkt(r, nfc, rec);
+                break;
+            case NFCEMU_TRACE_NCI_TX:
+            case NFCEMU_TRACE_HCI_TX:
+                check_expected(r, i, rec);
+                break;
+            case NFCEMU_TRACE_CONSOLE:
+                check_unexpected(r, i);
+                process_console(r, nfc, rec);
+                break;
+            default:
+                break;
+        }
+        if (record) {
+            write_trace(r, nfc);
+        }
+    }
+    check_unexpected(r, i);
+
+    nfc_device_destroy(nfc);
+}
+
+static void*
+replay_main(void* arg)
+{
+    struct replay* r = arg;
+    unsigned long i;
+
+    for (i = 0; i < r->nrepeats; ++i) {
+        replay_trace(r, r->output && !i);
+    }
+    return NULL;
+}
+
+/* loads the records of device 'id', or of the first record's device */
+static int
+load_trace(const uint8_t* buf, size_t len, long id, struct trace* trace)
+{
+    size_t off, n;
+
+    trace->record = NULL;
+    trace->nrecords = 0;
+
+    /* count, then fill */
+    for (n = 0; n < 2; ++n) {
+        size_t nrecords = 0;
+
+        for (off = 0; off < len;) {
+            const uint8_t* hdr = buf + off;
+            uint32_t recid;
+            size_t reclen;
+
+            if (len - off < sizeof(struct nfcemu_trace_hdr)) {
+                return -1;
+            }
+            recid = hdr[8] | hdr[9] << 8 | hdr[10] << 16 |
+                    (uint32_t)hdr[11] << 24;
+            reclen = hdr[12] | hdr[13] << 8;
+            if (len - off - sizeof(struct nfcemu_trace_hdr) < reclen) {
+                return -1;
+            }
+            if (id < 0) {
+                id = recid;
+            }
+            if (recid == id) {
+                if (hdr[14] == NFCEMU_TRACE_LOST) {
+                    fprintf(stderr, "trace lost records\n");
+                    return -1;
+                }
+                if (trace->record) {
+                    struct record* rec = trace->record + nrecords;
+                    rec->type = hdr[14];
+                    rec->len = reclen;
+                    rec->data = hdr + sizeof(struct nfcemu_trace_hdr);
+                }
+                ++nrecords;
+            }
+            off += sizeof(struct nfcemu_trace_hdr) + reclen;
+        }
+        if (!trace->record) {
+            trace->record = calloc(nrecords + 1, sizeof(*trace->record));
+            if (!trace->record) {
+                return -1;
+            }
+        }
+        trace->nrecords = nrecords;
+    }
+    trace->id = id;
+    return 0;
+}
+
+static uint8_t*
+read_file(const char* name, size_t* len)
+{
+    FILE* f;
+    uint8_t* buf = NULL;
+    size_t size = 0;
+
+    f = fopen(name, "rb");
+    if (!f) {
+        return NULL;
+    }
+    for (*len = 0; !feof(f) && !ferror(f);) {
+        if (*len == size) {
+            uint8_t* p = realloc(buf, size ? size * 2 : 1 << 16);
+            if (!p) {
+                break;
+            }
+            buf = p;
+            size = size ? size * 2 : 1 << 16;
+        }
+        *len += fread(buf + *len, 1, size - *len, f);
+    }
+    if (ferror(f)) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    return buf;
+}
+
+int
+main(int argc, char* argv[])
+{
+    struct nfcemu_ctx* ctx;
+    struct replay* r;
+    struct trace trace;
+    unsigned long nthreads = 1, nrepeats = 1;
+    unsigned long npackets = 0, ndiffs = 0, nerrors = 0;
+    long id = -1;
+    const char* output = NULL;
+    int verbose = 1;
+    uint8_t* buf;
+    size_t len, i;
+    double t0, t1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:r:i:o:q")) != -1) {
+        switch (opt) {
+            case 't':
+                nthreads = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                nrepeats = strtoul(optarg, NULL, 0);
+                break;
+            case 'i':
+                id = strtol(optarg, NULL, 0);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'q':
+                verbose = 0;
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    if ((optind != argc - 1) || !nthreads) {
+        fprintf(stderr, "usage: %s [-t threads] [-r repeats] [-i id] "
+                        "[-o output] [-q] trace-file\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    buf = read_file(argv[optind], &len);
+    if (!buf || (load_trace(buf, len, id, &trace) < 0)) {
+        fprintf(stderr, "cannot load trace '%s'\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    ctx = bench_ctx_create(send_pkt);
+    r = calloc(nthreads, sizeof(*r));
+    if (!ctx || !r) {
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < nthreads; ++i) {
+        r[i].trace = &trace;
+        r[i].ctx = ctx;
+        r[i].nrepeats = nrepeats;
+        r[i].verbose = verbose && !i;
+    }
+    if (output) {
+        r[0].output = fopen(output, "wb");
+        if (!r[0].output) {
+            fprintf(stderr, "cannot create trace '%s'\n", output);
+            return EXIT_FAILURE;
+        }
+    }
+
+    t0 = bench_now();
+    for (i = 0; i < nthreads; ++i) {
+        pthread_create(&r[i].thread, NULL, replay_main, r + i);
+    }
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(r[i].thread, NULL);
+        npackets += r[i].npackets;
+        ndiffs += r[i].ndiffs;
+        nerrors += r[i].nerrors;
+    }
+    t1 = bench_now();
+
+    if (output) {
+        fclose(r[0].output);
+    }
+
+    printf("%zu records, %lu threads, %lu repeats\n",
+           trace.nrecords, nthreads, nrepeats);
+    printf("%lu packets in %.3f s, %.0f packets/s\n",
+           npackets, t1 - t0, npackets / (t1 - t0));
+    printf("%lu differences, %lu errors\n", ndiffs, nerrors);
+
+    free(r);
+    nfcemu_ctx_destroy(ctx);
+    free(trace.record);
+    free(buf);
+
+    return (ndiffs || nerrors) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,427 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures SNEP throughput over LLCP. The benchmark plays the guest
+ * of an NFC-DEP remote endpoint and transfers large NDEF messages in
+ * both directions:
+ *
+ *  - put: the guest sends SNEP PUT requests to the RE's SNEP server,
+ *    fragmented into I PDUs of the announced MIU, which in turn are
+ *    segmented into NCI data packets.
+ *
+ *  - get: the RE sends a SNEP PUT request to the guest's SNEP server
+ *    (the console's 'snep put' command) and the guest acknowledges
+ *    every fragment.
+ *
+ * Usage: nfcemu-snep [message-size [seconds]]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <nfcemu/nfcemu.h>
+#include <nfcemu/cmdline.h>
+#include "bench-stub.h"
+
+enum {
+    /* LLCP SAPs of the guest */
+    GUEST_SAP = 0x20,
+    SNEP_SAP = 0x04,
+    /* LLCP PDU types */
+    PTYPE_SYMM = 0x0,
+    PTYPE_CONNECT = 0x4,
+    PTYPE_CC = 0x6,
+    PTYPE_I = 0xc,
+    PTYPE_RR = 0xd,
+    /* MIU announced by the guest */
+    GUEST_MIU = 2175,
+    GUEST_RW = 4,
+    SNEP_HDR_LEN = 6,
+    /* range of the message-size argument */
+    MIN_MSG_SIZE = 3,
+    MAX_MSG_SIZE = 64 * 1024 * 1024
+};
+
+struct guest {
+    /* last PDU received from the RE */
+    struct bench_peer peer;
+    struct nfc_device* nfc;
+    /* sequence numbers of the guest's data link */
+    unsigned int ns;
+    unsigned int nr;
+    /* message buffer */
+    size_t msglen;
+    uint8_t* msg;
+};
+
+static int
+process(struct guest* g, const uint8_t* pkt, size_t len)
+{
+    struct nfc_delivery_cb cb = { .func = NULL };
+    uint8_t cmd[BENCH_NCI_HDR_LEN + 256];
+    uint8_t rsp[BENCH_NCI_HDR_LEN + 256];
+    int res;
+
+    memset(cmd, 0, sizeof(cmd));
+    memcpy(cmd, pkt, len);
+
+    res = nfc_device_process_nci_msg(g->nfc, cmd, rsp, &cb);
+    if (res < 0) {
+        return -1;
+    }
+    bench_store_pdu(&g->peer, rsp, res);
+    if (cb.func && (cb.func(cb.data, (union nci_packet*)rsp) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Sends an LLCP PDU in as many NCI data packets as required and
+ * returns the type of the RE's answer. */
+static int
+xmit_pdu(struct guest* g, const uint8_t* pdu, size_t len)
+{
+    uint8_t pkt[BENCH_NCI_HDR_LEN + BENCH_NCI_MAX_PAYLOAD];
+
+    g->peer.pdulen = 0;
+
+    do {
+        size_t n = len < BENCH_NCI_MAX_PAYLOAD ? len : BENCH_NCI_MAX_PAYLOAD;
+
+        pkt[0] = (n < len) ? 0x10 : 0x00; /* PBF */
+        pkt[1] = 0;
+        pkt[2] = n;
+        memcpy(pkt + BENCH_NCI_HDR_LEN, pdu, n);
+        if (process(g, pkt, BENCH_NCI_HDR_LEN + n) < 0) {
+            return -1;
+        }
+        pdu += n;
+        len -= n;
+    } while (len);
+
+    if (g->peer.pdulen < 2) {
+        return PTYPE_SYMM;
+    }
+    return ((g->peer.pdu[0] & 0x03) << 2) | (g->peer.pdu[1] >> 6);
+}
+
+static size_t
+create_hdr(uint8_t* pdu, unsigned int dsap, unsigned int ptype,
+           unsigned int ssap)
+{
+    pdu[0] = (dsap << 2) | (ptype >> 2);
+    pdu[1] = ((ptype & 0x03) << 6) | ssap;
+    return 2;
+}
+
+static size_t
+create_dl_params(uint8_t* p)
+{
+    p[0] = 0x02; /* MIUX */
+    p[1] = 2;
+    p[2] = (GUEST_MIU - 128) >> 8;
+    p[3] = (GUEST_MIU - 128) & 0xff;
+    p[4] = 0x05; /* RW */
+    p[5] = 1;
+    p[6] = GUEST_RW;
+    return 7;
+}
+
+/* Acknowledges an I PDU from the RE. */
+static void
+recv_i_pdu(struct guest* g)
+{
+    g->nr = (g->nr + 1) % 16;
+}
+
+static int
+setup(struct guest* g)
+{
+    static const uint8_t init[][8] = {
+        { 0x20, 0x00, 0x01, 0x01 }, /* CORE_RESET_CMD */
+        { 0x20, 0x01, 0x00 }, /* CORE_INIT_CMD */
+        { 0x21, 0x03, 0x05, 0x02, 0x00, 0x01, 0x05, 0x01 } /* RF_DISCOVER */
+    };
+    static const size_t initlen[] = { 4, 3, 8 };
+    char activate[] = "rf_intf_activated_ntf 0";
+    uint8_t pdu[16];
+    size_t i, len;
+
+    for (i = 0; i < sizeof(init)/sizeof(init[0]); ++i) {
+        if (process(g, init[i], initlen[i]) < 0) {
+            return -1;
+        }
+    }
+    if (nfc_device_cmd_nci(g->nfc, activate) < 0) {
+        return -1;
+    }
+
+    /* connect to the RE's SNEP server */
+    len = create_hdr(pdu, SNEP_SAP, PTYPE_CONNECT, GUEST_SAP);
+    len += create_dl_params(pdu + len);
+    if (xmit_pdu(g, pdu, len) != PTYPE_CC) {
+        return -1;
+    }
+    g->ns = 0;
+    g->nr = 0;
+
+    return 0;
+}
+
+/* Guest sends a SNEP PUT request to the RE. */
+static int
+put_msg(struct guest* g, const uint8_t* ndef, size_t ndeflen)
+{
+    uint8_t* pdu = g->msg;
+    size_t off, len;
+
+    /* SNEP header of first fragment */
+    len = create_hdr(pdu, SNEP_SAP, PTYPE_I, GUEST_SAP);
+    pdu[len++] = (g->ns << 4) | g->nr;
+    pdu[len++] = 0x10;
+    pdu[len++] = 0x02; /* PUT */
+    pdu[len++] = ndeflen >> 24;
+    pdu[len++] = ndeflen >> 16;
+    pdu[len++] = ndeflen >> 8;
+    pdu[len++] = ndeflen;
+
+    for (off = 0; off < ndeflen;) {
+        size_t n = ndeflen - off;
+        size_t room = GUEST_MIU - (len - 3);
+        int ptype;
+
+        if (n > room) {
+            n = room;
+        }
+        memcpy(pdu + len, ndef + off, n);
+        off += n;
+
+        ptype = xmit_pdu(g, pdu, len + n);
+        g->ns = (g->ns + 1) % 16;
+        if (ptype == PTYPE_I) {
+            recv_i_pdu(g); /* Continue or Success */
+        } else if (ptype != PTYPE_RR) {
+            return -1;
+        }
+
+        len = create_hdr(pdu, SNEP_SAP, PTYPE_I, GUEST_SAP);
+        pdu[len++] = (g->ns << 4) | g->nr;
+    }
+
+    /* The last answer is SNEP Success */
+    if ((g->peer.pdulen < 5) || (g->peer.pdu[4] != 0x81)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* RE sends a SNEP PUT request to the guest. */
+static int
+get_msg(struct guest* g, char* cmd)
+{
+    uint8_t pdu[16];
+    size_t len, nbytes;
+    int ptype, ncontinue;
+
+    if (nfc_device_cmd_snep(g->nfc, cmd) < 0) {
+        return -1;
+    }
+
+    /* answer CONNECT with CC, if necessary; the new data link
+     * starts with fresh sequence numbers */
+    ptype = ((g->peer.pdu[0] & 0x03) << 2) | (g->peer.pdu[1] >> 6);
+    if (ptype == PTYPE_CONNECT) {
+        g->ns = 0;
+        g->nr = 0;
+        len = create_hdr(pdu, GUEST_SAP, PTYPE_CC, SNEP_SAP);
+        len += create_dl_params(pdu + len);
+        ptype = xmit_pdu(g, pdu, len);
+    }
+
+    nbytes = 0;
+    ncontinue = 1;
+
+    while (ptype == PTYPE_I) {
+        nbytes += g->peer.pdulen - 3;
+        recv_i_pdu(g);
+
+        if (nbytes == g->msglen) {
+            /* complete; respond with Success */
+            len = create_hdr(pdu, GUEST_SAP, PTYPE_I, SNEP_SAP);
+            pdu[len++] = (g->ns << 4) | g->nr;
+            memcpy(pdu + len, "\x10\x81\x00\x00\x00\x00", 6);
+            xmit_pdu(g, pdu, len + 6);
+            g->ns = (g->ns + 1) % 16;
+            return 0;
+        } else if (ncontinue) {
+            len = create_hdr(pdu, GUEST_SAP, PTYPE_I, SNEP_SAP);
+            pdu[len++] = (g->ns << 4) | g->nr;
+            memcpy(pdu + len, "\x10\x80\x00\x00\x00\x00", 6);
+            ptype = xmit_pdu(g, pdu, len + 6);
+            g->ns = (g->ns + 1) % 16;
+            ncontinue = 0;
+        } else {
+            len = create_hdr(pdu, GUEST_SAP, PTYPE_RR, SNEP_SAP);
+            pdu[len++] = g->nr;
+            ptype = xmit_pdu(g, pdu, len);
+        }
+    }
+    return -1;
+}
+
+/* creates a 'snep put' command with a single record of 'len' bytes */
+static char*
+create_put_cmd(size_t len, size_t* msglen)
+{
+    static const char b64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    static const char prefix[] = "put 4 32 [0,1,VA,,";
+    char* cmd;
+    size_t i, n;
+
+    len -= len % 3; /* no padding */
+    n = len / 3 * 4;
+
+    cmd = malloc(sizeof(prefix) + n + 2);
+    if (!cmd) {
+        return NULL;
+    }
+    strcpy(cmd, prefix);
+    for (i = 0; i < n; ++i) {
+        cmd[sizeof(prefix) - 1 + i] = b64[i % 64];
+    }
+    strcpy(cmd + sizeof(prefix) - 1 + n, "]");
+
+    /* SNEP header, NDEF header (long record), type 'T' and payload */
+    *msglen = SNEP_HDR_LEN + 6 + 1 + len;
+
+    return cmd;
+}
+
+static int
+parse_ul(const char* arg, unsigned long min, unsigned long max,
+         unsigned long* value)
+{
+    char* end;
+
+    *value = strtoul(arg, &end, 0);
+    if (!*arg || *end || (*value < min) || (*value > max)) {
+        return -1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    struct nfcemu_ctx* ctx;
+    struct guest g;
+    unsigned long msgsize, seconds;
+    size_t maxlen;
+    uint8_t* ndef;
+    char* cmd;
+    char* cmdbuf;
+    unsigned long n;
+    double t0, t1;
+    int res = EXIT_FAILURE;
+
+    msgsize = 16 * 1024;
+    seconds = 2;
+
+    if (((argc > 1) &&
+         (parse_ul(argv[1], MIN_MSG_SIZE, MAX_MSG_SIZE, &msgsize) < 0)) ||
+        ((argc > 2) && (parse_ul(argv[2], 1, 3600, &seconds) < 0))) {
+        fprintf(stderr, "usage: %s [message-size [seconds]], with "
+                        "%d <= message-size <= %d\n", argv[0],
+                MIN_MSG_SIZE, MAX_MSG_SIZE);
+        return EXIT_FAILURE;
+    }
+
+    memset(&g, 0, sizeof(g));
+    ctx = NULL;
+    cmdbuf = NULL;
+    g.msg = malloc(GUEST_MIU + 16);
+    ndef = malloc(msgsize);
+    cmd = create_put_cmd(msgsize, &g.msglen);
+    if (cmd) {
+        cmdbuf = malloc(strlen(cmd) + 1);
+    }
+    if (!g.msg || !ndef || !cmd || !cmdbuf) {
+        fprintf(stderr, "out of memory\n");
+        goto out;
+    }
+    memset(ndef, 0x55, msgsize);
+
+    ctx = bench_ctx_create(bench_send_pkt);
+    if (!ctx) {
+        goto out;
+    }
+    /* the guest's requests carry the plain message, the RE's an NDEF
+     * record; 'msglen' includes the SNEP header */
+    maxlen = SNEP_HDR_LEN + msgsize;
+    if (maxlen < g.msglen) {
+        maxlen = g.msglen;
+    }
+    if (nfcemu_ctx_set_snep_max_msg_length(ctx, maxlen) < 0) {
+        goto out;
+    }
+    g.nfc = nfc_device_create_ctx(ctx, &g);
+    if (!g.nfc || (setup(&g) < 0)) {
+        fprintf(stderr, "setup failed\n");
+        goto out;
+    }
+
+    printf("direction  message-size     msgs/s        bytes/s\n");
+
+    t0 = bench_now();
+    for (n = 0, t1 = t0; t1 - t0 < seconds; ++n, t1 = bench_now()) {
+        if (put_msg(&g, ndef, msgsize) < 0) {
+            fprintf(stderr, "put failed\n");
+            goto out;
+        }
+    }
+    printf("put        %12lu %10.0f %14.0f\n", msgsize,
+           n / (t1 - t0), n * msgsize / (t1 - t0));
+
+    t0 = bench_now();
+    for (n = 0, t1 = t0; t1 - t0 < seconds; ++n, t1 = bench_now()) {
+        strcpy(cmdbuf, cmd);
+        if (get_msg(&g, cmdbuf) < 0) {
+            fprintf(stderr, "get failed\n");
+            goto out;
+        }
+    }
+    printf("get        %12zu %10.0f %14.0f\n", g.msglen,
+           n / (t1 - t0), n * g.msglen / (t1 - t0));
+
+    res = g.peer.nerrors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+out:
+    if (g.nfc) {
+        nfc_device_destroy(g.nfc);
+    }
+    if (ctx) {
+        nfcemu_ctx_destroy(ctx);
+    }
+    free(cmdbuf);
+    free(cmd);
+    free(ndef);
+    free(g.msg);
+
+    return res;
+}
@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Drives N emulated devices from T threads at once. Each thread owns
+ * its devices, following the library's threading model. Every session
+ * resets the controller, discovers and activates the T4T remote
+ * endpoint, reads its NDEF file and deactivates again. The benchmark
+ * prints the session throughput for 1..T threads, which should scale
+ * linearly as long as there are enough cores.
+ *
+ * Usage: nfcemu-stress [threads [devices-per-thread [seconds]]]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <nfcemu/nfcemu.h>
+#include <nfcemu/cmdline.h>
+#include "bench-stub.h"
+
+struct session_step {
+    size_t len;
+    uint8_t pkt[16];
+};
+
+#define STEP(...) \
+    { \
+        .len = sizeof((uint8_t[]){ __VA_ARGS__ }), \
+        .pkt = { __VA_ARGS__ } \
+    }
+
+/* NCI packets sent by the 'guest' in each session */
+static const struct session_step session[] = {
+    STEP(0x20, 0x00, 0x01, 0x01), /* CORE_RESET_CMD */
+    STEP(0x20, 0x01, 0x00), /* CORE_INIT_CMD */
+    STEP(0x21, 0x03, 0x05, 0x02, 0x00, 0x01, 0x05, 0x01), /* RF_DISCOVER_CMD */
+};
+
+static const struct session_step t4t_read[] = {
+    /* NDEF tag application select */
+    STEP(0x00, 0x00, 0x0d, 0x00, 0xa4, 0x04, 0x00, 0x07,
+         0xd2, 0x76, 0x00, 0x00, 0x85, 0x01, 0x01, 0x00),
+    /* CC select and read */
+    STEP(0x00, 0x00, 0x07, 0x00, 0xa4, 0x00, 0x0c, 0x02, 0xe1, 0x03),
+    STEP(0x00, 0x00, 0x05, 0x00, 0xb0, 0x00, 0x00, 0x0f),
+    /* NDEF select and read */
+    STEP(0x00, 0x00, 0x07, 0x00, 0xa4, 0x00, 0x0c, 0x02, 0xe1, 0x04),
+    STEP(0x00, 0x00, 0x05, 0x00, 0xb0, 0x00, 0x00, 0x40),
+    /* RF_DEACTIVATE_CMD */
+    STEP(0x21, 0x06, 0x01, 0x00)
+};
+
+struct device_data {
+    struct bench_peer peer;
+    /* responses of the device */
+    uint8_t buf[512];
+};
+
+struct worker {
+    pthread_t thread;
+    size_t ndevices;
+    struct nfc_device** device;
+    const int* stop;
+    unsigned long nsessions;
+    unsigned long nerrors;
+};
+
+static int
+process(struct nfc_device* nfc, const struct session_step* step)
+{
+    struct device_data* dev = nfc_device_get_data(nfc);
+    struct nfc_delivery_cb cb = { .func = NULL };
+    uint8_t cmd[sizeof(step->pkt)+256];
+    int res;
+
+    memset(cmd, 0, sizeof(cmd));
+    memcpy(cmd, step->pkt, step->len);
+
+    res = nfc_device_process_nci_msg(nfc, cmd, dev->buf, &cb);
+    if (res <= 0) {
+        return -1;
+    }
+    if (cb.func && (cb.func(cb.data, (union nci_packet*)dev->buf) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int
+run_session(struct nfc_device* nfc)
+{
+    char activate[] = "rf_intf_activated_ntf 5";
+    size_t i;
+
+    for (i = 0; i < sizeof(session)/sizeof(session[0]); ++i) {
+        if (process(nfc, session+i) < 0) {
+            return -1;
+        }
+    }
+    if (nfc_device_cmd_nci(nfc, activate) < 0) {
+        return -1;
+    }
+    for (i = 0; i < sizeof(t4t_read)/sizeof(t4t_read[0]); ++i) {
+        if (process(nfc, t4t_read+i) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void*
+worker_main(void* arg)
+{
+    struct worker* w = arg;
+    size_t i;
+
+    while (!__atomic_load_n(w->stop, __ATOMIC_RELAXED)) {
+        for (i = 0; i < w->ndevices; ++i) {
+            if (run_session(w->device[i]) < 0) {
+                ++w->nerrors;
+            }
+            ++w->nsessions;
+        }
+    }
+    return NULL;
+}
+
+static int
+run(struct nfcemu_ctx* ctx, size_t nthreads, size_t ndevices,
+    unsigned int seconds, double* rate)
+{
+    struct worker* w;
+    int stop = 0;
+    unsigned long nsessions = 0, nerrors = 0;
+    double t0, t1;
+    size_t i, j;
+
+    w = calloc(nthreads, sizeof(*w));
+    if (!w) {
+        return -1;
+    }
+    for (i = 0; i < nthreads; ++i) {
+        w[i].ndevices = ndevices;
+        w[i].stop = &stop;
+        w[i].device = calloc(ndevices, sizeof(*w[i].device));
+        if (!w[i].device) {
+            return -1;
+        }
+        for (j = 0; j < ndevices; ++j) {
+            char tag[] = "set 5 [0,1,VA,,SGVsbG8sIHdvcmxkIQ]";
+            struct device_data* dev = calloc(1, sizeof(*dev));
+
+            w[i].device[j] = nfc_device_create_ctx(ctx, dev);
+            if (!dev || !w[i].device[j] ||
+                (nfc_device_cmd_tag(w[i].device[j], tag) < 0)) {
+                return -1;
+            }
+        }
+    }
+
+    t0 = bench_now();
+    for (i = 0; i < nthreads; ++i) {
+        pthread_create(&w[i].thread, NULL, worker_main, w+i);
+    }
+    sleep(seconds);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(w[i].thread, NULL);
+        nsessions += w[i].nsessions;
+        nerrors += w[i].nerrors;
+    }
+    t1 = bench_now();
+
+    for (i = 0; i < nthreads; ++i) {
+        for (j = 0; j < ndevices; ++j) {
+            struct device_data* dev = nfc_device_get_data(w[i].device[j]);
+            nerrors += dev->peer.nerrors;
+            nfc_device_destroy(w[i].device[j]);
+            free(dev);
+        }
+        free(w[i].device);
+    }
+    free(w);
+
+    *rate = nsessions / (t1 - t0);
+
+    return nerrors ? -1 : 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    struct nfcemu_ctx* ctx;
+    size_t maxthreads, ndevices, nthreads;
+    unsigned int seconds;
+    double base = 0;
+
+    maxthreads = argc > 1 ? strtoul(argv[1], NULL, 0)
+                          : (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+    ndevices = argc > 2 ? strtoul(argv[2], NULL, 0) : 16;
+    seconds = argc > 3 ? strtoul(argv[3], NULL, 0) : 2;
+
+    ctx = bench_ctx_create(bench_send_pkt);
+    if (!ctx) {
+        return EXIT_FAILURE;
+    }
+
+    printf("threads  devices  sessions/s   speedup\n");
+
+    for (nthreads = 1; nthreads <= maxthreads; ++nthreads) {
+        double rate;
+
+        if (run(ctx, nthreads, ndevices, seconds, &rate) < 0) {
+            fprintf(stderr, "errors with %zu threads\n", nthreads);
+            return EXIT_FAILURE;
+        }
+        if (nthreads == 1) {
+            base = rate;
+        }
+        printf("%7zu  %7zu  %10.0f  %8.2f\n", nthreads, nthreads*ndevices,
+               rate, rate/base);
+    }
+
+    nfcemu_ctx_destroy(ctx);
+
+    return EXIT_SUCCESS;
+}
@@ -17,11 +17,16 @@
 #ifndef nfcemu_cmdline_h
 #define nfcemu_cmdline_h
 
+struct nfc_cmd;
+struct nfc_device;
+
+/* Commands for devices in the default context */
+
 int
 nfc_cmd_snep(char* args);
 
 int
-nfc_cmd_nci(char*  args);
+nfc_cmd_nci(char* args);
 
 int
 nfc_cmd_llcp(char* args);
@@ -29,4 +34,56 @@ nfc_cmd_llcp(char* args);
 int
 nfc_cmd_tag(char* args);
 
+int
+nfc_cmd_re(char* args);
+
+int
+nfc_cmd_nfcee(char* args);
+
+/* Commands for a specific device */
+
+int
+nfc_device_cmd_snep(struct nfc_device* nfc, char* args);
+
+int
+nfc_device_cmd_nci(struct nfc_device* nfc, char* args);
+
+int
+nfc_device_cmd_llcp(struct nfc_device* nfc, char* args);
+
+int
+nfc_device_cmd_tag(struct nfc_device* nfc, char* args);
+
+int
+nfc_device_cmd_re(struct nfc_device* nfc, char* args);
+
+int
+nfc_device_cmd_nfcee(struct nfc_device* nfc, char* args);
+
+/* Compiled commands
+ *
+ * A command of the console group 'group', such as "tag" or "snep",
+ * can be parsed once and run any number of times afterwards. NDEF
+ * messages are encoded while compiling, so running a compiled command
+ * neither parses nor allocates. Remote endpoints are looked up when
+ * the command runs. A command compiled for a device can run on any
+ * device of the same context.
+ */
+
+struct nfc_cmd*
+nfc_cmd_compile(const char* group, const char* args);
+
+struct nfc_cmd*
+nfc_device_cmd_compile(struct nfc_device* nfc, const char* group,
+                       const char* args);
+
+int
+nfc_cmd_run(const struct nfc_cmd* cmd);
+
+int
+nfc_device_cmd_run(struct nfc_device* nfc, const struct nfc_cmd* cmd);
+
+void
+nfc_cmd_destroy(struct nfc_cmd* cmd);
+
 #endif
@@ -20,9 +20,27 @@
 #include <sys/types.h>
 #include "types.h"
 
+/*
+ * Threading model
+ *
+ * Devices don't share mutable state. All calls for a single device,
+ * including console commands and timeout callbacks, have to be
+ * serialized by the host, typically by running the device on a single
+ * thread. Calls for different devices can run in parallel without
+ * locking. Contexts are read-only after they have been created, so any
+ * number of threads can create devices from the same context.
+ * nfcemu_init() must complete before any device of the default context
+ * is used.
+ */
+
 struct nfc_device;
+struct nfcemu_ctx;
+struct nfcemu_tag_image;
 union nci_packet;
 
+/* Sets up the default context. Devices created by nfc_device_create()
+ * share the callbacks given here.
+ */
 int
 nfcemu_init(void (*log_msg)(const char* fmtstr, ...),
             void (*log_err)(const char* fmtstr, ...),
@@ -42,12 +60,329 @@ nfcemu_init(void (*log_msg)(const char* fmtstr, ...),
 void
 nfcemu_uninit(void);
 
+/* Creates an independent emulator context. The I/O callbacks receive
+ * the device that issued the request. Contexts don't share mutable
+ * state, so a single process can host any number of them. Data
+ * messages that don't fit into a single packet are delivered as
+ * segments by consecutive calls to send_dta.
+ */
+struct nfcemu_ctx*
+nfcemu_ctx_create(void (*log_msg)(const char* fmtstr, ...),
+                  void (*log_err)(const char* fmtstr, ...),
+                  nfcemu_timeout* (*new_timeout)(void (*cb)(void*),
+                                                 void* data),
+                  void (*mod_timeout)(nfcemu_timeout* t, unsigned long ms),
+                  void (*del_timeout)(nfcemu_timeout* t),
+                  int (*timeout_is_pending)(nfcemu_timeout* t),
+                  int (*send_ntf)(struct nfc_device* nfc,
+                                  ssize_t (*create)(void*,
+                                                    struct nfc_device*,
+                                                    size_t,
+                                                    union nci_packet*),
+                                  void* data),
+                  int (*send_dta)(struct nfc_device* nfc,
+                                  ssize_t (*create)(void*,
+                                                    struct nfc_device*,
+                                                    size_t,
+                                                    union nci_packet*),
+                                  void* data),
+                  int (*recv_dta)(struct nfc_device* nfc,
+                                  ssize_t (*handle)(void*,
+                                                    struct nfc_device*),
+                                  void* data));
+
+/* Sets the number of LLCP PDU buffers that each device of the
+ * context preallocates. PDUs queued for the guest come from this
+ * pool; a send fails if it runs dry. Only affects devices created
+ * afterwards; the default is 64.
+ */
+int
+nfcemu_ctx_set_pdu_pool_size(struct nfcemu_ctx* ctx, size_t nbufs);
+
+/* Sets a callback for results of console commands, such as received
+ * NDEF messages. Each result is delivered with a single call that
+ * gives its exact length in bytes. The host provides a buffer of at
+ * least 'len' bytes and calls 'write' to fill it; 'write' returns the
+ * number of bytes written. Without a callback, or with NULL, results
+ * are printed piece by piece with log_msg.
+ */
+int
+nfcemu_ctx_set_output(struct nfcemu_ctx* ctx,
+                      int (*output)(struct nfc_device* nfc, size_t len,
+                                    ssize_t (*write)(void*,
+                                                     struct nfc_device*,
+                                                     size_t, char*),
+                                    void* data));
+
+/* Sets the number of encoded tag images that each device of the
+ * context caches. Setting a tag to a recently used NDEF message
+ * copies the cached image instead of encoding the message again.
+ * Only affects devices created afterwards; the default is 32.
+ */
+int
+nfcemu_ctx_set_tag_cache_size(struct nfcemu_ctx* ctx, size_t nimages);
+
+/* Sets the largest SNEP message, including its 6-byte header, that
+ * devices of the context send or accept. Larger PUT requests from the
+ * guest are answered with 'Excess Data', and larger 'snep put'
+ * commands fail. The receive buffer of a data link grows to the size
+ * of the largest message received on it. Only affects devices
+ * created afterwards; the default is 64 KiB.
+ */
+int
+nfcemu_ctx_set_snep_max_msg_length(struct nfcemu_ctx* ctx, size_t len);
+
+/* Sets how often devices of the context measure the latency of
+ * nfc_device_process_nci_msg(). On average, one in 'interval' calls
+ * is timed, at random, so that periodic traffic doesn't always hit
+ * the same messages. 1 times every call and 0 disables the latency
+ * statistics. Only affects devices created afterwards; the default
+ * is 16.
+ */
+int
+nfcemu_ctx_set_latency_sampling(struct nfcemu_ctx* ctx,
+                                unsigned long interval);
+
+/* controller states for nfcemu_ctx_set_nci_cmd_handler() */
+enum {
+  NFCEMU_NCI_STATE_IDLE = 1 << 0,
+  NFCEMU_NCI_STATE_RESET = 1 << 1,
+  NFCEMU_NCI_STATE_INITIALIZED = 1 << 2,
+  NFCEMU_NCI_STATE_ALL = NFCEMU_NCI_STATE_IDLE |
+                         NFCEMU_NCI_STATE_RESET |
+                         NFCEMU_NCI_STATE_INITIALIZED
+};
+
+/* Installs the handler for the NCI command 'gid'/'oid' in the
+ * controller states set in 'states', replacing the built-in one. This
+ * is mostly useful for vendor commands in the proprietary GID 0xf. A
+ * NULL handler makes the devices ignore the command. Has to be called
+ * before the context's first device is created.
+ */
+int
+nfcemu_ctx_set_nci_cmd_handler(struct nfcemu_ctx* ctx, unsigned int states,
+                               unsigned int gid, unsigned int oid,
+                               nfcemu_nci_cmd_handler* handler);
+
+/* Destroys a context; all of its devices have to be destroyed first. */
+void
+nfcemu_ctx_destroy(struct nfcemu_ctx* ctx);
+
+/* Creates a device in the default context. */
 struct nfc_device*
 nfc_device_create(void);
 
+/* Creates a device in the given context. Each device owns its
+ * remote endpoints and tags; 'data' is returned by
+ * nfc_device_get_data(). */
+struct nfc_device*
+nfc_device_create_ctx(struct nfcemu_ctx* ctx, void* data);
+
 void
 nfc_device_destroy(struct nfc_device* nfc);
 
+void*
+nfc_device_get_data(const struct nfc_device* nfc);
+
+/*
+ * Tracing
+ *
+ * A device can record all NCI and HCI packets that it exchanges with
+ * the guest in a ring buffer of 'size' bytes, together with the
+ * console commands that it runs. Each record has a struct
+ * nfcemu_trace_hdr, followed by the packet or command, so the data read
+ * from the buffer can be written to disk as it is. Starting and
+ * stopping the tracer follow the device's threading rules. Reading
+ * can run on any thread, concurrently with the device, as long as
+ * only one thread reads. bench/nfcemu-replay replays recorded traces.
+ */
+
+int
+nfc_device_start_trace(struct nfc_device* nfc, uint32_t id, size_t size);
+
+/* Discards all unread records. */
+void
+nfc_device_stop_trace(struct nfc_device* nfc);
+
+/* Copies complete records into 'buf' and returns their length. Fails
+ * if the next record is larger than 'len'; a buffer of
+ * NFCEMU_TRACE_MAXIMUM_RECORD_LENGTH bytes is always large enough. */
+ssize_t
+nfc_device_read_trace(struct nfc_device* nfc, void* buf, size_t len);
+
+/*
+ * Batched output
+ *
+ * Instead of calling send_ntf and send_dta for every packet, a device
+ * can append its notifications and data packets to a ring buffer of
+ * the host and signal the host once per batch. The ring holds plain
+ * NCI packets back to back, so the host can flush a whole batch to
+ * the guest's device with a single write. A batch covers everything
+ * that a call to nfc_device_process_nci_msg(), a console command or a
+ * run of back-to-back scenario events sends; the signal comes before
+ * the call returns. Packets sent by other timeouts are signaled one at
+ * a time. Each packet needs room for the largest NCI packet before
+ * it's created; otherwise the device signals early so that the host
+ * can make room. If that doesn't help, the send fails without
+ * creating the packet, as with a failing callback, so the device's
+ * state stays as it is. Responses to NCI messages and their delivery
+ * callbacks don't go through the ring. Tracing records all packets
+ * that were sent.
+ */
+
+/* Sends the device's packets to 'ring' from now on, and signals the
+ * host with 'signal'. The ring's size has to be a power of 2 of at
+ * least NFCEMU_RING_MINIMUM_SIZE bytes, and the ring has to stay
+ * valid while it's in use. With a NULL ring, the device goes back to
+ * the send_ntf and send_dta callbacks. This isn't allowed from within
+ * the device's callbacks.
+ */
+int
+nfc_device_set_ring(struct nfc_device* nfc, struct nfcemu_ring* ring,
+                    nfcemu_ring_signal* signal);
+
+/*
+ * Scenarios
+ *
+ * A scenario is a schedule of field events, such as a tag entering
+ * the field, getting activated and leaving again, that the device
+ * runs from its own timeout instead of console commands. Each event
+ * runs 'delay' ms after the previous one; events with a delay of 0
+ * run back to back. The schedule repeats 'nloops' times, or forever
+ * if 'nloops' is 0. 'event' has to stay valid until the scenario has
+ * finished or has been stopped. Failed events are counted in the
+ * device's statistics and don't stop the scenario.
+ */
+
+int
+nfc_device_start_scenario(struct nfc_device* nfc,
+                          const struct nfcemu_scenario_event* event,
+                          size_t nevents, unsigned long nloops);
+
+void
+nfc_device_stop_scenario(struct nfc_device* nfc);
+
+int
+nfc_device_scenario_is_running(const struct nfc_device* nfc);
+
+/*
+ * Secure element
+ *
+ * Each device emulates a secure element that the guest discovers and
+ * enables with the NFCEE commands, and that receives the ISO-DEP
+ * traffic of readers according to the guest's listen-mode routing
+ * table. Its applets are looked up by AID, or by a prefix of the AID
+ * in a SELECT command. Applets without a handler answer every APDU
+ * with a fixed response.
+ */
+
+/* Adds an applet for 'aid', or replaces the existing one. */
+int
+nfc_device_add_nfcee_applet(struct nfc_device* nfc,
+                            const uint8_t* aid, size_t aidlen,
+                            nfcemu_apdu_handler* process, void* data);
+
+int
+nfc_device_remove_nfcee_applet(struct nfc_device* nfc,
+                               const uint8_t* aid, size_t aidlen);
+
+/* Exchanges a reader's APDUs with the card emulation in a single
+ * transaction. Returns the number of APDUs that got an answer; the
+ * exchange stops at the first one that doesn't, e.g., because it's
+ * routed to the DH. */
+ssize_t
+nfc_device_exchange_apdus(struct nfc_device* nfc,
+                          struct nfcemu_apdu* apdu, size_t napdus);
+
+/*
+ * Host card emulation
+ *
+ * An emulated reader polls the guest while it listens, activates the
+ * guest's ISO-DEP listen-mode interface and runs a transaction with
+ * the guest's card emulation. The reader enters the field like any
+ * other RE, e.g., with the console command "nci rf_intf_activated_ntf
+ * <index>" or a scenario, and sends its first C-APDU right after the
+ * activation. Each R-APDU from the guest is answered with the next
+ * C-APDU from the handler immediately, so transactions run as fast as
+ * the guest responds. The device's statistics collect the guest's
+ * response latency. Readers are removed with the console command
+ * "re remove <index>".
+ */
+
+/* Adds a reader and returns its RE index. */
+ssize_t
+nfc_device_add_reader(struct nfc_device* nfc,
+                      nfcemu_reader_handler* process, void* data);
+
+/*
+ * Tag images
+ *
+ * A tag image is the memory of an RE's tag at the time it was taken.
+ * Images are immutable and reference-counted, so a single image can
+ * provision the tags of any number of REs on any number of devices,
+ * also from different threads, without copying. Each tag shares the
+ * image's memory until the guest writes to it with a WRITE, UPDATE or
+ * UPDATE BINARY command; only then does the tag get its own copy.
+ * Tags set up from the same NDEF message share memory via the
+ * context's tag cache in the same way.
+ */
+
+/* Returns an image of the tag of RE 're', or NULL if the RE has no
+ * tag. */
+struct nfcemu_tag_image*
+nfc_device_get_tag_image(struct nfc_device* nfc, size_t re);
+
+/* Replaces the memory of the tag of RE 're', including its size, with
+ * the image. The image has to be of the tag's type. */
+int
+nfc_device_set_tag_image(struct nfc_device* nfc, size_t re,
+                         const struct nfcemu_tag_image* image);
+
+/* Drops the image; tags that share its memory keep it. */
+void
+nfcemu_tag_image_destroy(struct nfcemu_tag_image* image);
+
+/*
+ * Snapshots
+ *
+ * A snapshot holds the device's complete NCI state, its REs with
+ * their tags, live LLCP data links and queued PDUs, and the guest's
+ * listen-mode routing, so that a resumed VM can continue where it
+ * stopped without running CORE_RESET and RF discovery again. The
+ * format is versioned and only valid for hosts of the same byte
+ * order. Host-side setup, such as NFCEE applets, traces, scenarios
+ * and statistics, isn't part of a snapshot and stays as it is on
+ * restore. Readers are driven by host callbacks, so they aren't
+ * stored either; a device with an active reader can't be
+ * snapshotted.
+ */
+
+/* Stores the device's state in 'buf' and returns its length; with a
+ * NULL buffer, only returns the length. Fails if 'len' is too small.
+ */
+ssize_t
+nfc_device_snapshot(const struct nfc_device* nfc, void* buf, size_t len);
+
+/* Replaces the device's state, including all of its REs, with the
+ * snapshot in 'buf'. Invalid snapshots leave the device unchanged. If
+ * memory runs out while restoring, the device ends up idle without
+ * REs. */
+int
+nfc_device_restore(struct nfc_device* nfc, const void* buf, size_t len);
+
+/*
+ * Statistics
+ *
+ * Each device counts the packets and commands it processes, and the
+ * latency of each NCI message. The counters are plain per-device
+ * variables, so the snapshot follows the device's threading rules:
+ * it has to be serialized with the device's other calls.
+ */
+
+void
+nfc_device_get_stats(const struct nfc_device* nfc,
+                     struct nfcemu_stats* stats);
+
 int
 nfc_device_process_nci_msg(struct nfc_device* nfc,
                            const uint8_t* cmd, uint8_t* rsp,
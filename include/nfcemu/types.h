@@ -17,8 +17,12 @@
 #ifndef nfcemu_types_h
 #define nfcemu_types_h
 
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
+struct nfc_device;
+struct nfc_delivery_cb;
 union nci_packet;
 
 typedef void nfcemu_timeout;
@@ -30,7 +34,9 @@ enum nfc_buf_type {
   DATA_BUF
 };
 
-/* supplied to process_{nci,hci}_message */
+/* supplied to process_{nci,hci}_message; 'func' has to be called
+ * before the device processes its next message, as 'data' can refer
+ * to per-device state */
 struct nfc_delivery_cb {
   enum nfc_buf_type type;
   void* data;
@@ -41,4 +47,161 @@ enum {
   MAX_NCI_PAYLOAD_LENGTH = 256
 };
 
+/* handles an NCI command; returns the length of the response in 'rsp',
+ * or 0 if the command is to be ignored */
+typedef size_t (nfcemu_nci_cmd_handler)(const union nci_packet* cmd,
+                                        struct nfc_device* nfc,
+                                        union nci_packet* rsp,
+                                        struct nfc_delivery_cb* cb);
+
+/* handles a command APDU for an applet of the emulated secure
+ * element; returns the length of the response APDU in 'rsp', or -1
+ * if the command doesn't get an answer. Handlers must not add or
+ * remove applets. */
+typedef ssize_t (nfcemu_apdu_handler)(void* data, struct nfc_device* nfc,
+                                      const uint8_t* cmd, size_t len,
+                                      uint8_t* rsp, size_t maxlen);
+
+/* runs an emulated reader's side of a card-emulation transaction
+ * with the guest. Called with the guest's R-APDU, or without one
+ * when the reader enters the field; returns the length of the next
+ * C-APDU in 'cmd', 0 to end the transaction, or -1 on errors. */
+typedef ssize_t (nfcemu_reader_handler)(void* data, struct nfc_device* nfc,
+                                        const uint8_t* rsp, size_t len,
+                                        uint8_t* cmd, size_t maxlen);
+
+/* an APDU exchange, see nfc_device_exchange_apdus() */
+struct nfcemu_apdu {
+  const uint8_t* cmd;
+  size_t cmdlen;
+  uint8_t* rsp; /* buffer for the response */
+  size_t rsplen; /* size of 'rsp'; set to the response's length */
+};
+
+/* types of trace records */
+enum {
+  NFCEMU_TRACE_NCI_RX = 0, /* NCI packet from the guest */
+  NFCEMU_TRACE_NCI_TX = 1, /* NCI packet to the guest */
+  NFCEMU_TRACE_HCI_RX = 2, /* HCI packet from the guest */
+  NFCEMU_TRACE_HCI_TX = 3, /* HCI packet to the guest */
+  NFCEMU_TRACE_LOST = 4, /* 4-byte number of records that didn't fit */
+  NFCEMU_TRACE_CONSOLE = 5 /* device console command, e.g. "tag set 5 ..." */
+};
+
+/* Header of a trace record; all fields are little endian. The packet
+ * follows the header. */
+struct nfcemu_trace_hdr {
+  uint64_t timestamp; /* CLOCK_MONOTONIC in nanoseconds */
+  uint32_t id; /* device id given to nfc_device_start_trace() */
+  uint16_t len; /* packet length */
+  uint8_t type;
+  uint8_t reserved;
+} __attribute__((packed));
+
+enum {
+  /* largest trace record, with header; console commands can be
+   * longer than packets */
+  NFCEMU_TRACE_MAXIMUM_RECORD_LENGTH = sizeof(struct nfcemu_trace_hdr) +
+                                       0xffff
+};
+
+/* types of scenario events */
+enum {
+  /* RF_DISCOVER_NTFs for all REs that haven't been discovered */
+  NFCEMU_SCENARIO_DISCOVER = 0,
+  /* RE 're' enters the field and gets activated */
+  NFCEMU_SCENARIO_ACTIVATE = 1,
+  /* the active RE leaves the field */
+  NFCEMU_SCENARIO_DEACTIVATE = 2,
+  /* the tag of RE 're' gets the NDEF message in 'data' */
+  NFCEMU_SCENARIO_SET_TAG = 3,
+  /* the active RE sends the NDEF message in 'data' with SNEP PUT */
+  NFCEMU_SCENARIO_SNEP_PUT = 4
+};
+
+/* An event of a scenario, see nfc_device_start_scenario(). NDEF
+ * messages are encoded as on the tag. */
+struct nfcemu_scenario_event {
+  unsigned long delay; /* ms after the previous event */
+  unsigned int type;
+  size_t re; /* RE index */
+  const void* data;
+  size_t len;
+};
+
+/* Ring buffer for batched output, see nfc_device_set_ring(). The
+ * device appends NCI packets at 'head' and the host consumes them
+ * from 'tail'. Both are free-running byte counts; byte 'pos' is at
+ * buf[pos & (size - 1)], so packets can wrap around the end of the
+ * buffer. Each side only writes its own count, with a release store,
+ * and reads the other one with an acquire load, so the host can
+ * consume packets on any thread. */
+struct nfcemu_ring {
+  uint8_t* buf;
+  size_t size; /* power of 2 */
+  size_t head;
+  size_t tail;
+};
+
+enum {
+  /* holds the largest NCI packet */
+  NFCEMU_RING_MINIMUM_SIZE = 512
+};
+
+/* tells the host that the device appended packets to 'ring' */
+typedef void (nfcemu_ring_signal)(struct nfc_device* nfc,
+                                  struct nfcemu_ring* ring);
+
+enum {
+  NFCEMU_STATS_NUMBER_OF_LATENCY_BUCKETS = 32
+};
+
+/* Counters of a device, see nfc_device_get_stats(). All counters
+ * start at zero when the device is created. */
+struct nfcemu_stats {
+  /* NCI commands from the guest by GID and OID */
+  uint64_t nci_cmd[16][64];
+  /* NCI data packets from and to the guest */
+  uint64_t dta_rx;
+  uint64_t dta_tx;
+  /* LLCP PDUs from the guest by PTYPE */
+  uint64_t llcp_pdu[16];
+  /* LLCP transmit timeouts fired, i.e., SYMM or delayed PDUs */
+  uint64_t llcp_timeouts;
+  /* LLCP PDUs from the guest that were dropped, because they were too
+   * short or of a PTYPE without support */
+  uint64_t llcp_drops;
+  /* tag commands from the guest for T1T, T2T, T3T and T4T */
+  uint64_t tag_cmd[4];
+  /* PDUs in the REs' transmit queues at the time of the snapshot */
+  uint64_t re_xmit_q_len;
+  /* PDUs in the data links' transmit queues at the time of the
+   * snapshot, and the length of the longest of the queues */
+  uint64_t dl_xmit_q_len;
+  uint64_t dl_xmit_q_max;
+  /* largest number of LLCP PDU buffers that were in use at once */
+  uint64_t pdu_bufs_max;
+  /* scenario events that ran, and those that failed */
+  uint64_t scenario_events;
+  uint64_t scenario_errors;
+  /* APDUs from readers that the emulated secure element answered */
+  uint64_t nfcee_apdus;
+  /* R-APDUs that emulated readers received from the guest, and the
+   * guest's response latency, from handing over the C-APDU until its
+   * R-APDU arrived; buckets as for 'nci_latency' */
+  uint64_t hce_apdus;
+  uint64_t hce_latency[NFCEMU_STATS_NUMBER_OF_LATENCY_BUCKETS];
+  /* packets written to the batched output ring, signals that handed
+   * them to the host, and sends that failed because the ring was full
+   */
+  uint64_t ring_pkts;
+  uint64_t ring_signals;
+  uint64_t ring_drops;
+  /* latency of the sampled calls to nfc_device_process_nci_msg(),
+   * see nfcemu_ctx_set_latency_sampling(); bucket 'i' counts the
+   * calls that took from 2^i to 2^(i+1)-1 ns, the last bucket also
+   * counts all longer calls */
+  uint64_t nci_latency[NFCEMU_STATS_NUMBER_OF_LATENCY_BUCKETS];
+};
+
 #endif
@@ -23,11 +23,19 @@ nfcemu_SRC_FILES := base64.c\
                     llcp-snep.c \
                     ndef.c \
                     nfc.c \
+                    nfc-aid.c \
+                    nfc-hce.c \
                     nfc-hci.c \
                     nfc-nci.c \
+                    nfc-nfcee.c \
                     nfc-re.c \
                     nfc-rf.c \
+                    nfc-ring.c \
+                    nfc-scenario.c \
+                    nfc-snapshot.c \
                     nfc-tag.c \
+                    nfc-tag-cache.c \
+                    nfc-trace.c \
                     nfcemu.c \
                     snep.c
 
@@ -72,3 +80,57 @@ LOCAL_LDLIBS := -m64
 LOCAL_MODULE_TAGS := optional
 LOCAL_MODULE := lib64nfcemu
 include $(BUILD_HOST_STATIC_LIBRARY)
+
+#
+# 64-bit release and hardened libraries
+#
+# The release profile compiles out all assertions and debug output,
+# and builds with -O3 and LTO. The hardened profile keeps all
+# assertions, and adds fortified libc calls and stack protection.
+#
+
+nfcemu_RELEASE_CFLAGS := -m64 -O3 -flto -DNDEBUG -DDEBUG=0
+nfcemu_RELEASE_LDFLAGS := -m64 -O3 -flto
+nfcemu_HARDENED_CFLAGS := -m64 -O2 -UNDEBUG -D_FORTIFY_SOURCE=2 \
+                          -fstack-protector-strong
+nfcemu_HARDENED_LDFLAGS := -m64 -fstack-protector-strong
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := $(nfcemu_SRC_FILES)
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_CFLAGS := $(nfcemu_RELEASE_CFLAGS)
+LOCAL_LDFLAGS := $(nfcemu_RELEASE_LDFLAGS)
+LOCAL_LDLIBS := -m64
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := lib64nfcemu-release
+include $(BUILD_HOST_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := $(nfcemu_SRC_FILES)
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_CFLAGS := $(nfcemu_RELEASE_CFLAGS)
+LOCAL_LDFLAGS := $(nfcemu_RELEASE_LDFLAGS)
+LOCAL_LDLIBS := -m64
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := lib64nfcemu-release
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := $(nfcemu_SRC_FILES)
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_CFLAGS := $(nfcemu_HARDENED_CFLAGS)
+LOCAL_LDFLAGS := $(nfcemu_HARDENED_LDFLAGS)
+LOCAL_LDLIBS := -m64
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := lib64nfcemu-hardened
+include $(BUILD_HOST_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := $(nfcemu_SRC_FILES)
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include
+LOCAL_CFLAGS := $(nfcemu_HARDENED_CFLAGS)
+LOCAL_LDFLAGS := $(nfcemu_HARDENED_LDFLAGS)
+LOCAL_LDLIBS := -m64
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := lib64nfcemu-hardened
+include $(BUILD_HOST_STATIC_LIBRARY)
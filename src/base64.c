@@ -16,141 +16,277 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <string.h>
 #include "base64.h"
 
+#if defined(__i386__) || defined(__x86_64__)
+#define HAVE_BASE64_SSSE3 1
+#include <tmmintrin.h>
+#endif
+
+enum {
+    /* inputs shorter than this don't use the vector code */
+    BASE64_SIMD_MINIMUM_LENGTH = 16
+};
+
+static const unsigned char enc_value[64] = {
+     [0] = 'A',  [1] = 'B',  [2] = 'C',  [3] = 'D',
+     [4] = 'E',  [5] = 'F',  [6] = 'G',  [7] = 'H',
+     [8] = 'I',  [9] = 'J', [10] = 'K', [11] = 'L',
+    [12] = 'M', [13] = 'N', [14] = 'O', [15] = 'P',
+    [16] = 'Q', [17] = 'R', [18] = 'S', [19] = 'T',
+    [20] = 'U', [21] = 'V', [22] = 'W', [23] = 'X',
+    [24] = 'Y', [25] = 'Z', [26] = 'a', [27] = 'b',
+    [28] = 'c', [29] = 'd', [30] = 'e', [31] = 'f',
+    [32] = 'g', [33] = 'h', [34] = 'i', [35] = 'j',
+    [36] = 'k', [37] = 'l', [38] = 'm', [39] = 'n',
+    [40] = 'o', [41] = 'p', [42] = 'q', [43] = 'r',
+    [44] = 's', [45] = 't', [46] = 'u', [47] = 'v',
+    [48] = 'w', [49] = 'x', [50] = 'y', [51] = 'z',
+    [52] = '0', [53] = '1', [54] = '2', [55] = '3',
+    [56] = '4', [57] = '5', [58] = '6', [59] = '7',
+    [60] = '8', [61] = '9', [62] = '+', [63] = '/'
+};
+
+static const unsigned char dec_value[1<<CHAR_BIT] = {
+    ['A'] =  0, ['B'] =  1, ['C'] =  2, ['D'] =  3,
+    ['E'] =  4, ['F'] =  5, ['G'] =  6, ['H'] =  7,
+    ['I'] =  8, ['J'] =  9, ['K'] = 10, ['L'] = 11,
+    ['M'] = 12, ['N'] = 13, ['O'] = 14, ['P'] = 15,
+    ['Q'] = 16, ['R'] = 17, ['S'] = 18, ['T'] = 19,
+    ['U'] = 20, ['V'] = 21, ['W'] = 22, ['X'] = 23,
+    ['Y'] = 24, ['Z'] = 25, ['a'] = 26, ['b'] = 27,
+    ['c'] = 28, ['d'] = 29, ['e'] = 30, ['f'] = 31,
+    ['g'] = 32, ['h'] = 33, ['i'] = 34, ['j'] = 35,
+    ['k'] = 36, ['l'] = 37, ['m'] = 38, ['n'] = 39,
+    ['o'] = 40, ['p'] = 41, ['q'] = 42, ['r'] = 43,
+    ['s'] = 44, ['t'] = 45, ['u'] = 46, ['v'] = 47,
+    ['w'] = 48, ['x'] = 49, ['y'] = 50, ['z'] = 51,
+    ['0'] = 52, ['1'] = 53, ['2'] = 54, ['3'] = 55,
+    ['4'] = 56, ['5'] = 57, ['6'] = 58, ['7'] = 59,
+    ['8'] = 60, ['9'] = 61, ['+'] = 62, ['/'] = 63,
+    ['='] = 0xff
+};
+
 ssize_t
-encode_base64(const unsigned char* in, size_t ilen, char* out, size_t olen)
+encode_base64_scalar(const unsigned char* in, size_t ilen,
+                     char* out, size_t olen)
 {
-    static const unsigned char value[64] = {
-         [0] = 'A',  [1] = 'B',  [2] = 'C',  [3] = 'D',
-         [4] = 'E',  [5] = 'F',  [6] = 'G',  [7] = 'H',
-         [8] = 'I',  [9] = 'J', [10] = 'K', [11] = 'L',
-        [12] = 'M', [13] = 'N', [14] = 'O', [15] = 'P',
-        [16] = 'Q', [17] = 'R', [18] = 'S', [19] = 'T',
-        [20] = 'U', [21] = 'V', [22] = 'W', [23] = 'X',
-        [24] = 'Y', [25] = 'Z', [26] = 'a', [27] = 'b',
-        [28] = 'c', [29] = 'd', [30] = 'e', [31] = 'f',
-        [32] = 'g', [33] = 'h', [34] = 'i', [35] = 'j',
-        [36] = 'k', [37] = 'l', [38] = 'm', [39] = 'n',
-        [40] = 'o', [41] = 'p', [42] = 'q', [43] = 'r',
-        [44] = 's', [45] = 't', [46] = 'u', [47] = 'v',
-        [48] = 'w', [49] = 'x', [50] = 'y', [51] = 'z',
-        [52] = '0', [53] = '1', [54] = '2', [55] = '3',
-        [56] = '4', [57] = '5', [58] = '6', [59] = '7',
-        [60] = '8', [61] = '9', [62] = '+', [63] = '/'
-    };
-
     size_t len;
-    long shift;
-    unsigned char rest;
 
     assert(CHAR_BIT == 8); /* should be true on most modern platforms */
     assert(in || !ilen);
-    assert(olen || !ilen);
     assert(out || !olen);
 
-    /* encode input string */
-    for (len = 0, shift = 2, rest = 0; ilen; --olen, ++out) {
-        unsigned char c = *in;
-        assert(!(shift % 2));
-        assert(olen);
-        if (!shift) {
-            *out = value[rest];
-            rest = 0;
-            ++len;
-        } else if (shift == 2) {
-            *out = value[rest | (c >> 2)];
-            rest = (c&0x03) << 4;
-            ++in; --ilen; ++len;
-        } else if (shift == 4) {
-            *out = value[rest | (c >> 4)];
-            rest = (c&0x0f) << 2;
-            ++in; --ilen; ++len;
-        } else if (shift == 6) {
-            *out = value[rest | (c >> 6)];
-            rest = (c&0x3f) << 0;
-            ++in; --ilen; ++len;
-        }
-        shift = (shift + 2) % 8;
+    /* 4 characters for each started group of 3 bytes */
+    len = (ilen + 2) / 3 * 4;
+    if (len > olen) {
+        return -1; /* out-of-memory */
     }
-    /* append remaining bits */
-    if (rest) {
-        *out = value[rest];
-        ++out; --olen; ++len;
+
+    for (; ilen >= 3; in += 3, ilen -= 3, out += 4) {
+        out[0] = enc_value[in[0] >> 2];
+        out[1] = enc_value[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+        out[2] = enc_value[((in[1] & 0x0f) << 2) | (in[2] >> 6)];
+        out[3] = enc_value[in[2] & 0x3f];
     }
-    /* append padding bytes */
-    while (len % 4) {
-        assert(olen);
-        *out = '=';
-        ++out; --olen; ++len;
+    /* append remaining bits and padding bytes */
+    if (ilen == 1) {
+        out[0] = enc_value[in[0] >> 2];
+        out[1] = enc_value[(in[0] & 0x03) << 4];
+        out[2] = '=';
+        out[3] = '=';
+    } else if (ilen == 2) {
+        out[0] = enc_value[in[0] >> 2];
+        out[1] = enc_value[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+        out[2] = enc_value[(in[1] & 0x0f) << 2];
+        out[3] = '=';
     }
     return len;
 }
 
 ssize_t
-decode_base64(const char* in, size_t ilen, unsigned char* out, size_t olen)
+decode_base64_scalar(const char* in, size_t ilen,
+                     unsigned char* out, size_t olen)
 {
-    static const unsigned char value[1<<CHAR_BIT] = {
-        ['A'] =  0, ['B'] =  1, ['C'] =  2, ['D'] =  3,
-        ['E'] =  4, ['F'] =  5, ['G'] =  6, ['H'] =  7,
-        ['I'] =  8, ['J'] =  9, ['K'] = 10, ['L'] = 11,
-        ['M'] = 12, ['N'] = 13, ['O'] = 14, ['P'] = 15,
-        ['Q'] = 16, ['R'] = 17, ['S'] = 18, ['T'] = 19,
-        ['U'] = 20, ['V'] = 21, ['W'] = 22, ['X'] = 23,
-        ['Y'] = 24, ['Z'] = 25, ['a'] = 26, ['b'] = 27,
-        ['c'] = 28, ['d'] = 29, ['e'] = 30, ['f'] = 31,
-        ['g'] = 32, ['h'] = 33, ['i'] = 34, ['j'] = 35,
-        ['k'] = 36, ['l'] = 37, ['m'] = 38, ['n'] = 39,
-        ['o'] = 40, ['p'] = 41, ['q'] = 42, ['r'] = 43,
-        ['s'] = 44, ['t'] = 45, ['u'] = 46, ['v'] = 47,
-        ['w'] = 48, ['x'] = 49, ['y'] = 50, ['z'] = 51,
-        ['0'] = 52, ['1'] = 53, ['2'] = 54, ['3'] = 55,
-        ['4'] = 56, ['5'] = 57, ['6'] = 58, ['7'] = 59,
-        ['8'] = 60, ['9'] = 61, ['+'] = 62, ['/'] = 63,
-        ['='] = 0xff
-    };
-
     size_t len;
-    long shift;
+    unsigned long bits;
+    unsigned int nbits;
 
     assert(CHAR_BIT == 8); /* should be true on most modern platforms */
     assert(in || !ilen);
-    assert(olen || !ilen);
     assert(out || !olen);
 
-    for (len = 0, shift = 0; ilen; --ilen, ++in) {
-        unsigned long c = value[(unsigned char)(*in)];
+    /* collect 6 bits per character; store each complete byte */
+    for (len = 0, bits = 0, nbits = 0; ilen; --ilen, ++in) {
+        unsigned char c = dec_value[(unsigned char)(*in)];
         if (c == 0xff) {
             break; /* ignoring padding at the end of input */
         }
         if (!c && (*in != 'A')) {
             return -1; /* non-base64 input */
         }
-        assert(!(shift % 2));
-        assert(olen);
-        if (!shift) {
-            /* input value aligned to highest bit of current field */
-            shift += 2;
-            *out = c << shift;
-        } else if (shift == 6) {
-            /* input value aligned to lowest bit of current field */
-            shift = 0;
-            *out |= c;
-            if (!olen) {
-                return -1; /* out-of-memory */
-            }
-            ++out; --olen; ++len;
-        } else {
-            /* input value crosses field boundary */
-            *out |= c >> (6-shift);
-            if (!olen) {
+        bits = (bits << 6) | c;
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            if (len == olen) {
                 return -1; /* out-of-memory */
             }
-            ++out; --olen; ++len;
-            shift += 2;
-            assert(olen);
-            *out = c << shift;
+            out[len++] = bits >> nbits;
+        }
+    }
+    return len;
+}
+
+#ifdef HAVE_BASE64_SSSE3
+/*
+ * SSSE3 implementation
+ *
+ * Each iteration encodes 12 bytes into 16 characters, or decodes 16
+ * characters into 12 bytes. Loads and stores are 16 bytes wide, so
+ * the loops stop while 16 bytes of input and output remain; the scalar
+ * code handles the rest. Decoding falls back to the scalar code at the
+ * first block with padding or invalid characters, which then reports
+ * the error or stops at the padding.
+ */
+
+__attribute__((target("ssse3")))
+static size_t
+encode_base64_ssse3(const unsigned char** in, size_t* ilen, char* out)
+{
+    /* offsets from 6-bit values to characters; see below */
+    const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4,
+                                      -4, -4, -4, -4, -19, -16, 0, 0);
+    size_t len;
+
+    for (len = 0; *ilen >= 16; *in += 12, *ilen -= 12, len += 16) {
+        __m128i v, t0, t1, t2, t3, idx, mask;
+
+        /* bytes 'abc' of each group to 'bacb' ... */
+        v = _mm_loadu_si128((const __m128i*)*in);
+        v = _mm_shuffle_epi8(v, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+                                              7, 6, 8, 7, 10, 9, 11, 10));
+        /* ... and move the 4 sextets into individual bytes */
+        t0 = _mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00));
+        t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+        t2 = _mm_and_si128(v, _mm_set1_epi32(0x003f03f0));
+        t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+        v = _mm_or_si128(t1, t3);
+
+        /* table index is 0 for [0..25], 1 for [26..51], 2..11 for
+         * [52..61], 12 for 62 and 13 for 63 */
+        idx = _mm_subs_epu8(v, _mm_set1_epi8(51));
+        mask = _mm_cmpgt_epi8(v, _mm_set1_epi8(25));
+        idx = _mm_sub_epi8(idx, mask);
+        v = _mm_add_epi8(v, _mm_shuffle_epi8(lut, idx));
+
+        _mm_storeu_si128((__m128i*)(out + len), v);
+    }
+    return len;
+}
+
+__attribute__((target("ssse3")))
+static size_t
+decode_base64_ssse3(const char** in, size_t* ilen,
+                    unsigned char* out, size_t olen)
+{
+    /* valid characters have no bit in common between their entries
+     * in the tables for the low and the high nibble */
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x13, 0x1a,
+                                         0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02,
+                                         0x04, 0x08, 0x04, 0x08,
+                                         0x10, 0x10, 0x10, 0x10,
+                                         0x10, 0x10, 0x10, 0x10);
+    /* offsets from characters to 6-bit values by high nibble; index
+     * 1 is for '/' */
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                           0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+    size_t len;
+
+    for (len = 0; (*ilen >= 16) && (olen - len >= 16);
+         *in += 16, *ilen -= 16, len += 12) {
+        __m128i v, hi_nibbles, lo_nibbles, hi, lo, roll;
+
+        v = _mm_loadu_si128((const __m128i*)*in);
+
+        hi_nibbles = _mm_and_si128(_mm_srli_epi32(v, 4), mask_2f);
+        lo_nibbles = _mm_and_si128(v, mask_2f);
+        hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi),
+                                             _mm_setzero_si128()))) {
+            break;
         }
+        roll = _mm_shuffle_epi8(lut_roll,
+                                _mm_add_epi8(_mm_cmpeq_epi8(v, mask_2f),
+                                             hi_nibbles));
+        v = _mm_add_epi8(v, roll);
+
+        /* merge sextets into 24-bit groups and pack them */
+        v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+        v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+        v = _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9,
+                                              8, 14, 13, 12, -1, -1, -1, -1));
+
+        _mm_storeu_si128((__m128i*)(out + len), v);
     }
     return len;
 }
+#endif
+
+ssize_t
+encode_base64(const unsigned char* in, size_t ilen, char* out, size_t olen)
+{
+#ifdef HAVE_BASE64_SSSE3
+    if ((ilen >= BASE64_SIMD_MINIMUM_LENGTH) &&
+        __builtin_cpu_supports("ssse3")) {
+        size_t len;
+        ssize_t res;
+
+        if ((ilen + 2) / 3 * 4 > olen) {
+            return -1; /* out-of-memory */
+        }
+        len = encode_base64_ssse3(&in, &ilen, out);
+        res = encode_base64_scalar(in, ilen, out + len, olen - len);
+        return res < 0 ? -1 : (ssize_t)len + res;
+    }
+#endif
+    return encode_base64_scalar(in, ilen, out, olen);
+}
+
+ssize_t
+decode_base64(const char* in, size_t ilen, unsigned char* out, size_t olen)
+{
+#ifdef HAVE_BASE64_SSSE3
+    if ((ilen >= BASE64_SIMD_MINIMUM_LENGTH) &&
+        __builtin_cpu_supports("ssse3")) {
+        size_t len;
+        ssize_t res;
+
+        len = decode_base64_ssse3(&in, &ilen, out, olen);
+        res = decode_base64_scalar(in, ilen, out + len, olen - len);
+        return res < 0 ? -1 : (ssize_t)len + res;
+    }
+#endif
+    return decode_base64_scalar(in, ilen, out, olen);
+}
+
+size_t
+decode_base64_len(const char* in, size_t ilen)
+{
+    const char* pad;
+
+    assert(in || !ilen);
+
+    /* decoding stops at the first padding byte */
+    pad = memchr(in, '=', ilen);
+    if (pad) {
+        ilen = pad - in;
+    }
+    return ilen * 6 / 8;
+}
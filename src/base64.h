@@ -19,10 +19,28 @@
 
 #include <sys/types.h>
 
+/* Both functions return the length of the output, or -1 on errors.
+ * They use vector instructions if the CPU supports them; the scalar
+ * versions are the reference implementations.
+ */
+
 ssize_t
 encode_base64(const unsigned char* in, size_t ilen, char* out, size_t olen);
 
 ssize_t
 decode_base64(const char* in, size_t ilen, unsigned char* out, size_t olen);
 
+/* Returns the number of bytes that decode_base64() produces for valid
+ * input, without decoding or validating it. */
+size_t
+decode_base64_len(const char* in, size_t ilen);
+
+ssize_t
+encode_base64_scalar(const unsigned char* in, size_t ilen,
+                     char* out, size_t olen);
+
+ssize_t
+decode_base64_scalar(const char* in, size_t ilen,
+                     unsigned char* out, size_t olen);
+
 #endif
@@ -44,6 +44,9 @@
 #define cpu_to_le32(_x) \
   bswap_32(_x)
 
+#define cpu_to_le64(_x) \
+  bswap_64(_x)
+
 #else
 
 #define be16_to_cpu(_x) \
@@ -70,4 +73,7 @@
 #define cpu_to_le32(_x) \
   (_x)
 
+#define cpu_to_le64(_x) \
+  (_x)
+
 #endif
@@ -16,4 +16,4 @@
 
 #include "cb.h"
 
-struct nfcemu_cb cb;
+struct nfcemu_ctx nfcemu_default_ctx;
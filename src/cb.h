@@ -18,6 +18,8 @@
 
 #include <sys/types.h>
 #include <nfcemu/types.h>
+#include "nfc.h"
+#include "nfc-nci.h"
 
 struct nfc_device;
 union nci_packet;
@@ -33,15 +35,49 @@ struct nfcemu_cb {
   void (*del_timeout)(nfcemu_timeout* t);
   int (*timeout_is_pending)(nfcemu_timeout* t);
 
-  /* I/O callbacks */
-  int (*send_ntf)(ssize_t (*create)(void*, struct nfc_device*,
+  /* I/O callbacks; the device is NULL for requests that have not
+   * been bound to a specific device, such as legacy console commands */
+  int (*send_ntf)(struct nfc_device* nfc,
+                  ssize_t (*create)(void*, struct nfc_device*,
                                     size_t, union nci_packet*),
                   void* data);
-  int (*send_dta)(ssize_t (*create)(void*, struct nfc_device*,
+  int (*send_dta)(struct nfc_device* nfc,
+                  ssize_t (*create)(void*, struct nfc_device*,
                                     size_t, union nci_packet*),
                   void* data);
-  int (*recv_dta)(ssize_t (*handle)(void*, struct nfc_device*),
+  int (*recv_dta)(struct nfc_device* nfc,
+                  ssize_t (*handle)(void*, struct nfc_device*),
                   void* data);
+
+  /* optional output callback for console results; if NULL, results
+   * are printed with log_msg */
+  int (*output)(struct nfc_device* nfc, size_t len,
+                ssize_t (*write)(void*, struct nfc_device*, size_t, char*),
+                void* data);
+};
+
+/* An emulator context holds the host callbacks for all devices
+ * created from it. */
+struct nfcemu_ctx {
+  struct nfcemu_cb cb;
+
+  /* number of LLCP PDU buffers per device */
+  size_t pdu_pool_size;
+
+  /* number of cached tag images per device */
+  size_t tag_cache_size;
+
+  /* largest SNEP message of devices, including the header */
+  size_t snep_max_msg_len;
+
+  /* average number of NCI messages per latency sample; 0 disables
+   * latency statistics */
+  unsigned long latency_sampling;
+
+  /* NCI command handlers of all devices; starts as a copy of
+   * nfc_nci_default_cmd_table */
+  struct nfc_nci_cmd_table nci_cmd;
 };
 
-extern struct nfcemu_cb cb;
+/* context set up by nfcemu_init() */
+extern struct nfcemu_ctx nfcemu_default_ctx;
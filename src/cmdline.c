@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <nfcemu/cmdline.h>
 #include "ptr.h"
 #include "base64.h"
 #include "llcp.h"
@@ -25,10 +26,146 @@
 #include "nfc-re.h"
 #include "nfc.h"
 #include "nfc-nci.h"
+#include "nfc-ring.h"
 #include "nfc-tag.h"
+#include "nfc-trace.h"
 #include "snep.h"
 #include "cb.h"
 
+/* Some commands don't send data to the guest, so we operate on
+ * the device directly if it's known. Otherwise the host hands us
+ * its device from within recv_dta.
+ */
+static int
+run_device_cmd(const struct nfcemu_cb* cb, struct nfc_device* nfc,
+               ssize_t (*handle)(void*, struct nfc_device*), void* data)
+{
+    if (nfc) {
+        return handle(data, nfc) < 0 ? -1 : 0;
+    }
+    return cb->recv_dta(NULL, handle, data);
+}
+
+/* How a parsed command runs on the device */
+enum nfc_cmd_op {
+    NFC_CMD_RUN = 0, /* on the device, see run_device_cmd() */
+    NFC_CMD_RECV_DTA, /* from within recv_dta */
+    NFC_CMD_SEND_NTF, /* creates a notification */
+    NFC_CMD_SEND_DTA /* creates a data packet */
+};
+
+/* A parsed console command. Unless the command is being compiled, it
+ * runs as soon as its parameters are complete. Compiled commands keep
+ * a copy of their parameters for nfc_cmd_run(); the handlers never
+ * modify them, so they can run any number of times.
+ */
+struct nfc_cmd {
+    int compiled;
+
+    /* callbacks for parsing; device and callbacks for running right
+     * away */
+    const struct nfcemu_cb* cb;
+    struct nfc_device* nfc;
+
+    enum nfc_cmd_op op;
+    ssize_t (*handle)(void*, struct nfc_device*);
+    ssize_t (*create)(void*, struct nfc_device*, size_t,
+                      union nci_packet*);
+    void* param;
+
+    /* encoded NDEF message or decoded base64 data that the
+     * parameters refer to */
+    uint8_t* ndef;
+
+    /* console group and arguments for the tracer */
+    const char* group;
+    char* args;
+};
+
+#define NFC_CMD_INIT(_cb, _nfc, _compiled) \
+    { \
+        .compiled = (_compiled), \
+        .cb = (_cb), \
+        .nfc = (_nfc), \
+        .op = NFC_CMD_RUN, \
+        .handle = NULL, \
+        .create = NULL, \
+        .param = NULL, \
+        .ndef = NULL, \
+        .group = NULL, \
+        .args = NULL \
+    }
+
+static int
+run_cmd(const struct nfcemu_cb* cb, struct nfc_device* nfc,
+        const struct nfc_cmd* cmd, void* param)
+{
+    int res;
+
+    /* packets of a single command are signaled together */
+    nfc_ring_begin(nfc);
+
+    switch (cmd->op) {
+        case NFC_CMD_RUN:
+            res = run_device_cmd(cb, nfc, cmd->handle, param);
+            break;
+        case NFC_CMD_RECV_DTA:
+            res = cb->recv_dta(nfc, cmd->handle, param);
+            break;
+        case NFC_CMD_SEND_NTF:
+            res = cb->send_ntf(nfc, cmd->create, param);
+            break;
+        case NFC_CMD_SEND_DTA:
+            res = cb->send_dta(nfc, cmd->create, param);
+            break;
+        default:
+            res = -1;
+            break;
+    }
+
+    nfc_ring_end(nfc);
+
+    return res;
+}
+
+/* runs the parsed command, or keeps its parameters if it's being
+ * compiled */
+static int
+submit_cmd(struct nfc_cmd* cmd, const void* param, size_t len)
+{
+    if (!cmd->compiled) {
+        return run_cmd(cmd->cb, cmd->nfc, cmd, (void*)param);
+    }
+    cmd->param = malloc(len);
+    if (!cmd->param) {
+        cmd->cb->log_err("KO: out of memory\r\n");
+        return -1;
+    }
+    memcpy(cmd->param, param, len);
+    return 0;
+}
+
+static int
+submit_device_cmd(struct nfc_cmd* cmd, enum nfc_cmd_op op,
+                  ssize_t (*handle)(void*, struct nfc_device*),
+                  const void* param, size_t len)
+{
+    cmd->op = op;
+    cmd->handle = handle;
+    return submit_cmd(cmd, param, len);
+}
+
+static int
+submit_packet_cmd(struct nfc_cmd* cmd, enum nfc_cmd_op op,
+                  ssize_t (*create)(void*, struct nfc_device*, size_t,
+                                    union nci_packet*),
+                  const void* param, size_t len)
+{
+    cmd->op = op;
+    cmd->create = create;
+    return submit_cmd(cmd, param, len);
+}
+
 struct nfc_ndef_record_param {
     unsigned long flags;
     enum ndef_tnf tnf;
@@ -37,6 +174,11 @@ struct nfc_ndef_record_param {
     const char* payload;
 };
 
+/* records that a command parses without allocating memory */
+enum {
+    NFC_NDEF_STATIC_RECORDS = 8
+};
+
 #define NFC_NDEF_PARAM_RECORD_INIT(_rec) \
     _rec = { \
         .flags = 0, \
@@ -46,8 +188,56 @@ struct nfc_ndef_record_param {
         .payload = NULL \
     }
 
+static uint8_t
+ndef_rec_flags(const struct nfc_ndef_record_param* record, size_t i,
+               size_t nrecords)
+{
+    return record->flags |
+           ( NDEF_FLAG_MB * (!i) ) |
+           ( NDEF_FLAG_ME * (i+1 == nrecords) ) |
+           ( NDEF_FLAG_IL * (!!strlen(record->id)) );
+}
+
+/* Returns the exact length of the encoded NDEF message, so that it
+ * can be built in place. */
+static ssize_t
+ndef_msg_len(const struct nfcemu_cb* cb,
+             const struct nfc_ndef_record_param* record, size_t nrecords)
+{
+    size_t len;
+    size_t i;
+
+    assert(record || !nrecords);
+
+    len = 0;
+
+    for (i = 0; i < nrecords; ++i, ++record) {
+        uint8_t flags;
+        size_t tlen, ilen, plen;
+
+        flags = ndef_rec_flags(record, i, nrecords);
+
+        tlen = decode_base64_len(record->type, strlen(record->type));
+        ilen = decode_base64_len(record->id, strlen(record->id));
+        plen = decode_base64_len(record->payload, strlen(record->payload));
+
+        if ((tlen > 255) || (ilen > 255)) {
+            cb->log_err("KO: NDEF type or id longer than 255 bytes\r\n");
+            return -1;
+        } else if ((plen > 255) && (flags & NDEF_FLAG_SR)) {
+            cb->log_err("KO: NDEF flag SR set for long payload of "
+                        "%zu bytes\r\n", plen);
+            return -1;
+        }
+        len += ndef_rec_hdr_len(flags) + tlen + ilen + plen;
+    }
+    return len;
+}
+
+/* Builds the NDEF message into 'buf'; see ndef_msg_len(). */
 ssize_t
-build_ndef_msg(const struct nfc_ndef_record_param* record, size_t nrecords,
+build_ndef_msg(const struct nfcemu_cb* cb,
+               const struct nfc_ndef_record_param* record, size_t nrecords,
                uint8_t* buf, size_t len)
 {
     size_t off;
@@ -59,17 +249,15 @@ build_ndef_msg(const struct nfc_ndef_record_param* record, size_t nrecords,
     off = 0;
 
     for (i = 0; i < nrecords; ++i, ++record) {
-        size_t idlen;
         uint8_t flags;
         struct ndef_rec* ndef;
         ssize_t res;
 
-        idlen = strlen(record->id);
+        flags = ndef_rec_flags(record, i, nrecords);
 
-        flags = record->flags |
-                ( NDEF_FLAG_MB * (!i) ) |
-                ( NDEF_FLAG_ME * (i+1 == nrecords) ) |
-                ( NDEF_FLAG_IL * (!!idlen) );
+        if (ndef_rec_hdr_len(flags) > len-off) {
+            return -1;
+        }
 
         ndef = (struct ndef_rec*)(buf + off);
         off += ndef_create_rec(ndef, flags, record->tnf, 0, 0, 0);
@@ -99,10 +287,6 @@ build_ndef_msg(const struct nfc_ndef_record_param* record, size_t nrecords,
                             buf+off, len-off);
         if (res < 0) {
             return -1;
-        } else if ((res > 255) && (flags & NDEF_FLAG_SR)) {
-            cb.log_err("KO: NDEF flag SR set for long payload of %zu bytes",
-                       res);
-            return -1;
         }
         ndef_rec_set_payload_len(ndef, res);
         off += res;
@@ -110,41 +294,101 @@ build_ndef_msg(const struct nfc_ndef_record_param* record, size_t nrecords,
     return off;
 }
 
+/* Returns the length of the encoded NDEF message, or -1 if it's
+ * invalid or longer than 'maxlen' bytes. */
+static ssize_t
+limit_ndef_msg_len(const struct nfcemu_cb* cb,
+                   const struct nfc_ndef_record_param* record,
+                   size_t nrecords, size_t maxlen)
+{
+    ssize_t len;
+
+    len = ndef_msg_len(cb, record, nrecords);
+    if (len < 0) {
+        return -1;
+    } else if ((size_t)len > maxlen) {
+        cb->log_err("KO: NDEF message of %zd bytes exceeds %zu bytes\r\n",
+                    len, maxlen);
+        return -1;
+    }
+    return len;
+}
+
+/* Encodes the NDEF message into a buffer of the exact size that the
+ * command owns, so that running the command doesn't decode the
+ * records again. Returns the message's length. */
+static ssize_t
+compile_ndef_msg(const struct nfcemu_cb* cb,
+                 const struct nfc_ndef_record_param* record, size_t nrecords,
+                 size_t maxlen, struct nfc_cmd* cmd)
+{
+    ssize_t len;
+
+    assert(cmd);
+    assert(!cmd->ndef);
+
+    len = limit_ndef_msg_len(cb, record, nrecords, maxlen);
+    if (len <= 0) {
+        return len;
+    }
+    cmd->ndef = malloc(len);
+    if (!cmd->ndef) {
+        cb->log_err("KO: out of memory\r\n");
+        return -1;
+    }
+    if (build_ndef_msg(cb, record, nrecords, cmd->ndef, len) != len) {
+        cb->log_err("KO: invalid NDEF message\r\n");
+        return -1;
+    }
+    return len;
+}
+
+/* SNEP PUT of an NDEF message; without a message, the last message
+ * received from the guest is printed. Compiled commands carry the
+ * encoded message. Commands that run right away encode their records
+ * in place when the request is created, without a copy of the
+ * message. */
 struct nfc_snep_param {
     long dsap;
     long ssap;
+    const struct nfcemu_cb* cb;
+    const uint8_t* ndef;
+    const struct nfc_ndef_record_param* record;
     size_t nrecords;
-    struct nfc_ndef_record_param record[4];
+    size_t len;
 };
 
-#define NFC_SNEP_PARAM_INIT() \
+#define NFC_SNEP_PARAM_INIT(_cb) \
     { \
         .dsap = LLCP_SAP_LM, \
         .ssap = LLCP_SAP_LM, \
+        .cb = (_cb), \
+        .ndef = NULL, \
+        .record = NULL, \
         .nrecords = 0, \
-        .record = { \
-            NFC_NDEF_PARAM_RECORD_INIT([0]), \
-            NFC_NDEF_PARAM_RECORD_INIT([1]), \
-            NFC_NDEF_PARAM_RECORD_INIT([2]), \
-            NFC_NDEF_PARAM_RECORD_INIT([3]) \
-        } \
+        .len = 0 \
     }
 
 static ssize_t
 create_snep_cp(void *data, size_t len, struct snep* snep)
 {
     const struct nfc_snep_param* param;
-    ssize_t res;
 
     param = data;
     assert(param);
 
-    res = build_ndef_msg(param->record, param->nrecords,
-                         snep->info, len-sizeof(*snep));
-    if (res < 0) {
+    if (param->len > len-sizeof(*snep)) {
+        return -1;
+    }
+    if (param->ndef) {
+        memcpy(snep->info, param->ndef, param->len);
+    } else if (build_ndef_msg(param->cb, param->record, param->nrecords,
+                              snep->info, param->len) != param->len) {
+        param->cb->log_err("KO: invalid NDEF message\r\n");
         return -1;
     }
-    return snep_create_req_put(snep, res);
+
+    return snep_create_req_put(snep, param->len);
 }
 
 static ssize_t
@@ -152,106 +396,271 @@ nfc_send_snep_put_cb(void* data,
                      struct nfc_device* nfc,
                      size_t maxlen, union nci_packet* ntf)
 {
-    struct nfc_snep_param* param;
+    const struct nfc_snep_param* param;
+    long dsap, ssap;
     ssize_t res;
 
     param = data;
     assert(param);
 
     if (!nfc->active_re) {
-        cb.log_err("KO: no active remote endpoint\n");
+        nfc->cb->log_err("KO: no active remote endpoint\n");
         return -1;
     }
-    if ((param->dsap < 0) && (param->ssap < 0)) {
-        param->dsap = nfc->active_re->last_dsap;
-        param->ssap = nfc->active_re->last_ssap;
+    dsap = param->dsap;
+    ssap = param->ssap;
+    if ((dsap < 0) && (ssap < 0)) {
+        dsap = nfc->active_re->last_dsap;
+        ssap = nfc->active_re->last_ssap;
     }
-    res = nfc_re_send_snep_put(nfc->active_re, param->dsap, param->ssap,
+    res = nfc_re_send_snep_put(nfc->active_re, dsap, ssap,
+                               sizeof(struct snep) + param->len,
                                create_snep_cp, data);
     if (res < 0) {
-        cb.log_err("KO: 'snep put' failed\r\n");
+        nfc->cb->log_err("KO: 'snep put' failed\r\n");
         return -1;
     }
     return res;
 }
 
+/* Writes console results without formatting. A writer either
+ * counts the result's length, fills a buffer, or prints to log_msg.
+ * Base64 data can be given in pieces; up to 2 bytes of an incomplete
+ * group are carried over to the next piece, until 'last' flushes them.
+ */
+struct nfc_writer {
+    const struct nfcemu_cb* cb; /* print to log_msg if set */
+    char* buf; /* fill buffer if set */
+    size_t len;
+    size_t off;
+    unsigned char rest[2];
+    size_t nrest;
+};
+
+#define NFC_WRITER_INIT(_cb, _buf, _len) \
+    { \
+        .cb = (_cb), \
+        .buf = (_buf), \
+        .len = (_len), \
+        .off = 0, \
+        .nrest = 0 \
+    }
+
+static void
+write_str(struct nfc_writer* w, const char* str, size_t len)
+{
+    if (w->cb) {
+        w->cb->log_msg("%.*s", (int)len, str);
+    } else if (w->buf) {
+        assert(len <= w->len - w->off);
+        memcpy(w->buf + w->off, str, len);
+    }
+    w->off += len;
+}
+
+#define write_lit(_w, _str) \
+    write_str((_w), (_str), sizeof(_str) - 1)
+
+static void
+write_ul(struct nfc_writer* w, unsigned long value)
+{
+    char str[3 * sizeof(value)];
+    size_t i = sizeof(str);
+
+    do {
+        str[--i] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    write_str(w, str + i, sizeof(str) - i);
+}
+
+static void
+write_base64_groups(struct nfc_writer* w, const unsigned char* data,
+                    size_t len)
+{
+    char out[512];
+    ssize_t res;
+
+    if (w->cb) {
+        /* print in pieces of whole groups */
+        while (len) {
+            size_t n = len < sizeof(out) / 4 * 3 ? len : sizeof(out) / 4 * 3;
+            res = encode_base64(data, n, out, sizeof(out));
+            assert(res >= 0);
+            w->cb->log_msg("%.*s", (int)res, out);
+            data += n;
+            len -= n;
+            w->off += res;
+        }
+    } else if (w->buf) {
+        res = encode_base64(data, len, w->buf + w->off, w->len - w->off);
+        assert(res >= 0);
+        w->off += res;
+    } else {
+        w->off += (len + 2) / 3 * 4;
+    }
+}
+
+static void
+write_base64(struct nfc_writer* w, const unsigned char* data, size_t len,
+             int last)
+{
+    size_t keep;
+
+    if (w->nrest && (len || last)) {
+        unsigned char group[3];
+        size_t n, m;
+
+        /* complete the carried group */
+        n = w->nrest;
+        memcpy(group, w->rest, n);
+        m = len < 3 - n ? len : 3 - n;
+        memcpy(group + n, data, m);
+        data += m;
+        len -= m;
+        n += m;
+
+        if ((n < 3) && !last) {
+            memcpy(w->rest, group, n);
+            w->nrest = n;
+            return;
+        }
+        write_base64_groups(w, group, n);
+        w->nrest = 0;
+    }
+
+    keep = last ? 0 : len % 3;
+    write_base64_groups(w, data, len - keep);
+    memcpy(w->rest, data + len - keep, keep);
+    w->nrest = keep;
+}
+
+/* writes NDEF message in JSON format; payloads of chunked records
+ * are written as they come */
+static int
+write_ndef_msg(struct nfc_writer* w, const struct ndef_rec* ndef, size_t len)
+{
+    struct ndef_iter iter;
+    struct ndef_rec_view rec;
+    size_t nrecs;
+    int res;
+
+    ndef_iter_init(&iter, ndef, len);
+
+    write_lit(w, "[");
+
+    for (nrecs = 0; (res = ndef_iter_next(&iter, &rec)) > 0;) {
+        if (rec.first) {
+            if (nrecs++) {
+                write_lit(w, ","); /* more to come */
+            }
+            write_lit(w, "{\"tnf\": ");
+            write_ul(w, rec.tnf);
+            write_lit(w, ", \"type\": \"");
+            write_base64(w, rec.type, rec.tlen, 1);
+            write_lit(w, "\", \"id\": \"");
+            write_base64(w, rec.id, rec.ilen, 1);
+            write_lit(w, "\", \"payload\": \"");
+        }
+        write_base64(w, rec.payload, rec.plen, rec.last);
+        if (rec.last) {
+            write_lit(w, "\"}");
+        }
+    }
+    if (res < 0) {
+        return -1;
+    }
+    write_lit(w, "]\r\n");
+
+    return 0;
+}
+
+struct nfc_ndef_output_param {
+    const struct ndef_rec* ndef;
+    size_t len;
+};
+
 static ssize_t
-nfc_recv_process_ndef_cb(void* data, size_t len, const struct ndef_rec* ndef)
+nfc_ndef_output_cb(void* data, struct nfc_device* nfc, size_t len, char* buf)
 {
-    const struct nfc_snep_param* param;
-    ssize_t remain;
-    char base64[3][512];
+    const struct nfc_ndef_output_param* param = data;
+    struct nfc_writer w = NFC_WRITER_INIT(NULL, buf, len);
 
-    param = data;
     assert(param);
 
-    remain = len;
+    if (write_ndef_msg(&w, param->ndef, param->len) < 0) {
+        return -1;
+    }
+    return w.off;
+}
+
+static ssize_t
+nfc_recv_process_ndef_cb(void* data, size_t len, const struct ndef_rec* ndef)
+{
+    struct nfc_device* nfc;
 
-    cb.log_msg("[");
+    nfc = data;
+    assert(nfc);
 
-    while (remain) {
-        size_t tlen, plen, ilen, reclen;
+    if (nfc->cb->output) {
+        /* count first, so the host gets the result in one piece */
+        struct nfc_writer w = NFC_WRITER_INIT(NULL, NULL, 0);
+        struct nfc_ndef_output_param output = {
+            .ndef = ndef,
+            .len = len
+        };
 
-        if (remain < (ssize_t)sizeof(*ndef)) {
-            return -1; /* too short */
+        if (write_ndef_msg(&w, ndef, len) < 0) {
+            nfc->cb->log_err("KO: malformed NDEF message\r\n");
+            return -1;
         }
-        tlen = encode_base64(ndef_rec_const_type(ndef),
-                             ndef_rec_type_len(ndef),
-                             base64[0], sizeof(base64[0]));
-        ilen = encode_base64(ndef_rec_const_id(ndef), ndef_rec_id_len(ndef),
-                             base64[1], sizeof(base64[1]));
-        plen = encode_base64(ndef_rec_const_payload(ndef),
-                             ndef_rec_payload_len(ndef),
-                             base64[2], sizeof(base64[2]));
-
-        /* print NDEF message in JSON format */
-        cb.log_msg("{\"tnf\": %d,"
-                   " \"type\": \"%.*s\","
-                   " \"id\": \"%.*s\","
-                   " \"payload\": \"%.*s\"}",
-                   ndef->flags & NDEF_TNF_BITS,
-                   tlen, base64[0], ilen, base64[1], plen, base64[2]);
+        if (nfc->cb->output(nfc, w.off, nfc_ndef_output_cb, &output) < 0) {
+            return -1;
+        }
+    } else {
+        struct nfc_writer w = NFC_WRITER_INIT(nfc->cb, NULL, 0);
 
-        /* advance record */
-        reclen = ndef_rec_len(ndef);
-        remain -= reclen;
-        ndef = (const struct ndef_rec*)(((const unsigned char*)ndef) + reclen);
-        if (remain) {
-          cb.log_msg(","); /* more to come */
+        if (write_ndef_msg(&w, ndef, len) < 0) {
+            nfc->cb->log_err("KO: malformed NDEF message\r\n");
+            return -1;
         }
     }
-    cb.log_msg("]\r\n");
     return 0;
 }
 
 static ssize_t
 nfc_recv_snep_put_cb(void* data,  struct nfc_device* nfc)
 {
-    struct nfc_snep_param* param;
+    const struct nfc_snep_param* param;
+    long dsap, ssap;
     ssize_t res;
 
     param = data;
     assert(param);
 
     if (!nfc->active_re) {
-        cb.log_err("KO: no active remote endpoint\r\n");
+        nfc->cb->log_err("KO: no active remote endpoint\r\n");
         return -1;
     }
-    if ((param->dsap < 0) && (param->ssap < 0)) {
-        param->dsap = nfc->active_re->last_dsap;
-        param->ssap = nfc->active_re->last_ssap;
+    dsap = param->dsap;
+    ssap = param->ssap;
+    if ((dsap < 0) && (ssap < 0)) {
+        dsap = nfc->active_re->last_dsap;
+        ssap = nfc->active_re->last_ssap;
     }
-    res = nfc_re_recv_snep_put(nfc->active_re, param->dsap, param->ssap,
-                               nfc_recv_process_ndef_cb, data);
+    res = nfc_re_recv_snep_put(nfc->active_re, dsap, ssap,
+                               nfc_recv_process_ndef_cb, nfc);
     if (res < 0) {
-        cb.log_err("KO: 'snep put' failed\r\n");
+        nfc->cb->log_err("KO: 'snep put' failed\r\n");
         return -1;
     }
     return 0;
 }
 
 static const char*
-lex_token(const char* field, const char* delim, char** args)
+lex_token(const struct nfcemu_cb* cb, const char* field, const char* delim,
+          char** args)
 {
     const char *tok;
 
@@ -259,27 +668,28 @@ lex_token(const char* field, const char* delim, char** args)
 
     tok = strsep(args, delim);
     if (!tok) {
-        cb.log_err("KO: no token %s given\r\n", field);
+        cb->log_err("KO: no token %s given\r\n", field);
         return NULL;
     }
     return tok;
 }
 
 static int
-parse_token_l(const char* field, const char* delim, char** args, long* val)
+parse_token_l(const struct nfcemu_cb* cb, const char* field, const char* delim,
+              char** args, long* val)
 {
     const char* tok;
 
     assert(val);
 
-    tok = lex_token(field, delim, args);
+    tok = lex_token(cb, field, delim, args);
     if (!tok) {
         return -1;
     }
     errno = 0;
     *val = strtol(tok, NULL, 0);
     if (errno) {
-        cb.log_err("KO: invalid value '%s' for token %s, error %d(%s)\r\n",
+        cb->log_err("KO: invalid value '%s' for token %s, error %d(%s)\r\n",
                    tok, field, errno, strerror(errno));
         return -1;
     }
@@ -287,21 +697,21 @@ parse_token_l(const char* field, const char* delim, char** args, long* val)
 }
 
 static int
-parse_token_ul(const char* field, const char* delim,
+parse_token_ul(const struct nfcemu_cb* cb, const char* field, const char* delim,
                char** args, unsigned long* val)
 {
     const char* tok;
 
     assert(val);
 
-    tok = lex_token(field, delim, args);
+    tok = lex_token(cb, field, delim, args);
     if (!tok) {
         return -1;
     }
     errno = 0;
     *val = strtoul(tok, NULL, 0);
     if (errno) {
-        cb.log_err("KO: invalid value '%s' for token %s, error %d(%s)\r\n",
+        cb->log_err("KO: invalid value '%s' for token %s, error %d(%s)\r\n",
                    tok, field, errno, strerror(errno));
         return -1;
     }
@@ -309,36 +719,37 @@ parse_token_ul(const char* field, const char* delim,
 }
 
 static int
-parse_token_s(const char* field, const char* delim,
+parse_token_s(const struct nfcemu_cb* cb, const char* field, const char* delim,
               char** args, const char** val, int allow_empty)
 {
     // TODO: we could add support for escaped characters, if necessary
 
     assert(val);
 
-    *val = lex_token(field, delim, args);
+    *val = lex_token(cb, field, delim, args);
     if (!*val) {
         return -1;
     }
     if (!allow_empty && !(*val)[0]) {
-        cb.log_err("KO: empty token %s\r\n", field);
+        cb->log_err("KO: empty token %s\r\n", field);
         return -1;
     }
     return 0;
 }
 
 static int
-parse_sap(const char* field, char** args, long* sap, int can_autodetect)
+parse_sap(const struct nfcemu_cb* cb, const char* field, char** args,
+          long* sap, int can_autodetect)
 {
     assert(args);
     assert(sap);
 
-    if (parse_token_l(field, " ", args, sap) < 0) {
+    if (parse_token_l(cb, field, " ", args, sap) < 0) {
         return -1;
     }
     if (((*sap == -1) && !can_autodetect) ||
          (*sap < -1) || !(*sap < LLCP_NUMBER_OF_SAPS)) {
-        cb.log_err("KO: invalid %s '%ld'\r\n",
+        cb->log_err("KO: invalid %s '%ld'\r\n",
                       field, *sap);
         return -1;
     }
@@ -350,7 +761,8 @@ parse_sap(const char* field, char** args, long* sap, int can_autodetect)
  * are given in base64url encoding.
  */
 static int
-parse_ndef_rec(char** args, struct nfc_ndef_record_param* record)
+parse_ndef_rec(const struct nfcemu_cb* cb, char** args,
+               struct nfc_ndef_record_param* record)
 {
     const char* p;
     unsigned long tnf;
@@ -361,199 +773,264 @@ parse_ndef_rec(char** args, struct nfc_ndef_record_param* record)
     /* read opening bracket */
     p = strsep(args, "[");
     if (!p) {
-        cb.log_err("KO: no NDEF record given\r\n");
+        cb->log_err("KO: no NDEF record given\r\n");
         return -1;
     }
     /* read flags */
-    if (parse_token_ul("NDEF flags", " ,", args, &record->flags) < 0) {
+    if (parse_token_ul(cb, "NDEF flags", " ,", args, &record->flags) < 0) {
         return -1;
     }
     if (record->flags & ~NDEF_FLAG_BITS) {
-        cb.log_err("KO: invalid NDEF flags '%u'\r\n",
+        cb->log_err("KO: invalid NDEF flags '%u'\r\n",
                       record->flags);
         return -1;
     }
     /* read TNF */
-    if (parse_token_ul("NDEF TNF", " ,", args, &tnf) < 0) {
+    if (parse_token_ul(cb, "NDEF TNF", " ,", args, &tnf) < 0) {
         return -1;
     }
     if (!(tnf < NDEF_NUMBER_OF_TNFS)) {
-        cb.log_err("KO: invalid NDEF TNF '%u'\r\n",
+        cb->log_err("KO: invalid NDEF TNF '%u'\r\n",
                    record->tnf);
         return -1;
     }
     record->tnf = tnf;
     /* read type */
-    if (parse_token_s("NDEF type", " ,", args, &record->type, 0) < 0) {
+    if (parse_token_s(cb, "NDEF type", " ,", args, &record->type, 0) < 0) {
         return -1;
     }
     /* read id; might by empty */
-    if (parse_token_s("NDEF id", " ,", args, &record->id, 1) < 0) {
+    if (parse_token_s(cb, "NDEF id", " ,", args, &record->id, 1) < 0) {
         return -1;
     }
     /* read payload */
-    if (parse_token_s("NDEF payload", "]", args, &record->payload, 0) < 0) {
+    if (parse_token_s(cb, "NDEF payload", "]", args, &record->payload, 0) < 0) {
         return -1;
     }
     return 0;
 }
 
+/* Parses any number of records into '*record'. Up to
+ * NFC_NDEF_STATIC_RECORDS records are stored in 'buf'; longer messages
+ * get an array that the caller frees with free_ndef_msg(). */
 static ssize_t
-parse_ndef_msg(char** args, size_t nrecs, struct nfc_ndef_record_param* rec)
+parse_ndef_msg(const struct nfcemu_cb* cb, char** args,
+               struct nfc_ndef_record_param* buf,
+               struct nfc_ndef_record_param** record)
 {
-    size_t i;
+    struct nfc_ndef_record_param* rec;
+    size_t i, nrecs;
 
     assert(args);
+    assert(buf);
+    assert(record);
 
-    for (i = 0; i < nrecs && *args && strlen(*args); ++i) {
-        if (parse_ndef_rec(args, rec+i) < 0) {
-          return -1;
+    rec = buf;
+    nrecs = NFC_NDEF_STATIC_RECORDS;
+
+    for (i = 0; *args && strlen(*args); ++i) {
+        if (i == nrecs) {
+            struct nfc_ndef_record_param* r;
+            nrecs *= 2;
+            r = realloc(rec != buf ? rec : NULL, nrecs * sizeof(*rec));
+            if (!r) {
+                cb->log_err("KO: out of memory\r\n");
+                goto err;
+            }
+            if (rec == buf) {
+                memcpy(r, buf, i * sizeof(*rec));
+            }
+            rec = r;
+        }
+        if (parse_ndef_rec(cb, args, rec+i) < 0) {
+            goto err;
         }
     }
-    if (*args && strlen(*args)) {
-        cb.log_err("KO: invalid characters near EOL: %s\r\n",
-                   *args);
-        return -1;
-    }
+    *record = rec;
     return i;
+err:
+    if (rec != buf) {
+        free(rec);
+    }
+    return -1;
+}
+
+static void
+free_ndef_msg(struct nfc_ndef_record_param* buf,
+              struct nfc_ndef_record_param* record)
+{
+    if (record != buf) {
+        free(record);
+    }
 }
 
+/* REs can be added and removed, so the index is only checked by
+ * find_re() when the command runs on the device. */
 static int
-parse_re_index(char** args, unsigned long nres, unsigned long* i)
+parse_re_index(const struct nfcemu_cb* cb, char** args, unsigned long* i)
 {
     assert(i);
 
-    if (parse_token_ul("remote endpoint", " ", args, i) < 0) {
-        return -1;
-    }
-    if (!(*i < nres)) {
-        cb.log_err("KO: unknown remote endpoint %lu\r\n", *i);
-        return -1;
+    return parse_token_ul(cb, "remote endpoint", " ", args, i);
+}
+
+static struct nfc_re*
+find_re(const struct nfcemu_cb* cb, const struct nfc_device* nfc,
+        unsigned long i)
+{
+    struct nfc_re* re = nfc_device_get_re(nfc, i);
+
+    if (!re) {
+        cb->log_err("KO: unknown remote endpoint %lu\r\n", i);
     }
-    return 0;
+    return re;
 }
 
 static int
-parse_nci_ntf_type(char** args, unsigned long* ntype)
+parse_nci_ntf_type(const struct nfcemu_cb* cb, char** args,
+                   unsigned long* ntype)
 {
     assert(ntype);
 
-    if (parse_token_ul("discover notification type", " ", args, ntype) < 0) {
+    if (parse_token_ul(cb, "discover notification type", " ", args, ntype) < 0) {
         return -1;
     }
     if (!(*ntype < NUMBER_OF_NCI_NOTIFICATION_TYPES)) {
-        cb.log_err("KO: unknown discover notification type %lu\r\n", *ntype);
+        cb->log_err("KO: unknown discover notification type %lu\r\n", *ntype);
         return -1;
     }
     return 0;
 }
 
 static int
-parse_rf_index(char** args, long* rf)
+parse_rf_index(const struct nfcemu_cb* cb, char** args, long* rf)
 {
     assert(rf);
 
-    if (parse_token_l("rf index", " ", args, rf) < 0) {
+    if (parse_token_l(cb, "rf index", " ", args, rf) < 0) {
         return -1;
     }
     if (*rf < -1 || *rf >= NUMBER_OF_SUPPORTED_NCI_RF_INTERFACES) {
-        cb.log_err("KO: unknown rf index %lu\r\n", *rf);
+        cb->log_err("KO: unknown rf index %lu\r\n", *rf);
         return -1;
     }
     return 0;
 }
 
 static int
-parse_nci_deactivate_ntf_type(char** args, unsigned long* dtype)
+parse_nci_deactivate_ntf_type(const struct nfcemu_cb* cb, char** args,
+                              unsigned long* dtype)
 {
     assert(dtype);
 
-    if (parse_token_ul("deactivate notification type", " ", args, dtype) < 0) {
+    if (parse_token_ul(cb, "deactivate notification type", " ", args, dtype) < 0) {
         return -1;
     }
     if (!(*dtype < NUMBER_OF_NCI_RF_DEACT_TYPE)) {
-        cb.log_err("KO: unknown deactivate notification type %lu\r\n", *dtype);
+        cb->log_err("KO: unknown deactivate notification type %lu\r\n", *dtype);
         return -1;
     }
     return 0;
 }
 
 static int
-parse_nci_deactivate_ntf_reason(char** args, unsigned long* dreason)
+parse_nci_deactivate_ntf_reason(const struct nfcemu_cb* cb, char** args,
+                                unsigned long* dreason)
 {
     assert(dreason);
 
-    if (parse_token_ul("deactivate notification reason", " ", args, dreason) < 0) {
+    if (parse_token_ul(cb, "deactivate notification reason", " ", args, dreason) < 0) {
         return -1;
     }
     if (!(*dreason < NUMBER_OF_NCI_RF_DEACT_REASON)) {
-        cb.log_err("KO: unknown deactivate notification reason %lu\r\n", *dreason);
+        cb->log_err("KO: unknown deactivate notification reason %lu\r\n", *dreason);
         return -1;
     }
     return 0;
 }
 
-int
-nfc_cmd_snep(char* args)
+static int
+cmd_snep(const struct nfcemu_cb* cb, char* args, struct nfc_cmd* cmd)
 {
     char *p;
 
     if (!args) {
-        cb.log_err("KO: no arguments given\r\n");
+        cb->log_err("KO: no arguments given\r\n");
         return -1;
     }
 
     p = strsep(&args, " ");
     if (!p) {
-        cb.log_err("KO: no operation given\r\n");
+        cb->log_err("KO: no operation given\r\n");
         return -1;
     }
     if (!strcmp(p, "put")) {
-        ssize_t nrecords;
-        struct nfc_snep_param param = NFC_SNEP_PARAM_INIT();
+        ssize_t nrecords, len;
+        struct nfc_ndef_record_param buf[NFC_NDEF_STATIC_RECORDS];
+        struct nfc_ndef_record_param* record;
+        struct nfc_snep_param param = NFC_SNEP_PARAM_INIT(cb);
+        int res;
 
         /* read DSAP */
-        if (parse_sap("DSAP", &args, &param.dsap, 1) < 0) {
+        if (parse_sap(cb, "DSAP", &args, &param.dsap, 1) < 0) {
             return -1;
         }
         /* read SSAP */
-        if (parse_sap("SSAP", &args, &param.ssap, 1) < 0) {
+        if (parse_sap(cb, "SSAP", &args, &param.ssap, 1) < 0) {
             return -1;
         }
-        /* The emulator supports up to 4 records per NDEF
-         * message. If no records are given, the emulator
-         * will print the current content of the LLCP data-
-         * link buffer.
+        /* If no records are given, the emulator will print
+         * the current content of the LLCP data-link buffer.
          */
-        nrecords = parse_ndef_msg(&args, ARRAY_SIZE(param.record),
-                                  param.record);
+        nrecords = parse_ndef_msg(cb, &args, buf, &record);
         if (nrecords < 0) {
             return -1;
         }
-        param.nrecords = nrecords;
-        if (param.nrecords) {
+        if (cmd->compiled) {
+            /* the records don't outlive this function */
+            len = compile_ndef_msg(cb, record, nrecords,
+                                   SNEP_MAX_MSG_LENGTH - sizeof(struct snep),
+                                   cmd);
+            param.ndef = cmd->ndef;
+        } else {
+            len = limit_ndef_msg_len(cb, record, nrecords,
+                                     SNEP_MAX_MSG_LENGTH -
+                                        sizeof(struct snep));
+            param.record = record;
+            param.nrecords = nrecords;
+        }
+        if (len < 0) {
+            res = -1;
+        } else if (nrecords) {
+            param.len = len;
             /* put SNEP request onto SNEP server */
-            if (cb.send_dta(nfc_send_snep_put_cb, &param) < 0) {
-                /* error message generated in create function */
-                return -1;
-            }
+            res = submit_packet_cmd(cmd, NFC_CMD_SEND_DTA,
+                                    nfc_send_snep_put_cb,
+                                    &param, sizeof(param));
         } else {
             /* put SNEP request onto SNEP server */
-            if (cb.recv_dta(nfc_recv_snep_put_cb, &param) < 0) {
-                /* error message generated in create function */
-                return -1;
-            }
+            res = submit_device_cmd(cmd, NFC_CMD_RECV_DTA,
+                                    nfc_recv_snep_put_cb,
+                                    &param, sizeof(param));
+        }
+        free_ndef_msg(buf, record);
+        if (res < 0) {
+            return -1;
         }
     } else {
-        cb.log_err("KO: invalid operation '%s'\r\n", p);
+        cb->log_err("KO: invalid operation '%s'\r\n", p);
         return -1;
     }
 
     return 0;
 }
 
+/* Remote endpoints are given by index, so they can be looked up
+ * in whichever device the notification gets delivered to. An index
+ * of -1 selects the device's active RE.
+ */
 struct nfc_ntf_param {
-    struct nfc_re* re;
+    long re;
     unsigned long ntype;
     long rf;
     unsigned long dreason;
@@ -562,7 +1039,7 @@ struct nfc_ntf_param {
 
 #define NFC_NTF_PARAM_INIT() \
     { \
-      .re = NULL, \
+      .re = -1, \
       .ntype = 0, \
       .rf = -1, \
       .dreason = 0, \
@@ -576,9 +1053,13 @@ nfc_rf_discovery_ntf_cb(void* data,
 {
     ssize_t res;
     const struct nfc_ntf_param* param = data;
-    res = nfc_create_rf_discovery_ntf(param->re, param->ntype, nfc, ntf);
+    struct nfc_re* re = find_re(nfc->cb, nfc, param->re);
+    if (!re) {
+        return -1;
+    }
+    res = nfc_create_rf_discovery_ntf(re, param->ntype, nfc, ntf);
     if (res < 0) {
-        cb.log_err("KO: rf_discover_ntf failed\r\n");
+        nfc->cb->log_err("KO: rf_discover_ntf failed\r\n");
         return -1;
     }
     return res;
@@ -590,33 +1071,39 @@ nfc_rf_intf_activated_ntf_cb(void* data,
                              union nci_packet* ntf)
 {
     ssize_t res;
+    struct nfc_re* re;
     struct nfc_ntf_param* param = data;
-    if (!param->re) {
+    if (param->re < 0) {
         if (!nfc->active_re) {
-            cb.log_err("KO: no active remote-endpoint\n");
+            nfc->cb->log_err("KO: no active remote-endpoint\n");
+            return -1;
+        }
+        re = nfc->active_re;
+    } else {
+        re = find_re(nfc->cb, nfc, param->re);
+        if (!re) {
             return -1;
         }
-        param->re = nfc->active_re;
     }
-    nfc_clear_re(param->re);
+    nfc_clear_re(re);
     if (nfc->active_rf) {
         // Already select an active rf interface,so do nothing.
     } else if (param->rf == -1) {
         // Auto select active rf interface based on remote-endpoint protocol and mode.
         nfc->active_rf = nfc_find_rf_by_protocol_and_mode(nfc,
-                                                          param->re->rfproto,
-                                                          param->re->mode);
+                                                          re->rfproto,
+                                                          re->mode);
         if (!nfc->active_rf) {
-            cb.log_err("KO: no active rf interface\r\n");
+            nfc->cb->log_err("KO: no active rf interface\r\n");
             return -1;
         }
     } else {
         nfc->active_rf = nfc->rf + param->rf;
     }
 
-    res = nfc_create_rf_intf_activated_ntf(param->re, nfc, ntf);
+    res = nfc_create_rf_intf_activated_ntf(re, nfc, ntf);
     if (res < 0) {
-        cb.log_err("KO: rf_intf_activated_ntf failed\r\n");
+        nfc->cb->log_err("KO: rf_intf_activated_ntf failed\r\n");
         return -1;
     }
     return res;
@@ -635,45 +1122,138 @@ nfc_rf_intf_deactivate_ntf_cb(void* data,
 
     res = nfc_create_deactivate_ntf(param->dtype, param->dreason, ntf);
     if (res < 0) {
-        cb.log_err("KO: rf_intf_deactivate_ntf failed\r\n");
+        nfc->cb->log_err("KO: rf_intf_deactivate_ntf failed\r\n");
         return -1;
     }
     return res;
 }
 
-int
-nfc_cmd_nci(char*  args)
+/* REs for a batch of RF_DISCOVER_NTFs; all REs if none are given */
+struct nfc_discovery_ntfs_param {
+    size_t nres;
+    unsigned long re[NFC_MAXIMUM_RE_ID];
+};
+
+#define NFC_DISCOVERY_NTFS_PARAM_INIT() \
+    { \
+        .nres = 0 \
+    }
+
+static ssize_t
+nfc_discovery_ntfs_cb(void* data, struct nfc_device* nfc)
+{
+    const struct nfc_discovery_ntfs_param* param = data;
+    struct nfc_re* re[NFC_MAXIMUM_RE_ID];
+    size_t i, j, nres;
+
+    assert(param);
+    assert(nfc);
+
+    nres = 0;
+
+    if (param->nres) {
+        for (i = 0; i < param->nres; ++i) {
+            struct nfc_re* r = find_re(nfc->cb, nfc, param->re[i]);
+            if (!r) {
+                return -1;
+            }
+            /* drop duplicates */
+            for (j = 0; (j < nres) && (re[j] != r); ++j) { }
+            if (j == nres) {
+                re[nres++] = r;
+            }
+        }
+    } else {
+        /* there are no more ids than that in a single cycle */
+        nres = nfc_device_get_undiscovered_res(nfc, re, ARRAY_SIZE(re));
+    }
+
+    if (nfc_send_rf_discovery_ntfs(nfc, re, nres) < 0) {
+        nfc->cb->log_err("KO: rf_discover_ntfs failed\r\n");
+        return -1;
+    }
+    return 0;
+}
+
+struct nfc_credits_param {
+    unsigned long ncredits;
+};
+
+#define NFC_CREDITS_PARAM_INIT() \
+    { \
+        .ncredits = NCI_DTA_CREDITS_UNLIMITED \
+    }
+
+static ssize_t
+nfc_credits_cb(void* data, struct nfc_device* nfc)
+{
+    const struct nfc_credits_param* param = data;
+
+    assert(param);
+    assert(nfc);
+
+    if (nfc_set_dta_credits(nfc, param->ncredits) < 0) {
+        nfc->cb->log_err("KO: invalid number of credits\r\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+cmd_nci(const struct nfcemu_cb* cb, char* args, struct nfc_cmd* cmd)
 {
     char *p;
 
     if (!args) {
-        cb.log_err("KO: no arguments given\r\n");
+        cb->log_err("KO: no arguments given\r\n");
         return -1;
     }
 
     /* read notification type */
     p = strsep(&args, " ");
     if (!p) {
-        cb.log_err("KO: no operation given\r\n");
+        cb->log_err("KO: no operation given\r\n");
         return -1;
     }
     if (!strcmp(p, "rf_discover_ntf")) {
         unsigned long i;
         struct nfc_ntf_param param = NFC_NTF_PARAM_INIT();
         /* read remote-endpoint index */
-        if (parse_re_index(&args, ARRAY_SIZE(nfc_res), &i) < 0) {
+        if (parse_re_index(cb, &args, &i) < 0) {
             return -1;
         }
-        param.re = nfc_res + i;
+        param.re = i;
 
         /* read discover notification type */
-        if (parse_nci_ntf_type(&args, &param.ntype) < 0) {
+        if (parse_nci_ntf_type(cb, &args, &param.ntype) < 0) {
             return -1;
         }
 
         /* generate RF_DISCOVER_NTF */
-        if (cb.send_ntf(nfc_rf_discovery_ntf_cb, &param) < 0) {
-            /* error message generated in create function */
+        if (submit_packet_cmd(cmd, NFC_CMD_SEND_NTF, nfc_rf_discovery_ntf_cb,
+                              &param, sizeof(param)) < 0) {
+            return -1;
+        }
+    } else if (!strcmp(p, "rf_discover_ntfs")) {
+        struct nfc_discovery_ntfs_param param =
+            NFC_DISCOVERY_NTFS_PARAM_INIT();
+
+        /* read remote-endpoint indices */
+        while (args && *args) {
+            if (param.nres == ARRAY_SIZE(param.re)) {
+                cb->log_err("KO: more than %zu remote endpoints given\r\n",
+                            ARRAY_SIZE(param.re));
+                return -1;
+            }
+            if (parse_re_index(cb, &args, param.re + param.nres) < 0) {
+                return -1;
+            }
+            ++param.nres;
+        }
+
+        /* generate the complete sequence of RF_DISCOVER_NTFs */
+        if (submit_device_cmd(cmd, NFC_CMD_RUN, nfc_discovery_ntfs_cb, &param,
+                              sizeof(param)) < 0) {
             return -1;
         }
     } else if (!strcmp(p, "rf_intf_activated_ntf")) {
@@ -681,50 +1261,63 @@ nfc_cmd_nci(char*  args)
         if (args && *args) {
             unsigned long i;
             /* read remote-endpoint index */
-            if (parse_re_index(&args, ARRAY_SIZE(nfc_res), &i) < 0) {
+            if (parse_re_index(cb, &args, &i) < 0) {
                 return -1;
             }
-            param.re = nfc_res + i;
+            param.re = i;
 
             if (args && *args) {
                 /* read rf interface index */
-                if (parse_rf_index(&args, &param.rf) < 0) {
+                if (parse_rf_index(cb, &args, &param.rf) < 0) {
                     return -1;
                 }
             } else {
                 param.rf = -1;
             }
         } else {
-            param.re = NULL;
+            param.re = -1;
             param.rf = -1;
         }
-        /* generate RF_INTF_ACTIVATED_NTF; if param.re == NULL,
+        /* generate RF_INTF_ACTIVATED_NTF; if param.re == -1,
          * active RE will be used */
-        if (cb.send_ntf(nfc_rf_intf_activated_ntf_cb, &param) < 0) {
-            /* error message generated in create function */
+        if (submit_packet_cmd(cmd, NFC_CMD_SEND_NTF,
+                              nfc_rf_intf_activated_ntf_cb, &param,
+                              sizeof(param)) < 0) {
             return -1;
         }
     } else if (!strcmp(p, "rf_intf_deactivate_ntf")) {
         struct nfc_ntf_param param = NFC_NTF_PARAM_INIT();
         if (args && *args) {
             /* read deactivate ntf type */
-            if (parse_nci_deactivate_ntf_type(&args, &param.dtype) < 0) {
+            if (parse_nci_deactivate_ntf_type(cb, &args, &param.dtype) < 0) {
                 return -1;
             }
             /* read deactivate ntf reason */
-            if (parse_nci_deactivate_ntf_reason(&args, &param.dreason) < 0) {
+            if (parse_nci_deactivate_ntf_reason(cb, &args, &param.dreason) < 0) {
                 return -1;
             }
         } else {
             param.dtype = NCI_RF_DEACT_DISCOVERY;
             param.dreason = NCI_RF_DEACT_RF_LINK_LOSS;
         }
-        if (cb.send_ntf(nfc_rf_intf_deactivate_ntf_cb, &param) < 0) {
-            /* error message generated in create function */
+        if (submit_packet_cmd(cmd, NFC_CMD_SEND_NTF,
+                              nfc_rf_intf_deactivate_ntf_cb, &param,
+                              sizeof(param)) < 0) {
+            return -1;
+        }
+    } else if (!strcmp(p, "credits")) {
+        struct nfc_credits_param param = NFC_CREDITS_PARAM_INIT();
+
+        /* read number of credits; 255 disables flow control */
+        if (parse_token_ul(cb, "credits", " ", &args, &param.ncredits) < 0) {
+            return -1;
+        }
+        if (submit_device_cmd(cmd, NFC_CMD_RUN, nfc_credits_cb, &param,
+                              sizeof(param)) < 0) {
             return -1;
         }
     } else {
-        cb.log_err("KO: invalid operation '%s'\r\n", p);
+        cb->log_err("KO: invalid operation '%s'\r\n", p);
         return -1;
     }
 
@@ -746,145 +1339,954 @@ static ssize_t
 nfc_llcp_connect_cb(void* data, struct nfc_device* nfc, size_t maxlen,
                     union nci_packet* packet)
 {
-    struct nfc_llcp_param* param = data;
+    const struct nfc_llcp_param* param = data;
+    long dsap, ssap;
     ssize_t res;
 
     if (!nfc->active_re) {
-        cb.log_err("KO: no active remote endpoint\n");
+        nfc->cb->log_err("KO: no active remote endpoint\n");
         return -1;
     }
-    if ((param->dsap < 0) && (param->ssap < 0)) {
-        param->dsap = nfc->active_re->last_dsap;
-        param->ssap = nfc->active_re->last_ssap;
+    dsap = param->dsap;
+    ssap = param->ssap;
+    if ((dsap < 0) && (ssap < 0)) {
+        dsap = nfc->active_re->last_dsap;
+        ssap = nfc->active_re->last_ssap;
     }
-    if (!param->dsap) {
-        cb.log_err("KO: DSAP is 0\r\n");
+    if (!dsap) {
+        nfc->cb->log_err("KO: DSAP is 0\r\n");
         return -1;
     }
-    if (!param->ssap) {
-        cb.log_err("KO: SSAP is 0\r\n");
+    if (!ssap) {
+        nfc->cb->log_err("KO: SSAP is 0\r\n");
         return -1;
     }
-    res = nfc_re_send_llcp_connect(nfc->active_re, param->dsap, param->ssap);
+    res = nfc_re_send_llcp_connect(nfc->active_re, dsap, ssap);
     if (res < 0) {
-        cb.log_err("KO: LLCP connect failed\r\n");
+        nfc->cb->log_err("KO: LLCP connect failed\r\n");
         return -1;
     }
     return 0;
 }
 
-int
-nfc_cmd_llcp(char* args)
-{
-    char *p;
+struct nfc_llcp_timing_param {
+    unsigned long re;
+    unsigned long lto;
+    unsigned long symm_delay;
+    unsigned long adaptive;
+};
 
-    if (!args) {
-        cb.log_err("KO: no arguments given\r\n");
+#define NFC_LLCP_TIMING_PARAM_INIT() \
+    { \
+        .re = 0, \
+        .lto = LLCP_DEFAULT_LTO, \
+        .symm_delay = LLCP_DEFAULT_SYMM_DELAY, \
+        .adaptive = 0 \
+    }
+
+static ssize_t
+nfc_llcp_timing_cb(void* data, struct nfc_device* nfc)
+{
+    const struct nfc_llcp_timing_param* param = data;
+    struct nfc_re* re;
+    ssize_t res;
+
+    assert(param);
+    assert(nfc);
+
+    re = find_re(nfc->cb, nfc, param->re);
+    if (!re) {
+        return -1;
+    }
+    res = nfc_re_set_llcp_timing(re, param->lto, param->symm_delay,
+                                 param->adaptive);
+    if (res < 0) {
+        nfc->cb->log_err("KO: invalid LLCP timing\r\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+cmd_llcp(const struct nfcemu_cb* cb, char* args, struct nfc_cmd* cmd)
+{
+    char *p;
+
+    if (!args) {
+        cb->log_err("KO: no arguments given\r\n");
         return -1;
     }
 
     p = strsep(&args, " ");
     if (!p) {
-        cb.log_err("KO: no operation given\r\n");
+        cb->log_err("KO: no operation given\r\n");
         return -1;
     }
     if (!strcmp(p, "connect")) {
         struct nfc_llcp_param param = NFC_LLCP_PARAM_INIT();
 
         /* read DSAP */
-        if (parse_sap("DSAP", &args, &param.dsap, 1) < 0) {
+        if (parse_sap(cb, "DSAP", &args, &param.dsap, 1) < 0) {
             return -1;
         }
         /* read SSAP */
-        if (parse_sap("SSAP", &args, &param.ssap, 1) < 0) {
+        if (parse_sap(cb, "SSAP", &args, &param.ssap, 1) < 0) {
+            return -1;
+        }
+        if (submit_packet_cmd(cmd, NFC_CMD_SEND_DTA, nfc_llcp_connect_cb,
+                              &param, sizeof(param)) < 0) {
+            return -1;
+        }
+    } else if (!strcmp(p, "timing")) {
+        struct nfc_llcp_timing_param param = NFC_LLCP_TIMING_PARAM_INIT();
+
+        /* read remote-endpoint index */
+        if (parse_re_index(cb, &args, &param.re) < 0) {
+            return -1;
+        }
+        /* read LTO and SYMM delay in ms, and adaptive flag */
+        if (parse_token_ul(cb, "LTO", " ", &args, &param.lto) < 0) {
+            return -1;
+        }
+        if (parse_token_ul(cb, "SYMM delay", " ", &args,
+                           &param.symm_delay) < 0) {
             return -1;
         }
-        if (cb.send_dta(nfc_llcp_connect_cb, &param) < 0) {
-            /* error message generated in create function */
+        if (args && *args &&
+            (parse_token_ul(cb, "adaptive", " ", &args,
+                            &param.adaptive) < 0)) {
+            return -1;
+        }
+        if (submit_device_cmd(cmd, NFC_CMD_RUN, nfc_llcp_timing_cb, &param,
+                              sizeof(param)) < 0) {
             return -1;
         }
     } else {
-        cb.log_err("KO: invalid operation '%s'\r\n", p);
+        cb->log_err("KO: invalid operation '%s'\r\n", p);
         return -1;
     }
 
     return 0;
 }
 
-int
-nfc_cmd_tag(char* args)
+struct nfc_tag_param {
+    unsigned long re;
+    const uint8_t* data;
+    ssize_t len;
+    unsigned long max_read;
+    unsigned long max_write;
+    int (*func)(struct nfc_device*, struct nfc_tag*,
+                const struct nfc_tag_param*);
+};
+
+#define NFC_TAG_PARAM_INIT() \
+    { \
+        .re = 0, \
+        .data = NULL, \
+        .len = 0, \
+        .max_read = 0, \
+        .max_write = 0, \
+        .func = NULL \
+    }
+
+static ssize_t
+nfc_tag_cb(void* data, struct nfc_device* nfc)
+{
+    const struct nfc_tag_param* param = data;
+    struct nfc_re* re;
+
+    assert(param);
+    assert(nfc);
+
+    re = find_re(nfc->cb, nfc, param->re);
+    if (!re) {
+        return -1;
+    }
+    if (!re->tag) {
+        nfc->cb->log_err("KO: remote endpoint is not a tag\r\n");
+        return -1;
+    }
+    if (param->func(nfc, re->tag, param) < 0) {
+        nfc->cb->log_err("KO: tag operation failed\r\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+set_tag_data(struct nfc_device* nfc, struct nfc_tag* tag,
+             const struct nfc_tag_param* param)
+{
+    return nfc_tag_cache_set_data(&nfc->tag_cache, tag, param->data,
+                                  param->len);
+}
+
+static int
+format_tag(struct nfc_device* nfc, struct nfc_tag* tag,
+           const struct nfc_tag_param* param)
+{
+    return nfc_tag_format(tag);
+}
+
+static int
+resize_tag(struct nfc_device* nfc, struct nfc_tag* tag,
+           const struct nfc_tag_param* param)
+{
+    return nfc_tag_resize(tag, param->len);
+}
+
+static int
+set_tag_limits(struct nfc_device* nfc, struct nfc_tag* tag,
+               const struct nfc_tag_param* param)
+{
+    return nfc_tag_set_limits(tag, param->max_read, param->max_write);
+}
+
+static int
+cmd_tag(const struct nfcemu_cb* cb, char* args, struct nfc_cmd* cmd)
 {
     char *p;
+    struct nfc_tag_param param = NFC_TAG_PARAM_INIT();
 
     if (!args) {
-        cb.log_err("KO: no arguments given\r\n");
+        cb->log_err("KO: no arguments given\r\n");
         return -1;
     }
 
     p = strsep(&args, " ");
     if (!p) {
-        cb.log_err("KO: no operation given\r\n");
+        cb->log_err("KO: no operation given\r\n");
         return -1;
     }
     if (!strcmp(p, "set")) {
-        unsigned long i;
-        ssize_t res;
         ssize_t nrecords;
-        struct nfc_ndef_record_param record[4];
-        struct nfc_re* re;
-        uint8_t buf[MAXIMUM_SUPPORTED_TAG_SIZE];
+        struct nfc_ndef_record_param buf[NFC_NDEF_STATIC_RECORDS];
+        struct nfc_ndef_record_param* record;
 
         /* read remote-endpoint index */
-        if (parse_re_index(&args, ARRAY_SIZE(nfc_res), &i) < 0) {
+        if (parse_re_index(cb, &args, &param.re) < 0) {
             return -1;
         }
-        re = nfc_res + i;
 
-        if (!re->tag) {
-            cb.log_err("KO: remote endpoint is not a tag\r\n");
+        nrecords = parse_ndef_msg(cb, &args, buf, &record);
+        if (nrecords < 0) {
             return -1;
         }
 
-        nrecords = parse_ndef_msg(&args, ARRAY_SIZE(record), record);
-        if (nrecords < 0) {
+        param.len = compile_ndef_msg(cb, record, nrecords,
+                                     MAXIMUM_SUPPORTED_TAG_SIZE, cmd);
+        free_ndef_msg(buf, record);
+        if (param.len < 0) {
             return -1;
         }
+        param.data = cmd->ndef;
+        param.func = set_tag_data;
 
-        res = build_ndef_msg(record, nrecords, buf, ARRAY_SIZE(buf));
-        if (res < 0) {
+        if (submit_device_cmd(cmd, NFC_CMD_RUN, nfc_tag_cb, &param,
+                              sizeof(param)) < 0) {
             return -1;
         }
+    } else if (!strcmp(p, "clear")) {
+        /* read remote-endpoint index */
+        if (parse_re_index(cb, &args, &param.re) < 0) {
+            return -1;
+        }
+        param.func = set_tag_data;
 
-        if (nfc_tag_set_data(re->tag, buf, res) < 0) {
+        if (submit_device_cmd(cmd, NFC_CMD_RUN, nfc_tag_cb, &param,
+                              sizeof(param)) < 0) {
             return -1;
         }
-    } else if (!strcmp(p, "clear")) {
-        unsigned long i;
-        struct nfc_re* re;
+    } else if (!strcmp(p, "format")) {
+        /* read remote-endpoint index */
+        if (parse_re_index(cb, &args, &param.re) < 0) {
+            return -1;
+        }
+        param.func = format_tag;
+
+        if (submit_device_cmd(cmd, NFC_CMD_RUN, nfc_tag_cb, &param,
+                              sizeof(param)) < 0) {
+            return -1;
+        }
+    } else if (!strcmp(p, "size")) {
+        unsigned long size;
 
         /* read remote-endpoint index */
-        if (parse_re_index(&args, ARRAY_SIZE(nfc_res), &i) < 0) {
+        if (parse_re_index(cb, &args, &param.re) < 0) {
             return -1;
         }
-        re = nfc_res + i;
+        /* read size of the data area; 0 selects the default */
+        if (parse_token_ul(cb, "size", " ", &args, &size) < 0) {
+            return -1;
+        }
+        if (size > MAXIMUM_SUPPORTED_TAG_SIZE) {
+            cb->log_err("KO: tag size %lu exceeds %d bytes\r\n", size,
+                        MAXIMUM_SUPPORTED_TAG_SIZE);
+            return -1;
+        }
+        param.len = size;
+        param.func = resize_tag;
 
-        if (nfc_tag_set_data(re->tag, NULL, 0) < 0) {
+        if (submit_device_cmd(cmd, NFC_CMD_RUN, nfc_tag_cb, &param,
+                              sizeof(param)) < 0) {
             return -1;
         }
-    } else if (!strcmp(p, "format")) {
-        unsigned long i;
-        struct nfc_re* re;
+    } else if (!strcmp(p, "limits")) {
+        /* read remote-endpoint index */
+        if (parse_re_index(cb, &args, &param.re) < 0) {
+            return -1;
+        }
+        /* read maximum per READ and WRITE command; blocks for T3T,
+         * bytes for T4T */
+        if (parse_token_ul(cb, "read limit", " ", &args,
+                           &param.max_read) < 0) {
+            return -1;
+        }
+        if (parse_token_ul(cb, "write limit", " ", &args,
+                           &param.max_write) < 0) {
+            return -1;
+        }
+        param.func = set_tag_limits;
+
+        if (submit_device_cmd(cmd, NFC_CMD_RUN, nfc_tag_cb, &param,
+                              sizeof(param)) < 0) {
+            return -1;
+        }
+    } else {
+        cb->log_err("KO: invalid operation '%s'\r\n", p);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Remote endpoints
+ */
+
+struct nfc_re_param {
+    unsigned long re;
+    enum nci_rf_protocol rfproto;
+};
+
+#define NFC_RE_PARAM_INIT() \
+    { \
+        .re = 0, \
+        .rfproto = NCI_RF_PROTOCOL_NFC_DEP \
+    }
+
+static ssize_t
+nfc_re_add_cb(void* data, struct nfc_device* nfc)
+{
+    const struct nfc_re_param* param = data;
+    ssize_t i;
+
+    assert(param);
+    assert(nfc);
+
+    i = nfc_device_add_re(nfc, param->rfproto, NULL, NULL);
+    if (i < 0) {
+        nfc->cb->log_err("KO: could not add remote endpoint\r\n");
+        return -1;
+    }
+    nfc->cb->log_msg("%zd\r\n", i);
+
+    return 0;
+}
+
+static ssize_t
+nfc_re_remove_cb(void* data, struct nfc_device* nfc)
+{
+    const struct nfc_re_param* param = data;
+
+    assert(param);
+    assert(nfc);
+
+    if (!find_re(nfc->cb, nfc, param->re)) {
+        return -1;
+    }
+    if (nfc_device_remove_re(nfc, param->re) < 0) {
+        nfc->cb->log_err("KO: remote endpoint %lu is active\r\n",
+                           param->re);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+parse_rf_protocol(const struct nfcemu_cb* cb, char** args,
+                  enum nci_rf_protocol* rfproto)
+{
+    static const struct {
+        const char* name;
+        enum nci_rf_protocol rfproto;
+    } protocol[] = {
+        { "nfc-dep", NCI_RF_PROTOCOL_NFC_DEP },
+        { "t1t", NCI_RF_PROTOCOL_T1T },
+        { "t2t", NCI_RF_PROTOCOL_T2T },
+        { "t3t", NCI_RF_PROTOCOL_T3T },
+        { "t4t", NCI_RF_PROTOCOL_ISO_DEP }
+    };
+    char* p;
+    size_t i;
+
+    assert(rfproto);
+
+    p = strsep(args, " ");
+    if (!p) {
+        cb->log_err("KO: no RF protocol given\r\n");
+        return -1;
+    }
+    for (i = 0; i < ARRAY_SIZE(protocol); ++i) {
+        if (!strcmp(p, protocol[i].name)) {
+            *rfproto = protocol[i].rfproto;
+            return 0;
+        }
+    }
+    cb->log_err("KO: unknown RF protocol '%s'\r\n", p);
+    return -1;
+}
+
+static int
+cmd_re(const struct nfcemu_cb* cb, char* args, struct nfc_cmd* cmd)
+{
+    char *p;
+    struct nfc_re_param param = NFC_RE_PARAM_INIT();
+
+    if (!args) {
+        cb->log_err("KO: no arguments given\r\n");
+        return -1;
+    }
 
+    p = strsep(&args, " ");
+    if (!p) {
+        cb->log_err("KO: no operation given\r\n");
+        return -1;
+    }
+    if (!strcmp(p, "add")) {
+        /* read RF protocol; the new RE's index is printed */
+        if (parse_rf_protocol(cb, &args, &param.rfproto) < 0) {
+            return -1;
+        }
+        if (submit_device_cmd(cmd, NFC_CMD_RUN, nfc_re_add_cb, &param,
+                              sizeof(param)) < 0) {
+            return -1;
+        }
+    } else if (!strcmp(p, "remove")) {
         /* read remote-endpoint index */
-        if (parse_re_index(&args, ARRAY_SIZE(nfc_res), &i) < 0) {
+        if (parse_re_index(cb, &args, &param.re) < 0) {
+            return -1;
+        }
+        if (submit_device_cmd(cmd, NFC_CMD_RUN, nfc_re_remove_cb, &param,
+                              sizeof(param)) < 0) {
             return -1;
         }
-        re = nfc_res + i;
+    } else {
+        cb->log_err("KO: invalid operation '%s'\r\n", p);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Secure element
+ */
+
+/* Decodes all base64url arguments into a buffer that the command
+ * owns. Each field is prefixed with its length in 2 bytes. Returns
+ * the number of fields. */
+static ssize_t
+compile_base64_fields(const struct nfcemu_cb* cb, const char* args,
+                      struct nfc_cmd* cmd, size_t* len)
+{
+    static const char delim[] = " ";
+    const char* p;
+    size_t n, off, flen;
+
+    assert(cmd);
+    assert(!cmd->ndef);
+    assert(len);
+
+    if (!args) {
+        args = "";
+    }
+
+    /* count first, so that the buffer is of the exact size */
+    for (n = 0, off = 0, p = args + strspn(args, delim); *p;
+         p += flen, p += strspn(p, delim), ++n) {
+        flen = strcspn(p, delim);
+        off += 2 + decode_base64_len(p, flen);
+    }
+    if (!n) {
+        return 0;
+    }
+    cmd->ndef = malloc(off);
+    if (!cmd->ndef) {
+        cb->log_err("KO: out of memory\r\n");
+        return -1;
+    }
+    *len = off;
+
+    for (off = 0, p = args + strspn(args, delim); *p;
+         p += flen, p += strspn(p, delim)) {
+        ssize_t res;
 
-        if (nfc_tag_format(re->tag) < 0) {
+        flen = strcspn(p, delim);
+        res = decode_base64(p, flen, cmd->ndef + off + 2,
+                            *len - off - 2);
+        if ((res < 0) || (res > 0xffff)) {
+            cb->log_err("KO: invalid base64 data '%.*s'\r\n",
+                        (int)flen, p);
             return -1;
         }
+        cmd->ndef[off] = res >> 8;
+        cmd->ndef[off + 1] = res & 0xff;
+        off += 2 + res;
+    }
+    return n;
+}
+
+/* returns the next field from compile_base64_fields() */
+static const uint8_t*
+next_field(const uint8_t** data, size_t* len)
+{
+    const uint8_t* field = *data + 2;
+
+    *len = ((*data)[0] << 8) | (*data)[1];
+    *data = field + *len;
+
+    return field;
+}
+
+struct nfc_nfcee_param {
+    const uint8_t* data; /* fields */
+    size_t nfields;
+};
+
+#define NFC_NFCEE_PARAM_INIT() \
+    { \
+        .data = NULL, \
+        .nfields = 0 \
+    }
+
+static ssize_t
+nfc_nfcee_applet_cb(void* data, struct nfc_device* nfc)
+{
+    const struct nfc_nfcee_param* param = data;
+    const uint8_t* p;
+    const uint8_t* aid;
+    const uint8_t* rsp;
+    size_t aidlen, rsplen;
+
+    assert(param);
+    assert(nfc);
+
+    p = param->data;
+    aid = next_field(&p, &aidlen);
+    rsp = next_field(&p, &rsplen);
+
+    if (nfc_nfcee_add_applet(&nfc->nfcee, aid, aidlen, NULL, NULL,
+                             rsp, rsplen) < 0) {
+        nfc->cb->log_err("KO: could not add applet\r\n");
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t
+nfc_nfcee_remove_cb(void* data, struct nfc_device* nfc)
+{
+    const struct nfc_nfcee_param* param = data;
+    const uint8_t* p;
+    const uint8_t* aid;
+    size_t aidlen;
+
+    assert(param);
+    assert(nfc);
+
+    p = param->data;
+    aid = next_field(&p, &aidlen);
+
+    if (nfc_nfcee_remove_applet(&nfc->nfcee, aid, aidlen) < 0) {
+        nfc->cb->log_err("KO: no applet for AID\r\n");
+        return -1;
+    }
+    return 0;
+}
+
+struct nfc_rapdu_output_param {
+    const uint8_t* rapdu;
+    size_t len;
+};
+
+static void
+write_rapdu(struct nfc_writer* w, const uint8_t* rapdu, size_t len)
+{
+    write_base64(w, rapdu, len, 1);
+    write_lit(w, "\r\n");
+}
+
+static ssize_t
+nfc_rapdu_output_cb(void* data, struct nfc_device* nfc, size_t len,
+                    char* buf)
+{
+    const struct nfc_rapdu_output_param* param = data;
+    struct nfc_writer w = NFC_WRITER_INIT(NULL, buf, len);
+
+    assert(param);
+
+    write_rapdu(&w, param->rapdu, param->len);
+
+    return w.off;
+}
+
+/* Exchanges the APDUs in a single transaction and prints each
+ * response on its own line. */
+static ssize_t
+nfc_nfcee_apdu_cb(void* data, struct nfc_device* nfc)
+{
+    const struct nfc_nfcee_param* param = data;
+    struct nfc_apdu_session ses = NFC_APDU_SESSION_INIT;
+    const uint8_t* p;
+    size_t i;
+
+    assert(param);
+    assert(nfc);
+
+    p = param->data;
+
+    for (i = 0; i < param->nfields; ++i) {
+        uint8_t rapdu[258]; /* [ISO7816-4] short R-APDU */
+        const uint8_t* capdu;
+        size_t len;
+        ssize_t res;
+
+        capdu = next_field(&p, &len);
+
+        res = nfc_nfcee_transceive(nfc, &ses, capdu, len, rapdu,
+                                   sizeof(rapdu));
+        if (res < 0) {
+            nfc->cb->log_err("KO: no answer for APDU %zu\r\n", i);
+            return -1;
+        }
+        if (nfc->cb->output) {
+            struct nfc_writer w = NFC_WRITER_INIT(NULL, NULL, 0);
+            struct nfc_rapdu_output_param output = {
+                .rapdu = rapdu,
+                .len = res
+            };
+
+            write_rapdu(&w, rapdu, res);
+            if (nfc->cb->output(nfc, w.off, nfc_rapdu_output_cb,
+                                &output) < 0) {
+                return -1;
+            }
+        } else {
+            struct nfc_writer w = NFC_WRITER_INIT(nfc->cb, NULL, 0);
+
+            write_rapdu(&w, rapdu, res);
+        }
+    }
+    return 0;
+}
+
+static int
+cmd_nfcee(const struct nfcemu_cb* cb, char* args, struct nfc_cmd* cmd)
+{
+    char *p;
+    struct nfc_nfcee_param param = NFC_NFCEE_PARAM_INIT();
+    ssize_t (*handle)(void*, struct nfc_device*);
+    size_t nfields, len;
+    ssize_t res;
+
+    if (!args) {
+        cb->log_err("KO: no arguments given\r\n");
+        return -1;
+    }
+
+    p = strsep(&args, " ");
+    if (!p) {
+        cb->log_err("KO: no operation given\r\n");
+        return -1;
+    }
+    if (!strcmp(p, "applet")) {
+        /* read AID and fixed response */
+        handle = nfc_nfcee_applet_cb;
+        nfields = 2;
+    } else if (!strcmp(p, "remove")) {
+        /* read AID */
+        handle = nfc_nfcee_remove_cb;
+        nfields = 1;
+    } else if (!strcmp(p, "apdu")) {
+        /* read any number of C-APDUs */
+        handle = nfc_nfcee_apdu_cb;
+        nfields = 0;
+    } else {
+        cb->log_err("KO: invalid operation '%s'\r\n", p);
+        return -1;
+    }
+
+    res = compile_base64_fields(cb, args, cmd, &len);
+    if (res < 0) {
+        return -1;
+    } else if (!res || (nfields && ((size_t)res != nfields))) {
+        cb->log_err("KO: invalid number of arguments for '%s'\r\n", p);
+        return -1;
+    }
+    param.data = cmd->ndef;
+    param.nfields = res;
+
+    if (submit_device_cmd(cmd, NFC_CMD_RUN, handle, &param,
+                          sizeof(param)) < 0) {
+        return -1;
     }
 
     return 0;
 }
+
+typedef int (*nfc_cmd_parse)(const struct nfcemu_cb*, char*,
+                             struct nfc_cmd*);
+
+static const struct {
+    const char* name;
+    nfc_cmd_parse parse;
+} cmd_group[] = {
+    { "snep", cmd_snep },
+    { "nci", cmd_nci },
+    { "llcp", cmd_llcp },
+    { "tag", cmd_tag },
+    { "re", cmd_re },
+    { "nfcee", cmd_nfcee }
+};
+
+/* parses and runs a command in a single step */
+static int
+parse_and_run(nfc_cmd_parse parse, const struct nfcemu_cb* cb,
+              struct nfc_device* nfc, char* args)
+{
+    struct nfc_cmd cmd = NFC_CMD_INIT(cb, nfc, 0);
+    int res;
+
+    res = parse(cb, args, &cmd);
+    free(cmd.ndef);
+
+    return res;
+}
+
+/*
+ * Legacy commands operate on the default context
+ */
+
+int
+nfc_cmd_snep(char* args)
+{
+    return parse_and_run(cmd_snep, &nfcemu_default_ctx.cb, NULL, args);
+}
+
+int
+nfc_cmd_nci(char* args)
+{
+    return parse_and_run(cmd_nci, &nfcemu_default_ctx.cb, NULL, args);
+}
+
+int
+nfc_cmd_llcp(char* args)
+{
+    return parse_and_run(cmd_llcp, &nfcemu_default_ctx.cb, NULL, args);
+}
+
+int
+nfc_cmd_tag(char* args)
+{
+    return parse_and_run(cmd_tag, &nfcemu_default_ctx.cb, NULL, args);
+}
+
+int
+nfc_cmd_re(char* args)
+{
+    return parse_and_run(cmd_re, &nfcemu_default_ctx.cb, NULL, args);
+}
+
+int
+nfc_cmd_nfcee(char* args)
+{
+    return parse_and_run(cmd_nfcee, &nfcemu_default_ctx.cb, NULL, args);
+}
+
+/*
+ * Device commands
+ */
+
+int
+nfc_device_cmd_snep(struct nfc_device* nfc, char* args)
+{
+    assert(nfc);
+
+    if (nfc->trace) {
+        nfc_trace_record_console(nfc->trace, "snep", args);
+    }
+    return parse_and_run(cmd_snep, nfc->cb, nfc, args);
+}
+
+int
+nfc_device_cmd_nci(struct nfc_device* nfc, char* args)
+{
+    assert(nfc);
+
+    if (nfc->trace) {
+        nfc_trace_record_console(nfc->trace, "nci", args);
+    }
+    return parse_and_run(cmd_nci, nfc->cb, nfc, args);
+}
+
+int
+nfc_device_cmd_llcp(struct nfc_device* nfc, char* args)
+{
+    assert(nfc);
+
+    if (nfc->trace) {
+        nfc_trace_record_console(nfc->trace, "llcp", args);
+    }
+    return parse_and_run(cmd_llcp, nfc->cb, nfc, args);
+}
+
+int
+nfc_device_cmd_tag(struct nfc_device* nfc, char* args)
+{
+    assert(nfc);
+
+    if (nfc->trace) {
+        nfc_trace_record_console(nfc->trace, "tag", args);
+    }
+    return parse_and_run(cmd_tag, nfc->cb, nfc, args);
+}
+
+int
+nfc_device_cmd_re(struct nfc_device* nfc, char* args)
+{
+    assert(nfc);
+
+    if (nfc->trace) {
+        nfc_trace_record_console(nfc->trace, "re", args);
+    }
+    return parse_and_run(cmd_re, nfc->cb, nfc, args);
+}
+
+int
+nfc_device_cmd_nfcee(struct nfc_device* nfc, char* args)
+{
+    assert(nfc);
+
+    if (nfc->trace) {
+        nfc_trace_record_console(nfc->trace, "nfcee", args);
+    }
+    return parse_and_run(cmd_nfcee, nfc->cb, nfc, args);
+}
+
+/*
+ * Compiled commands
+ */
+
+static struct nfc_cmd*
+compile_cmd(const struct nfcemu_cb* cb, const char* group, const char* args)
+{
+    struct nfc_cmd* cmd;
+    nfc_cmd_parse parse = NULL;
+    char* buf;
+    size_t i;
+    int res;
+
+    assert(cb);
+    assert(group);
+
+    for (i = 0; i < ARRAY_SIZE(cmd_group); ++i) {
+        if (!strcmp(group, cmd_group[i].name)) {
+            group = cmd_group[i].name;
+            parse = cmd_group[i].parse;
+            break;
+        }
+    }
+    if (!parse) {
+        cb->log_err("KO: invalid command '%s'\r\n", group);
+        return NULL;
+    }
+
+    cmd = malloc(sizeof(*cmd));
+    if (!cmd) {
+        cb->log_err("KO: out of memory\r\n");
+        return NULL;
+    }
+    *cmd = (struct nfc_cmd)NFC_CMD_INIT(cb, NULL, 1);
+    cmd->group = group;
+
+    /* the parser modifies its arguments, so the tracer gets a copy */
+    if (args) {
+        cmd->args = strdup(args);
+        buf = strdup(args);
+        if (!cmd->args || !buf) {
+            cb->log_err("KO: out of memory\r\n");
+            free(buf);
+            nfc_cmd_destroy(cmd);
+            return NULL;
+        }
+    } else {
+        buf = NULL;
+    }
+
+    res = parse(cb, buf, cmd);
+    free(buf);
+
+    if (res < 0) {
+        nfc_cmd_destroy(cmd);
+        return NULL;
+    }
+    return cmd;
+}
+
+struct nfc_cmd*
+nfc_cmd_compile(const char* group, const char* args)
+{
+    return compile_cmd(&nfcemu_default_ctx.cb, group, args);
+}
+
+struct nfc_cmd*
+nfc_device_cmd_compile(struct nfc_device* nfc, const char* group,
+                       const char* args)
+{
+    assert(nfc);
+
+    return compile_cmd(nfc->cb, group, args);
+}
+
+int
+nfc_cmd_run(const struct nfc_cmd* cmd)
+{
+    assert(cmd);
+
+    return run_cmd(&nfcemu_default_ctx.cb, NULL, cmd, cmd->param);
+}
+
+int
+nfc_device_cmd_run(struct nfc_device* nfc, const struct nfc_cmd* cmd)
+{
+    assert(nfc);
+    assert(cmd);
+
+    if (nfc->trace) {
+        nfc_trace_record_console(nfc->trace, cmd->group, cmd->args);
+    }
+    return run_cmd(nfc->cb, nfc, cmd, cmd->param);
+}
+
+void
+nfc_cmd_destroy(struct nfc_cmd* cmd)
+{
+    if (!cmd) {
+        return;
+    }
+    free(cmd->param);
+    free(cmd->ndef);
+    free(cmd->args);
+    free(cmd);
+}
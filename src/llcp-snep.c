@@ -33,17 +33,27 @@ process_req_put(const struct snep* snep, struct llcp_data_link* dl,
 
     sneplen = be32_to_cpu(snep->len);
 
-    if (!(sneplen < sizeof(dl->rbuf))) {
+    /* copy information field into dl->rbuf */
+    if (llcp_dl_write_rbuf(dl, sneplen, snep->info) < 0) {
         NFC_D("SNEP responding 'Excess Data'");
         return snep_create_rsp_excess_data(rsp);
     }
 
-    /* copy information field into dl->rbuf */
-    llcp_dl_write_rbuf(dl, sneplen, snep->info);
-
     return snep_create_rsp_success(rsp, 0);
 }
 
+static size_t
+process_rsp_continue(const struct snep* snep, struct llcp_data_link* dl,
+                     struct snep* rsp)
+{
+    NFC_D("SNEP Continue");
+
+    /* the remaining fragments of our request can be sent */
+    dl->swait = 0;
+
+    return 0;
+}
+
 static size_t
 process_rsp_success(const struct snep* snep, struct llcp_data_link* dl,
                           struct snep* rsp)
@@ -67,8 +77,9 @@ process_msg(const struct snep* snep, struct llcp_data_link* dl,
     static size_t (*const process[])(const struct snep*,
                                            struct llcp_data_link*,
                                            struct snep*) = {
-        [SNEP_REQ_PUT]     = process_req_put,
-        [SNEP_RSP_SUCCESS] = process_rsp_success
+        [SNEP_REQ_PUT]      = process_req_put,
+        [SNEP_RSP_CONTINUE] = process_rsp_continue,
+        [SNEP_RSP_SUCCESS]  = process_rsp_success
     };
 
     if (!version_is_supported(snep->ver.major, snep->ver.minor)) {
@@ -76,12 +87,75 @@ process_msg(const struct snep* snep, struct llcp_data_link* dl,
         return snep_create_rsp_unsupported_version(rsp);
     }
     if ((snep->msg >= ARRAY_SIZE(process)) || !process[snep->msg]) {
+        if (snep->msg >= SNEP_RSP_CONTINUE) {
+            /* the peer rejected our request; drop what's left of it */
+            NFC_D("SNEP response %x", snep->msg);
+            llcp_dl_clear_sbuf(dl);
+            return 0;
+        }
         NFC_D("SNEP responding 'Not Implemented'");
         return snep_create_rsp_not_implemented(rsp);
     }
     return process[snep->msg](snep, dl, rsp);
 }
 
+/* Starts receiving a request that is larger than the I PDU that
+ * carries its first fragment. [SNEP], Sec 5.1 */
+static size_t
+process_first_fragment(const struct snep* snep, size_t len,
+                       struct llcp_data_link* dl, struct snep* rsp)
+{
+    uint32_t sneplen;
+
+    if (!version_is_supported(snep->ver.major, snep->ver.minor)) {
+        NFC_D("SNEP responding 'Unsupported Version'");
+        return snep_create_rsp_unsupported_version(rsp);
+    }
+    if (snep->msg != SNEP_REQ_PUT) {
+        NFC_D("SNEP responding 'Not Implemented'");
+        return snep_create_rsp_not_implemented(rsp);
+    }
+
+    sneplen = be32_to_cpu(snep->len);
+
+    if ((sneplen > dl->rmax - sizeof(*snep)) ||
+        (llcp_dl_reserve_rbuf(dl, sneplen) < 0)) {
+        NFC_D("SNEP responding 'Excess Data'");
+        return snep_create_rsp_excess_data(rsp);
+    }
+
+    NFC_D("SNEP Put, %zu of %u bytes", len - sizeof(*snep), sneplen);
+
+    llcp_dl_write_rbuf(dl, len - sizeof(*snep), snep->info);
+    dl->rrem = sneplen - dl->rlen;
+
+    return snep_create_rsp_continue(rsp);
+}
+
+static size_t
+process_fragment(const uint8_t* info, size_t len, struct llcp_data_link* dl,
+                 struct snep* rsp)
+{
+    if (len > dl->rrem) {
+        NFC_D("SNEP responding 'Bad Request'");
+        dl->rlen = 0;
+        dl->rrem = 0;
+        return snep_create_rsp_bad_request(rsp);
+    }
+
+    /* space has been reserved by the first fragment */
+    llcp_dl_append_rbuf(dl, len, info);
+    dl->rrem -= len;
+
+    if (dl->rrem) {
+        return 0; /* more fragments to come */
+    }
+
+    NFC_D("SNEP Put complete, %zu bytes", dl->rlen);
+
+    return snep_create_rsp_success(rsp, 0);
+}
+
 size_t
 llcp_sap_snep(struct llcp_data_link* dl, const uint8_t* info, size_t len,
               struct snep* rsp)
@@ -90,10 +164,13 @@ llcp_sap_snep(struct llcp_data_link* dl, const uint8_t* info, size_t len,
     uint32_t sneplen;
 
     assert(dl);
-    assert(info);
-    assert(len >= 6);
+    assert(info || !len);
     assert(rsp);
 
+    if (dl->rrem) {
+        return process_fragment(info, len, dl, rsp);
+    }
+
     if (len < sizeof(*snep)) {
         NFC_D("SNEP responding 'Bad Request'");
         return snep_create_rsp_bad_request(rsp);
@@ -102,10 +179,14 @@ llcp_sap_snep(struct llcp_data_link* dl, const uint8_t* info, size_t len,
     snep = (struct snep*)info;
     sneplen = be32_to_cpu(snep->len);
 
-    if (!(sneplen < (UINT32_MAX-sizeof(*snep))) ||
-         (sneplen+sizeof(*snep) != len)) {
+    if (!(sneplen < (UINT32_MAX-sizeof(*snep)))) {
         NFC_D("SNEP responding 'Excess Data'");
         return snep_create_rsp_excess_data(rsp);
+    } else if (sneplen+sizeof(*snep) > len) {
+        return process_first_fragment(snep, len, dl, rsp);
+    } else if (sneplen+sizeof(*snep) < len) {
+        NFC_D("SNEP responding 'Bad Request'");
+        return snep_create_rsp_bad_request(rsp);
     }
     return process_msg(snep, dl, rsp);
 }
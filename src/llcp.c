@@ -68,6 +68,17 @@ llcp_create_pdu_i(struct llcp_pdu* llcp, unsigned char dsap,
   return llcp_create_pdu(llcp, dsap, LLCP_PTYPE_I, ssap) + 1;
 }
 
+size_t
+llcp_create_pdu_rr(struct llcp_pdu* llcp, unsigned char dsap,
+                   unsigned char ssap, unsigned char nr)
+{
+  assert(llcp);
+
+  llcp->info[0] = nr&0x0f;
+
+  return llcp_create_pdu(llcp, dsap, LLCP_PTYPE_RR, ssap) + 1;
+}
+
 unsigned char
 llcp_ptype(const struct llcp_pdu* llcp)
 {
@@ -81,7 +92,7 @@ llcp_ptype(const struct llcp_pdu* llcp)
 }
 
 size_t
-llcp_create_param_tail(uint8_t* p)
+llcp_create_param_tail(uint8_t* p, uint8_t lto)
 {
     const uint8_t *beg = p;
 
@@ -100,7 +111,29 @@ llcp_create_param_tail(uint8_t* p)
     /* SYMM timeout */
     *p++ = LLCP_PARAM_LTO;
     *p++ = 1;
-    *p++ = 250;
+    *p++ = lto;
+
+    return p-beg;
+}
+
+size_t
+llcp_create_dl_params(uint8_t* p, size_t miu, uint8_t rw)
+{
+    const uint8_t *beg = p;
+
+    assert(p);
+    assert(miu >= LLCP_DEFAULT_MIU && miu <= LLCP_MAX_MIU);
+
+    if (miu > LLCP_DEFAULT_MIU) {
+        *p++ = LLCP_PARAM_MIUX;
+        *p++ = 2;
+        *p++ = (miu - LLCP_DEFAULT_MIU) >> 8;
+        *p++ = (miu - LLCP_DEFAULT_MIU) & 0xff;
+    }
+
+    *p++ = LLCP_PARAM_RW;
+    *p++ = 1;
+    *p++ = rw & 0x0f;
 
     return p-beg;
 }
@@ -109,16 +142,59 @@ llcp_create_param_tail(uint8_t* p)
  * LLCP PDU handling
  */
 
+int
+llcp_pdu_pool_init(struct llcp_pdu_pool* pool, size_t nbufs)
+{
+    size_t i;
+
+    assert(pool);
+
+    pool->buf = calloc(nbufs, sizeof(*pool->buf));
+    if (nbufs && !pool->buf) {
+        NFC_D("calloc failed: %d (%s)", errno, strerror(errno));
+        return -1;
+    }
+    pool->nbufs = nbufs;
+    pool->nused = 0;
+    pool->maxused = 0;
+
+    TAILQ_INIT(&pool->free_q);
+    for (i = 0; i < nbufs; ++i) {
+        TAILQ_INSERT_TAIL(&pool->free_q, pool->buf + i, entry);
+    }
+    return 0;
+}
+
+void
+llcp_pdu_pool_uninit(struct llcp_pdu_pool* pool)
+{
+    assert(pool);
+
+    free(pool->buf);
+    pool->buf = NULL;
+    pool->nbufs = 0;
+    pool->nused = 0;
+    TAILQ_INIT(&pool->free_q);
+}
+
 struct llcp_pdu_buf*
-llcp_alloc_pdu_buf(void)
+llcp_alloc_pdu_buf(struct llcp_pdu_pool* pool)
 {
     struct llcp_pdu_buf* buf;
 
-    buf = malloc(sizeof(*buf));
-    if (!buf) {
-        NFC_D("malloc failed: %d (%s)", errno, strerror(errno));
+    assert(pool);
+
+    if (TAILQ_EMPTY(&pool->free_q)) {
+        NFC_D("PDU pool of %zu buffers exhausted", pool->nbufs);
         return NULL;
     }
+    buf = TAILQ_FIRST(&pool->free_q);
+    TAILQ_REMOVE(&pool->free_q, buf, entry);
+
+    if (++pool->nused > pool->maxused) {
+        pool->maxused = pool->nused;
+    }
+
     buf->entry.tqe_next = NULL;
     buf->entry.tqe_prev = NULL;
     buf->len = 0;
@@ -126,9 +202,40 @@ llcp_alloc_pdu_buf(void)
 }
 
 void
-llcp_free_pdu_buf(struct llcp_pdu_buf* buf)
+llcp_free_pdu_buf(struct llcp_pdu_pool* pool, struct llcp_pdu_buf* buf)
+{
+    assert(pool);
+    assert(buf);
+    assert(buf >= pool->buf && buf < pool->buf + pool->nbufs);
+
+    TAILQ_INSERT_HEAD(&pool->free_q, buf, entry);
+    --pool->nused;
+}
+
+void
+llcp_free_pdu_queue(struct llcp_pdu_pool* pool, struct llcp_pdu_queue* q)
 {
-    free(buf);
+    assert(q);
+
+    while (!TAILQ_EMPTY(q)) {
+        struct llcp_pdu_buf* buf = TAILQ_FIRST(q);
+        TAILQ_REMOVE(q, buf, entry);
+        llcp_free_pdu_buf(pool, buf);
+    }
+}
+
+size_t
+llcp_pdu_queue_len(const struct llcp_pdu_queue* q)
+{
+    const struct llcp_pdu_buf* buf;
+    size_t len = 0;
+
+    assert(q);
+
+    TAILQ_FOREACH(buf, q, entry) {
+        ++len;
+    }
+    return len;
 }
 
 /*
@@ -144,46 +251,183 @@ llcp_clear_data_link(struct llcp_data_link* dl)
     dl->v_sa = 0;
     dl->v_r = 0;
     dl->v_ra = 0;
-    dl->miu = 128;
-    dl->rw_l = 1;
+    dl->miu = LLCP_DEFAULT_MIU;
+    dl->rw_l = LLCP_LOCAL_RW;
     dl->rw_r = 1;
     dl->rlen = 0;
+    dl->rrem = 0;
+    llcp_dl_clear_sbuf(dl);
 
     return dl;
 }
 
 struct llcp_data_link*
-llcp_init_data_link(struct llcp_data_link* dl)
+llcp_init_data_link(struct llcp_data_link* dl, size_t rmax)
 {
     assert(dl);
 
     dl->status = LLCP_DATA_LINK_DISCONNECTED;
     TAILQ_INIT(&dl->xmit_q);
+    dl->rmax = rmax;
+    dl->rsiz = 0;
+    dl->rbuf = NULL;
+    dl->ssiz = 0;
+    dl->sbuf = NULL;
 
     return llcp_clear_data_link(dl);
 }
 
-size_t
+void
+llcp_uninit_data_link(struct llcp_data_link* dl)
+{
+    assert(dl);
+
+    llcp_dl_clear_sbuf(dl);
+    free(dl->sbuf);
+    dl->sbuf = NULL;
+    dl->ssiz = 0;
+    free(dl->rbuf);
+    dl->rbuf = NULL;
+    dl->rsiz = 0;
+    dl->rlen = 0;
+    dl->rrem = 0;
+}
+
+void
+llcp_dl_parse_params(struct llcp_data_link* dl, const uint8_t* opt,
+                     size_t len)
+{
+    assert(dl);
+    assert(opt || !len);
+
+    while (len >= 2) {
+        size_t plen = opt[1];
+
+        if (len - 2 < plen) {
+            NFC_D("LLCP parameter %d truncated", opt[0]);
+            break;
+        }
+        switch (opt[0]) {
+            case LLCP_PARAM_MIUX:
+                if (plen != 2) {
+                    break;
+                }
+                dl->miu = LLCP_DEFAULT_MIU + (((opt[2] & 0x07) << 8) | opt[3]);
+                NFC_D("LLCP MIU size=%d", dl->miu);
+                break;
+            case LLCP_PARAM_RW:
+                if (plen != 1) {
+                    break;
+                }
+                dl->rw_r = opt[2] & 0x0f;
+                NFC_D("LLCP remote RW size %d", dl->rw_r);
+                break;
+            case LLCP_PARAM_SN:
+                NFC_D("requesting LLCP service %.*s", (int)plen,
+                      (const char*)opt+2);
+                break;
+            default:
+                NFC_D("Ignoring unknown LLCP parameter %d", opt[0]);
+                break;
+        }
+        opt += 2 + plen;
+        len -= 2 + plen;
+    }
+}
+
+int
+llcp_dl_window_is_open(const struct llcp_data_link* dl)
+{
+    assert(dl);
+
+    /* number of unacknowledged I PDUs; [LLCP], Sec 5.6.2.2 */
+    return ((dl->v_s - dl->v_sa) & 0x0f) < dl->rw_r;
+}
+
+int
+llcp_dl_reserve_rbuf(struct llcp_data_link* dl, size_t len)
+{
+    uint8_t* rbuf;
+
+    assert(dl);
+
+    if (len <= dl->rsiz) {
+        return 0;
+    }
+    rbuf = realloc(dl->rbuf, len);
+    if (!rbuf) {
+        NFC_D("realloc failed: %d (%s)", errno, strerror(errno));
+        return -1;
+    }
+    dl->rbuf = rbuf;
+    dl->rsiz = len;
+
+    return 0;
+}
+
+ssize_t
 llcp_dl_write_rbuf(struct llcp_data_link* dl, size_t len, const void* data)
 {
     assert(dl);
-    assert(len < sizeof(dl->rbuf));
+
+    dl->rlen = 0;
+
+    return llcp_dl_append_rbuf(dl, len, data);
+}
+
+ssize_t
+llcp_dl_append_rbuf(struct llcp_data_link* dl, size_t len, const void* data)
+{
+    assert(dl);
     assert(data || !len);
 
-    dl->rlen = len;
-    memcpy(dl->rbuf, data, len);
+    if (llcp_dl_reserve_rbuf(dl, dl->rlen + len) < 0) {
+        return -1;
+    }
+    memcpy(dl->rbuf + dl->rlen, data, len);
+    dl->rlen += len;
 
-    return dl->rlen;
+    return len;
 }
 
 size_t
 llcp_dl_read_rbuf(const struct llcp_data_link* dl, size_t len, void* data)
 {
     assert(dl);
-    assert(len < sizeof(dl->rbuf));
 
     len = len < dl->rlen ? len : dl->rlen;
     memcpy(data, dl->rbuf, len);
 
     return len;
 }
+
+int
+llcp_dl_reserve_sbuf(struct llcp_data_link* dl, size_t len)
+{
+    uint8_t* sbuf;
+
+    assert(dl);
+
+    if (len <= dl->ssiz) {
+        return 0;
+    }
+    sbuf = realloc(dl->sbuf, len);
+    if (!sbuf) {
+        NFC_D("realloc failed: %d (%s)", errno, strerror(errno));
+        return -1;
+    }
+    dl->sbuf = sbuf;
+    dl->ssiz = len;
+
+    return 0;
+}
+
+void
+llcp_dl_clear_sbuf(struct llcp_data_link* dl)
+{
+    assert(dl);
+
+    dl->slen = 0;
+    dl->soff = 0;
+    dl->swait = 0;
+}
@@ -24,6 +24,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/queue.h>
+#include <sys/types.h>
 
 enum {
     LLCP_VERSION_MAJOR = 0x01,
@@ -156,6 +157,14 @@ enum nfc_llcp_ptype {
     LLCP_PTYPE_RNR = 0xe
 };
 
+/* [LLCP], Sec 4.3.8 */
+enum llcp_dm_reason {
+    LLCP_DM_REASON_DISC = 0x00,
+    LLCP_DM_REASON_NO_CONNECTION = 0x01,
+    LLCP_DM_REASON_NO_SERVICE = 0x02,
+    LLCP_DM_REASON_REJECTED = 0x03
+};
+
 struct llcp_pdu {
 #if BITORDER_MSB_FIRST
     uint16_t dsap:6;
@@ -187,12 +196,20 @@ size_t
 llcp_create_pdu_i(struct llcp_pdu* llcp, unsigned char dsap,
                   unsigned char ssap, unsigned char ns, unsigned char nr);
 
+size_t
+llcp_create_pdu_rr(struct llcp_pdu* llcp, unsigned char dsap,
+                   unsigned char ssap, unsigned char nr);
+
 unsigned char
 llcp_ptype(const struct llcp_pdu* llcp);
 
-/* used during link establishment */
+/* used during link establishment; LTO is given in steps of 10 ms */
 size_t
-llcp_create_param_tail(uint8_t* p);
+llcp_create_param_tail(uint8_t* p, uint8_t lto);
+
+/* used in CONNECT and CC PDUs; announces the local MIU and RW */
+size_t
+llcp_create_dl_params(uint8_t* p, size_t miu, uint8_t rw);
 
 /*
  * LLCP PDU handling
@@ -206,16 +223,55 @@ struct llcp_pdu_buf {
 
 TAILQ_HEAD(llcp_pdu_queue, llcp_pdu_buf);
 
+enum {
+    LLCP_PDU_POOL_DEFAULT_SIZE = 64
+};
+
+/* Fixed-size pool of PDU buffers. All buffers are allocated
+ * when the pool is set up; allocating and freeing a buffer
+ * only moves it from or to the free list.
+ */
+struct llcp_pdu_pool {
+    size_t nbufs;
+    /* buffers in use, and the largest number in use at once */
+    size_t nused;
+    size_t maxused;
+    struct llcp_pdu_buf* buf;
+    struct llcp_pdu_queue free_q;
+};
+
+int
+llcp_pdu_pool_init(struct llcp_pdu_pool* pool, size_t nbufs);
+
+void
+llcp_pdu_pool_uninit(struct llcp_pdu_pool* pool);
+
+/* returns NULL if the pool is exhausted */
 struct llcp_pdu_buf*
-llcp_alloc_pdu_buf(void);
+llcp_alloc_pdu_buf(struct llcp_pdu_pool* pool);
+
+void
+llcp_free_pdu_buf(struct llcp_pdu_pool* pool, struct llcp_pdu_buf* buf);
 
+/* returns all of the queue's buffers to the pool */
 void
-llcp_free_pdu_buf(struct llcp_pdu_buf* buf);
+llcp_free_pdu_queue(struct llcp_pdu_pool* pool, struct llcp_pdu_queue* q);
+
+/* returns the number of buffers in the queue */
+size_t
+llcp_pdu_queue_len(const struct llcp_pdu_queue* q);
 
 /*
  * LLCP data link
  */
 
+enum {
+    LLCP_DEFAULT_MIU = 128,
+    LLCP_MAX_MIU = LLCP_DEFAULT_MIU + 0x7ff,
+    /* receive window announced for our end of data links */
+    LLCP_LOCAL_RW = 4
+};
+
 enum llcp_data_link_status {
     LLCP_DATA_LINK_DISCONNECTED = 0,
     LLCP_DATA_LINK_CONNECTING,
@@ -225,32 +281,77 @@ enum llcp_data_link_status {
 
 struct llcp_data_link {
     enum llcp_data_link_status status;
+    /* remote and local SAP of the connection */
+    uint8_t rsap;
+    uint8_t lsap;
     /* data-link connection state variables; [LLCP], Sec 5.6.1 */
     uint8_t v_s;
     uint8_t v_sa;
     uint8_t v_r;
     uint8_t v_ra;
     /* data-link connection parameters; [LLCP], Sec 5.6.2 */
-    uint8_t miu;
+    uint16_t miu;
     uint8_t rw_l;
     uint8_t rw_r;
-    /* receive buffer for user data (e.g., NDEF records) */
-    uint8_t rlen;
-    uint8_t rbuf[256];
+    /* receive buffer for user data (e.g., NDEF records); grows
+     * on demand. 'rrem' is the number of bytes still missing
+     * from a fragmented message. Messages of more than 'rmax'
+     * bytes are refused. */
+    size_t rmax;
+    size_t rlen;
+    size_t rsiz;
+    size_t rrem;
+    uint8_t* rbuf;
+    /* outgoing message that doesn't fit into a single I PDU; it's
+     * transmitted in fragments within the remote receive window. A
+     * message is pending while 'slen' is non-zero. The buffer of
+     * 'ssiz' bytes is kept for the next message. */
+    size_t slen;
+    size_t soff;
+    int swait;
+    size_t ssiz;
+    uint8_t* sbuf;
     /* transmit queue for outgoing packets */
     struct llcp_pdu_queue xmit_q;
 };
 
 struct llcp_data_link*
-llcp_init_data_link(struct llcp_data_link* dl);
+llcp_init_data_link(struct llcp_data_link* dl, size_t rmax);
 
 struct llcp_data_link*
 llcp_clear_data_link(struct llcp_data_link* dl);
 
-size_t
+/* frees the data link's buffers, but not its queued PDUs */
+void
+llcp_uninit_data_link(struct llcp_data_link* dl);
+
+/* applies MIUX and RW parameters from a CONNECT or CC PDU */
+void
+llcp_dl_parse_params(struct llcp_data_link* dl, const uint8_t* opt,
+                     size_t len);
+
+/* returns non-zero if the remote receive window is open */
+int
+llcp_dl_window_is_open(const struct llcp_data_link* dl);
+
+int
+llcp_dl_reserve_rbuf(struct llcp_data_link* dl, size_t len);
+
+ssize_t
 llcp_dl_write_rbuf(struct llcp_data_link* dl, size_t len, const void* data);
 
+ssize_t
+llcp_dl_append_rbuf(struct llcp_data_link* dl, size_t len, const void* data);
+
 size_t
 llcp_dl_read_rbuf(const struct llcp_data_link* dl, size_t len, void* data);
 
+/* makes room for an outgoing message of 'len' bytes in 'sbuf' */
+int
+llcp_dl_reserve_sbuf(struct llcp_data_link* dl, size_t len);
+
+/* drops the pending message, but keeps the buffer */
+void
+llcp_dl_clear_sbuf(struct llcp_data_link* dl);
+
 #endif
@@ -21,9 +21,15 @@
 static size_t
 ndef_hdr_len(const struct ndef_rec* ndef)
 {
-    return sizeof(*ndef) + 2 + /* flags/tlen/plen bytes */
-           (!(ndef->flags&NDEF_FLAG_SR) * 3) + /* 3 extra bytes for long plen */
-           !!(ndef->flags&NDEF_FLAG_IL); /* 1 extra byte for ilen */
+    return ndef_rec_hdr_len(ndef->flags);
+}
+
+size_t
+ndef_rec_hdr_len(uint8_t flags)
+{
+    return sizeof(struct ndef_rec) + 2 + /* flags/tlen/plen bytes */
+           (!(flags&NDEF_FLAG_SR) * 3) + /* 3 extra bytes for long plen */
+           !!(flags&NDEF_FLAG_IL); /* 1 extra byte for ilen */
 }
 
 size_t
@@ -37,19 +43,19 @@ ndef_create_rec(struct ndef_rec* ndef, uint8_t flags, enum ndef_tnf tnf,
     ndef->flags = flags | tnf;
 
     if (flags & NDEF_FLAG_SR) {
-        struct ndef_rec_fields* rf = (struct ndef_rec_fields*)ndef->data;
-        rf->tlen = tlen;
-        rf->plen = cpu_to_be32(plen);
-        if (flags & NDEF_FLAG_IL) {
-            rf->ilen = ilen;
-        }
-    } else {
         struct ndef_srec_fields* srf = (struct ndef_srec_fields*)ndef->data;
         srf->tlen = tlen;
         srf->plen = plen;
         if (flags & NDEF_FLAG_IL) {
             srf->ilen = ilen;
         }
+    } else {
+        struct ndef_rec_fields* rf = (struct ndef_rec_fields*)ndef->data;
+        rf->tlen = tlen;
+        rf->plen = cpu_to_be32(plen);
+        if (flags & NDEF_FLAG_IL) {
+            rf->ilen = ilen;
+        }
     }
     return ndef_hdr_len(ndef);
 }
@@ -130,7 +136,7 @@ ndef_rec_payload_len(const struct ndef_rec* ndef)
 }
 
 void
-ndef_rec_set_payload_len(struct ndef_rec* ndef, uint8_t plen)
+ndef_rec_set_payload_len(struct ndef_rec* ndef, uint32_t plen)
 {
     assert(ndef);
 
@@ -144,10 +150,11 @@ ndef_rec_set_payload_len(struct ndef_rec* ndef, uint8_t plen)
     }
 }
 
+/* [NDEF], Sec 3.2; id precedes the payload */
 size_t
 ndef_rec_payload_off(const struct ndef_rec* ndef)
 {
-    return ndef_rec_type_off(ndef) + ndef_rec_type_len(ndef);
+    return ndef_rec_id_off(ndef) + ndef_rec_id_len(ndef);
 }
 
 const uint8_t*
@@ -209,7 +216,7 @@ ndef_rec_set_id_len(struct ndef_rec* ndef, uint8_t ilen)
 size_t
 ndef_rec_id_off(const struct ndef_rec* ndef)
 {
-    return ndef_rec_payload_off(ndef) + ndef_rec_payload_len(ndef);
+    return ndef_rec_type_off(ndef) + ndef_rec_type_len(ndef);
 }
 
 const uint8_t*
@@ -225,3 +232,97 @@ ndef_rec_id(struct ndef_rec* ndef)
     assert(ndef);
     return ndef->data + ndef_rec_id_off(ndef);
 }
+
+/*
+ * Message iterator
+ */
+
+void
+ndef_iter_init(struct ndef_iter* iter, const void* buf, size_t len)
+{
+    assert(iter);
+    assert(buf || !len);
+
+    iter->buf = buf;
+    iter->len = len;
+    iter->off = 0;
+    iter->done = 0;
+    iter->chunked.tnf = NDEF_TNF_EMPTY;
+    iter->chunked.first = 0;
+    iter->chunked.last = 1;
+}
+
+int
+ndef_iter_next(struct ndef_iter* iter, struct ndef_rec_view* rec)
+{
+    const struct ndef_rec* ndef;
+    size_t remain, hlen, reclen;
+    uint8_t flags;
+
+    assert(iter);
+    assert(rec);
+
+    remain = iter->len - iter->off;
+
+    if (iter->done) {
+        return remain ? -1 : 0; /* trailing bytes after ME */
+    }
+    if (!remain) {
+        /* empty message, or truncated after the latest record */
+        return (!iter->off) ? 0 : -1;
+    }
+
+    ndef = (const struct ndef_rec*)(iter->buf + iter->off);
+    flags = ndef->flags;
+
+    /* header length depends on the flags only */
+    hlen = ndef_hdr_len(ndef);
+    if (hlen > remain) {
+        return -1;
+    }
+    reclen = hlen + (size_t)ndef_rec_type_len(ndef) +
+             ndef_rec_id_len(ndef);
+    if ((reclen > remain) || (ndef_rec_payload_len(ndef) > remain - reclen)) {
+        return -1;
+    }
+    reclen += ndef_rec_payload_len(ndef);
+
+    /* MB only on the first record; ME not before the last chunk */
+    if (!!(flags & NDEF_FLAG_MB) != !iter->off) {
+        return -1;
+    }
+    if ((flags & NDEF_FLAG_ME) && (flags & NDEF_FLAG_CF)) {
+        return -1;
+    }
+
+    if (!iter->chunked.last) {
+        /* middle or terminating chunk; [NDEF], Sec 2.3.3 */
+        if (((flags & NDEF_TNF_BITS) != NDEF_TNF_UNCHANGED) ||
+            ndef_rec_type_len(ndef) || ndef_rec_id_len(ndef)) {
+            return -1;
+        }
+        iter->chunked.offset += iter->chunked.plen;
+        iter->chunked.first = 0;
+    } else {
+        if ((flags & NDEF_TNF_BITS) == NDEF_TNF_UNCHANGED) {
+            return -1;
+        }
+        iter->chunked.tnf = flags & NDEF_TNF_BITS;
+        iter->chunked.type = ndef_rec_const_type(ndef);
+        iter->chunked.tlen = ndef_rec_type_len(ndef);
+        iter->chunked.id = ndef_rec_const_id(ndef);
+        iter->chunked.ilen = ndef_rec_id_len(ndef);
+        iter->chunked.offset = 0;
+        iter->chunked.first = 1;
+    }
+    iter->chunked.payload = ndef_rec_const_payload(ndef);
+    iter->chunked.plen = ndef_rec_payload_len(ndef);
+    iter->chunked.last = !(flags & NDEF_FLAG_CF);
+
+    *rec = iter->chunked;
+
+    iter->off += reclen;
+    iter->done = !!(flags & NDEF_FLAG_ME);
+
+    return 1;
+}
@@ -73,6 +73,10 @@ ndef_create_rec(struct ndef_rec* rec, uint8_t flags, enum ndef_tnf tnf,
 size_t
 ndef_rec_len(const struct ndef_rec* rec);
 
+/* length of the header of a record with the given flags */
+size_t
+ndef_rec_hdr_len(uint8_t flags);
+
 /*
  * Type lookup
  */
@@ -100,7 +104,7 @@ uint32_t
 ndef_rec_payload_len(const struct ndef_rec* ndef);
 
 void
-ndef_rec_set_payload_len(struct ndef_rec* ndef, uint8_t plen);
+ndef_rec_set_payload_len(struct ndef_rec* ndef, uint32_t plen);
 
 size_t
 ndef_rec_payload_off(const struct ndef_rec* ndef);
@@ -130,4 +134,45 @@ ndef_rec_const_id(const struct ndef_rec* ndef);
 uint8_t*
 ndef_rec_id(struct ndef_rec* ndef);
 
+/*
+ * Message iterator
+ */
+
+/* View of a record within the message buffer. A chunked record is
+ * returned once per chunk, each time with the type and id of the
+ * first chunk and the chunk's part of the payload. 'offset' is the
+ * position of this part within the payload of the whole record.
+ */
+struct ndef_rec_view {
+    enum ndef_tnf tnf;
+    const uint8_t* type;
+    size_t tlen;
+    const uint8_t* id;
+    size_t ilen;
+    const uint8_t* payload;
+    size_t plen;
+    size_t offset;
+    int first; /* first chunk of the record */
+    int last; /* last chunk of the record */
+};
+
+struct ndef_iter {
+    const uint8_t* buf;
+    size_t len;
+    size_t off;
+    int done; /* ME record has been returned */
+    /* record of a chunk sequence, if one is in progress */
+    struct ndef_rec_view chunked;
+};
+
+void
+ndef_iter_init(struct ndef_iter* iter, const void* buf, size_t len);
+
+/* Returns 1 and fills in 'rec' for each record or chunk, 0 at the
+ * end of the message, or -1 if the message is malformed. All lengths
+ * are checked against the buffer, and the MB, ME and CF flags have to
+ * describe a well-formed message [NDEF], Sec 2.5. */
+int
+ndef_iter_next(struct ndef_iter* iter, struct ndef_rec_view* rec);
+
 #endif
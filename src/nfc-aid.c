@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include "nfc-aid.h"
+
+static unsigned int
+nibble(const uint8_t* aid, size_t i)
+{
+    return (i & 1) ? aid[i / 2] & 0x0f : aid[i / 2] >> 4;
+}
+
+static int
+node_is_empty(const struct nfc_aid_node* node)
+{
+    size_t i;
+
+    if (node->value) {
+        return 0;
+    }
+    for (i = 0; i < 16; ++i) {
+        if (node->child[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void
+destroy_node(struct nfc_aid_node* node, void (*destroy)(void*))
+{
+    size_t i;
+
+    if (!node) {
+        return;
+    }
+    for (i = 0; i < 16; ++i) {
+        destroy_node(node->child[i], destroy);
+    }
+    if (node->value && destroy) {
+        destroy(node->value);
+    }
+    free(node);
+}
+
+void
+nfc_aid_trie_init(struct nfc_aid_trie* trie)
+{
+    assert(trie);
+
+    trie->root = NULL;
+    trie->nvalues = 0;
+}
+
+void
+nfc_aid_trie_clear(struct nfc_aid_trie* trie, void (*destroy)(void*))
+{
+    assert(trie);
+
+    destroy_node(trie->root, destroy);
+    trie->root = NULL;
+    trie->nvalues = 0;
+}
+
+int
+nfc_aid_trie_insert(struct nfc_aid_trie* trie, const uint8_t* aid,
+                    size_t len, void* value, void** old)
+{
+    struct nfc_aid_node** node;
+    size_t i;
+
+    assert(trie);
+    assert(aid || !len);
+    assert(value);
+
+    if (!len || (len > NFC_AID_MAXIMUM_LENGTH)) {
+        return -1;
+    }
+
+    for (node = &trie->root, i = 0;; ++i) {
+        if (!*node) {
+            *node = calloc(1, sizeof(**node));
+            if (!*node) {
+                /* nodes created so far are empty; drop them */
+                nfc_aid_trie_remove(trie, aid, len);
+                return -1;
+            }
+        }
+        if (i == 2 * len) {
+            break;
+        }
+        node = &(*node)->child[nibble(aid, i)];
+    }
+
+    if (old) {
+        *old = (*node)->value;
+    }
+    if (!(*node)->value) {
+        ++trie->nvalues;
+    }
+    (*node)->value = value;
+
+    return 0;
+}
+
+void*
+nfc_aid_trie_remove(struct nfc_aid_trie* trie, const uint8_t* aid,
+                    size_t len)
+{
+    struct nfc_aid_node** path[2 * NFC_AID_MAXIMUM_LENGTH + 1];
+    struct nfc_aid_node** node;
+    void* value;
+    size_t i;
+
+    assert(trie);
+    assert(aid || !len);
+
+    if (!len || (len > NFC_AID_MAXIMUM_LENGTH)) {
+        return NULL;
+    }
+
+    /* remember the path, so that empty nodes can be pruned */
+    for (node = &trie->root, i = 0; *node && (i < 2 * len); ++i) {
+        path[i] = node;
+        node = &(*node)->child[nibble(aid, i)];
+    }
+    if (!*node) {
+        value = NULL; /* not completely in the trie; prune anyway */
+    } else {
+        path[i++] = node;
+        value = (*node)->value;
+        (*node)->value = NULL;
+        if (value) {
+            --trie->nvalues;
+        }
+    }
+
+    while (i && node_is_empty(*path[i - 1])) {
+        node = path[--i];
+        free(*node);
+        *node = NULL;
+    }
+
+    return value;
+}
+
+void*
+nfc_aid_trie_find_longest(const struct nfc_aid_trie* trie,
+                          const uint8_t* aid, size_t len)
+{
+    const struct nfc_aid_node* node;
+    void* value;
+    size_t i;
+
+    assert(trie);
+    assert(aid || !len);
+
+    if (len > NFC_AID_MAXIMUM_LENGTH) {
+        len = NFC_AID_MAXIMUM_LENGTH;
+    }
+
+    value = NULL;
+
+    for (node = trie->root, i = 0; node; ++i) {
+        /* only whole bytes make up an AID */
+        if (!(i & 1) && node->value) {
+            value = node->value;
+        }
+        if (i == 2 * len) {
+            break;
+        }
+        node = node->child[nibble(aid, i)];
+    }
+    return value;
+}
+
+void*
+nfc_aid_trie_find_first(const struct nfc_aid_trie* trie,
+                        const uint8_t* prefix, size_t len)
+{
+    const struct nfc_aid_node* node;
+    size_t i;
+
+    assert(trie);
+    assert(prefix || !len);
+
+    if (len > NFC_AID_MAXIMUM_LENGTH) {
+        return NULL;
+    }
+
+    for (node = trie->root, i = 0; node && (i < 2 * len); ++i) {
+        node = node->child[nibble(prefix, i)];
+    }
+
+    /* descend into the smallest child; as empty nodes are pruned,
+     * there's a value at the end of the way */
+    while (node && !node->value) {
+        for (i = 0; !node->child[i]; ++i) {
+            assert(i < 15);
+        }
+        node = node->child[i];
+    }
+    return node ? node->value : NULL;
+}
+
+static int
+foreach_node(const struct nfc_aid_node* node, uint8_t* aid, size_t i,
+             int (*func)(void*, const uint8_t*, size_t, void*),
+             void* data)
+{
+    unsigned int n;
+
+    if (node->value && (func(data, aid, i / 2, node->value) < 0)) {
+        return -1;
+    }
+    for (n = 0; n < 16; ++n) {
+        if (!node->child[n]) {
+            continue;
+        }
+        if (i & 1) {
+            aid[i / 2] = (aid[i / 2] & 0xf0) | n;
+        } else {
+            aid[i / 2] = n << 4;
+        }
+        if (foreach_node(node->child[n], aid, i + 1, func, data) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int
+nfc_aid_trie_foreach(const struct nfc_aid_trie* trie,
+                     int (*func)(void*, const uint8_t*, size_t, void*),
+                     void* data)
+{
+    uint8_t aid[NFC_AID_MAXIMUM_LENGTH] = { 0 };
+
+    assert(trie);
+    assert(func);
+
+    if (!trie->root) {
+        return 0;
+    }
+    return foreach_node(trie->root, aid, 0, func, data);
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef nfc_aid_h
+#define nfc_aid_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    /* [ISO7816-4] Sec 8.2.1.2; AIDs have 5 to 16 bytes */
+    NFC_AID_MINIMUM_LENGTH = 5,
+    NFC_AID_MAXIMUM_LENGTH = 16
+};
+
+/* Node of an AID trie; each level holds 4 bits of the AID, so a
+ * lookup takes at most 32 steps, whatever the number of entries.
+ * Nodes without a value always have a value in their subtree.
+ */
+struct nfc_aid_node {
+    struct nfc_aid_node* child[16];
+    void* value;
+};
+
+/* Maps AIDs to values; the trie doesn't own the values. Children
+ * are ordered by their nibble, so walking the trie visits AIDs in
+ * lexicographic order.
+ */
+struct nfc_aid_trie {
+    struct nfc_aid_node* root;
+    size_t nvalues;
+};
+
+void
+nfc_aid_trie_init(struct nfc_aid_trie* trie);
+
+/* Removes all entries and calls 'destroy' for each value, if set. */
+void
+nfc_aid_trie_clear(struct nfc_aid_trie* trie, void (*destroy)(void*));
+
+/* Sets the value of 'aid'; replaces and returns a previous value in
+ * '*old' if given. */
+int
+nfc_aid_trie_insert(struct nfc_aid_trie* trie, const uint8_t* aid,
+                    size_t len, void* value, void** old);
+
+/* Removes 'aid' and returns its value, or NULL if there's none. */
+void*
+nfc_aid_trie_remove(struct nfc_aid_trie* trie, const uint8_t* aid,
+                    size_t len);
+
+/* Returns the value of 'aid' or of its longest prefix in the trie;
+ * NULL if there's neither. */
+void*
+nfc_aid_trie_find_longest(const struct nfc_aid_trie* trie,
+                          const uint8_t* aid, size_t len);
+
+/* Returns the value of the first AID in lexicographic order that
+ * starts with 'prefix', as required for partial selection by
+ * [ISO7816-4] Sec 7.1.1; NULL if there's none. */
+void*
+nfc_aid_trie_find_first(const struct nfc_aid_trie* trie,
+                        const uint8_t* prefix, size_t len);
+
+/* Calls 'func' for each AID in lexicographic order; stops and fails
+ * if 'func' fails. */
+int
+nfc_aid_trie_foreach(const struct nfc_aid_trie* trie,
+                     int (*func)(void*, const uint8_t*, size_t, void*),
+                     void* data);
+
+#endif
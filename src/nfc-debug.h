@@ -21,10 +21,10 @@
 
 #if DEBUG
 #define NFC_D(...) \
-  {
-    fprintf(stderr, __VA_ARGS__);
-    fprintf(stderr, "\n");
-  }
+  do { \
+    fprintf(stderr, __VA_ARGS__); \
+    fprintf(stderr, "\n"); \
+  } while (0)
 #else
 #define NFC_D(...)  ((void)0)
 #endif
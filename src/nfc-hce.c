@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include "cb.h"
+#include "nfc-debug.h"
+#include "nfc.h"
+#include "nfc-nci.h"
+#include "nfc-re.h"
+#include "nfc-hce.h"
+
+void
+nfc_hce_reader_init(struct nfc_hce_reader* reader,
+                    nfcemu_reader_handler* process, void* data)
+{
+    assert(reader);
+    assert(process);
+
+    reader->process = process;
+    reader->data = data;
+    reader->start_timeout = NULL;
+    reader->waiting = 0;
+    reader->sent_ns = 0;
+}
+
+void
+nfc_hce_reader_uninit(struct nfc_hce_reader* reader, struct nfc_device* nfc)
+{
+    assert(reader);
+    assert(nfc);
+
+    if (reader->start_timeout) {
+        nfc->cb->del_timeout(reader->start_timeout);
+        reader->start_timeout = NULL;
+    }
+}
+
+/* asks the handler for the next C-APDU and starts its clock */
+static size_t
+next_capdu(struct nfc_re* re, const uint8_t* rapdu, size_t len,
+           uint8_t* capdu, size_t maxlen)
+{
+    struct nfc_hce_reader* reader = re->reader;
+    ssize_t res;
+
+    res = reader->process(reader->data, re->nfc, rapdu, len, capdu,
+                          maxlen);
+    if (res <= 0) {
+        if (res < 0) {
+            NFC_D("reader failed to create C-APDU");
+        }
+        reader->waiting = 0;
+        return 0;
+    }
+    assert((size_t)res <= maxlen);
+
+    reader->waiting = 1;
+    reader->sent_ns = nfc_monotonic_ns();
+
+    return res;
+}
+
+static void
+start_cb(void* data)
+{
+    struct nfc_re* re = data;
+    struct nfc_device* nfc;
+    size_t len;
+
+    assert(re);
+
+    nfc = re->nfc;
+
+    /* the reader might have left the field in the meantime */
+    if ((nfc->active_re != re) ||
+        (nfc->rf_state != NFC_RFST_LISTEN_ACTIVE)) {
+        return;
+    }
+    if (!nfc_device_tx_buf(nfc)) {
+        NFC_D("couldn't send first C-APDU");
+        return;
+    }
+    len = next_capdu(re, NULL, 0, nfc->tx_buf, NFC_MAX_DTA_LENGTH);
+    if (!len) {
+        return;
+    }
+    if (nfc_send_nci_dta(nfc, re->connid, nfc->tx_buf, len) < 0) {
+        NFC_D("couldn't send first C-APDU");
+        re->reader->waiting = 0;
+    }
+}
+
+void
+nfc_hce_reader_activate(struct nfc_re* re)
+{
+    struct nfc_hce_reader* reader;
+    const struct nfcemu_cb* cb;
+
+    assert(re);
+    assert(re->reader);
+
+    reader = re->reader;
+    cb = re->nfc->cb;
+
+    if (!reader->start_timeout) {
+        reader->start_timeout = cb->new_timeout(start_cb, re);
+        assert(reader->start_timeout);
+    }
+    reader->waiting = 0;
+    re->connid = 0; /* static RF connection */
+
+    cb->mod_timeout(reader->start_timeout, 0);
+}
+
+size_t
+nfc_hce_reader_process(struct nfc_re* re, const uint8_t* rapdu,
+                       size_t len, uint8_t* capdu, size_t maxlen)
+{
+    struct nfc_hce_reader* reader;
+    struct nfc_device* nfc;
+
+    assert(re);
+    assert(re->reader);
+
+    reader = re->reader;
+    nfc = re->nfc;
+
+    if (!reader->waiting) {
+        NFC_D("dropping R-APDU without C-APDU");
+        return 0;
+    }
+    ++nfc->stats.hce_apdus;
+    nfc_count_latency(nfc->stats.hce_latency,
+                      nfc_monotonic_ns() - reader->sent_ns);
+
+    return next_capdu(re, rapdu, len, capdu, maxlen);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef nfc_hce_h
+#define nfc_hce_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <nfcemu/types.h>
+
+struct nfc_device;
+struct nfc_re;
+
+/* An emulated reader that polls the guest in listen mode and talks
+ * to the guest's host card emulation over the ISO-DEP interface. The
+ * handler produces the C-APDUs; the reader measures how long the
+ * guest takes to answer each of them.
+ */
+struct nfc_hce_reader {
+    nfcemu_reader_handler* process;
+    void* data;
+    /* sends the first C-APDU after the activation */
+    nfcemu_timeout* start_timeout;
+    /* true while a C-APDU waits for its R-APDU, and its time */
+    int waiting;
+    uint64_t sent_ns;
+};
+
+void
+nfc_hce_reader_init(struct nfc_hce_reader* reader,
+                    nfcemu_reader_handler* process, void* data);
+
+void
+nfc_hce_reader_uninit(struct nfc_hce_reader* reader, struct nfc_device* nfc);
+
+/* Starts a transaction; the first C-APDU follows the activation
+ * notification, once the host has delivered it. */
+void
+nfc_hce_reader_activate(struct nfc_re* re);
+
+/* Processes the guest's R-APDU and returns the length of the next
+ * C-APDU in 'capdu', or 0 if the transaction is over. */
+size_t
+nfc_hce_reader_process(struct nfc_re* re, const uint8_t* rapdu,
+                       size_t len, uint8_t* capdu, size_t maxlen);
+
+#endif
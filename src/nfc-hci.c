@@ -93,7 +93,7 @@ static size_t
 reset_process_cmd(const union hci_packet* cmd, struct nfc_device* nfc,
                   union hci_answer* rsp)
 {
-    assert(0);
+    NFC_D("dropping HCI command in RESET state");
 
     return 0;
 }
@@ -18,8 +18,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include "bswap.h"
+#include "ptr.h"
 #include "nfc-debug.h"
 #include "nfc.h"
+#include "nfc-hce.h"
 #include "cb.h"
 #include "nfc-re.h"
 #include "nfc-nci.h"
@@ -70,7 +72,7 @@ nfc_nci_device_set(struct nfc_device* nfc, enum nci_config_param_id id,
     nfc_device_set(nfc, config_id_value[id][0], len, value);
 
     if ((id == NCI_CONFIG_PARAM_BCM2079x_I93_DATARATE) && (value[2] & 0x1)) {
-        cb.send_ntf(nfc_rf_field_info_ntf_cb, NULL);
+        nfc->cb->send_ntf(nfc, nfc_rf_field_info_ntf_cb, NULL);
     }
 }
 
@@ -83,18 +85,99 @@ nfc_nci_device_get(struct nfc_device* nfc, enum nci_config_param_id id,
     nfc_device_get(nfc, config_id_value[id][0], len, value);
 }
 
+/*
+ * Flow control
+ */
+
+/* Returns the number of credits the host can hold without overrunning
+ * the RE's send buffer with full-sized packets. */
+static uint8_t
+dta_credits_limit(const struct nfc_device* nfc, const struct nfc_re* re)
+{
+    size_t n = nfc_re_sbuf_room(re) / NCI_MAX_DTA_PAYLOAD_LENGTH;
+
+    return n < nfc->max_dta_credits ? n : nfc->max_dta_credits;
+}
+
+int
+nfc_set_dta_credits(struct nfc_device* nfc, unsigned long ncredits)
+{
+    assert(nfc);
+
+    if (!ncredits || (ncredits > NCI_DTA_CREDITS_UNLIMITED)) {
+        return -1;
+    }
+    nfc->max_dta_credits = ncredits;
+
+    return 0;
+}
+
+struct nfc_conn_credits_param {
+    uint8_t connid;
+    uint8_t ncredits;
+};
+
+static ssize_t
+create_conn_credits_ntf(void* data, struct nfc_device* nfc, size_t maxlen,
+                        union nci_packet* ntf)
+{
+    const struct nfc_conn_credits_param* param = data;
+    struct nci_core_conn_credits_ntf* payload;
+
+    assert(param);
+    assert(ntf);
+
+    payload = (struct nci_core_conn_credits_ntf*)ntf->control.payload;
+    payload->nentries = 1;
+    payload->entries[0] = param->connid;
+    payload->entries[1] = param->ncredits;
+
+    nfc->dta_credits += param->ncredits;
+
+    return nfc_create_nci_ntf(ntf, NCI_PBF_END, NCI_GID_CORE,
+                              NCI_OID_CORE_CONN_CREDITS_NTF,
+                              sizeof(*payload) + 2);
+}
+
+void
+nfc_update_dta_credits(struct nfc_device* nfc)
+{
+    struct nfc_conn_credits_param param;
+    uint8_t limit;
+
+    assert(nfc);
+
+    if (!nfc->active_re ||
+        (nfc->max_dta_credits == NCI_DTA_CREDITS_UNLIMITED)) {
+        return;
+    }
+    limit = dta_credits_limit(nfc, nfc->active_re);
+    if (limit <= nfc->dta_credits) {
+        return; /* the RE hasn't drained enough data yet */
+    }
+    param.connid = nfc->active_re->connid;
+    param.ncredits = limit - nfc->dta_credits;
+
+    if (nfc->cb->send_ntf(nfc, create_conn_credits_ntf, &param) < 0) {
+        NFC_D("couldn't return %d credits", param.ncredits);
+    }
+}
+
 /*
  * Data
  */
 
 size_t
-nfc_create_nci_dta(union nci_packet* rsp, enum nci_pbf pbf,
-                   uint8_t connid, unsigned char l)
+nfc_create_nci_dta(struct nfc_device* nfc, union nci_packet* rsp,
+                   enum nci_pbf pbf, uint8_t connid, unsigned char l)
 {
+    assert(nfc);
     assert(rsp);
 
     NFC_D("creating NCI data pbf=%d connid=%d length=%d", pbf, connid, l);
 
+    ++nfc->stats.dta_tx;
+
     rsp->data.mt = NCI_MT_DTA;
     rsp->data.pbf = pbf;
     rsp->data.connid = connid;
@@ -104,23 +187,150 @@ nfc_create_nci_dta(union nci_packet* rsp, enum nci_pbf pbf,
     return 3 + l;
 }
 
+struct nfc_dta_segment_param {
+    uint8_t connid;
+    const uint8_t* data;
+    size_t len;
+};
+
+static ssize_t
+create_dta_segment(void* data, struct nfc_device* nfc, size_t maxlen,
+                   union nci_packet* dta)
+{
+    struct nfc_dta_segment_param* param = data;
+    enum nci_pbf pbf;
+    size_t len;
+
+    assert(param);
+    assert(dta);
+
+    if (maxlen <= 3) {
+        return -1;
+    }
+    len = param->len;
+    if (len > maxlen-3) {
+        len = maxlen-3;
+    }
+    if (len > NCI_MAX_DTA_PAYLOAD_LENGTH) {
+        len = NCI_MAX_DTA_PAYLOAD_LENGTH;
+    }
+    pbf = (len < param->len) ? NCI_PBF_SEG : NCI_PBF_END;
+
+    memcpy(dta->data.payload, param->data, len);
+    param->data += len;
+    param->len -= len;
+
+    return nfc_create_nci_dta(nfc, dta, pbf, param->connid, len);
+}
+
+/* Sends a data message to the host, split into as many
+ * segments as required. [NCI], Sec 3.4.2 */
+int
+nfc_send_nci_dta(struct nfc_device* nfc, uint8_t connid,
+                 const void* data, size_t len)
+{
+    struct nfc_dta_segment_param param = {
+        .connid = connid,
+        .data = data,
+        .len = len
+    };
+
+    assert(nfc);
+    assert(data || !len);
+
+    do {
+        len = param.len;
+        if (nfc->cb->send_dta(nfc, create_dta_segment, &param) < 0) {
+            return -1;
+        }
+        if (len && (param.len == len)) {
+            return -1; /* host didn't take the segment */
+        }
+    } while (param.len);
+
+    return 0;
+}
+
 static size_t
 process_nci_dta(const union nci_packet* dta, struct nfc_device* nfc,
                 union nci_packet* rsp)
 {
     enum nfc_rfst rfst;
+    const uint8_t* data;
+    size_t len;
 
     assert(dta);
     assert(nfc);
 
+    ++nfc->stats.dta_rx;
+
     rfst = nfc_rf_state_transition(&nfc->rf_state,
                                    NFC_RFST_POLL_ACTIVE_BIT|
                                    NFC_RFST_LISTEN_ACTIVE_BIT,
                                    nfc->rf_state);
-    assert(rfst != NUMBER_OF_NFC_RFSTS);
+    if (rfst == NUMBER_OF_NFC_RFSTS) {
+        NFC_D("dropping data packet in RF state %d", nfc->rf_state);
+        return 0;
+    }
+
+    if (nfc->max_dta_credits != NCI_DTA_CREDITS_UNLIMITED) {
+        /* every packet from the host consumes one credit */
+        if (!nfc->dta_credits) {
+            NFC_D("dropping data packet, host has no credits");
+            return 0;
+        }
+        --nfc->dta_credits;
+    }
+
+    /* reassemble segmented data messages, [NCI] Sec 3.4.2 */
+
+    if (dta->data.pbf == NCI_PBF_SEG || nfc->rx_len) {
+        if (!nfc_device_rx_buf(nfc)) {
+            NFC_D("dropping segmented data message");
+            nfc->rx_len = 0;
+            return 0;
+        }
+        if (dta->data.l > NFC_MAX_DTA_LENGTH - nfc->rx_len) {
+            NFC_D("dropping oversized data message");
+            nfc->rx_len = 0;
+            return 0;
+        }
+        memcpy(nfc->rx_buf + nfc->rx_len, dta->data.payload, dta->data.l);
+        nfc->rx_len += dta->data.l;
+        if (dta->data.pbf == NCI_PBF_SEG) {
+            return 0; /* wait for more segments */
+        }
+        data = nfc->rx_buf;
+        len = nfc->rx_len;
+        nfc->rx_len = 0;
+    } else {
+        data = dta->data.payload;
+        len = dta->data.l;
+    }
+
+    if (!nfc_device_tx_buf(nfc)) {
+        NFC_D("dropping data message");
+        return 0;
+    }
 
     /* data gets processed by RE */
-    return nfc_re_process_data(nfc->active_re, dta, rsp);
+    len = nfc_re_process_data(nfc->active_re, dta->data.connid, data, len,
+                              nfc->tx_buf);
+    if (!len) {
+        return 0;
+    }
+    assert(len <= NFC_MAX_DTA_LENGTH);
+
+    if (len > NCI_MAX_DTA_PAYLOAD_LENGTH) {
+        /* response doesn't fit into a single packet */
+        if (nfc_send_nci_dta(nfc, dta->data.connid, nfc->tx_buf, len) < 0) {
+            NFC_D("couldn't send segmented data message");
+        }
+        return 0;
+    }
+    memcpy(rsp->data.payload, nfc->tx_buf, len);
+
+    return nfc_create_nci_dta(nfc, rsp, NCI_PBF_END, dta->data.connid, len);
 }
 
 size_t
@@ -146,8 +356,8 @@ nfc_create_dta(const void* data, size_t len,
     payload_len = nfc_re_create_dta_act(nfc->active_re, data, len,
                                         nci->data.payload);
 
-    return nfc_create_nci_dta(nci, NCI_PBF_END, nfc->active_re->connid,
-                              payload_len);
+    return nfc_create_nci_dta(nfc, nci, NCI_PBF_END,
+                              nfc->active_re->connid, payload_len);
 }
 
 /*
@@ -194,13 +404,13 @@ create_semantic_error_rsp(const union nci_packet* cmd,
                                      NCI_STATUS_SEMANTIC_ERROR);
 }
 
-/* IDLE state */
+/* IDLE and INITIALIZED states */
 
 static size_t
-idle_process_oid_core_reset_cmd(const union nci_packet* cmd,
-                                struct nfc_device* nfc,
-                                union nci_packet* rsp,
-                                struct nfc_delivery_cb* cb)
+process_oid_core_reset_cmd(const union nci_packet* cmd,
+                           struct nfc_device* nfc,
+                           union nci_packet* rsp,
+                           struct nfc_delivery_cb* cb)
 {
     assert(cmd);
     assert(nfc);
@@ -210,6 +420,10 @@ idle_process_oid_core_reset_cmd(const union nci_packet* cmd,
 
     if (cmd->control.payload[0]) {
         nfc->rf_state = NFC_RFST_IDLE;
+        /* [NCI] Sec 4.1; resetting the configuration drops the
+         * routing table and disables all NFCEEs */
+        nfc_routing_clear(&nfc->routing);
+        nfc->nfcee.enabled = 0;
     }
 
     rsp->control.payload[0] = NCI_STATUS_OK;
@@ -220,164 +434,6 @@ idle_process_oid_core_reset_cmd(const union nci_packet* cmd,
                               cmd->control.oid, 3);
 }
 
-static size_t
-idle_process_oid_bcm2079x_get_build_info_cmd(const union nci_packet* cmd,
-                                             struct nfc_device* nfc,
-                                             union nci_packet* rsp,
-                                             struct nfc_delivery_cb* cb)
-{
-    // status code
-    rsp->control.payload[0] = NCI_STATUS_OK;
-    // unknown
-    rsp->control.payload[1] = 0x4d;
-    rsp->control.payload[2] = 0x61;
-    rsp->control.payload[3] = 0x72;
-    rsp->control.payload[4] = 0x20;
-    rsp->control.payload[5] = 0x31;
-    rsp->control.payload[6] = 0x37;
-    rsp->control.payload[7] = 0x20;
-    rsp->control.payload[8] = 0x32;
-    rsp->control.payload[9] = 0x30;
-    rsp->control.payload[10] = 0x31;
-    rsp->control.payload[11] = 0x32;
-    rsp->control.payload[12] = 0x31;
-    rsp->control.payload[13] = 0x30;
-    rsp->control.payload[14] = 0x3a;
-    rsp->control.payload[15] = 0x35;
-    rsp->control.payload[16] = 0x34;
-    rsp->control.payload[17] = 0x3a;
-    rsp->control.payload[18] = 0x31;
-    rsp->control.payload[19] = 0x35;
-    rsp->control.payload[20] = 0x1;
-    rsp->control.payload[21] = 0x3;
-    rsp->control.payload[22] = 0xa;
-    rsp->control.payload[23] = 0x44;
-    // HW id
-    rsp->control.payload[24] = 0x3;
-    rsp->control.payload[25] = 0x1b;
-    rsp->control.payload[26] = 0x79;
-    rsp->control.payload[27] = 0x20;
-    // chip-version length
-    rsp->control.payload[28] = 7;
-    // chip version
-    rsp->control.payload[29] = '2';
-    rsp->control.payload[30] = '0';
-    rsp->control.payload[31] = '7';
-    rsp->control.payload[32] = '9';
-    rsp->control.payload[33] = '1';
-    rsp->control.payload[34] = 'B';
-    rsp->control.payload[35] = '3';
-
-    return create_control_rsp(rsp, NCI_PBF_END, cmd->control.gid,
-                              cmd->control.oid, 36);
-}
-
-static size_t
-idle_process_oid_bcm2079x_get_patch_version_cmd(const union nci_packet* cmd,
-                                                struct nfc_device* nfc,
-                                                union nci_packet* rsp,
-                                                struct nfc_delivery_cb* cb)
-{
-    struct nci_bcm2079x_get_patch_version_rsp* payload;
-
-    payload =
-        (struct nci_bcm2079x_get_patch_version_rsp*)rsp->control.payload;
-
-    payload->projectid = cpu_to_le16(0x100);
-    payload->rfu = 0;
-    payload->chipver = 7;
-    payload->patchinfover[0] = '2';
-    payload->patchinfover[1] = '0';
-    payload->patchinfover[2] = '7';
-    payload->patchinfover[3] = '9';
-    payload->patchinfover[4] = '1';
-    payload->patchinfover[5] = 'B';
-    payload->patchinfover[6] = '3';
-    memset(payload->patchinfover+payload->chipver, 0,
-           sizeof(payload->patchinfover)-payload->chipver);
-    payload->major = cpu_to_le16(0x93);
-    payload->minor = cpu_to_le16(0x9d);
-    payload->maxsize = cpu_to_le16(256);
-    payload->patchmaxsize = cpu_to_le16(256);
-    payload->lpmsize = cpu_to_le16(0);
-    payload->fpmsize = cpu_to_le16(0x1b52);
-    payload->lpmbadcrc = 0;
-    payload->fpmbadcrc = 0;
-    payload->nvmtype = NCI_BCM2079x_SPD_NVM_EEPROM;
-
-    return create_control_rsp(rsp, NCI_PBF_END, cmd->control.gid,
-                              cmd->control.oid, sizeof(*payload));
-}
-
-static size_t
-idle_process_cmd(const union nci_packet* cmd, struct nfc_device* nfc,
-                 union nci_packet* rsp, struct nfc_delivery_cb* cb)
-{
-    static size_t (* const core_oid[NUMBER_OF_NCI_CMDS])
-      (const union nci_packet*, struct nfc_device*, union nci_packet*,
-       struct nfc_delivery_cb* cb) = {
-        [NCI_OID_CORE_RESET_CMD] = idle_process_oid_core_reset_cmd,
-        [NCI_OID_CORE_INIT_CMD] = create_semantic_error_rsp,
-        [NCI_OID_CORE_SET_CONFIG_CMD] = create_semantic_error_rsp,
-        [NCI_OID_CORE_GET_CONFIG_CMD] = create_semantic_error_rsp,
-        [NCI_OID_CORE_CONN_CREATE_CMD] = create_semantic_error_rsp,
-        [NCI_OID_CORE_CONN_CLOSE_CMD] = create_semantic_error_rsp
-    };
-    static size_t (* const rf_oid[NUMBER_OF_NCI_CMDS])
-      (const union nci_packet*, struct nfc_device*, union nci_packet*,
-       struct nfc_delivery_cb* cb) = {
-        [NCI_OID_RF_DISCOVER_MAP_CMD] = create_semantic_error_rsp,
-        [NCI_OID_RF_SET_LISTEN_MODE_ROUTING_CMD] = create_semantic_error_rsp,
-        [NCI_OID_RF_GET_LISTEN_MODE_ROUTING_CMD] = create_semantic_error_rsp,
-        [NCI_OID_RF_DISCOVER_CMD] = create_semantic_error_rsp,
-        [NCI_OID_RF_DISCOVER_SELECT_CMD] = create_semantic_error_rsp,
-        [NCI_OID_RF_DEACTIVATED_CMD] = create_semantic_error_rsp,
-        [NCI_OID_RF_T3T_POLLING_CMD] = create_semantic_error_rsp,
-        [NCI_OID_RF_PARAMETER_UPDATE_CMD] = create_semantic_error_rsp
-    };
-    static size_t (* const nfcee_oid[NUMBER_OF_NCI_CMDS])
-      (const union nci_packet*, struct nfc_device*, union nci_packet*,
-       struct nfc_delivery_cb* cb) = {
-        [NCI_OID_NFCEE_DISCOVER_CMD] = create_semantic_error_rsp,
-        [NCI_OID_NFCEE_MODE_SET_CMD] = create_semantic_error_rsp
-    };
-    static size_t (* const prop_oid[NUMBER_OF_NCI_CMDS])
-      (const union nci_packet*, struct nfc_device*, union nci_packet*,
-       struct nfc_delivery_cb* cb) = {
-        [NCI_OID_BCM2079x_GET_BUILD_INFO_CMD] =
-          idle_process_oid_bcm2079x_get_build_info_cmd,
-        [NCI_OID_BCM2079x_HCI_NETWK_CMD] = create_semantic_error_rsp,
-        [NCI_OID_BCM2079x_SET_FWFSM_CMD] = create_semantic_error_rsp,
-        [NCI_OID_BCM2079x_GET_PATCH_VERSION_CMD] =
-          idle_process_oid_bcm2079x_get_patch_version_cmd
-    };
-
-    size_t (*process)(const union nci_packet*, struct nfc_device*,
-                      union nci_packet* rsp, struct nfc_delivery_cb* cb);
-
-    assert(cmd);
-
-    NFC_D("gid=0x%x oid=0x%x", cmd->control.gid, cmd->control.oid);
-
-    if (cmd->control.gid == NCI_GID_CORE) {
-        process = core_oid[cmd->control.oid];
-    } else if (cmd->control.gid == NCI_GID_RF) {
-        process = rf_oid[cmd->control.oid];
-    } else if (cmd->control.gid == NCI_GID_NFCEE) {
-        process = nfcee_oid[cmd->control.oid];
-    } else if (cmd->control.gid == NCI_GID_PROP) {
-        process = prop_oid[cmd->control.oid];
-    } else {
-        process = NULL;
-    }
-
-    assert(process);
-    if (!process)
-        return 0; /* [NCI] SEC 3.2.2, ignore unknown commands */
-
-    return process(cmd, nfc, rsp, cb);
-}
-
 /* RESET state */
 
 static size_t
@@ -414,99 +470,8 @@ reset_process_oid_core_init_cmd(const union nci_packet* cmd,
                               cmd->control.oid, sizeof(*payload));
 }
 
-static size_t
-reset_process_cmd(const union nci_packet* cmd, struct nfc_device* nfc,
-                  union nci_packet* rsp, struct nfc_delivery_cb* cb)
-{
-    static size_t (* const core_oid[NUMBER_OF_NCI_CMDS])
-      (const union nci_packet*, struct nfc_device*, union nci_packet*,
-       struct nfc_delivery_cb* cb) = {
-        [NCI_OID_CORE_RESET_CMD] = create_semantic_error_rsp,
-        [NCI_OID_CORE_INIT_CMD] = reset_process_oid_core_init_cmd,
-        [NCI_OID_CORE_SET_CONFIG_CMD] = create_semantic_error_rsp,
-        [NCI_OID_CORE_GET_CONFIG_CMD] = create_semantic_error_rsp,
-        [NCI_OID_CORE_CONN_CREATE_CMD] = create_semantic_error_rsp,
-        [NCI_OID_CORE_CONN_CLOSE_CMD] = create_semantic_error_rsp
-    };
-    static size_t (* const rf_oid[NUMBER_OF_NCI_CMDS])
-      (const union nci_packet*, struct nfc_device*, union nci_packet*,
-       struct nfc_delivery_cb* cb) = {
-        [NCI_OID_RF_DISCOVER_MAP_CMD] = create_semantic_error_rsp,
-        [NCI_OID_RF_SET_LISTEN_MODE_ROUTING_CMD] = create_semantic_error_rsp,
-        [NCI_OID_RF_GET_LISTEN_MODE_ROUTING_CMD] = create_semantic_error_rsp,
-        [NCI_OID_RF_DISCOVER_CMD] = create_semantic_error_rsp,
-        [NCI_OID_RF_DISCOVER_SELECT_CMD] = create_semantic_error_rsp,
-        [NCI_OID_RF_DEACTIVATED_CMD] = create_semantic_error_rsp,
-        [NCI_OID_RF_T3T_POLLING_CMD] = create_semantic_error_rsp,
-        [NCI_OID_RF_PARAMETER_UPDATE_CMD] = create_semantic_error_rsp
-    };
-    static size_t (* const nfcee_oid[NUMBER_OF_NCI_CMDS])
-      (const union nci_packet*, struct nfc_device*, union nci_packet*,
-       struct nfc_delivery_cb* cb) = {
-        [NCI_OID_NFCEE_DISCOVER_CMD] = create_semantic_error_rsp,
-        [NCI_OID_NFCEE_MODE_SET_CMD] = create_semantic_error_rsp
-    };
-    static size_t (* const prop_oid[NUMBER_OF_NCI_CMDS])
-      (const union nci_packet*, struct nfc_device*, union nci_packet*,
-       struct nfc_delivery_cb* cb) = {
-        [NCI_OID_BCM2079x_GET_BUILD_INFO_CMD] = create_semantic_error_rsp,
-        [NCI_OID_BCM2079x_HCI_NETWK_CMD] = create_semantic_error_rsp,
-        [NCI_OID_BCM2079x_SET_FWFSM_CMD] = create_semantic_error_rsp,
-        [NCI_OID_BCM2079x_GET_PATCH_VERSION_CMD] = create_semantic_error_rsp
-    };
-
-    size_t (*process)(const union nci_packet*, struct nfc_device*,
-                      union nci_packet* rsp, struct nfc_delivery_cb* cb);
-
-    assert(cmd);
-
-    NFC_D("gid=0x%x oid=0x%x", cmd->control.gid, cmd->control.oid);
-
-    if (cmd->control.gid == NCI_GID_CORE) {
-        process = core_oid[cmd->control.oid];
-    } else if (cmd->control.gid == NCI_GID_RF) {
-        process = rf_oid[cmd->control.oid];
-    } else if (cmd->control.gid == NCI_GID_NFCEE) {
-        process = nfcee_oid[cmd->control.oid];
-    } else if (cmd->control.gid == NCI_GID_PROP) {
-        process = prop_oid[cmd->control.oid];
-    } else {
-        process = NULL;
-    }
-
-    assert(process);
-    if (!process)
-        return 0; /* [NCI] SEC 3.2.2, ignore unknown commands */
-
-    return process(cmd, nfc, rsp, cb);
-}
-
 /* INITIALIZED state */
 
-static size_t
-init_process_oid_core_reset_cmd(const union nci_packet* cmd,
-                                struct nfc_device* nfc,
-                                union nci_packet* rsp,
-                                struct nfc_delivery_cb* cb)
-{
-    assert(cmd);
-    assert(nfc);
-    assert(rsp);
-
-    nfc->state = NFC_FSM_STATE_RESET;
-
-    if (cmd->control.payload[0]) {
-        nfc->rf_state = NFC_RFST_IDLE;
-    }
-
-    rsp->control.payload[0] = NCI_STATUS_OK;
-    rsp->control.payload[1] = NCI_VERSION_1_0;
-    rsp->control.payload[2] = cmd->control.payload[0];
-
-    return create_control_rsp(rsp, NCI_PBF_END, cmd->control.gid,
-                              cmd->control.oid, 3);
-}
-
 static size_t
 init_process_oid_core_set_config_cmd(const union nci_packet* cmd,
                                      struct nfc_device* nfc,
@@ -581,7 +546,10 @@ init_process_oid_rf_discover_cmd(const union nci_packet* cmd,
 
     rfst = nfc_rf_state_transition(&nfc->rf_state, NFC_RFST_IDLE_BIT,
                                    NFC_RFST_DISCOVERY);
-    assert(rfst != NUMBER_OF_NFC_RFSTS);
+    if (rfst == NUMBER_OF_NFC_RFSTS) {
+        NFC_D("can't start discovery in RF state %d", nfc->rf_state);
+        return create_semantic_error_rsp(cmd, nfc, rsp, cb);
+    }
 
     payload = (struct nci_rf_discover_cmd*)cmd->control.payload;
 
@@ -619,7 +587,7 @@ init_process_oid_rf_discover_select_cmd(const union nci_packet* cmd,
         goto status_rejected;
     }
 
-    re = nfc_get_re_by_id(payload->id);
+    re = nfc_get_re_by_id(nfc, payload->id);
 
     if (!re) {
         NFC_D("couldn't find payload id %d", payload->id);
@@ -653,25 +621,17 @@ status_rejected:
                                      cmd->control.oid, NCI_STATUS_REJECTED);
 }
 
-struct nfc_deactivate_ntf_param {
-    uint8_t type;
-    uint8_t reason;
-};
-
 static ssize_t
 nfc_delivery_deactivate_cmd_cb(void* data, union nci_packet* pkt)
 {
-    struct nfc_deactivate_ntf_param* param;
-    ssize_t res;
+    struct nfc_device* nfc;
 
     assert(data);
 
-    param = (struct nfc_deactivate_ntf_param*)data;
-    res = nfc_create_deactivate_ntf(param->type, param->reason, pkt);
-
-    free(param);
+    nfc = data;
 
-    return res;
+    return nfc_create_deactivate_ntf(nfc->delivery.deactivate.type,
+                                     nfc->delivery.deactivate.reason, pkt);
 }
 
 static size_t
@@ -683,7 +643,6 @@ init_process_oid_rf_deactivate_cmd(const union nci_packet* cmd,
     const struct nci_rf_deactivate_cmd *payload;
     unsigned long bits;
     enum nfc_rfst rfst;
-    size_t i;
     int send_ntf = 1;
 
     payload = (struct nci_rf_deactivate_cmd*)cmd->control.payload;
@@ -706,7 +665,7 @@ init_process_oid_rf_deactivate_cmd(const union nci_packet* cmd,
             } else if (nfc->rf_state == NFC_RFST_LISTEN_ACTIVE) {
                 rfst = NFC_RFST_LISTEN_SLEEP;
             } else {
-                assert(0);
+                rfst = NUMBER_OF_NFC_RFSTS; /* rejected below */
             }
             break;
         case NCI_RF_DEACT_DISCOVERY:
@@ -732,28 +691,24 @@ init_process_oid_rf_deactivate_cmd(const union nci_packet* cmd,
     }
 
     rfst = nfc_rf_state_transition(&nfc->rf_state, bits, rfst);
-    assert(rfst != NUMBER_OF_NFC_RFSTS);
+    if (rfst == NUMBER_OF_NFC_RFSTS) {
+        NFC_D("can't deactivate with type %d in RF state %d",
+              payload->type, nfc->rf_state);
+        return create_semantic_error_rsp(cmd, nfc, rsp, cb);
+    }
 
     /* reset state */
 
     nfc->active_re = NULL;
     nfc->active_rf = NULL;
 
-    for (i = 0; i < sizeof(nfc_res)/sizeof(nfc_res[0]); ++i) {
-        nfc_res[i].id = 0;
-    }
+    nfc_device_clear_re_ids(nfc);
 
     if (send_ntf) {
-        struct nfc_deactivate_ntf_param* data;
-
-        data = malloc(sizeof(*data));
-        if (!data) {
-          abort(); // TODO: maybe return error
-        }
-        data->type = payload->type;
-        data->reason = NCI_RF_DEACT_DH_REQUEST;
+        nfc->delivery.deactivate.type = payload->type;
+        nfc->delivery.deactivate.reason = NCI_RF_DEACT_DH_REQUEST;
 
-        nfc_delivery_cb_setup(cb, NTFN_BUF, data,
+        nfc_delivery_cb_setup(cb, NTFN_BUF, nfc,
             nfc_delivery_deactivate_cmd_cb);
     }
 
@@ -761,24 +716,16 @@ init_process_oid_rf_deactivate_cmd(const union nci_packet* cmd,
                                      cmd->control.oid, NCI_STATUS_OK);
 }
 
-struct nfc_t3t_polling_ntf_param {
-    struct nfc_re* re;
-};
-
 static ssize_t
 nfc_delivery_t3t_polling_cmd_cb(void* data, union nci_packet* pkt)
 {
-    struct nfc_t3t_polling_ntf_param* param;
-    ssize_t res;
+    struct nfc_device* nfc;
 
     assert(data);
 
-    param = (struct nfc_t3t_polling_ntf_param*)data;
-    res = nfc_create_t3t_polling_ntf(param->re, pkt);
-
-    free(param);
+    nfc = data;
 
-    return res;
+    return nfc_create_t3t_polling_ntf(nfc->delivery.t3t_polling.re, pkt);
 }
 
 /* [NCI] 8.2.2.2 */
@@ -789,22 +736,117 @@ init_process_oid_t3t_polling_cmd(const union nci_packet* cmd,
                                  struct nfc_delivery_cb* cb)
 {
     /* We do nothing here except send notification to HOST */
-    struct nfc_t3t_polling_ntf_param* ntf;
+    nfc->delivery.t3t_polling.re = nfc->active_re;
+
+    nfc_delivery_cb_setup(cb, NTFN_BUF, nfc,
+        nfc_delivery_t3t_polling_cmd_cb);
 
-    ntf = malloc(sizeof(*ntf));
-    if (!ntf) {
-      abort(); // TODO: maybe return error
+    return create_control_status_rsp(rsp, cmd->control.gid,
+                                     cmd->control.oid, NCI_STATUS_OK);
+}
+
+/* checks all entries, so that malformed commands don't change the
+ * routing table */
+static int
+routing_entries_are_valid(const uint8_t* entry, const uint8_t* end,
+                          size_t nentries)
+{
+    for (; nentries; --nentries) {
+        const struct nci_routing_entry* e =
+            (const struct nci_routing_entry*)entry;
+
+        if ((end - entry < 4) || (e->len < 2) ||
+            (e->len > end - entry - 2)) {
+            return 0;
+        } else if ((e->type == NCI_ROUTING_ENTRY_AID) &&
+                   ((e->len == 2) ||
+                    (e->len - 2 > NFC_AID_MAXIMUM_LENGTH))) {
+            return 0;
+        }
+        entry += e->len + 2;
     }
+    return 1;
+}
 
-    ntf->re = nfc->active_re;
+/* [NCI] Sec 6.3.2 */
+static size_t
+init_process_oid_rf_set_listen_mode_routing_cmd(const union nci_packet* cmd,
+                                                struct nfc_device* nfc,
+                                                union nci_packet* rsp,
+                                                struct nfc_delivery_cb* cb)
+{
+    const struct nci_rf_set_listen_mode_routing_cmd* payload;
+    const uint8_t* entry;
+    const uint8_t* end;
+    uint8_t i;
 
-    nfc_delivery_cb_setup(cb, NTFN_BUF, ntf,
-        nfc_delivery_t3t_polling_cmd_cb);
+    assert(cmd);
+    assert(nfc);
+
+    payload = (const struct nci_rf_set_listen_mode_routing_cmd*)
+        cmd->control.payload;
+    end = cmd->control.payload + cmd->control.l;
+
+    if ((cmd->control.l < sizeof(*payload)) ||
+        !routing_entries_are_valid(payload->entry, end,
+                                   payload->nentries)) {
+        return create_control_status_rsp(rsp, cmd->control.gid,
+                                         cmd->control.oid,
+                                         NCI_STATUS_SYNTAX_ERROR);
+    }
+
+    /* the first part of a table replaces the old one */
+    if (!nfc->routing.more) {
+        nfc_routing_clear(&nfc->routing);
+    }
+
+    for (entry = payload->entry, i = 0; i < payload->nentries; ++i) {
+        const struct nci_routing_entry* e =
+            (const struct nci_routing_entry*)entry;
+
+        switch (e->type) {
+            case NCI_ROUTING_ENTRY_PROTOCOL:
+                if ((e->len == 3) &&
+                    (e->value[0] == NCI_RF_PROTOCOL_ISO_DEP)) {
+                    nfc->routing.iso_dep = e->nfceeid;
+                }
+                break;
+            case NCI_ROUTING_ENTRY_AID:
+                if (nfc_routing_add_aid(&nfc->routing, e->value,
+                                        e->len - 2, e->nfceeid) < 0) {
+                    return create_control_status_rsp(rsp,
+                                                     cmd->control.gid,
+                                                     cmd->control.oid,
+                                                     NCI_STATUS_FAILED);
+                }
+                break;
+            default:
+                /* technology routes don't concern the emulated
+                 * NFCEE; all reader traffic is ISO-DEP */
+                break;
+        }
+        entry += e->len + 2;
+    }
+
+    nfc->routing.more = payload->more;
 
     return create_control_status_rsp(rsp, cmd->control.gid,
                                      cmd->control.oid, NCI_STATUS_OK);
 }
 
+static ssize_t
+nfc_delivery_nfcee_discover_cmd_cb(void* data, union nci_packet* pkt)
+{
+    struct nfc_device* nfc;
+
+    assert(data);
+
+    nfc = data;
+
+    return nfc_create_nfcee_discover_ntf(&nfc->nfcee, pkt);
+}
+
+/* [NCI] Sec 9.2 */
 static size_t
 init_process_oid_nfcee_discover_cmd(const union nci_packet* cmd,
                                     struct nfc_device* nfc,
@@ -814,18 +856,54 @@ init_process_oid_nfcee_discover_cmd(const union nci_packet* cmd,
     struct nci_nfcee_discovery_rsp* payload =
         (struct nci_nfcee_discovery_rsp*)rsp->control.payload;
 
+    if (cmd->control.payload[0] == NCI_NFCEE_DISCOVERY_ENABLED) {
+        nfc_delivery_cb_setup(cb, NTFN_BUF, nfc,
+                              nfc_delivery_nfcee_discover_cmd_cb);
+    }
+
     payload->status = NCI_STATUS_OK;
-    payload->nnfcees = 0; /* no NFCEEs for now */
+    payload->nnfcees = 1; /* the emulated secure element */
 
     return create_control_rsp(rsp, NCI_PBF_END, cmd->control.gid,
                               cmd->control.oid, sizeof(*payload));
 }
 
+/* [NCI] Sec 9.3 */
 static size_t
-init_process_oid_bcm2079x_get_build_info_cmd(const union nci_packet* cmd,
-                                             struct nfc_device* nfc,
-                                             union nci_packet* rsp,
-                                             struct nfc_delivery_cb* cb)
+init_process_oid_nfcee_mode_set_cmd(const union nci_packet* cmd,
+                                    struct nfc_device* nfc,
+                                    union nci_packet* rsp,
+                                    struct nfc_delivery_cb* cb)
+{
+    const struct nci_nfcee_mode_set_cmd* payload =
+        (const struct nci_nfcee_mode_set_cmd*)cmd->control.payload;
+    uint8_t status;
+
+    if (cmd->control.l < sizeof(*payload)) {
+        status = NCI_STATUS_SYNTAX_ERROR;
+    } else if (payload->nfceeid != nfc->nfcee.id) {
+        status = NCI_STATUS_REJECTED;
+    } else if (payload->mode == NCI_NFCEE_MODE_ENABLE) {
+        nfc->nfcee.enabled = 1;
+        status = NCI_STATUS_OK;
+    } else if (payload->mode == NCI_NFCEE_MODE_DISABLE) {
+        nfc->nfcee.enabled = 0;
+        status = NCI_STATUS_OK;
+    } else {
+        status = NCI_STATUS_INVALID_PARAM;
+    }
+
+    return create_control_status_rsp(rsp, cmd->control.gid,
+                                     cmd->control.oid, status);
+}
+
+/* BCM2079x vendor commands */
+
+static size_t
+process_oid_bcm2079x_get_build_info_cmd(const union nci_packet* cmd,
+                                        struct nfc_device* nfc,
+                                        union nci_packet* rsp,
+                                        struct nfc_delivery_cb* cb)
 {
     // status code
     rsp->control.payload[0] = NCI_STATUS_OK;
@@ -874,30 +952,30 @@ init_process_oid_bcm2079x_get_build_info_cmd(const union nci_packet* cmd,
 }
 
 static size_t
-init_process_oid_bcm2079x_hci_netwk_cmd(const union nci_packet* cmd,
-                                        struct nfc_device* nfc,
-                                        union nci_packet* rsp,
-                                        struct nfc_delivery_cb* cb)
+process_oid_bcm2079x_hci_netwk_cmd(const union nci_packet* cmd,
+                                   struct nfc_device* nfc,
+                                   union nci_packet* rsp,
+                                   struct nfc_delivery_cb* cb)
 {
     return create_control_status_rsp(rsp, cmd->control.gid,
                                      cmd->control.oid, NCI_STATUS_OK);
 }
 
 static size_t
-init_process_oid_bcm2079x_set_fwfsm_cmd(const union nci_packet* cmd,
-                                        struct nfc_device* nfc,
-                                        union nci_packet* rsp,
-                                        struct nfc_delivery_cb* cb)
+process_oid_bcm2079x_set_fwfsm_cmd(const union nci_packet* cmd,
+                                   struct nfc_device* nfc,
+                                   union nci_packet* rsp,
+                                   struct nfc_delivery_cb* cb)
 {
     return create_control_status_rsp(rsp, cmd->control.gid,
                                      cmd->control.oid, NCI_STATUS_OK);
 }
 
 static size_t
-init_process_oid_bcm2079x_get_patch_version_cmd(const union nci_packet* cmd,
-                                                struct nfc_device* nfc,
-                                                union nci_packet* rsp,
-                                                struct nfc_delivery_cb* cb)
+process_oid_bcm2079x_get_patch_version_cmd(const union nci_packet* cmd,
+                                           struct nfc_device* nfc,
+                                           union nci_packet* rsp,
+                                           struct nfc_delivery_cb* cb)
 {
     struct nci_bcm2079x_get_patch_version_rsp* payload;
 
@@ -930,93 +1008,144 @@ init_process_oid_bcm2079x_get_patch_version_cmd(const union nci_packet* cmd,
                               cmd->control.oid, sizeof(*payload));
 }
 
-static size_t
-init_process_cmd(const union nci_packet* cmd, struct nfc_device* nfc,
-                 union nci_packet* rsp, struct nfc_delivery_cb* cb)
-{
-    /* fill NULL pointers if necessary */
-    static size_t (* const core_oid[NUMBER_OF_NCI_CMDS])
-      (const union nci_packet*, struct nfc_device*, union nci_packet*,
-       struct nfc_delivery_cb* cb) = {
-        [NCI_OID_CORE_RESET_CMD] = init_process_oid_core_reset_cmd,
-        [NCI_OID_CORE_INIT_CMD] = create_semantic_error_rsp,
-        [NCI_OID_CORE_SET_CONFIG_CMD] = init_process_oid_core_set_config_cmd,
-        [NCI_OID_CORE_GET_CONFIG_CMD] = NULL,
-        [NCI_OID_CORE_CONN_CREATE_CMD] = NULL,
-        [NCI_OID_CORE_CONN_CLOSE_CMD] = NULL
-    };
-    static size_t (* const rf_oid[NUMBER_OF_NCI_CMDS])
-      (const union nci_packet*, struct nfc_device*, union nci_packet*,
-       struct nfc_delivery_cb* cb) = {
-        [NCI_OID_RF_DISCOVER_MAP_CMD] = init_process_oid_rf_discover_map_cmd,
-        [NCI_OID_RF_SET_LISTEN_MODE_ROUTING_CMD] = NULL,
-        [NCI_OID_RF_GET_LISTEN_MODE_ROUTING_CMD] = NULL,
-        [NCI_OID_RF_DISCOVER_CMD] = init_process_oid_rf_discover_cmd,
-        [NCI_OID_RF_DISCOVER_SELECT_CMD] = init_process_oid_rf_discover_select_cmd,
-        [NCI_OID_RF_DEACTIVATED_CMD] = init_process_oid_rf_deactivate_cmd,
-        [NCI_OID_RF_T3T_POLLING_CMD] = init_process_oid_t3t_polling_cmd,
-        [NCI_OID_RF_PARAMETER_UPDATE_CMD] = NULL
-    };
-    static size_t (* const nfcee_oid[NUMBER_OF_NCI_CMDS])
-      (const union nci_packet*, struct nfc_device*, union nci_packet*,
-       struct nfc_delivery_cb* cb) = {
-        [NCI_OID_NFCEE_DISCOVER_CMD] = init_process_oid_nfcee_discover_cmd,
-        [NCI_OID_NFCEE_MODE_SET_CMD] = NULL
-    };
-    static size_t (* const prop_oid[NUMBER_OF_NCI_CMDS])
-      (const union nci_packet*, struct nfc_device*, union nci_packet*,
-       struct nfc_delivery_cb* cb) = {
-        [NCI_OID_BCM2079x_GET_BUILD_INFO_CMD] = init_process_oid_bcm2079x_get_build_info_cmd,
-        [NCI_OID_BCM2079x_HCI_NETWK_CMD] = init_process_oid_bcm2079x_hci_netwk_cmd,
-        [NCI_OID_BCM2079x_SET_FWFSM_CMD] = init_process_oid_bcm2079x_set_fwfsm_cmd,
-        [NCI_OID_BCM2079x_GET_PATCH_VERSION_CMD] = init_process_oid_bcm2079x_get_patch_version_cmd
-    };
-
-    size_t (*process)(const union nci_packet*, struct nfc_device*,
-                      union nci_packet* rsp, struct nfc_delivery_cb* cb);
-
-    assert(cmd);
-
-    NFC_D("gid=0x%x oid=0x%x", cmd->control.gid, cmd->control.oid);
+/*
+ * Command dispatching
+ */
 
-    if (cmd->control.gid == NCI_GID_CORE) {
-        process = core_oid[cmd->control.oid];
-    } else if (cmd->control.gid == NCI_GID_RF) {
-        process = rf_oid[cmd->control.oid];
-    } else if (cmd->control.gid == NCI_GID_NFCEE) {
-        process = nfcee_oid[cmd->control.oid];
-    } else if (cmd->control.gid == NCI_GID_PROP) {
-        process = prop_oid[cmd->control.oid];
-    } else {
-        process = NULL;
+const struct nfc_nci_cmd_table nfc_nci_default_cmd_table = {
+    .cmd = {
+        [NFC_FSM_STATE_IDLE] = {
+            [NCI_GID_CORE] = {
+                [NCI_OID_CORE_RESET_CMD] = process_oid_core_reset_cmd,
+                [NCI_OID_CORE_INIT_CMD] = create_semantic_error_rsp,
+                [NCI_OID_CORE_SET_CONFIG_CMD] = create_semantic_error_rsp,
+                [NCI_OID_CORE_GET_CONFIG_CMD] = create_semantic_error_rsp,
+                [NCI_OID_CORE_CONN_CREATE_CMD] = create_semantic_error_rsp,
+                [NCI_OID_CORE_CONN_CLOSE_CMD] = create_semantic_error_rsp
+            },
+            [NCI_GID_RF] = {
+                [NCI_OID_RF_DISCOVER_MAP_CMD] = create_semantic_error_rsp,
+                [NCI_OID_RF_SET_LISTEN_MODE_ROUTING_CMD] =
+                    create_semantic_error_rsp,
+                [NCI_OID_RF_GET_LISTEN_MODE_ROUTING_CMD] =
+                    create_semantic_error_rsp,
+                [NCI_OID_RF_DISCOVER_CMD] = create_semantic_error_rsp,
+                [NCI_OID_RF_DISCOVER_SELECT_CMD] = create_semantic_error_rsp,
+                [NCI_OID_RF_DEACTIVATED_CMD] = create_semantic_error_rsp,
+                [NCI_OID_RF_T3T_POLLING_CMD] = create_semantic_error_rsp,
+                [NCI_OID_RF_PARAMETER_UPDATE_CMD] = create_semantic_error_rsp
+            },
+            [NCI_GID_NFCEE] = {
+                [NCI_OID_NFCEE_DISCOVER_CMD] = create_semantic_error_rsp,
+                [NCI_OID_NFCEE_MODE_SET_CMD] = create_semantic_error_rsp
+            },
+            [NCI_GID_PROP] = {
+                [NCI_OID_BCM2079x_GET_BUILD_INFO_CMD] =
+                    process_oid_bcm2079x_get_build_info_cmd,
+                [NCI_OID_BCM2079x_HCI_NETWK_CMD] = create_semantic_error_rsp,
+                [NCI_OID_BCM2079x_SET_FWFSM_CMD] = create_semantic_error_rsp,
+                [NCI_OID_BCM2079x_GET_PATCH_VERSION_CMD] =
+                    process_oid_bcm2079x_get_patch_version_cmd
+            }
+        },
+        [NFC_FSM_STATE_RESET] = {
+            [NCI_GID_CORE] = {
+                [NCI_OID_CORE_RESET_CMD] = create_semantic_error_rsp,
+                [NCI_OID_CORE_INIT_CMD] = reset_process_oid_core_init_cmd,
+                [NCI_OID_CORE_SET_CONFIG_CMD] = create_semantic_error_rsp,
+                [NCI_OID_CORE_GET_CONFIG_CMD] = create_semantic_error_rsp,
+                [NCI_OID_CORE_CONN_CREATE_CMD] = create_semantic_error_rsp,
+                [NCI_OID_CORE_CONN_CLOSE_CMD] = create_semantic_error_rsp
+            },
+            [NCI_GID_RF] = {
+                [NCI_OID_RF_DISCOVER_MAP_CMD] = create_semantic_error_rsp,
+                [NCI_OID_RF_SET_LISTEN_MODE_ROUTING_CMD] =
+                    create_semantic_error_rsp,
+                [NCI_OID_RF_GET_LISTEN_MODE_ROUTING_CMD] =
+                    create_semantic_error_rsp,
+                [NCI_OID_RF_DISCOVER_CMD] = create_semantic_error_rsp,
+                [NCI_OID_RF_DISCOVER_SELECT_CMD] = create_semantic_error_rsp,
+                [NCI_OID_RF_DEACTIVATED_CMD] = create_semantic_error_rsp,
+                [NCI_OID_RF_T3T_POLLING_CMD] = create_semantic_error_rsp,
+                [NCI_OID_RF_PARAMETER_UPDATE_CMD] = create_semantic_error_rsp
+            },
+            [NCI_GID_NFCEE] = {
+                [NCI_OID_NFCEE_DISCOVER_CMD] = create_semantic_error_rsp,
+                [NCI_OID_NFCEE_MODE_SET_CMD] = create_semantic_error_rsp
+            },
+            [NCI_GID_PROP] = {
+                [NCI_OID_BCM2079x_GET_BUILD_INFO_CMD] =
+                    create_semantic_error_rsp,
+                [NCI_OID_BCM2079x_HCI_NETWK_CMD] = create_semantic_error_rsp,
+                [NCI_OID_BCM2079x_SET_FWFSM_CMD] = create_semantic_error_rsp,
+                [NCI_OID_BCM2079x_GET_PATCH_VERSION_CMD] =
+                    create_semantic_error_rsp
+            }
+        },
+        [NFC_FSM_STATE_INITIALIZED] = {
+            [NCI_GID_CORE] = {
+                [NCI_OID_CORE_RESET_CMD] = process_oid_core_reset_cmd,
+                [NCI_OID_CORE_INIT_CMD] = create_semantic_error_rsp,
+                [NCI_OID_CORE_SET_CONFIG_CMD] =
+                    init_process_oid_core_set_config_cmd
+            },
+            [NCI_GID_RF] = {
+                [NCI_OID_RF_DISCOVER_MAP_CMD] =
+                    init_process_oid_rf_discover_map_cmd,
+                [NCI_OID_RF_SET_LISTEN_MODE_ROUTING_CMD] =
+                    init_process_oid_rf_set_listen_mode_routing_cmd,
+                [NCI_OID_RF_DISCOVER_CMD] = init_process_oid_rf_discover_cmd,
+                [NCI_OID_RF_DISCOVER_SELECT_CMD] =
+                    init_process_oid_rf_discover_select_cmd,
+                [NCI_OID_RF_DEACTIVATED_CMD] =
+                    init_process_oid_rf_deactivate_cmd,
+                [NCI_OID_RF_T3T_POLLING_CMD] = init_process_oid_t3t_polling_cmd
+            },
+            [NCI_GID_NFCEE] = {
+                [NCI_OID_NFCEE_DISCOVER_CMD] =
+                    init_process_oid_nfcee_discover_cmd,
+                [NCI_OID_NFCEE_MODE_SET_CMD] =
+                    init_process_oid_nfcee_mode_set_cmd
+            },
+            [NCI_GID_PROP] = {
+                [NCI_OID_BCM2079x_GET_BUILD_INFO_CMD] =
+                    process_oid_bcm2079x_get_build_info_cmd,
+                [NCI_OID_BCM2079x_HCI_NETWK_CMD] =
+                    process_oid_bcm2079x_hci_netwk_cmd,
+                [NCI_OID_BCM2079x_SET_FWFSM_CMD] =
+                    process_oid_bcm2079x_set_fwfsm_cmd,
+                [NCI_OID_BCM2079x_GET_PATCH_VERSION_CMD] =
+                    process_oid_bcm2079x_get_patch_version_cmd
+            }
+        }
     }
-
-    assert(process);
-    if (!process)
-        return 0; /* [NCI] SEC 3.2.2, ignore unknown commands */
-
-    return process(cmd, nfc, rsp, cb);
-}
+};
 
 static size_t
 process_nci_cmd(const union nci_packet* cmd, struct nfc_device* nfc,
                 union nci_packet* rsp, struct nfc_delivery_cb* cb)
 {
-    static size_t (* const process[NUMBER_OF_NFC_FSM_STATES])
-      (const union nci_packet*, struct nfc_device*, union nci_packet*,
-       struct nfc_delivery_cb* cb) = {
-        [NFC_FSM_STATE_IDLE] = idle_process_cmd,
-        [NFC_FSM_STATE_RESET] = reset_process_cmd,
-        [NFC_FSM_STATE_INITIALIZED] = init_process_cmd
-    };
+    nfcemu_nci_cmd_handler* process;
+
+    assert(cmd);
+    assert(nfc);
 
-    NFC_D("NCI mt=%d pbf=%d unused=%d; NFC state=%d",
-          cmd->common.mt, cmd->common.pbf, cmd->common.unused, nfc->state);
+    NFC_D("NCI mt=%d pbf=%d unused=%d; NFC state=%d gid=0x%x oid=0x%x",
+          cmd->common.mt, cmd->common.pbf, cmd->common.unused, nfc->state,
+          cmd->control.gid, cmd->control.oid);
 
     assert(nfc->state < NUMBER_OF_NFC_FSM_STATES);
-    assert(process[nfc->state]);
 
-    return process[nfc->state](cmd, nfc, rsp, cb);
+    /* GID and OID are 4- and 6-bit fields, so they always index
+     * into the tables */
+    ++nfc->stats.nci_cmd[cmd->control.gid][cmd->control.oid];
+
+    process = nfc->nci_cmd->cmd[nfc->state][cmd->control.gid]
+                               [cmd->control.oid];
+    if (!process) {
+        return 0; /* [NCI] SEC 3.2.2, ignore unknown commands */
+    }
+    return process(cmd, nfc, rsp, cb);
 }
 
 /*
@@ -1030,7 +1159,9 @@ nfc_process_nci_msg(const union nci_packet* pkt, struct nfc_device* nfc,
     assert(pkt);
 
     if (pkt->common.mt == NCI_MT_DTA) {
-        return process_nci_dta(pkt, nfc, rsp);
+        size_t len = process_nci_dta(pkt, nfc, rsp);
+        nfc_update_dta_credits(nfc);
+        return len;
     } else if (pkt->common.mt == NCI_MT_CMD) {
         return process_nci_cmd(pkt, nfc, rsp, cb);
     } else {
@@ -1060,13 +1191,31 @@ nfc_create_nci_ntf(union nci_packet* ntf, enum nci_pbf pbf,
     return 3 + l;
 }
 
+static size_t
+create_rf_discover_ntf(const struct nfc_re* re,
+                       enum nci_notification_type type,
+                       const struct nfc_device* nfc, union nci_packet* ntf)
+{
+    struct nci_rf_discover_ntf* payload;
+
+    payload = (struct nci_rf_discover_ntf*)ntf->control.payload;
+    payload->id = re->id;
+    payload->rfproto = re->rfproto;
+    payload->mode = nfc->rf[0].mode;
+    payload->nparams = 0;
+    payload->end[payload->nparams] = type;
+
+    return nfc_create_nci_ntf(ntf, NCI_PBF_END, NCI_GID_RF,
+                              NCI_OID_RF_DISCOVER_NTF,
+                              sizeof(*payload)+payload->nparams+1);
+}
+
 size_t
 nfc_create_rf_discovery_ntf(struct nfc_re* re,
                             enum nci_notification_type type,
                             struct nfc_device* nfc,
                             union nci_packet* ntf)
 {
-    struct nci_rf_discover_ntf* payload;
     unsigned long bits;
     enum nfc_rfst rfst;
 
@@ -1077,28 +1226,16 @@ nfc_create_rf_discovery_ntf(struct nfc_re* re,
         return 0; /* RE already discovered */
     }
 
-    ntf->control.mt = NCI_MT_NTF;
-    ntf->control.pbf = NCI_PBF_END;
-    ntf->control.gid = NCI_GID_RF;
-    ntf->control.oid = NCI_OID_RF_DISCOVER_NTF;
-
-    re->id = nfc_device_incr_id(nfc);
-
-    payload = (struct nci_rf_discover_ntf*)ntf->control.payload;
-    payload->id = re->id;
-    payload->rfproto = re->rfproto;
-    payload->mode = nfc->rf[0].mode;
-    payload->nparams = 0;
+    nfc_device_set_re_id(nfc, re);
 
     switch (nfc->rf_state) {
         case NFC_RFST_DISCOVERY:
             assert(type == NCI_MORE_NOTIFICATIONS);
-            payload->end[payload->nparams] = NCI_MORE_NOTIFICATIONS;
+            type = NCI_MORE_NOTIFICATIONS;
             bits = NFC_RFST_DISCOVERY_BIT;
             rfst = NFC_RFST_W4_ALL_DISCOVERIES;
             break;
         case NFC_RFST_W4_ALL_DISCOVERIES:
-            payload->end[payload->nparams] = type;
             bits = NFC_RFST_W4_ALL_DISCOVERIES_BIT;
             if (type == NCI_MORE_NOTIFICATIONS) {
                 rfst = NFC_RFST_W4_ALL_DISCOVERIES;
@@ -1115,9 +1252,107 @@ nfc_create_rf_discovery_ntf(struct nfc_re* re,
     rfst = nfc_rf_state_transition(&nfc->rf_state, bits, rfst);
     assert(rfst != NUMBER_OF_NFC_RFSTS);
 
-    return nfc_create_nci_ntf(ntf, NCI_PBF_END, NCI_GID_RF,
-                              NCI_OID_RF_DISCOVER_NTF,
-                              sizeof(*payload)+payload->nparams+1);
+    return create_rf_discover_ntf(re, type, nfc, ntf);
+}
+
+struct nfc_rf_discovery_ntfs_param {
+    struct nfc_re* const* re;
+    size_t nres;
+    size_t i;
+    int done;
+};
+
+static ssize_t
+create_next_rf_discover_ntf(void* data, struct nfc_device* nfc,
+                            size_t maxlen, union nci_packet* ntf)
+{
+    struct nfc_rf_discovery_ntfs_param* param = data;
+    struct nfc_re* re;
+    size_t i;
+
+    assert(param);
+    assert(ntf);
+
+    if (maxlen < 3 + sizeof(struct nci_rf_discover_ntf) + 1) {
+        return -1;
+    }
+
+    /* skip REs that have been discovered before */
+    while (param->re[param->i]->id) {
+        ++param->i;
+    }
+    re = param->re[param->i++];
+    nfc_device_set_re_id(nfc, re);
+
+    /* LAST, unless another undiscovered RE follows */
+    for (i = param->i; (i < param->nres) && param->re[i]->id; ++i) { }
+    param->done = (i == param->nres);
+
+    return create_rf_discover_ntf(re, param->done ? NCI_LAST_NOTIFICATION :
+                                                    NCI_MORE_NOTIFICATIONS,
+                                  nfc, ntf);
+}
+
+/* Sends RF_DISCOVER_NTF for all REs in 're' that haven't been
+ * discovered, the last one with type LAST, and moves to
+ * RFST_W4_HOST_SELECT afterwards. If the host refuses a notification,
+ * moves to RFST_W4_ALL_DISCOVERIES, unless none got sent. The REs have
+ * to be distinct.
+ * [NCI] Sec 5.2.2 */
+int
+nfc_send_rf_discovery_ntfs(struct nfc_device* nfc,
+                           struct nfc_re* const* re, size_t nres)
+{
+    struct nfc_rf_discovery_ntfs_param param = {
+        .re = re,
+        .nres = nres,
+        .i = 0,
+        .done = 0
+    };
+    size_t i, n, nsent;
+    enum nfc_rfst rfst;
+    int res = 0;
+
+    assert(nfc);
+    assert(re || !nres);
+
+    for (i = 0, n = 0; i < nres; ++i) {
+        n += !re[i]->id;
+    }
+
+    /* a single RE gets activated from RFST_DISCOVERY */
+    if (!((nfc->rf_state == NFC_RFST_DISCOVERY) && (n > 1)) &&
+        !((nfc->rf_state == NFC_RFST_W4_ALL_DISCOVERIES) && n)) {
+        NFC_D("can't discover %zu REs in RF state %d", n, nfc->rf_state);
+        return -1;
+    }
+
+    nsent = 0;
+
+    do {
+        i = param.i;
+        if ((nfc->cb->send_ntf(nfc, create_next_rf_discover_ntf,
+                               &param) < 0) || (param.i == i)) {
+            res = -1; /* host didn't take the notification */
+            break;
+        }
+        ++nsent;
+    } while (!param.done);
+
+    /* the guest hasn't seen a notification; stay in RFST_DISCOVERY */
+    if (!nsent) {
+        return res;
+    }
+
+    /* the guest waits for more notifications if we didn't send all */
+    rfst = nfc_rf_state_transition(&nfc->rf_state,
+                                   NFC_RFST_DISCOVERY_BIT|
+                                   NFC_RFST_W4_ALL_DISCOVERIES_BIT,
+                                   res ? NFC_RFST_W4_ALL_DISCOVERIES :
+                                         NFC_RFST_W4_HOST_SELECT);
+    assert(rfst != NUMBER_OF_NFC_RFSTS);
+
+    return res;
 }
 
 size_t
@@ -1144,15 +1379,23 @@ nfc_create_rf_intf_activated_ntf(struct nfc_re* re,
     payload = (struct nci_rf_intf_activated_ntf*)ntf->control.payload;
 
     if (!re->id) {
-        re->id = nfc_device_incr_id(nfc);
+        nfc_device_set_re_id(nfc, re);
     }
 
+    /* drop incomplete data from previous activations */
+    nfc->rx_len = 0;
+
     payload->id = re->id;
     payload->iface = nfc->active_rf->iface;
     payload->rfproto = re->rfproto;
     payload->actmode = nfc->active_rf->mode;
-    payload->maxpayload = 255;
-    payload->ncredits = 0xff; /* disable flow control */
+    payload->maxpayload = NCI_MAX_DTA_PAYLOAD_LENGTH;
+    if (nfc->max_dta_credits == NCI_DTA_CREDITS_UNLIMITED) {
+        payload->ncredits = NCI_DTA_CREDITS_UNLIMITED; /* no flow control */
+    } else {
+        nfc->dta_credits = dta_credits_limit(nfc, re);
+        payload->ncredits = nfc->dta_credits;
+    }
     payload->nparams = nfc_re_create_rf_intf_activated_ntf_tech(
         payload->actmode, re, payload->param);
 
@@ -1186,6 +1429,8 @@ nfc_create_rf_intf_activated_ntf(struct nfc_re* re,
             break;
         default:
             assert(0);
+            bits = 0;
+            rfst = NUMBER_OF_NFC_RFSTS;
             break;
     }
 
@@ -1199,6 +1444,10 @@ nfc_create_rf_intf_activated_ntf(struct nfc_re* re,
     }
     assert(nfc->active_re == re);
 
+    if (re->reader) {
+        nfc_hce_reader_activate(re);
+    }
+
     return nfc_create_nci_ntf(ntf, NCI_PBF_END, NCI_GID_RF,
                               NCI_OID_RF_INTF_ACTIVATED_NTF,
                               sizeof(*payload)+payload->nparams+
@@ -1275,3 +1524,49 @@ nfc_create_rf_field_info_ntf(struct nfc_device* nfc,
     return nfc_create_nci_ntf(ntf, NCI_PBF_END, NCI_GID_RF,
                               NCI_OID_RF_FIELD_INFO_NTF, sizeof(*payload));
 }
+
+size_t
+nfc_create_rf_nfcee_action_ntf(uint8_t nfceeid, enum nci_nfcee_trigger trigger,
+                               const uint8_t* data, size_t len,
+                               union nci_packet* ntf)
+{
+    struct nci_rf_nfcee_action_ntf* payload;
+
+    assert(data || !len);
+    assert(ntf);
+
+    if (len > MAX_NCI_PAYLOAD_LENGTH - sizeof(*payload)) {
+        len = MAX_NCI_PAYLOAD_LENGTH - sizeof(*payload);
+    }
+
+    payload = (struct nci_rf_nfcee_action_ntf*)ntf->control.payload;
+    payload->nfceeid = nfceeid;
+    payload->trigger = trigger;
+    payload->len = len;
+    memcpy(payload->data, data, len);
+
+    return nfc_create_nci_ntf(ntf, NCI_PBF_END, NCI_GID_RF,
+                              NCI_OID_RF_NFCEE_ACTION_NTF,
+                              sizeof(*payload) + len);
+}
+
+size_t
+nfc_create_nfcee_discover_ntf(const struct nfc_nfcee* nfcee,
+                              union nci_packet* ntf)
+{
+    struct nci_nfcee_discovery_ntf* payload;
+
+    assert(nfcee);
+    assert(ntf);
+
+    payload = (struct nci_nfcee_discovery_ntf*)ntf->control.payload;
+    payload->nfceeid = nfcee->id;
+    payload->status = nfcee->enabled ? NCI_NFCEE_STATUS_ENABLED
+                                     : NCI_NFCEE_STATUS_DISABLED;
+    payload->nprotos = 1;
+    payload->proto = NCI_NFCEE_PROTOCOL_APDU;
+    payload->ntlvs = 0;
+
+    return nfc_create_nci_ntf(ntf, NCI_PBF_END, NCI_GID_NFCEE,
+                              NCI_OID_NFCEE_DISCOVER_NTF, sizeof(*payload));
+}
@@ -26,6 +26,7 @@
 
 struct nfc_device;
 struct nfc_re;
+struct nfc_nfcee;
 struct nfc_delivery_cb;
 
 enum nci_mt {
@@ -40,6 +41,17 @@ enum nci_pbf {
     NCI_PBF_SEG = 0x1
 };
 
+enum {
+    /* maximum payload of data packets in both directions, as
+     * announced in RF_INTF_ACTIVATED_NTF */
+    NCI_MAX_DTA_PAYLOAD_LENGTH = 255
+};
+
+enum {
+    /* credit count that disables data flow control */
+    NCI_DTA_CREDITS_UNLIMITED = 0xff
+};
+
 enum nci_gid {
     NCI_GID_CORE = 0x0,
     NCI_GID_RF = 0x1,
@@ -47,6 +59,10 @@ enum nci_gid {
     NCI_GID_PROP = 0xf
 };
 
+enum {
+    NUMBER_OF_NCI_GIDS = 16
+};
+
 enum nci_oid {
     /* GID == 0x0 */
     NCI_OID_CORE_RESET_CMD = 0x00,
@@ -525,6 +541,79 @@ struct nci_nfcee_discovery_rsp {
     uint8_t nnfcees;
 };
 
+/* [NCI] Table 89 */
+enum nci_nfcee_status {
+    NCI_NFCEE_STATUS_ENABLED = 0x00,
+    NCI_NFCEE_STATUS_DISABLED = 0x01,
+    NCI_NFCEE_STATUS_REMOVED = 0x02
+};
+
+/* [NCI] Table 90 */
+enum nci_nfcee_protocol {
+    NCI_NFCEE_PROTOCOL_APDU = 0x00,
+    NCI_NFCEE_PROTOCOL_HCI_ACCESS = 0x01,
+    NCI_NFCEE_PROTOCOL_T3T_CMD_SET = 0x02,
+    NCI_NFCEE_PROTOCOL_TRANSPARENT = 0x03
+};
+
+/* with a single protocol and no information TLVs */
+struct nci_nfcee_discovery_ntf {
+    uint8_t nfceeid;
+    uint8_t status;
+    uint8_t nprotos;
+    uint8_t proto;
+    uint8_t ntlvs;
+} __attribute__((packed));
+
+/* NCI_NFCEE_MODE_SET */
+
+enum nci_nfcee_mode {
+    NCI_NFCEE_MODE_DISABLE = 0x00,
+    NCI_NFCEE_MODE_ENABLE = 0x01
+};
+
+struct nci_nfcee_mode_set_cmd {
+    uint8_t nfceeid;
+    uint8_t mode;
+};
+
+/* NCI_RF_SET_LISTEN_MODE_ROUTING, [NCI] Sec 6.3.2 */
+
+enum nci_routing_entry_type {
+    NCI_ROUTING_ENTRY_TECHNOLOGY = 0x00,
+    NCI_ROUTING_ENTRY_PROTOCOL = 0x01,
+    NCI_ROUTING_ENTRY_AID = 0x02
+};
+
+struct nci_rf_set_listen_mode_routing_cmd {
+    uint8_t more;
+    uint8_t nentries;
+    uint8_t entry[0]; /* struct nci_routing_entry */
+} __attribute__((packed));
+
+/* the value starts with the NFCEE id and the power state, followed
+ * by the technology, the protocol or the AID */
+struct nci_routing_entry {
+    uint8_t type;
+    uint8_t len;
+    uint8_t nfceeid;
+    uint8_t power;
+    uint8_t value[0];
+} __attribute__((packed));
+
+/* NCI_RF_NFCEE_ACTION */
+
+enum nci_nfcee_trigger {
+    NCI_NFCEE_TRIGGER_SELECT = 0x00
+};
+
+struct nci_rf_nfcee_action_ntf {
+    uint8_t nfceeid;
+    uint8_t trigger;
+    uint8_t len;
+    uint8_t data[0];
+} __attribute__((packed));
+
 /* NCI_BCM2079x_GET_PATCH_VERSION */
 
 enum {
@@ -549,13 +638,24 @@ struct nci_bcm2079x_get_patch_version_rsp {
     uint8_t nvmtype;
 } __attribute__((packed));
 
+/* NCI command handlers, indexed by the controller state and the
+ * command's GID and OID; NULL entries ignore the command */
+struct nfc_nci_cmd_table {
+    nfcemu_nci_cmd_handler* cmd[NUMBER_OF_NFC_FSM_STATES]
+                               [NUMBER_OF_NCI_GIDS]
+                               [NUMBER_OF_NCI_CMDS];
+};
+
+/* built-in command handlers, including the BCM2079x vendor commands */
+extern const struct nfc_nci_cmd_table nfc_nci_default_cmd_table;
+
 size_t
 nfc_process_nci_msg(const union nci_packet* pkt, struct nfc_device* nfc,
                     union nci_packet* rsp, struct nfc_delivery_cb* cb);
 
 size_t
-nfc_create_nci_dta(union nci_packet* rsp, enum nci_pbf pbf,
-                   uint8_t connid, unsigned char l);
+nfc_create_nci_dta(struct nfc_device* nfc, union nci_packet* rsp,
+                   enum nci_pbf pbf, uint8_t connid, unsigned char l);
 
 size_t
 nfc_create_nci_ntf(union nci_packet* ntf, enum nci_pbf pbf,
@@ -567,6 +667,10 @@ nfc_create_rf_discovery_ntf(struct nfc_re* re,
                             struct nfc_device* nfc,
                             union nci_packet* ntf);
 
+int
+nfc_send_rf_discovery_ntfs(struct nfc_device* nfc,
+                           struct nfc_re* const* re, size_t nres);
+
 size_t
 nfc_create_rf_intf_activated_ntf(struct nfc_re* re,
                                  struct nfc_device* nfc,
@@ -585,9 +689,32 @@ size_t
 nfc_create_rf_field_info_ntf(struct nfc_device* nfc,
                              union nci_packet* ntf);
 
+size_t
+nfc_create_rf_nfcee_action_ntf(uint8_t nfceeid, enum nci_nfcee_trigger trigger,
+                               const uint8_t* data, size_t len,
+                               union nci_packet* ntf);
+
+size_t
+nfc_create_nfcee_discover_ntf(const struct nfc_nfcee* nfcee,
+                              union nci_packet* ntf);
+
 size_t
 nfc_create_dta(const void* data, size_t len,
                struct nfc_device* nfc,
                union nci_packet* nci);
 
+int
+nfc_send_nci_dta(struct nfc_device* nfc, uint8_t connid,
+                 const void* data, size_t len);
+
+/* Sets the number of credits the host gets for the RF connection,
+ * starting with the next activation. */
+int
+nfc_set_dta_credits(struct nfc_device* nfc, unsigned long ncredits);
+
+/* Returns credits to the host, as far as the active RE's send
+ * buffer has room for more data. */
+void
+nfc_update_dta_credits(struct nfc_device* nfc);
+
 #endif
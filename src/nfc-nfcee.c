@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cb.h"
+#include "nfc-debug.h"
+#include "nfc.h"
+#include "nfc-nci.h"
+#include "nfc-nfcee.h"
+
+/* [ISO7816-4] Sec 5.1.3 */
+enum {
+    ISO_SW_WRONG_LENGTH = 0x6700,
+    ISO_SW_FILE_NOT_FOUND = 0x6a82,
+    ISO_SW_INS_NOT_SUPPORTED = 0x6d00
+};
+
+/*
+ * Applets
+ */
+
+void
+nfc_nfcee_init(struct nfc_nfcee* nfcee)
+{
+    assert(nfcee);
+
+    nfcee->id = NFC_NFCEE_ID;
+    nfcee->enabled = 0;
+    nfc_aid_trie_init(&nfcee->applet);
+}
+
+void
+nfc_nfcee_uninit(struct nfc_nfcee* nfcee)
+{
+    assert(nfcee);
+
+    nfc_aid_trie_clear(&nfcee->applet, free);
+}
+
+int
+nfc_nfcee_add_applet(struct nfc_nfcee* nfcee,
+                     const uint8_t* aid, size_t aidlen,
+                     nfcemu_apdu_handler* process, void* data,
+                     const uint8_t* rsp, size_t rsplen)
+{
+    struct nfc_nfcee_applet* applet;
+    void* old;
+
+    assert(nfcee);
+    assert(aid);
+    assert(process || rsp || !rsplen);
+
+    if ((aidlen < NFC_AID_MINIMUM_LENGTH) ||
+        (aidlen > NFC_AID_MAXIMUM_LENGTH)) {
+        NFC_D("invalid AID length %zu", aidlen);
+        return -1;
+    }
+    if (process) {
+        rsplen = 0;
+    }
+
+    applet = malloc(sizeof(*applet) + rsplen);
+    if (!applet) {
+        return -1;
+    }
+    memcpy(applet->aid, aid, aidlen);
+    applet->aidlen = aidlen;
+    applet->process = process;
+    applet->data = data;
+    applet->rsplen = rsplen;
+    if (rsplen) {
+        memcpy(applet->rsp, rsp, rsplen);
+    }
+
+    if (nfc_aid_trie_insert(&nfcee->applet, aid, aidlen, applet, &old) < 0) {
+        free(applet);
+        return -1;
+    }
+    free(old);
+
+    return 0;
+}
+
+int
+nfc_nfcee_remove_applet(struct nfc_nfcee* nfcee,
+                        const uint8_t* aid, size_t aidlen)
+{
+    struct nfc_nfcee_applet* applet;
+
+    assert(nfcee);
+
+    applet = nfc_aid_trie_remove(&nfcee->applet, aid, aidlen);
+    if (!applet) {
+        return -1;
+    }
+    free(applet);
+
+    return 0;
+}
+
+/*
+ * Listen-mode routing
+ */
+
+void
+nfc_routing_init(struct nfc_routing* routing)
+{
+    assert(routing);
+
+    nfc_aid_trie_init(&routing->aid);
+    routing->iso_dep = NFC_NFCEE_ID_DH;
+    routing->more = 0;
+}
+
+void
+nfc_routing_uninit(struct nfc_routing* routing)
+{
+    assert(routing);
+
+    nfc_aid_trie_clear(&routing->aid, NULL);
+}
+
+void
+nfc_routing_clear(struct nfc_routing* routing)
+{
+    nfc_routing_uninit(routing);
+    nfc_routing_init(routing);
+}
+
+int
+nfc_routing_add_aid(struct nfc_routing* routing,
+                    const uint8_t* aid, size_t aidlen, uint8_t nfcee)
+{
+    assert(routing);
+
+    return nfc_aid_trie_insert(&routing->aid, aid, aidlen,
+                               (void*)((uintptr_t)nfcee + 1), NULL);
+}
+
+struct foreach_aid_param {
+    int (*func)(void*, const uint8_t*, size_t, uint8_t);
+    void* data;
+};
+
+static int
+foreach_aid(void* data, const uint8_t* aid, size_t aidlen, void* route)
+{
+    const struct foreach_aid_param* param = data;
+
+    return param->func(param->data, aid, aidlen, (uintptr_t)route - 1);
+}
+
+int
+nfc_routing_foreach_aid(const struct nfc_routing* routing,
+                        int (*func)(void*, const uint8_t*, size_t,
+                                    uint8_t),
+                        void* data)
+{
+    struct foreach_aid_param param = {
+        .func = func,
+        .data = data
+    };
+
+    assert(routing);
+
+    return nfc_aid_trie_foreach(&routing->aid, foreach_aid, &param);
+}
+
+static uint8_t
+route_aid(const struct nfc_routing* routing, const uint8_t* aid,
+          size_t aidlen)
+{
+    void* route;
+
+    route = nfc_aid_trie_find_longest(&routing->aid, aid, aidlen);
+    if (!route) {
+        return routing->iso_dep;
+    }
+    return (uintptr_t)route - 1;
+}
+
+/*
+ * APDU exchange
+ */
+
+struct nfc_nfcee_action_param {
+    uint8_t nfcee;
+    const uint8_t* aid;
+    size_t aidlen;
+};
+
+static ssize_t
+create_nfcee_action_ntf(void* data, struct nfc_device* nfc, size_t maxlen,
+                        union nci_packet* ntf)
+{
+    const struct nfc_nfcee_action_param* param = data;
+
+    assert(param);
+
+    return nfc_create_rf_nfcee_action_ntf(param->nfcee,
+                                          NCI_NFCEE_TRIGGER_SELECT,
+                                          param->aid, param->aidlen, ntf);
+}
+
+static ssize_t
+create_status(uint8_t* rapdu, size_t maxlen, unsigned int sw)
+{
+    if (maxlen < 2) {
+        return -1;
+    }
+    rapdu[0] = sw >> 8;
+    rapdu[1] = sw & 0xff;
+
+    return 2;
+}
+
+/* [ISO7816-4] Sec 11.2.2; SELECT by DF name, i.e., by AID */
+static int
+is_select_by_aid(const uint8_t* capdu, size_t len)
+{
+    return (len >= 5) && (capdu[1] == 0xa4) && (capdu[2] == 0x04);
+}
+
+ssize_t
+nfc_nfcee_transceive(struct nfc_device* nfc, struct nfc_apdu_session* ses,
+                     const uint8_t* capdu, size_t len,
+                     uint8_t* rapdu, size_t maxlen)
+{
+    const struct nfc_nfcee_applet* applet;
+    int select;
+
+    assert(nfc);
+    assert(ses);
+    assert(capdu || !len);
+    assert(rapdu || !maxlen);
+
+    /* the reader talks to the NFCC while it's listening */
+    if (nfc->rf_state != NFC_RFST_DISCOVERY) {
+        NFC_D("NFCC isn't in listen mode, RF state=%d", nfc->rf_state);
+        return -1;
+    }
+
+    select = is_select_by_aid(capdu, len);
+
+    if (select) {
+        const uint8_t* aid = capdu + 5;
+        size_t aidlen = capdu[4];
+
+        if (aidlen > len - 5) {
+            return create_status(rapdu, maxlen, ISO_SW_WRONG_LENGTH);
+        }
+        ses->routed = 1;
+        ses->nfcee = route_aid(&nfc->routing, aid, aidlen);
+        ses->applet = NULL;
+
+        if ((ses->nfcee == nfc->nfcee.id) && nfc->nfcee.enabled) {
+            struct nfc_nfcee_action_param param = {
+                .nfcee = ses->nfcee,
+                .aid = aid,
+                .aidlen = aidlen
+            };
+            ses->applet = nfc_aid_trie_find_first(&nfc->nfcee.applet,
+                                                  aid, aidlen);
+            /* [NCI] Sec 6.4 */
+            if (nfc->cb->send_ntf(nfc, create_nfcee_action_ntf,
+                                  &param) < 0) {
+                NFC_D("couldn't send RF_NFCEE_ACTION_NTF");
+            }
+        }
+    } else if (!ses->routed) {
+        ses->routed = 1;
+        ses->nfcee = nfc->routing.iso_dep;
+    }
+
+    if ((ses->nfcee != nfc->nfcee.id) || !nfc->nfcee.enabled) {
+        /* the DH or a disabled NFCEE */
+        NFC_D("no answer for APDU routed to NFCEE %d", ses->nfcee);
+        return -1;
+    }
+
+    ++nfc->stats.nfcee_apdus;
+
+    applet = ses->applet;
+
+    if (!applet) {
+        return create_status(rapdu, maxlen,
+                             select ? ISO_SW_FILE_NOT_FOUND
+                                    : ISO_SW_INS_NOT_SUPPORTED);
+    } else if (applet->process) {
+        return applet->process(applet->data, nfc, capdu, len, rapdu, maxlen);
+    } else if (applet->rsplen > maxlen) {
+        return -1;
+    }
+    memcpy(rapdu, applet->rsp, applet->rsplen);
+
+    return applet->rsplen;
+}
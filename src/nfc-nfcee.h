@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef nfc_nfcee_h
+#define nfc_nfcee_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <nfcemu/types.h>
+#include "nfc-aid.h"
+
+struct nfc_device;
+
+enum {
+    /* [NCI] Table 88; the DH is addressed as NFCEE 0 */
+    NFC_NFCEE_ID_DH = 0x00,
+    /* the emulated secure element */
+    NFC_NFCEE_ID = 0x01
+};
+
+/* An application on the emulated secure element. Without a handler,
+ * the applet answers all APDUs with its fixed response. */
+struct nfc_nfcee_applet {
+    uint8_t aid[NFC_AID_MAXIMUM_LENGTH];
+    size_t aidlen;
+    nfcemu_apdu_handler* process;
+    void* data;
+    size_t rsplen;
+    uint8_t rsp[0];
+};
+
+/* The emulated secure element; answers APDUs from readers in the
+ * field without involving the DH */
+struct nfc_nfcee {
+    uint8_t id;
+    int enabled; /* set by NFCEE_MODE_SET_CMD */
+    struct nfc_aid_trie applet;
+};
+
+/* Listen-mode routing table, [NCI] Sec 6.3. AID routes map to the
+ * NFCEE id plus 1, so that DH routes aren't NULL. ISO-DEP traffic
+ * without a matching AID follows the protocol route.
+ */
+struct nfc_routing {
+    struct nfc_aid_trie aid;
+    uint8_t iso_dep;
+    int more; /* the DH is sending another part of the table */
+};
+
+/* State of a reader's transaction with the card emulation: the
+ * destination of the last SELECT and its applet. */
+struct nfc_apdu_session {
+    int routed;
+    uint8_t nfcee;
+    const struct nfc_nfcee_applet* applet;
+};
+
+#define NFC_APDU_SESSION_INIT \
+    { \
+        .routed = 0, \
+        .nfcee = NFC_NFCEE_ID_DH, \
+        .applet = NULL \
+    }
+
+void
+nfc_nfcee_init(struct nfc_nfcee* nfcee);
+
+void
+nfc_nfcee_uninit(struct nfc_nfcee* nfcee);
+
+/* Adds an applet, or replaces the one with the same AID. 'rsp' is
+ * copied if the applet doesn't have a handler. */
+int
+nfc_nfcee_add_applet(struct nfc_nfcee* nfcee,
+                     const uint8_t* aid, size_t aidlen,
+                     nfcemu_apdu_handler* process, void* data,
+                     const uint8_t* rsp, size_t rsplen);
+
+int
+nfc_nfcee_remove_applet(struct nfc_nfcee* nfcee,
+                        const uint8_t* aid, size_t aidlen);
+
+void
+nfc_routing_init(struct nfc_routing* routing);
+
+void
+nfc_routing_uninit(struct nfc_routing* routing);
+
+/* Removes all routes; the protocol route goes back to the DH. */
+void
+nfc_routing_clear(struct nfc_routing* routing);
+
+int
+nfc_routing_add_aid(struct nfc_routing* routing,
+                    const uint8_t* aid, size_t aidlen, uint8_t nfcee);
+
+/* Calls 'func' with each AID route in lexicographic order of the
+ * AIDs; stops and fails if 'func' fails. */
+int
+nfc_routing_foreach_aid(const struct nfc_routing* routing,
+                        int (*func)(void*, const uint8_t*, size_t,
+                                    uint8_t),
+                        void* data);
+
+/* Exchanges an APDU of a reader with the card emulation. SELECT
+ * commands are routed by AID; every other APDU goes where the
+ * last SELECT went. Returns the length of the response, or -1 if
+ * the APDU doesn't get an answer.
+ */
+ssize_t
+nfc_nfcee_transceive(struct nfc_device* nfc, struct nfc_apdu_session* ses,
+                     const uint8_t* capdu, size_t len,
+                     uint8_t* rapdu, size_t maxlen);
+
+#endif
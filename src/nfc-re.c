@@ -15,10 +15,12 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include "ptr.h"
 #include "nfc-debug.h"
 #include "nfc.h"
+#include "nfc-hce.h"
 #include "nfc-nci.h"
 #include "nfc-tag.h"
 #include "llcp.h"
@@ -27,22 +29,6 @@
 #include "cb.h"
 #include "nfc-re.h"
 
-/* NFCID2 is defined in [Digital] Table44 */
-struct nfc_re nfc_res[6] = {
-    INIT_NFC_RE([0], NCI_RF_PROTOCOL_NFC_DEP, NCI_RF_NFC_F_PASSIVE_LISTEN_MODE,
-                NULL, "deadbeaf0", "\x01\xfe\x0\x0\x0\x0\x0", nfc_res+0),
-    INIT_NFC_RE([1], NCI_RF_PROTOCOL_NFC_DEP, NCI_RF_NFC_F_PASSIVE_LISTEN_MODE,
-                NULL, "deadbeaf1", "\x01\xfe\x0\x0\x0\x0\x1", nfc_res+1),
-    INIT_NFC_RE([2], NCI_RF_PROTOCOL_T1T, NCI_RF_NFC_A_PASSIVE_LISTEN_MODE,
-                nfc_tags+0, "deadbeaf2", "\x0\x0\x0\x0\x0\x0\x2", nfc_res+2),
-    INIT_NFC_RE([3], NCI_RF_PROTOCOL_T2T, NCI_RF_NFC_A_PASSIVE_LISTEN_MODE,
-                nfc_tags+1, "deadbeaf3", "\x0\x0\x0\x0\x0\x0\x3", nfc_res+3),
-    INIT_NFC_RE([4], NCI_RF_PROTOCOL_T3T, NCI_RF_NFC_F_PASSIVE_LISTEN_MODE,
-                nfc_tags+2, "deadbeaf4", "\x02\xfe\x0\x0\x0\x0\x4", nfc_res+4),
-    INIT_NFC_RE([5], NCI_RF_PROTOCOL_ISO_DEP, NCI_RF_NFC_A_PASSIVE_LISTEN_MODE,
-                nfc_tags+3, "deadbeaf5", "\x00\x0\x0\x0\x0\x0\x5", nfc_res+5)
-};
-
 struct create_nci_dta_param {
     ssize_t (*create)(void*, struct llcp_pdu*);
     void* data;
@@ -68,7 +54,7 @@ create_nci_dta(void* data, struct nfc_device* nfc, size_t maxlen,
     assert(param);
 
     len = param->create(param->data, (struct llcp_pdu*)dta->data.payload);
-    return nfc_create_nci_dta(dta, NCI_PBF_END, param->re->connid, len);
+    return nfc_create_nci_dta(nfc, dta, NCI_PBF_END, param->re->connid, len);
 }
 
 /* Sends an LLCP PDU from the RE to the guest. Sending
@@ -86,15 +72,15 @@ send_pdu_from_re(ssize_t (*create)(void*, struct llcp_pdu*),
         struct create_nci_dta_param param =
             CREATE_NCI_DTA_PARAM_INIT(create, data, re);
 
-        cb.send_dta(create_nci_dta, &param);
+        re->nfc->cb->send_dta(re->nfc, create_nci_dta, &param);
         re->xmit_next = 0;
         if (re->xmit_timeout) {
-            cb.del_timeout(re->xmit_timeout);
+            re->nfc->cb->del_timeout(re->xmit_timeout);
         }
     } else {
         /* we're waiting for the host to send a SYMM PDU, so
          * we queue up PDUs for later delivery */
-        struct llcp_pdu_buf* buf = llcp_alloc_pdu_buf();
+        struct llcp_pdu_buf* buf = llcp_alloc_pdu_buf(&re->nfc->pdu_pool);
         if (!buf) {
             return -1;
         }
@@ -124,7 +110,7 @@ fetch_pdu_from_re(struct llcp_pdu* llcp, struct nfc_re* re)
     len = buf->len;
     memcpy(llcp, buf->pdu, len);
     TAILQ_REMOVE(&re->xmit_q, buf, entry);
-    llcp_free_pdu_buf(buf);
+    llcp_free_pdu_buf(&re->nfc->pdu_pool, buf);
 
     return len;
 }
@@ -157,67 +143,287 @@ xmit_pdu_or_symm_from_re(struct llcp_pdu* llcp, struct nfc_re* re)
 static void
 prepare_xmit_timeout(struct nfc_re* re, void (*xmit_next_cb)(void*))
 {
+    const struct nfcemu_cb* cb = re->nfc->cb;
+
     if (!re->xmit_timeout) {
-        re->xmit_timeout = cb.new_timeout(xmit_next_cb, re);
+        re->xmit_timeout = cb->new_timeout(xmit_next_cb, re);
         assert(re->xmit_timeout);
     }
-    if (!cb.timeout_is_pending(re->xmit_timeout)) {
-        /* xmit PDU in two seconds */
-        cb.mod_timeout(re->xmit_timeout, 2000);
+    if (re->symm_adaptive) {
+        if (!TAILQ_EMPTY(&re->xmit_q)) {
+            /* xmit queued PDU right away */
+            re->symm_next_delay = LLCP_SYMM_MIN_DELAY;
+            cb->mod_timeout(re->xmit_timeout, 0);
+        } else if (!cb->timeout_is_pending(re->xmit_timeout)) {
+            /* back off while the link is idle */
+            cb->mod_timeout(re->xmit_timeout, re->symm_next_delay);
+            re->symm_next_delay = re->symm_next_delay * 2;
+            if (re->symm_next_delay > re->symm_delay) {
+                re->symm_next_delay = re->symm_delay;
+            }
+        }
+    } else if (!cb->timeout_is_pending(re->xmit_timeout)) {
+        cb->mod_timeout(re->xmit_timeout, re->symm_delay);
     }
 }
 
-struct nfc_re*
-nfc_get_re_by_id(uint8_t id)
+void
+nfc_re_init(struct nfc_re* re, struct nfc_device* nfc,
+            enum nci_rf_protocol rfproto, enum nci_rf_tech_mode mode,
+            struct nfc_tag* tag, const char* nfcid1, const char* nfcid2)
+{
+    assert(re);
+    assert(nfc);
+    assert(nfcid1);
+    assert(nfcid2);
+
+    re->nfc = nfc;
+    re->rfproto = rfproto;
+    re->mode = mode;
+    re->tag = tag;
+    re->reader = NULL;
+    memcpy(re->nfcid1, nfcid1, sizeof(re->nfcid1));
+    memcpy(re->nfcid2, nfcid2, sizeof(re->nfcid2));
+    memcpy(re->nfcid3, nfcid1, sizeof(re->nfcid3));
+    re->id = 0;
+    re->xmit_next = 0;
+    re->xmit_timeout = NULL;
+    re->lto = LLCP_DEFAULT_LTO;
+    re->symm_delay = LLCP_DEFAULT_SYMM_DELAY;
+    re->symm_adaptive = 0;
+    re->symm_next_delay = LLCP_SYMM_MIN_DELAY;
+    TAILQ_INIT(&re->xmit_q);
+    re->connid = 0;
+    re->sbufsiz = 0;
+    re->rbufsiz = 0;
+    re->llcp_dl = NULL;
+    re->llcp_ndls = 0;
+    re->llcp_nspares = 0;
+    re->llcp_maxdls = 0;
+    re->last_dsap = LLCP_SAP_LM;
+    re->last_ssap = LLCP_SAP_LM;
+}
+
+void
+nfc_re_uninit(struct nfc_re* re)
+{
+    size_t i;
+
+    assert(re);
+
+    if (re->xmit_timeout) {
+        re->nfc->cb->del_timeout(re->xmit_timeout);
+        re->xmit_timeout = NULL;
+    }
+    nfc_clear_re(re);
+
+    for (i = 0; i < re->llcp_nspares; ++i) {
+        llcp_uninit_data_link(re->llcp_dl[i]);
+        free(re->llcp_dl[i]);
+    }
+    re->llcp_nspares = 0;
+    free(re->llcp_dl);
+    re->llcp_dl = NULL;
+    re->llcp_maxdls = 0;
+}
+
+int
+nfc_re_set_llcp_timing(struct nfc_re* re, unsigned long lto,
+                       unsigned long symm_delay, int adaptive)
 {
-    struct nfc_re* pos;
-    const struct nfc_re* end;
+    assert(re);
+
+    /* LTO is transfered in steps of 10 ms */
+    if (!lto || (lto > 255 * 10)) {
+        return -1;
+    }
+    if (symm_delay < LLCP_SYMM_MIN_DELAY) {
+        return -1;
+    }
+    re->lto = lto;
+    re->symm_delay = symm_delay;
+    re->symm_adaptive = !!adaptive;
+    re->symm_next_delay = LLCP_SYMM_MIN_DELAY;
+
+    return 0;
+}
 
+struct nfc_re*
+nfc_get_re_by_id(struct nfc_device* nfc, uint8_t id)
+{
+    assert(nfc);
     assert(id);
     assert(id < 255);
 
-    pos = nfc_res;
-    end = nfc_res + sizeof(nfc_res)/sizeof(nfc_res[0]);
+    return nfc->re_by_id[id];
+}
+
+/*
+ * Data links are only allocated for SAP pairs that are actually
+ * in use. We keep them in an array sorted by remote and local SAP.
+ */
+
+static unsigned int
+dl_key(unsigned char rsap, unsigned char lsap)
+{
+    return (rsap << 8) | lsap;
+}
+
+/* Returns the index of the data link or the index where it has
+ * to be inserted. */
+static size_t
+search_dl(const struct nfc_re* re, unsigned char rsap, unsigned char lsap)
+{
+    size_t beg, end;
+    unsigned int key;
+
+    key = dl_key(rsap, lsap);
+    beg = 0;
+    end = re->llcp_ndls;
+
+    while (beg < end) {
+        size_t mid = beg + (end - beg) / 2;
+        const struct llcp_data_link* dl = re->llcp_dl[mid];
+
+        if (dl_key(dl->rsap, dl->lsap) < key) {
+            beg = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+    return beg;
+}
+
+/* Returns the data link or NULL if it doesn't exist. */
+static struct llcp_data_link*
+find_dl(const struct nfc_re* re, unsigned char rsap, unsigned char lsap)
+{
+    size_t i;
+
+    assert(re);
+    assert(rsap < LLCP_NUMBER_OF_SAPS);
+    assert(lsap < LLCP_NUMBER_OF_SAPS);
+
+    i = search_dl(re, rsap, lsap);
+    if ((i == re->llcp_ndls) ||
+        (re->llcp_dl[i]->rsap != rsap) || (re->llcp_dl[i]->lsap != lsap)) {
+        return NULL;
+    }
+    return re->llcp_dl[i];
+}
+
+/* Returns the data link and allocates it if necessary. Closed data
+ * links are reused before allocating new ones. */
+static struct llcp_data_link*
+get_dl(struct nfc_re* re, unsigned char rsap, unsigned char lsap)
+{
+    struct llcp_data_link* dl;
+    size_t i;
+
+    dl = find_dl(re, rsap, lsap);
+    if (dl) {
+        return dl;
+    }
 
-    while (pos < end) {
-        if (pos->id == id) {
-            return pos;
+    if (re->llcp_nspares) {
+        /* the first spare's slot is taken by the insertion below */
+        dl = re->llcp_dl[re->llcp_ndls];
+        --re->llcp_nspares;
+    } else {
+        if (re->llcp_ndls == re->llcp_maxdls) {
+            size_t maxdls = re->llcp_maxdls ? 2 * re->llcp_maxdls : 2;
+            struct llcp_data_link** array =
+                realloc(re->llcp_dl, maxdls * sizeof(*array));
+            if (!array) {
+                return NULL;
+            }
+            re->llcp_dl = array;
+            re->llcp_maxdls = maxdls;
+        }
+        dl = malloc(sizeof(*dl));
+        if (!dl) {
+            return NULL;
         }
-        ++pos;
+        llcp_init_data_link(dl, re->nfc->snep_max_msg_len);
     }
+    dl->rsap = rsap;
+    dl->lsap = lsap;
+
+    i = search_dl(re, rsap, lsap);
+    memmove(re->llcp_dl + i + 1, re->llcp_dl + i,
+            (re->llcp_ndls - i) * sizeof(*re->llcp_dl));
+    re->llcp_dl[i] = dl;
+    ++re->llcp_ndls;
+
+    return dl;
+}
+
+/* Returns the data link's pending PDUs to the pool and resets its
+ * state. The buffers are kept for the data link's next use. */
+static void
+close_dl(struct nfc_re* re, struct llcp_data_link* dl)
+{
+    llcp_free_pdu_queue(&re->nfc->pdu_pool, &dl->xmit_q);
+    llcp_clear_data_link(dl);
+    dl->status = LLCP_DATA_LINK_DISCONNECTED;
+}
+
+/* Closes the data link and keeps it as the first spare. */
+static void
+put_dl(struct nfc_re* re, struct llcp_data_link* dl)
+{
+    size_t i;
+
+    assert(re);
+    assert(dl);
+
+    i = search_dl(re, dl->rsap, dl->lsap);
+    assert(i < re->llcp_ndls && re->llcp_dl[i] == dl);
 
-    return NULL;
+    --re->llcp_ndls;
+    memmove(re->llcp_dl + i, re->llcp_dl + i + 1,
+            (re->llcp_ndls - i) * sizeof(*re->llcp_dl));
+    re->llcp_dl[re->llcp_ndls] = dl;
+    ++re->llcp_nspares;
+
+    close_dl(re, dl);
 }
 
 void
 nfc_clear_re(struct nfc_re* re)
 {
-    size_t dsap, ssap;
+    size_t i;
 
     assert(re);
 
-    for (dsap = 0; dsap < ARRAY_SIZE(re->llcp_dl); ++dsap) {
-        for (ssap = 0; ssap < ARRAY_SIZE(re->llcp_dl[dsap]); ++ssap) {
-            llcp_init_data_link(re->llcp_dl[dsap]+ssap);
-        }
+    /* return pending PDUs to the pool */
+    llcp_free_pdu_queue(&re->nfc->pdu_pool, &re->xmit_q);
+
+    /* all data links become spares */
+    for (i = 0; i < re->llcp_ndls; ++i) {
+        close_dl(re, re->llcp_dl[i]);
     }
+    re->llcp_nspares += re->llcp_ndls;
+    re->llcp_ndls = 0;
 
     re->last_dsap = LLCP_SAP_LM;
     re->last_ssap = LLCP_SAP_LM;
 }
 
 static ssize_t
-write_buf(size_t* bufsiz, uint8_t* buf, size_t len, const void* data)
+write_buf(size_t* bufsiz, uint8_t* buf, size_t maxsiz, size_t len,
+          const void* data)
 {
     assert(bufsiz);
-    assert(buf || !*bufsiz);
+    assert(buf || !maxsiz);
+    assert(*bufsiz <= maxsiz);
     assert(data || !len);
 
-    if (len > *bufsiz) {
+    if (len > maxsiz - *bufsiz) {
         return -1; /* not enough memory */
     }
 
-    memcpy(buf, data, len);
+    memcpy(buf + *bufsiz, data, len);
     *bufsiz += len;
 
     return len;
@@ -245,21 +451,36 @@ ssize_t
 nfc_re_write_sbuf(struct nfc_re* re, size_t len, const void* data)
 {
     assert(re);
-    return write_buf(&re->sbufsiz, re->sbuf, len, data);
+    return write_buf(&re->sbufsiz, re->sbuf, sizeof(re->sbuf), len, data);
 }
 
 ssize_t
 nfc_re_read_sbuf(struct nfc_re* re, size_t len, void* data)
+{
+    ssize_t res;
+
+    assert(re);
+
+    res = read_buf(&re->sbufsiz, re->sbuf, len, data);
+    if ((res > 0) && (re == re->nfc->active_re)) {
+        /* there's room for more data from the host */
+        nfc_update_dta_credits(re->nfc);
+    }
+    return res;
+}
+
+size_t
+nfc_re_sbuf_room(const struct nfc_re* re)
 {
     assert(re);
-    return read_buf(&re->sbufsiz, re->sbuf, len, data);
+    return sizeof(re->sbuf) - re->sbufsiz;
 }
 
 ssize_t
 nfc_re_write_rbuf(struct nfc_re* re, size_t len, const void* data)
 {
     assert(re);
-    return write_buf(&re->rbufsiz, re->rbuf, len, data);
+    return write_buf(&re->rbufsiz, re->rbuf, sizeof(re->rbuf), len, data);
 }
 
 ssize_t
@@ -290,6 +511,62 @@ static size_t (* const llcp_sap_cb[LLCP_NUMBER_OF_SAPS])(struct llcp_data_link*,
     [LLCP_SAP_SNEP] = llcp_sap_snep
 };
 
+/* Returns the largest fragment of user data that fits into an I PDU
+ * on this data link. */
+static size_t
+dl_fragment_len(const struct llcp_data_link* dl)
+{
+    /* PDU buffers and NCI packets limit us to 255 bytes per PDU */
+    size_t len = NCI_MAX_DTA_PAYLOAD_LENGTH - (sizeof(struct llcp_pdu) + 1);
+
+    return dl->miu < len ? dl->miu : len;
+}
+
+/* Queues fragments of the data link's pending message while the
+ * remote receive window is open. Returns the number of queued PDUs.
+ */
+static size_t
+xmit_sdu(struct nfc_re* re, struct llcp_data_link* dl)
+{
+    size_t n = 0;
+
+    assert(re);
+    assert(dl);
+
+    while (dl->slen && !dl->swait && llcp_dl_window_is_open(dl)) {
+        struct llcp_pdu_buf* buf;
+        size_t hdrlen, len;
+
+        buf = llcp_alloc_pdu_buf(&re->nfc->pdu_pool);
+        if (!buf) {
+            break; /* try again when the next PDU has been sent */
+        }
+        hdrlen = llcp_create_pdu_i((struct llcp_pdu*)buf->pdu,
+                                   dl->rsap, dl->lsap, dl->v_s, dl->v_r);
+        dl->v_s = (dl->v_s + 1) % 16;
+
+        len = dl->slen - dl->soff;
+        if (len > dl_fragment_len(dl)) {
+            len = dl_fragment_len(dl);
+        }
+        memcpy(buf->pdu + hdrlen, dl->sbuf + dl->soff, len);
+        buf->len = hdrlen + len;
+
+        if (!dl->soff && (len < dl->slen)) {
+            /* wait for the peer's Continue; [SNEP], Sec 5.1 */
+            dl->swait = 1;
+        }
+        dl->soff += len;
+        if (dl->soff == dl->slen) {
+            llcp_dl_clear_sbuf(dl);
+        }
+
+        TAILQ_INSERT_TAIL(&re->xmit_q, buf, entry);
+        ++n;
+    }
+    return n;
+}
+
 static ssize_t
 create_dta(void* data, struct nfc_device* nfc, size_t maxlen,
            union nci_packet* dta)
@@ -301,18 +578,32 @@ create_dta(void* data, struct nfc_device* nfc, size_t maxlen,
     assert(re);
 
     len = xmit_pdu_or_symm_from_re((struct llcp_pdu*)dta->data.payload, re);
-    return nfc_create_nci_dta(dta, NCI_PBF_END, re->connid, len);
+    return nfc_create_nci_dta(nfc, dta, NCI_PBF_END, re->connid, len);
 }
 
 static void
 xmit_next_cb(void* opaque)
 {
-    cb.send_dta(create_dta, opaque);
+    struct nfc_re* re = opaque;
+
+    ++re->nfc->stats.llcp_timeouts;
+
+    re->nfc->cb->send_dta(re->nfc, create_dta, re);
+}
+
+void
+nfc_re_restart_xmit_timeout(struct nfc_re* re)
+{
+    assert(re);
+
+    if (re->xmit_next) {
+        prepare_xmit_timeout(re, xmit_next_cb);
+    }
 }
 
 static size_t
 process_ptype_symm(struct nfc_re* re, const struct llcp_pdu* llcp,
-                   size_t len, uint8_t* consumed, struct llcp_pdu* rsp)
+                   size_t len, size_t* consumed, struct llcp_pdu* rsp)
 {
     assert(re);
     assert(llcp);
@@ -326,7 +617,7 @@ process_ptype_symm(struct nfc_re* re, const struct llcp_pdu* llcp,
 
 static size_t
 process_ptype_connect(struct nfc_re* re, const struct llcp_pdu* llcp,
-                      size_t len, uint8_t* consumed,
+                      size_t len, size_t* consumed,
                       struct llcp_pdu* rsp)
 {
     struct llcp_data_link* dl;
@@ -337,85 +628,72 @@ process_ptype_connect(struct nfc_re* re, const struct llcp_pdu* llcp,
     assert(consumed);
     assert(rsp);
 
-    dl = llcp_init_data_link(re->llcp_dl[llcp->ssap] + llcp->dsap);
-    dl->status = LLCP_DATA_LINK_CONNECTED;
-
     *consumed = sizeof(*llcp);
-    len -= *consumed;
-
-    opt = ((const uint8_t*)llcp) + *consumed;
 
-    while (len >= 2) {
-        len -= 2;
-        switch (opt[0]) {
-            case LLCP_PARAM_MIUX:
-                if ((opt[1] != 2) || (len < opt[1])) {
-                    continue;
-                }
-                {
-                  const struct llcp_param_miux* param =
-                      (const struct llcp_param_miux*)(opt + 2);
-                  dl->miu = param->miux - 128;
-                }
-                NFC_D("LLCP MIU size=%d", dl->miu);
-                break;
-            case LLCP_PARAM_RW:
-                if ((opt[1] != 1) || (len < opt[1])) {
-                    continue;
-                }
-                {
-                  const struct llcp_param_rw* param =
-                      (const struct llcp_param_rw*)(opt + 2);
-                  dl->rw_r = param->rw;
-                }
-                NFC_D("LLCP remote RW size %d", dl->rw_r);
-                break;
-            case LLCP_PARAM_SN:
-                if (len < opt[1]) {
-                    continue;
-                }
-                NFC_D("requesting LLCP service %.*s\n", opt[1], (const char*)opt+2);
-                break;
-            default:
-                NFC_D("Ignoring unknown LLCP parameter %d\n", opt[0]);
-                break;
-        }
+    dl = find_dl(re, llcp->ssap, llcp->dsap);
+    if (dl) {
+        put_dl(re, dl);
+    }
+    dl = get_dl(re, llcp->ssap, llcp->dsap);
+    if (!dl) {
+        /* out of memory; reject connection */
+        return llcp_create_pdu_dm(rsp, llcp->ssap, llcp->dsap,
+                                  LLCP_DM_REASON_REJECTED);
     }
+    dl->status = LLCP_DATA_LINK_CONNECTED;
+
+    opt = ((const uint8_t*)llcp) + *consumed;
+    llcp_dl_parse_params(dl, opt, len - *consumed);
+    *consumed = len;
 
     update_last_saps(re, llcp->ssap, llcp->dsap);
 
     /* switch DSAP and SSAP in outgoing PDU */
-    return llcp_create_pdu(rsp, llcp->ssap, LLCP_PTYPE_CC, llcp->dsap);
+    return llcp_create_pdu(rsp, llcp->ssap, LLCP_PTYPE_CC, llcp->dsap) +
+           llcp_create_dl_params(rsp->info, LLCP_MAX_MIU, dl->rw_l);
 }
 
 static size_t
 process_ptype_disc(struct nfc_re* re, const struct llcp_pdu* llcp,
-                   size_t len, uint8_t* consumed,
+                   size_t len, size_t* consumed,
                    struct llcp_pdu* rsp)
 {
     struct llcp_data_link* dl;
 
-    dl = re->llcp_dl[llcp->ssap] + llcp->dsap;
-    dl->status = LLCP_DATA_LINK_DISCONNECTED;
+    dl = find_dl(re, llcp->ssap, llcp->dsap);
+    if (dl) {
+        put_dl(re, dl);
+    }
 
     *consumed = sizeof(*llcp);
 
     update_last_saps(re, llcp->ssap, llcp->dsap);
 
     /* switch DSAP and SSAP in outgoing PDU */
-    return llcp_create_pdu_dm(rsp, llcp->ssap, llcp->dsap, 0);
+    return llcp_create_pdu_dm(rsp, llcp->ssap, llcp->dsap,
+                              LLCP_DM_REASON_DISC);
 }
 
 static size_t
 process_ptype_cc(struct nfc_re* re, const struct llcp_pdu* llcp,
-                 size_t len, uint8_t* consumed,
+                 size_t len, size_t* consumed,
                  struct llcp_pdu* rsp)
 {
     struct llcp_data_link* dl;
 
-    dl = llcp_clear_data_link(re->llcp_dl[llcp->ssap] + llcp->dsap);
-    assert(dl->status == LLCP_DATA_LINK_CONNECTING);
+    *consumed = len;
+
+    dl = find_dl(re, llcp->ssap, llcp->dsap);
+    if (!dl) {
+        NFC_D("LLCP CC for unknown data link");
+        return 0;
+    }
+    if (dl->status != LLCP_DATA_LINK_CONNECTING) {
+        NFC_D("LLCP CC for data link in state %d", dl->status);
+        return 0;
+    }
     dl->status = LLCP_DATA_LINK_CONNECTED;
+    llcp_dl_parse_params(dl, llcp->info, len - sizeof(*llcp));
 
     /* move DL's pending PDUs to global xmit queue */
     while (!TAILQ_EMPTY(&dl->xmit_q)) {
@@ -423,25 +701,26 @@ process_ptype_cc(struct nfc_re* re, const struct llcp_pdu* llcp,
         TAILQ_REMOVE(&dl->xmit_q, buf, entry);
         TAILQ_INSERT_TAIL(&re->xmit_q, buf, entry);
     }
+    xmit_sdu(re, dl);
 
     update_last_saps(re, llcp->ssap, llcp->dsap);
 
-    *consumed = sizeof(*llcp) + 1;
-
     return 0;
 }
 
 static size_t
 process_ptype_dm(struct nfc_re* re, const struct llcp_pdu* llcp,
-                 size_t len, uint8_t* consumed,
+                 size_t len, size_t* consumed,
                  struct llcp_pdu* rsp)
 {
     struct llcp_data_link* dl;
 
     NFC_D("LLCP DM, reason=%d\n", llcp->info[0]);
 
-    dl = re->llcp_dl[llcp->ssap] + llcp->dsap;
-    dl->status = LLCP_DATA_LINK_DISCONNECTED;
+    dl = find_dl(re, llcp->ssap, llcp->dsap);
+    if (dl) {
+        put_dl(re, dl);
+    }
 
     update_last_saps(re, llcp->ssap, llcp->dsap);
 
@@ -453,7 +732,7 @@ process_ptype_dm(struct nfc_re* re, const struct llcp_pdu* llcp,
 
 static size_t
 process_ptype_frmr(struct nfc_re* re, const struct llcp_pdu* llcp,
-                size_t len, uint8_t* consumed, struct llcp_pdu* rsp)
+                size_t len, size_t* consumed, struct llcp_pdu* rsp)
 {
     unsigned int flags = (llcp->info[0] >> 4) & 0xf;
     unsigned int ptype =  llcp->info[0] & 0xf;
@@ -474,14 +753,22 @@ process_ptype_frmr(struct nfc_re* re, const struct llcp_pdu* llcp,
 
 static size_t
 process_ptype_i(struct nfc_re* re, const struct llcp_pdu* llcp,
-                size_t len, uint8_t* consumed, struct llcp_pdu* rsp)
+                size_t len, size_t* consumed, struct llcp_pdu* rsp)
 {
     const uint8_t* info;
     struct llcp_data_link* dl;
+    size_t (*sap_cb)(struct llcp_data_link*, const uint8_t*, size_t,
+                     struct snep*);
     ssize_t res;
 
-    dl = re->llcp_dl[llcp->ssap] + llcp->dsap;
+    dl = find_dl(re, llcp->ssap, llcp->dsap);
+    if (!dl) {
+        *consumed = sizeof(*llcp) + 1;
+        return llcp_create_pdu_dm(rsp, llcp->ssap, llcp->dsap,
+                                  LLCP_DM_REASON_NO_CONNECTION);
+    }
     dl->v_r = (dl->v_r + 1) % 16;
+    dl->v_sa = llcp->info[0] & 0x0f; /* N(R) acknowledges our I PDUs */
 
     /* I PDUs transfer messages (i.e., 'Service Data Units' in LLCP
      * speak) over LLCP connections. In our case we hand over the
@@ -496,27 +783,42 @@ process_ptype_i(struct nfc_re* re, const struct llcp_pdu* llcp,
     len -= *consumed;
 
     info = ((const uint8_t*)llcp) + *consumed;
-    if (llcp_sap_cb[llcp->dsap]) {
+    *consumed += len;
+
+    /* we're either the server of the local SAP or the client
+     * of the remote one */
+    sap_cb = llcp_sap_cb[llcp->dsap] ? llcp_sap_cb[llcp->dsap]
+                                     : llcp_sap_cb[llcp->ssap];
+    if (sap_cb) {
         /* there's a handler for this SAP, call it and build an LLCP
          * header if there is a response */
-        res = llcp_sap_cb[llcp->dsap](dl, info, len,
-                                      (struct snep*)rsp->info+1);
+        res = sap_cb(dl, info, len, (struct snep*)(rsp->info+1));
         if (res) {
             res += llcp_create_pdu_i(rsp, llcp->ssap, llcp->dsap,
                                      dl->v_s, dl->v_r);
+            dl->v_s = (dl->v_s + 1) % 16;
         }
     } else {
-        /* copy information field into re->sbuf */
+        /* copy information field into dl->rbuf */
         llcp_dl_write_rbuf(dl, len, info);
         res = 0;
     }
 
+    /* the peer might have opened its receive window */
+    if (xmit_sdu(re, dl) && !res) {
+        /* the next fragment acknowledges the received PDU */
+        res = fetch_pdu_from_re(rsp, re);
+    }
+    if (!res) {
+        res = llcp_create_pdu_rr(rsp, llcp->ssap, llcp->dsap, dl->v_r);
+    }
+
     return res;
 }
 
 static size_t
 process_ptype_rr(struct nfc_re* re, const struct llcp_pdu* llcp,
-                size_t len, uint8_t* consumed, struct llcp_pdu* rsp)
+                size_t len, size_t* consumed, struct llcp_pdu* rsp)
 {
     struct llcp_data_link* dl;
     unsigned int nr;
@@ -525,8 +827,11 @@ process_ptype_rr(struct nfc_re* re, const struct llcp_pdu* llcp,
 
     NFC_D("LLCP RR N(R)=%d", nr);
 
-    dl = re->llcp_dl[llcp->ssap] + llcp->dsap;
-    dl->v_sa = nr;
+    dl = find_dl(re, llcp->ssap, llcp->dsap);
+    if (dl) {
+        dl->v_sa = nr;
+        xmit_sdu(re, dl);
+    }
 
     update_last_saps(re, llcp->ssap, llcp->dsap);
 
@@ -536,7 +841,7 @@ process_ptype_rr(struct nfc_re* re, const struct llcp_pdu* llcp,
 
 static size_t
 process_ptype_rnr(struct nfc_re* re, const struct llcp_pdu* llcp,
-                  size_t len, uint8_t* consumed, struct llcp_pdu* rsp)
+                  size_t len, size_t* consumed, struct llcp_pdu* rsp)
 {
     struct llcp_data_link* dl;
     unsigned int nr;
@@ -545,8 +850,10 @@ process_ptype_rnr(struct nfc_re* re, const struct llcp_pdu* llcp,
 
     NFC_D("LLCP RNR N(R)=%d", nr);
 
-    dl = re->llcp_dl[llcp->ssap] + llcp->dsap;
-    dl->v_sa = nr;
+    dl = find_dl(re, llcp->ssap, llcp->dsap);
+    if (dl) {
+        dl->v_sa = nr;
+    }
 
     update_last_saps(re, llcp->ssap, llcp->dsap);
 
@@ -556,11 +863,11 @@ process_ptype_rnr(struct nfc_re* re, const struct llcp_pdu* llcp,
 
 static size_t
 process_llcp(struct nfc_re* re, const struct llcp_pdu* llcp,
-             size_t len, uint8_t* consumed, struct llcp_pdu* rsp)
+             size_t len, size_t* consumed, struct llcp_pdu* rsp)
 {
     static size_t (* const process[16])
         (struct nfc_re*, const struct llcp_pdu*,
-         size_t, uint8_t*, struct llcp_pdu*) = {
+         size_t, size_t*, struct llcp_pdu*) = {
         [LLCP_PTYPE_SYMM] = process_ptype_symm,
         [LLCP_PTYPE_CONNECT] = process_ptype_connect,
         [LLCP_PTYPE_DISC] = process_ptype_disc,
@@ -571,16 +878,55 @@ process_llcp(struct nfc_re* re, const struct llcp_pdu* llcp,
         [LLCP_PTYPE_RR] = process_ptype_rr,
         [LLCP_PTYPE_RNR] = process_ptype_rnr
     };
+    /* fixed fields after the header, i.e., the DM reason, the FRMR
+     * information and the sequence numbers; [LLCP] Sec 4.3 */
+    static const unsigned char minlen[16] = {
+        [LLCP_PTYPE_DM] = 1,
+        [LLCP_PTYPE_FRMR] = 4,
+        [LLCP_PTYPE_I] = 1,
+        [LLCP_PTYPE_RR] = 1,
+        [LLCP_PTYPE_RNR] = 1
+    };
 
     unsigned char ptype;
 
+    if (len < sizeof(*llcp)) {
+        NFC_D("dropping LLCP PDU of %zu bytes", len);
+        ++re->nfc->stats.llcp_drops;
+        *consumed = len;
+        return 0;
+    }
+
     ptype = llcp_ptype(llcp);
 
     NFC_D("LLCP dsap=%x ptype=%x ssap=%x", llcp->dsap, ptype, llcp->ssap);
 
-    assert(process[ptype]);
+    ++re->nfc->stats.llcp_pdu[ptype];
+
+    if (!process[ptype]) {
+        /* AGF, UI, PAX, SNL and reserved PTYPEs */
+        NFC_D("dropping LLCP PDU with unsupported PTYPE %d", ptype);
+        ++re->nfc->stats.llcp_drops;
+        *consumed = len;
+        len = 0;
+    } else if (len < sizeof(*llcp) + minlen[ptype]) {
+        NFC_D("dropping LLCP PDU with PTYPE %d of %zu bytes", ptype, len);
+        ++re->nfc->stats.llcp_drops;
+        *consumed = len;
+        len = 0;
+    } else {
+        len = process[ptype](re, llcp, len, consumed, rsp);
+    }
+
+    if (!len) {
+        /* answer with the next queued PDU, if any */
+        len = fetch_pdu_from_re(rsp, re);
+    }
 
-    len = process[ptype](re, llcp, len, consumed, rsp);
+    if (ptype != LLCP_PTYPE_SYMM) {
+        /* link is busy, reset back-off */
+        re->symm_next_delay = LLCP_SYMM_MIN_DELAY;
+    }
 
     /* we implicitely received send permission */
     re->xmit_next = 1;
@@ -592,71 +938,64 @@ process_llcp(struct nfc_re* re, const struct llcp_pdu* llcp,
 }
 
 size_t
-nfc_re_process_data(struct nfc_re* re, const union nci_packet* dta,
-                    union nci_packet* rsp)
+nfc_re_process_data(struct nfc_re* re, uint8_t connid,
+                    const uint8_t* data, size_t len, uint8_t* rsp)
 {
-    size_t len;
-    uint8_t off;
+    size_t rsplen, off;
 
     assert(re);
-    assert(dta);
+    assert(data);
     assert(rsp);
 
     /* consume llcp */
 
-    re->connid = dta->data.connid;
+    re->connid = connid;
 
     switch (re->rfproto) {
         case NCI_RF_PROTOCOL_NFC_DEP:
-            len = process_llcp(re,
-                (const struct llcp_pdu*)dta->data.payload,
-                dta->data.l, &off, (struct llcp_pdu*)rsp->data.payload);
-            if (len) {
-                len = nfc_create_nci_dta(rsp, NCI_PBF_END, re->connid, len);
-            }
+            rsplen = process_llcp(re, (const struct llcp_pdu*)data, len, &off,
+                               (struct llcp_pdu*)rsp);
             break;
         case NCI_RF_PROTOCOL_T1T:
-            len = process_t1t(re,
-                (const union command_packet*)dta->data.payload,
-                dta->data.l, &off, (union response_packet*)rsp->data.payload);
-            if (len) {
-                len = nfc_create_nci_dta(rsp, NCI_PBF_END, re->connid, len);
-            }
+            ++re->nfc->stats.tag_cmd[0];
+            rsplen = process_t1t(re, (const union command_packet*)data, len,
+                              &off, (union response_packet*)rsp);
             break;
         case NCI_RF_PROTOCOL_T2T:
-            len = process_t2t(re,
-                (const union command_packet*)dta->data.payload,
-                dta->data.l, &off, (union response_packet*)rsp->data.payload);
-            if (len) {
-                len = nfc_create_nci_dta(rsp, NCI_PBF_END, re->connid, len);
-            }
+            ++re->nfc->stats.tag_cmd[1];
+            rsplen = process_t2t(re, (const union command_packet*)data, len,
+                              &off, (union response_packet*)rsp);
             break;
         case NCI_RF_PROTOCOL_T3T:
-            len = process_t3t(re,
-                (const union command_packet*)dta->data.payload,
-                dta->data.l, &off, (union response_packet*)rsp->data.payload);
-            if (len) {
-                len = nfc_create_nci_dta(rsp, NCI_PBF_END, re->connid, len);
-            }
+            ++re->nfc->stats.tag_cmd[2];
+            rsplen = process_t3t(re, (const union command_packet*)data, len,
+                              &off, (union response_packet*)rsp);
             break;
         case NCI_RF_PROTOCOL_ISO_DEP:
-            len = process_t4t(re,
-                (const union command_packet*)dta->data.payload,
-                dta->data.l, &off, (union response_packet*)rsp->data.payload);
-            if (len) {
-                len = nfc_create_nci_dta(rsp, NCI_PBF_END, re->connid, len);
+            if (re->reader) {
+                /* the guest answers our C-APDU */
+                rsplen = nfc_hce_reader_process(re, data, len, rsp,
+                                                NFC_MAX_DTA_LENGTH);
+                off = len;
+                break;
             }
+            ++re->nfc->stats.tag_cmd[3];
+            rsplen = process_t4t(re, (const union command_packet*)data, len,
+                              &off, (union response_packet*)rsp);
             break;
         default:
-            assert(0); /* TODO: support other RF protocols */
-            len = 0;
-            off = 0;
+            /* TODO: support other RF protocols */
+            NFC_D("dropping data for RF protocol %d", re->rfproto);
+            rsplen = 0;
+            off = len;
             break;
     }
 
     /* payload gets stored in RE send buffer */
-    nfc_re_write_sbuf(re, dta->data.l-off, dta->data.payload+off);
-    return len;
+    if ((off < len) && (nfc_re_write_sbuf(re, len-off, data+off) < 0)) {
+        NFC_D("RE send buffer full, dropping %zu bytes", len-off);
+    }
+    return rsplen;
 }
 
 enum {
@@ -781,7 +1120,7 @@ create_activated_ntf_nfc_dep(struct nfc_re* re, uint8_t* act)
     *p++ = NFC_DEP_PP_G; /* PP */
 
     /* LLCP */
-    p += llcp_create_param_tail(p);
+    p += llcp_create_param_tail(p, (re->lto + 9) / 10);
 
     /* ATR_REQ length */
     act[0] = (p-act)-1;
@@ -789,6 +1128,19 @@ create_activated_ntf_nfc_dep(struct nfc_re* re, uint8_t* act)
     return p-act;
 }
 
+/* [NCI] Table 79; byte 2 of the reader's RATS command */
+static size_t
+create_activated_ntf_iso_dep_listen(struct nfc_re* re, uint8_t* act)
+{
+    assert(re);
+
+    /* FSDI 8, i.e., frames of up to 256 bytes, and CID 0;
+     * [DIGITAL] Sec 13.6.1 */
+    act[0] = 0x80;
+
+    return 1;
+}
+
 size_t
 nfc_re_create_rf_intf_activated_ntf_act(struct nfc_re* re, uint8_t* act)
 {
@@ -797,6 +1149,9 @@ nfc_re_create_rf_intf_activated_ntf_act(struct nfc_re* re, uint8_t* act)
     switch (re->rfproto) {
         case NCI_RF_PROTOCOL_T1T:
             return create_activated_ntf_t1t(re, act);
+        case NCI_RF_PROTOCOL_ISO_DEP:
+            return re->reader ? create_activated_ntf_iso_dep_listen(re, act)
+                              : 0;
         case NCI_RF_PROTOCOL_NFC_DEP:
             return create_activated_ntf_nfc_dep(re, act);
         default:
@@ -813,14 +1168,17 @@ nfc_re_create_dta_act(struct nfc_re* re, const void* data,
 
   assert(act);
 
-  dl = re->llcp_dl[LLCP_SAP_SNEP] + LLCP_SAP_SNEP;
+  dl = get_dl(re, LLCP_SAP_SNEP, LLCP_SAP_SNEP);
+  if (!dl) {
+    return 0;
+  }
   llcp_len = llcp_create_pdu_i((struct llcp_pdu*)act,
                                LLCP_SAP_SNEP, LLCP_SAP_SNEP,
                                dl->v_s, dl->v_r);
   dl->v_s = (dl->v_s+1) % 16;
   dl->v_r = (dl->v_r+1) % 16;
 
-  memcpy(act+len, data, len);
+  memcpy(act+llcp_len, data, len);
 
   return llcp_len + len;
 }
@@ -851,18 +1209,26 @@ create_connect_dta(void* data, struct llcp_pdu* llcp)
     param = data;
     assert(param);
 
-    dl = param->re->llcp_dl[param->dsap] + param->ssap;
-
+    dl = find_dl(param->re, param->dsap, param->ssap);
+    assert(dl);
     assert(dl->status == LLCP_DATA_LINK_DISCONNECTED);
     dl->status = LLCP_DATA_LINK_CONNECTING;
 
-    return llcp_create_pdu(llcp, param->dsap, LLCP_PTYPE_CONNECT, param->ssap);
+    return llcp_create_pdu(llcp, param->dsap, LLCP_PTYPE_CONNECT,
+                           param->ssap) +
+           llcp_create_dl_params(llcp->info, LLCP_MAX_MIU, dl->rw_l);
 }
 
 int
 nfc_re_send_llcp_connect(struct nfc_re* re, unsigned char dsap, unsigned char ssap)
 {
     struct llcp_connect_param param = LLCP_CONNECT_PARAM_INIT(re, dsap, ssap);
+    struct llcp_data_link* dl;
+
+    dl = get_dl(re, dsap, ssap);
+    if (!dl || (dl->status != LLCP_DATA_LINK_DISCONNECTED)) {
+        return -1;
+    }
     return send_pdu_from_re(create_connect_dta, &param, re);
 }
 
@@ -870,96 +1236,75 @@ nfc_re_send_llcp_connect(struct nfc_re* re, unsigned char dsap, unsigned char ss
  * SNEP PUT
  */
 
-struct llcp_i_param {
-    struct nfc_re* re;
-    unsigned char dsap;
-    unsigned char ssap;
-    ssize_t (*create_snep)(void*, size_t, struct snep*);
-    void* data;
-};
-
-#define LLCP_I_PARAM_INIT(_re, _dsap, _ssap, _create_snep, _data) \
-    { \
-        .re = (_re), \
-        .dsap = (_dsap), \
-        .ssap = (_ssap), \
-        .create_snep = (_create_snep), \
-        .data =  (_data) \
-    }
-
-static ssize_t
-create_i_pdu(void* data, struct llcp_pdu* llcp)
+/* Builds the SNEP message and transmits it in fragments that fit
+ * the data link's MIU. Messages that don't fit into the first I PDU
+ * are continued after the peer's 'Continue' response.
+ */
+static int
+send_snep_over_llcp(struct nfc_re* re,
+                    enum llcp_sap dsap, enum llcp_sap ssap, size_t len,
+                    ssize_t (*create)(void*, size_t, struct snep*),
+                    void* data)
 {
-    const struct llcp_i_param* param;
+    int res;
     struct llcp_data_link* dl;
-    size_t len;
-    struct snep* snep;
-    ssize_t res;
-
-    param = data;
-    assert(param);
+    ssize_t res_len;
 
-    dl = param->re->llcp_dl[param->dsap] + param->ssap;
-    len = llcp_create_pdu_i(llcp, param->dsap, param->ssap, dl->v_s, dl->v_r);
+    if ((len < sizeof(struct snep)) || (len > re->nfc->snep_max_msg_len)) {
+        NFC_D("invalid SNEP request length %zu", len);
+        return -1;
+    }
 
-    snep = (struct snep*)(llcp->info + (len-sizeof(*llcp)));
-    res = param->create_snep(param->data, 200-len, snep);
-    if (res < 0) {
+    dl = get_dl(re, dsap, ssap);
+    if (!dl) {
         return -1;
     }
-    dl->v_s = (dl->v_s + 1) % 16;
 
-    return len + res;
-}
+    if (dl->status == LLCP_DATA_LINK_DISCONNECTING) {
+        /* don't send a request for disconnecting links */
+        return 0;
+    }
+    if (dl->slen) {
+        NFC_D("SNEP request already in progress");
+        return -1;
+    }
 
-static int
-send_snep_over_llcp(struct nfc_re* re,
-                    enum llcp_sap dsap, enum llcp_sap ssap,
-                    ssize_t (*create)(void*, size_t, struct snep*),
-                    void* data)
-{
-    int res;
-    struct llcp_data_link* dl;
-    struct llcp_i_param i_param =
-        LLCP_I_PARAM_INIT(re, dsap, ssap, create, data);
+    /* the request is built in place in the data link's send buffer,
+     * which later requests reuse */
+    if (llcp_dl_reserve_sbuf(dl, len) < 0) {
+        return -1;
+    }
+    res_len = create(data, len, (struct snep*)dl->sbuf);
+    if (res_len <= 0) {
+        return -1;
+    }
+    dl->slen = res_len;
 
     res = 0;
-    dl = re->llcp_dl[dsap] + ssap;
 
     if (dl->status == LLCP_DATA_LINK_DISCONNECTED) {
-        /* enqueue request for later delivery and connect first */
-        struct llcp_pdu_buf* buf;
+        /* connect first; on success, the message will be delivered */
         struct llcp_connect_param connect_param =
             LLCP_CONNECT_PARAM_INIT(re, dsap, ssap);
-        buf = llcp_alloc_pdu_buf();
-        if (!buf) {
-            return -1;
-        }
-        buf->len = create_i_pdu(&i_param, (struct llcp_pdu*)buf->pdu);
-        TAILQ_INSERT_TAIL(&dl->xmit_q, buf, entry);
-        /* on connecting successfully, pending packets will be delivered */
         res = send_pdu_from_re(create_connect_dta, &connect_param, re);
-    } else if (dl->status == LLCP_DATA_LINK_CONNECTING) {
-        /* connecting in process; only enqueue request for later delivery */
-        struct llcp_pdu_buf* buf = llcp_alloc_pdu_buf();
-        if (!buf) {
-            return -1;
-        }
-        buf->len = create_i_pdu(&i_param, (struct llcp_pdu*)buf->pdu);
-        TAILQ_INSERT_TAIL(&dl->xmit_q, buf, entry);
     } else if (dl->status == LLCP_DATA_LINK_CONNECTED) {
         /* normal operation; send a SNEP request */
-        res = send_pdu_from_re(create_i_pdu, &i_param, re);
-    } else {
-        /* don't send a request for disconnecting links */
-        assert(dl->status == LLCP_DATA_LINK_DISCONNECTING);
+        if (xmit_sdu(re, dl) && re->xmit_next) {
+            /* it's our turn; send the first fragment right away */
+            re->nfc->cb->send_dta(re->nfc, create_dta, re);
+            if (re->xmit_timeout) {
+                re->nfc->cb->del_timeout(re->xmit_timeout);
+            }
+        }
     }
+    /* connecting links send the message after receiving CC */
+
     return res;
 }
 
 int
 nfc_re_send_snep_put(struct nfc_re* re,
-                     enum llcp_sap dsap, enum llcp_sap ssap,
+                     enum llcp_sap dsap, enum llcp_sap ssap, size_t len,
                      ssize_t (*create_snep)(void*, size_t, struct snep*),
                      void* data)
 {
@@ -970,7 +1315,8 @@ nfc_re_send_snep_put(struct nfc_re* re,
     switch (re->rfproto) {
         case NCI_RF_PROTOCOL_NFC_DEP:
             /* send SNEP over LLCP */
-            res = send_snep_over_llcp(re, dsap, ssap, create_snep, data);
+            res = send_snep_over_llcp(re, dsap, ssap, len, create_snep,
+                                      data);
             break;
         default:
             /* TODO: support over protocols */
@@ -988,10 +1334,17 @@ recv_snep_over_llcp(struct nfc_re* re,
     struct llcp_data_link* dl;
     ssize_t res;
 
-    dl = re->llcp_dl[dsap] + ssap;
+    dl = find_dl(re, dsap, ssap);
+    if (!dl || (dl->status != LLCP_DATA_LINK_CONNECTED)) {
+        return -1;
+    }
+
+    if (dl->rrem) {
+        NFC_D("SNEP request incomplete, %zu bytes missing", dl->rrem);
+        return -1;
+    }
 
     /* normal operation; process last received SNEP request */
-    assert(dl->status == LLCP_DATA_LINK_CONNECTED);
 
     res = process(data, dl->rlen, (const struct ndef_rec*)dl->rbuf);
     if (res < 0) {
@@ -23,7 +23,9 @@
 #include "nfc-rf.h"
 
 union nci_packet;
+struct nfc_device;
 struct nfc_tag;
+struct nfc_hce_reader;
 struct ndef_rec;
 struct snep;
 
@@ -53,8 +55,16 @@ enum {
     SEL_RES_OTHER_TAGS = 0x10
 };
 
+/* LLCP timing defaults, in ms */
+enum {
+    LLCP_DEFAULT_LTO = 2500,
+    LLCP_DEFAULT_SYMM_DELAY = 2000,
+    LLCP_SYMM_MIN_DELAY = 10
+};
+
 /* NFC Remote Endpoint */
 struct nfc_re {
+    struct nfc_device* nfc; /* device that owns the RE */
     enum nci_rf_protocol rfproto;
     enum nci_rf_tech_mode mode;
     char nfcid1[10];
@@ -62,12 +72,23 @@ struct nfc_re {
     char nfcid3[10];
     uint8_t id;
     struct nfc_tag* tag;
-    /* outer array is always remote SAP, inner array is local, emulated SAP */
-    struct llcp_data_link llcp_dl[LLCP_NUMBER_OF_SAPS][LLCP_NUMBER_OF_SAPS];
+    /* emulated reader that polls the guest, if set */
+    struct nfc_hce_reader* reader;
+    /* live data links, sorted by remote SAP and local, emulated SAP,
+     * followed by 'llcp_nspares' closed data links for reuse */
+    struct llcp_data_link** llcp_dl;
+    size_t llcp_ndls;
+    size_t llcp_nspares;
+    size_t llcp_maxdls;
     enum llcp_sap last_dsap; /* last remote SAP */
     enum llcp_sap last_ssap; /* last local SAP */
     int xmit_next; /* true if we are supposed to send the next PDU */
     nfcemu_timeout* xmit_timeout;
+    /* LLCP timing; all values in ms */
+    unsigned long lto; /* link timeout advertised on activation */
+    unsigned long symm_delay; /* (maximum) delay until we xmit */
+    int symm_adaptive; /* true for exponential back-off of SYMMs */
+    unsigned long symm_next_delay; /* next delay in adaptive mode */
     struct llcp_pdu_queue xmit_q;
     uint8_t connid;
     size_t sbufsiz;
@@ -76,28 +97,30 @@ struct nfc_re {
     uint8_t rbuf[1024]; /* data for reading from RE */
 };
 
-#define INIT_NFC_RE(re_, rfproto_, mode_, tag_, nfcid_, nfcid2_, addr_) \
-    re_ = { \
-        .rfproto = rfproto_, \
-        .mode = mode_, \
-        .tag = tag_, \
-        .nfcid1 = nfcid_, \
-        .nfcid2 = nfcid2_, \
-        .nfcid3 = nfcid_, \
-        .id = 0, \
-        .xmit_next = 0, \
-        .xmit_timeout = NULL, \
-        .xmit_q = TAILQ_HEAD_INITIALIZER((addr_)->xmit_q), \
-        .connid = 0, \
-        .sbufsiz = 0, \
-        .rbufsiz = 0 \
-    }
-
-/* predefined NFC Remote Endpoints */
-extern struct nfc_re nfc_res[6];
+void
+nfc_re_init(struct nfc_re* re, struct nfc_device* nfc,
+            enum nci_rf_protocol rfproto, enum nci_rf_tech_mode mode,
+            struct nfc_tag* tag, const char* nfcid1, const char* nfcid2);
+
+void
+nfc_re_uninit(struct nfc_re* re);
+
+/* Sets the link timeout advertised on activation and the delay
+ * before the RE answers with a SYMM or queued PDU. In adaptive
+ * mode, queued PDUs are sent immediately and the delay for SYMM
+ * PDUs doubles on an idle link, up to symm_delay.
+ */
+int
+nfc_re_set_llcp_timing(struct nfc_re* re, unsigned long lto,
+                       unsigned long symm_delay, int adaptive);
+
+/* Arms the LLCP timeout again if it's the RE's turn to send, e.g.,
+ * after the RE has been restored from a snapshot. */
+void
+nfc_re_restart_xmit_timeout(struct nfc_re* re);
 
 struct nfc_re*
-nfc_get_re_by_id(uint8_t id);
+nfc_get_re_by_id(struct nfc_device* nfc, uint8_t id);
 
 void
 nfc_clear_re(struct nfc_re* re);
@@ -108,6 +131,10 @@ nfc_re_write_sbuf(struct nfc_re* re, size_t len, const void* data);
 ssize_t
 nfc_re_read_sbuf(struct nfc_re* re, size_t len, void* data);
 
+/* returns the number of bytes that can still be written to sbuf */
+size_t
+nfc_re_sbuf_room(const struct nfc_re* re);
+
 ssize_t
 nfc_re_write_rbuf(struct nfc_re* re, size_t len, const void* data);
 
@@ -115,8 +142,8 @@ ssize_t
 nfc_re_read_rbuf(struct nfc_re* re, size_t len, void* data);
 
 size_t
-nfc_re_process_data(struct nfc_re* re, const union nci_packet* dta,
-                    union nci_packet* rsp);
+nfc_re_process_data(struct nfc_re* re, uint8_t connid,
+                    const uint8_t* data, size_t len, uint8_t* rsp);
 
 size_t
 nfc_re_create_rf_intf_activated_ntf_tech(enum nci_rf_tech_mode mode,
@@ -133,9 +160,10 @@ int
 nfc_re_send_llcp_connect(struct nfc_re* re, unsigned char dsap,
                          unsigned char ssap);
 
+/* 'len' is the length of the SNEP request that 'create_snep' builds */
 int
 nfc_re_send_snep_put(struct nfc_re* re,
-                     enum llcp_sap dsap, enum llcp_sap ssap,
+                     enum llcp_sap dsap, enum llcp_sap ssap, size_t len,
                      ssize_t (*create_snep)(void*, size_t, struct snep*),
                      void* data);
 
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nfc.h"
+#include "nfc-debug.h"
+#include "nfc-nci.h"
+#include "nfc-ring.h"
+
+static void
+copy_to_ring(struct nfcemu_ring* ring, size_t pos, const void* data,
+             size_t len)
+{
+    size_t off = pos & (ring->size - 1);
+    size_t n = len < ring->size - off ? len : ring->size - off;
+
+    memcpy(ring->buf + off, data, n);
+    memcpy(ring->buf, (const uint8_t*)data + n, len - n);
+}
+
+static void
+signal_host(struct nfc_device* nfc, struct nfc_ring* ring)
+{
+    size_t head = ring->ring->head;
+
+    if (head == ring->signaled) {
+        return;
+    }
+    ring->signaled = head;
+    ++nfc->stats.ring_signals;
+    ring->signal(nfc, ring->ring);
+}
+
+static size_t
+ring_avail(const struct nfcemu_ring* ring)
+{
+    return ring->size - (ring->head - __atomic_load_n(&ring->tail,
+                                                      __ATOMIC_ACQUIRE));
+}
+
+static int
+ring_send(struct nfc_device* nfc,
+          ssize_t (*create)(void*, struct nfc_device*, size_t,
+                            union nci_packet*),
+          void* data)
+{
+    struct nfc_ring* ring;
+    union nci_packet pkt;
+    ssize_t len;
+
+    assert(nfc);
+    assert(nfc->ring);
+    assert(create);
+
+    ring = nfc->ring;
+
+    /* creating the packet changes the device's state, e.g., hands out
+     * credits or dequeues an LLCP PDU; so there has to be room for the
+     * largest packet before */
+    if (ring_avail(ring->ring) < sizeof(pkt)) {
+        /* let the host make room */
+        signal_host(nfc, ring);
+        if (ring_avail(ring->ring) < sizeof(pkt)) {
+            NFC_D("not sending packet, ring is full");
+            ++nfc->stats.ring_drops;
+            return -1;
+        }
+    }
+
+    len = create(data, nfc, sizeof(pkt), &pkt);
+    if (len <= 0) {
+        return len < 0 ? -1 : 0;
+    }
+    copy_to_ring(ring->ring, ring->ring->head, &pkt, len);
+
+    /* publish the packet to the host */
+    __atomic_store_n(&ring->ring->head, ring->ring->head + len,
+                     __ATOMIC_RELEASE);
+    ++nfc->stats.ring_pkts;
+
+    if (!ring->depth) {
+        signal_host(nfc, ring);
+    }
+    return 0;
+}
+
+struct nfc_ring*
+nfc_ring_create(const struct nfcemu_cb* host_cb, struct nfcemu_ring* ring,
+                nfcemu_ring_signal* signal)
+{
+    struct nfc_ring* nfc_ring;
+
+    assert(host_cb);
+    assert(ring);
+    assert(signal);
+
+    if (!ring->buf || (ring->size < NFCEMU_RING_MINIMUM_SIZE) ||
+        (ring->size & (ring->size - 1))) {
+        NFC_D("invalid ring of %zu bytes", ring->size);
+        return NULL;
+    }
+
+    nfc_ring = malloc(sizeof(*nfc_ring));
+    if (!nfc_ring) {
+        return NULL;
+    }
+    nfc_ring->ring = ring;
+    nfc_ring->signal = signal;
+    nfc_ring->depth = 0;
+    nfc_ring->signaled = ring->head;
+    nfc_ring->host_cb = host_cb;
+    nfc_ring->cb = *host_cb;
+    nfc_ring->cb.send_ntf = ring_send;
+    nfc_ring->cb.send_dta = ring_send;
+
+    return nfc_ring;
+}
+
+void
+nfc_ring_destroy(struct nfc_ring* ring)
+{
+    free(ring);
+}
+
+void
+nfc_ring_begin(struct nfc_device* nfc)
+{
+    if (!nfc || !nfc->ring) {
+        return;
+    }
+    ++nfc->ring->depth;
+}
+
+void
+nfc_ring_end(struct nfc_device* nfc)
+{
+    /* the ring can have been set up within the batch */
+    if (!nfc || !nfc->ring || !nfc->ring->depth) {
+        return;
+    }
+    if (!--nfc->ring->depth) {
+        signal_host(nfc, nfc->ring);
+    }
+}
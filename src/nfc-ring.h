@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef nfc_ring_h
+#define nfc_ring_h
+
+#include <stddef.h>
+#include <nfcemu/types.h>
+#include "cb.h"
+
+struct nfc_device;
+
+/* Batched output of a device into the host's ring buffer. Packets are
+ * created right away and copied into the ring; the host gets a single
+ * signal for all packets of a batch. Batches nest, and packets sent
+ * outside of a batch are signaled one by one.
+ */
+struct nfc_ring {
+    struct nfcemu_ring* ring;
+    nfcemu_ring_signal* signal;
+    unsigned int depth; /* nesting level of open batches */
+    size_t signaled; /* head at the latest signal */
+
+    /* the device's callbacks while batching; sending packets goes
+     * into the ring */
+    struct nfcemu_cb cb;
+    const struct nfcemu_cb* host_cb;
+};
+
+struct nfc_ring*
+nfc_ring_create(const struct nfcemu_cb* host_cb, struct nfcemu_ring* ring,
+                nfcemu_ring_signal* signal);
+
+void
+nfc_ring_destroy(struct nfc_ring* ring);
+
+/* Opens a batch for the device's packets; does nothing if the device
+ * doesn't batch its output. */
+void
+nfc_ring_begin(struct nfc_device* nfc);
+
+/* Closes a batch and signals the host if the outermost batch holds
+ * any packets. */
+void
+nfc_ring_end(struct nfc_device* nfc);
+
+#endif
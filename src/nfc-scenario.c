@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ptr.h"
+#include "cb.h"
+#include "nfc.h"
+#include "nfc-debug.h"
+#include "nfc-nci.h"
+#include "nfc-re.h"
+#include "nfc-rf.h"
+#include "nfc-ring.h"
+#include "nfc-scenario.h"
+#include "nfc-tag-cache.h"
+#include "snep.h"
+
+static ssize_t
+create_rf_intf_activated_ntf(void* data, struct nfc_device* nfc,
+                             size_t maxlen, union nci_packet* ntf)
+{
+    return nfc_create_rf_intf_activated_ntf(data, nfc, ntf);
+}
+
+static ssize_t
+create_deactivate_ntf(void* data, struct nfc_device* nfc, size_t maxlen,
+                      union nci_packet* ntf)
+{
+    return nfc_create_deactivate_ntf(NCI_RF_DEACT_DISCOVERY,
+                                     NCI_RF_DEACT_RF_LINK_LOSS, ntf);
+}
+
+static ssize_t
+create_snep_put(void* data, size_t len, struct snep* snep)
+{
+    const struct nfcemu_scenario_event* ev = data;
+
+    if (ev->len > len - sizeof(*snep)) {
+        return -1;
+    }
+    memcpy(snep->info, ev->data, ev->len);
+
+    return snep_create_req_put(snep, ev->len);
+}
+
+static int
+discover(struct nfc_device* nfc)
+{
+    struct nfc_re* re[NFC_MAXIMUM_RE_ID];
+    size_t nres;
+
+    nres = nfc_device_get_undiscovered_res(nfc, re, ARRAY_SIZE(re));
+
+    return nfc_send_rf_discovery_ntfs(nfc, re, nres);
+}
+
+static int
+activate(struct nfc_device* nfc, size_t i)
+{
+    struct nfc_re* re;
+
+    re = nfc_device_get_re(nfc, i);
+    if (!re) {
+        NFC_D("unknown RE %zu", i);
+        return -1;
+    }
+    /* a single RE in the field gets activated right away */
+    if ((nfc->rf_state != NFC_RFST_DISCOVERY) || nfc->active_re) {
+        NFC_D("can't activate RE %zu in RF state %d", i, nfc->rf_state);
+        return -1;
+    }
+    if (!nfc->active_rf) {
+        nfc->active_rf = nfc_find_rf_by_protocol_and_mode(nfc, re->rfproto,
+                                                          re->mode);
+        if (!nfc->active_rf) {
+            NFC_D("no RF interface for RE %zu", i);
+            return -1;
+        }
+    }
+    nfc_clear_re(re);
+
+    if (nfc->cb->send_ntf(nfc, create_rf_intf_activated_ntf, re) < 0) {
+        if (nfc->active_re != re) {
+            nfc->active_rf = NULL;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static int
+deactivate(struct nfc_device* nfc)
+{
+    struct nfc_re* re = nfc->active_re;
+    enum nfc_rfst rfst;
+
+    if (!re) {
+        NFC_D("no active RE");
+        return -1;
+    }
+
+    /* the RE left the field */
+    rfst = nfc_rf_state_transition(&nfc->rf_state,
+                                   NFC_RFST_POLL_ACTIVE_BIT|
+                                   NFC_RFST_LISTEN_ACTIVE_BIT,
+                                   NFC_RFST_DISCOVERY);
+    if (rfst == NUMBER_OF_NFC_RFSTS) {
+        NFC_D("can't deactivate in RF state %d", nfc->rf_state);
+        return -1;
+    }
+    if (re->xmit_timeout) {
+        nfc->cb->del_timeout(re->xmit_timeout);
+        re->xmit_timeout = NULL;
+    }
+    nfc_clear_re(re);
+
+    nfc->active_re = NULL;
+    nfc->active_rf = NULL;
+    nfc->rx_len = 0;
+    nfc_device_clear_re_ids(nfc);
+
+    return nfc->cb->send_ntf(nfc, create_deactivate_ntf, NULL);
+}
+
+static int
+set_tag(struct nfc_device* nfc, const struct nfcemu_scenario_event* ev)
+{
+    struct nfc_re* re;
+
+    re = nfc_device_get_re(nfc, ev->re);
+    if (!re || !re->tag) {
+        NFC_D("RE %zu is not a tag", ev->re);
+        return -1;
+    }
+    return nfc_tag_cache_set_data(&nfc->tag_cache, re->tag, ev->data,
+                                  ev->len);
+}
+
+static int
+snep_put(struct nfc_device* nfc, const struct nfcemu_scenario_event* ev)
+{
+    struct nfc_re* re = nfc->active_re;
+
+    if (!re) {
+        NFC_D("no active RE");
+        return -1;
+    }
+    return nfc_re_send_snep_put(re, re->last_dsap, re->last_ssap,
+                                sizeof(struct snep) + ev->len,
+                                create_snep_put, (void*)ev);
+}
+
+static int
+run_event(struct nfc_device* nfc, const struct nfcemu_scenario_event* ev)
+{
+    switch (ev->type) {
+        case NFCEMU_SCENARIO_DISCOVER:
+            return discover(nfc);
+        case NFCEMU_SCENARIO_ACTIVATE:
+            return activate(nfc, ev->re);
+        case NFCEMU_SCENARIO_DEACTIVATE:
+            return deactivate(nfc);
+        case NFCEMU_SCENARIO_SET_TAG:
+            return set_tag(nfc, ev);
+        case NFCEMU_SCENARIO_SNEP_PUT:
+            return snep_put(nfc, ev);
+        default:
+            NFC_D("unknown scenario event %u", ev->type);
+            return -1;
+    }
+}
+
+static void
+run_cb(void* data)
+{
+    struct nfc_scenario* scn = data;
+    struct nfc_device* nfc = scn->nfc;
+
+    /* back-to-back events are signaled together */
+    nfc_ring_begin(nfc);
+
+    do {
+        ++nfc->stats.scenario_events;
+        if (run_event(nfc, scn->event + scn->i) < 0) {
+            ++nfc->stats.scenario_errors;
+        }
+        if (++scn->i == scn->nevents) {
+            scn->i = 0;
+            if (scn->nloops && !--scn->nloops) {
+                scn->done = 1;
+            }
+            break; /* each loop starts from a new timeout */
+        }
+    } while (!scn->event[scn->i].delay);
+
+    nfc_ring_end(nfc);
+
+    if (!scn->done) {
+        nfc->cb->mod_timeout(scn->timeout, scn->event[scn->i].delay);
+    }
+}
+
+struct nfc_scenario*
+nfc_scenario_create(struct nfc_device* nfc,
+                    const struct nfcemu_scenario_event* event,
+                    size_t nevents, unsigned long nloops)
+{
+    struct nfc_scenario* scn;
+
+    assert(nfc);
+    assert(event || !nevents);
+
+    if (!nevents) {
+        NFC_D("scenario without events");
+        return NULL;
+    }
+
+    scn = malloc(sizeof(*scn));
+    if (!scn) {
+        NFC_D("malloc failed: %d (%s)", errno, strerror(errno));
+        return NULL;
+    }
+    scn->nfc = nfc;
+    scn->event = event;
+    scn->nevents = nevents;
+    scn->nloops = nloops;
+    scn->i = 0;
+    scn->done = 0;
+
+    scn->timeout = nfc->cb->new_timeout(run_cb, scn);
+    if (!scn->timeout) {
+        free(scn);
+        return NULL;
+    }
+    nfc->cb->mod_timeout(scn->timeout, event[0].delay);
+
+    return scn;
+}
+
+void
+nfc_scenario_destroy(struct nfc_scenario* scn)
+{
+    if (!scn) {
+        return;
+    }
+    scn->nfc->cb->del_timeout(scn->timeout);
+    free(scn);
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef nfc_scenario_h
+#define nfc_scenario_h
+
+#include <stddef.h>
+#include <nfcemu/types.h>
+
+struct nfc_device;
+
+/* Runs a schedule of field events from a timeout of the device. The
+ * events belong to the host; they are only read while the scenario
+ * runs. Events with a delay of 0 run in the same timeout as their
+ * predecessor, except for the first event of each loop.
+ */
+struct nfc_scenario {
+    struct nfc_device* nfc;
+    const struct nfcemu_scenario_event* event;
+    size_t nevents;
+    unsigned long nloops; /* 0 loops forever */
+    size_t i; /* next event */
+    int done;
+    nfcemu_timeout* timeout;
+};
+
+struct nfc_scenario*
+nfc_scenario_create(struct nfc_device* nfc,
+                    const struct nfcemu_scenario_event* event,
+                    size_t nevents, unsigned long nloops);
+
+void
+nfc_scenario_destroy(struct nfc_scenario* scn);
+
+#endif
@@ -0,0 +1,884 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "llcp.h"
+#include "nfc-debug.h"
+#include "nfc.h"
+#include "nfc-re.h"
+#include "nfc-tag.h"
+#include <nfcemu/nfcemu.h>
+
+/* A snapshot is a sequence of fixed-width fields in host byte order.
+ * Variable-sized data follows its length, lists follow the number of
+ * their entries, and only live objects are stored: REs by index
+ * without the free slots, data links without the spare room of the
+ * RE's array, buffers and queues with their content only.
+ */
+enum {
+    NFC_SNAPSHOT_MAGIC = 0x5343464e, /* "NFCS" in little endian */
+    NFC_SNAPSHOT_VERSION = 1
+};
+
+enum {
+    /* no active RE or RF interface */
+    NFC_SNAPSHOT_NO_INDEX = 0xffffffff,
+    /* bounds the RE array that a restore allocates */
+    NFC_SNAPSHOT_MAXIMUM_RES = 65536,
+    NFC_SNAPSHOT_NO_RF = 0xff,
+    /* offset of the snapshot's length in the header */
+    NFC_SNAPSHOT_LENGTH_OFFSET = 8
+};
+
+/*
+ * Snapshot
+ */
+
+struct writer {
+    uint8_t* buf;
+    size_t len;
+    size_t off;
+};
+
+/* Appends 'len' bytes if they fit; the offset always advances, so
+ * it ends up at the length of the whole snapshot. */
+static void
+put(struct writer* w, const void* data, size_t len)
+{
+    if (w->buf && len && (w->off <= w->len) && (len <= w->len - w->off)) {
+        memcpy(w->buf + w->off, data, len);
+    }
+    w->off += len;
+}
+
+static void
+put_u8(struct writer* w, uint8_t value)
+{
+    put(w, &value, sizeof(value));
+}
+
+static void
+put_u16(struct writer* w, uint16_t value)
+{
+    put(w, &value, sizeof(value));
+}
+
+static void
+put_u32(struct writer* w, uint32_t value)
+{
+    put(w, &value, sizeof(value));
+}
+
+static void
+save_pdu_queue(struct writer* w, const struct llcp_pdu_queue* q)
+{
+    const struct llcp_pdu_buf* buf;
+
+    put_u32(w, llcp_pdu_queue_len(q));
+
+    TAILQ_FOREACH(buf, q, entry) {
+        put_u8(w, buf->len);
+        put(w, buf->pdu, buf->len);
+    }
+}
+
+static void
+save_dl(struct writer* w, const struct llcp_data_link* dl)
+{
+    put_u8(w, dl->status);
+    put_u8(w, dl->rsap);
+    put_u8(w, dl->lsap);
+    put_u8(w, dl->v_s);
+    put_u8(w, dl->v_sa);
+    put_u8(w, dl->v_r);
+    put_u8(w, dl->v_ra);
+    put_u16(w, dl->miu);
+    put_u8(w, dl->rw_l);
+    put_u8(w, dl->rw_r);
+    put_u32(w, dl->rlen);
+    put_u32(w, dl->rrem);
+    put(w, dl->rbuf, dl->rlen);
+    put_u32(w, dl->slen);
+    put_u32(w, dl->soff);
+    put_u8(w, dl->swait);
+    put(w, dl->sbuf, dl->slen);
+    save_pdu_queue(w, &dl->xmit_q);
+}
+
+static void
+save_tag(struct writer* w, const struct nfc_tag* tag)
+{
+    /* the memory's size follows from the type and the data area */
+    put_u8(w, tag->type);
+    put_u8(w, tag->t4t_file_sel);
+    put_u32(w, tag->size);
+    put_u32(w, tag->max_read);
+    put_u32(w, tag->max_write);
+    put(w, tag->t.mem, tag->memsize);
+}
+
+static void
+save_re(struct writer* w, size_t i, const struct nfc_re* re)
+{
+    size_t j;
+
+    put_u32(w, i);
+    put_u8(w, re->rfproto);
+    put_u8(w, re->mode);
+    put(w, re->nfcid1, sizeof(re->nfcid1));
+    put(w, re->nfcid2, sizeof(re->nfcid2));
+    put(w, re->nfcid3, sizeof(re->nfcid3));
+    put_u8(w, re->id);
+    put_u8(w, re->connid);
+
+    put_u8(w, re->last_dsap);
+    put_u8(w, re->last_ssap);
+    put_u8(w, re->xmit_next);
+    put_u8(w, re->symm_adaptive);
+    put_u32(w, re->lto);
+    put_u32(w, re->symm_delay);
+    put_u32(w, re->symm_next_delay);
+    put_u16(w, re->sbufsiz);
+    put(w, re->sbuf, re->sbufsiz);
+    put_u16(w, re->rbufsiz);
+    put(w, re->rbuf, re->rbufsiz);
+    save_pdu_queue(w, &re->xmit_q);
+
+    put_u32(w, re->llcp_ndls);
+    for (j = 0; j < re->llcp_ndls; ++j) {
+        save_dl(w, re->llcp_dl[j]);
+    }
+
+    put_u8(w, !!re->tag);
+    if (re->tag) {
+        save_tag(w, re->tag);
+    }
+}
+
+static int
+save_route(void* data, const uint8_t* aid, size_t aidlen, uint8_t nfcee)
+{
+    struct writer* w = data;
+
+    put_u8(w, aidlen);
+    put(w, aid, aidlen);
+    put_u8(w, nfcee);
+
+    return 0;
+}
+
+ssize_t
+nfc_device_snapshot(const struct nfc_device* nfc, void* buf, size_t len)
+{
+    struct writer w = {
+        .buf = buf,
+        .len = len,
+        .off = 0
+    };
+    uint32_t active_re, nres, snaplen;
+    size_t i;
+
+    assert(nfc);
+    assert(buf || !len);
+
+    /* readers are driven by host callbacks */
+    if (nfc->active_re && nfc->active_re->reader) {
+        NFC_D("active RE is a reader");
+        return -1;
+    }
+
+    active_re = NFC_SNAPSHOT_NO_INDEX;
+    nres = 0;
+
+    for (i = 0; i < nfc->nres; ++i) {
+        if (!nfc->re[i] || nfc->re[i]->reader) {
+            continue;
+        }
+        if (i >= NFC_SNAPSHOT_MAXIMUM_RES) {
+            NFC_D("RE index %zu too large", i);
+            return -1;
+        }
+        if (nfc->re[i] == nfc->active_re) {
+            active_re = i;
+        }
+        ++nres;
+    }
+
+    put_u32(&w, NFC_SNAPSHOT_MAGIC);
+    put_u16(&w, NFC_SNAPSHOT_VERSION);
+    put_u16(&w, 0);
+    put_u32(&w, 0); /* length; set below */
+
+    put_u8(&w, nfc->state);
+    put_u8(&w, nfc->rf_state);
+    put_u8(&w, nfc->id);
+    put_u8(&w, nfc->nids);
+    put_u8(&w, nfc->max_dta_credits);
+    put_u8(&w, nfc->dta_credits);
+    put_u8(&w, nfc->active_rf ? nfc->active_rf - nfc->rf
+                              : NFC_SNAPSHOT_NO_RF);
+    put_u32(&w, active_re);
+    put(&w, nfc->config_id_value, sizeof(nfc->config_id_value));
+    put_u32(&w, nfc->rx_len);
+    put(&w, nfc->rx_buf, nfc->rx_len);
+
+    put_u8(&w, nfc->nfcee.enabled);
+    put_u8(&w, nfc->routing.iso_dep);
+    put_u8(&w, nfc->routing.more);
+    put_u32(&w, nfc->routing.aid.nvalues);
+    nfc_routing_foreach_aid(&nfc->routing, save_route, &w);
+
+    put_u32(&w, nres);
+    for (i = 0; i < nfc->nres; ++i) {
+        if (nfc->re[i] && !nfc->re[i]->reader) {
+            save_re(&w, i, nfc->re[i]);
+        }
+    }
+
+    if (!buf) {
+        return w.off;
+    }
+    if (w.off > len) {
+        NFC_D("snapshot needs %zu bytes", w.off);
+        return -1;
+    }
+    snaplen = w.off;
+    memcpy(w.buf + NFC_SNAPSHOT_LENGTH_OFFSET, &snaplen, sizeof(snaplen));
+
+    return w.off;
+}
+
+/*
+ * Restore
+ *
+ * Restoring runs twice over the snapshot: first without a device to
+ * validate all fields, then for real. Only running out of memory can
+ * make the second pass fail.
+ */
+
+struct reader {
+    const uint8_t* buf;
+    size_t len;
+    size_t off;
+    int err; /* set if the snapshot ended early */
+    /* PDUs, one after the largest RE index, and the RF discovery ids
+     * in use */
+    size_t npdus;
+    size_t nres;
+    uint8_t id_used[NFC_MAXIMUM_RE_ID + 1];
+};
+
+/* Returns the next 'len' bytes, or NULL if the snapshot ends before. */
+static const uint8_t*
+get(struct reader* r, size_t len)
+{
+    const uint8_t* data;
+
+    if (r->err || (len > r->len - r->off)) {
+        r->err = 1;
+        return NULL;
+    }
+    data = r->buf + r->off;
+    r->off += len;
+
+    return data;
+}
+
+static uint8_t
+get_u8(struct reader* r)
+{
+    const uint8_t* data = get(r, sizeof(uint8_t));
+
+    return data ? *data : 0;
+}
+
+static uint16_t
+get_u16(struct reader* r)
+{
+    const uint8_t* data = get(r, sizeof(uint16_t));
+    uint16_t value = 0;
+
+    if (data) {
+        memcpy(&value, data, sizeof(value));
+    }
+    return value;
+}
+
+static uint32_t
+get_u32(struct reader* r)
+{
+    const uint8_t* data = get(r, sizeof(uint32_t));
+    uint32_t value = 0;
+
+    if (data) {
+        memcpy(&value, data, sizeof(value));
+    }
+    return value;
+}
+
+static int
+is_valid_rf(enum nci_rf_protocol rfproto, enum nci_rf_tech_mode mode)
+{
+    switch (rfproto) {
+        case NCI_RF_PROTOCOL_T1T:
+        case NCI_RF_PROTOCOL_T2T:
+        case NCI_RF_PROTOCOL_T3T:
+        case NCI_RF_PROTOCOL_ISO_DEP:
+        case NCI_RF_PROTOCOL_NFC_DEP:
+            break;
+        default:
+            return 0;
+    }
+    switch (mode) {
+        case NCI_RF_NFC_A_PASSIVE_POLL_MODE:
+        case NCI_RF_NFC_B_PASSIVE_POLL_MODE:
+        case NCI_RF_NFC_F_PASSIVE_POLL_MODE:
+        case NCI_RF_NFC_A_PASSIVE_LISTEN_MODE:
+        case NCI_RF_NFC_B_PASSIVE_LISTEN_MODE:
+        case NCI_RF_NFC_F_PASSIVE_LISTEN_MODE:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* returns the type of the tag that an RE of the RF protocol carries,
+ * or -1 if it doesn't carry one */
+static int
+rf_tag_type(enum nci_rf_protocol rfproto)
+{
+    switch (rfproto) {
+        case NCI_RF_PROTOCOL_T1T:
+            return T1T;
+        case NCI_RF_PROTOCOL_T2T:
+            return T2T;
+        case NCI_RF_PROTOCOL_T3T:
+            return T3T;
+        case NCI_RF_PROTOCOL_ISO_DEP:
+            return T4T; /* readers aren't stored */
+        default:
+            return -1;
+    }
+}
+
+/* appends the PDUs to 'q', unless 'pool' is NULL */
+static int
+restore_pdu_queue(struct reader* r, struct llcp_pdu_pool* pool,
+                  struct llcp_pdu_queue* q)
+{
+    uint32_t npdus, i;
+
+    npdus = get_u32(r);
+
+    for (i = 0; (i < npdus) && !r->err; ++i) {
+        struct llcp_pdu_buf* buf;
+        uint8_t len;
+        const uint8_t* pdu;
+
+        len = get_u8(r);
+        pdu = get(r, len);
+        if (!pdu) {
+            break;
+        }
+        ++r->npdus;
+        if (!pool) {
+            continue;
+        }
+        buf = llcp_alloc_pdu_buf(pool);
+        if (!buf) {
+            return -1;
+        }
+        buf->len = len;
+        memcpy(buf->pdu, pdu, len);
+        TAILQ_INSERT_TAIL(q, buf, entry);
+    }
+    return r->err ? -1 : 0;
+}
+
+/* Appends the data link to the RE's array, unless 're' is NULL.
+ * 'key' is one after the key of the previous data link. */
+static int
+restore_dl(struct reader* r, struct nfc_re* re, unsigned int* key)
+{
+    struct llcp_data_link* dl;
+    uint8_t status, rsap, lsap, v_s, v_sa, v_r, v_ra, rw_l, rw_r, swait;
+    uint16_t miu;
+    uint32_t rlen, rrem, slen, soff;
+    const uint8_t* rbuf;
+    const uint8_t* sbuf;
+    unsigned int dlkey;
+
+    status = get_u8(r);
+    rsap = get_u8(r);
+    lsap = get_u8(r);
+    v_s = get_u8(r);
+    v_sa = get_u8(r);
+    v_r = get_u8(r);
+    v_ra = get_u8(r);
+    miu = get_u16(r);
+    rw_l = get_u8(r);
+    rw_r = get_u8(r);
+    rlen = get_u32(r);
+    rrem = get_u32(r);
+    rbuf = get(r, rlen);
+    slen = get_u32(r);
+    soff = get_u32(r);
+    swait = get_u8(r);
+    sbuf = get(r, slen);
+
+    if (r->err) {
+        return -1;
+    }
+
+    dlkey = (rsap << 8) | lsap;
+
+    /* data links are stored in the order of the RE's array */
+    if ((status > LLCP_DATA_LINK_DISCONNECTING) ||
+        (rsap >= LLCP_NUMBER_OF_SAPS) || (lsap >= LLCP_NUMBER_OF_SAPS) ||
+        (dlkey < *key) ||
+        (v_s > 0x0f) || (v_sa > 0x0f) || (v_r > 0x0f) || (v_ra > 0x0f) ||
+        (rw_l > 0x0f) || (rw_r > 0x0f) || (miu > LLCP_MAX_MIU) ||
+        (soff > slen)) {
+        NFC_D("invalid data link %d:%d", rsap, lsap);
+        return -1;
+    }
+    *key = dlkey + 1;
+
+    if (!re) {
+        return restore_pdu_queue(r, NULL, NULL);
+    }
+
+    dl = malloc(sizeof(*dl));
+    if (!dl) {
+        NFC_D("malloc failed: %d (%s)", errno, strerror(errno));
+        return -1;
+    }
+    llcp_init_data_link(dl, re->nfc->snep_max_msg_len);
+    re->llcp_dl[re->llcp_ndls++] = dl;
+
+    dl->status = status;
+    dl->rsap = rsap;
+    dl->lsap = lsap;
+    dl->v_s = v_s;
+    dl->v_sa = v_sa;
+    dl->v_r = v_r;
+    dl->v_ra = v_ra;
+    dl->miu = miu;
+    dl->rw_l = rw_l;
+    dl->rw_r = rw_r;
+
+    if (llcp_dl_write_rbuf(dl, rlen, rbuf) < 0) {
+        return -1;
+    }
+    dl->rrem = rrem;
+
+    if (slen) {
+        if (llcp_dl_reserve_sbuf(dl, slen) < 0) {
+            return -1;
+        }
+        memcpy(dl->sbuf, sbuf, slen);
+        dl->slen = slen;
+        dl->soff = soff;
+        dl->swait = swait;
+    }
+
+    return restore_pdu_queue(r, &re->nfc->pdu_pool, &dl->xmit_q);
+}
+
+/* returns the tag of type 'tag_type' in '*tag', unless 'tag' is
+ * NULL */
+static int
+restore_tag(struct reader* r, enum nfc_tag_type tag_type,
+            struct nfc_tag** tag)
+{
+    struct nfc_tag* t;
+    uint8_t type, file_sel;
+    uint32_t size, max_read, max_write;
+    size_t memsize;
+    const uint8_t* mem;
+
+    type = get_u8(r);
+    file_sel = get_u8(r);
+    size = get_u32(r);
+    max_read = get_u32(r);
+    max_write = get_u32(r);
+
+    if (r->err) {
+        return -1;
+    }
+    memsize = nfc_tag_memsize(type, size);
+    if ((type != tag_type) || !memsize || (file_sel > NDEF_SELECT) ||
+        !nfc_tag_limits_are_valid(type, max_read, max_write)) {
+        NFC_D("invalid tag of type %d", type);
+        return -1;
+    }
+    mem = get(r, memsize);
+    if (!mem) {
+        return -1;
+    }
+    if (!tag) {
+        return 0;
+    }
+
+    t = malloc(sizeof(*t));
+    if (!t) {
+        NFC_D("malloc failed: %d (%s)", errno, strerror(errno));
+        return -1;
+    }
+    if (nfc_tag_init(t, type, size) < 0) {
+        free(t);
+        return -1;
+    }
+    memcpy(t->t.mem, mem, memsize);
+    t->t4t_file_sel = file_sel;
+    t->max_read = max_read;
+    t->max_write = max_write;
+    *tag = t;
+
+    return 0;
+}
+
+/* stores the RE at its index in the device, unless 'nfc' is NULL */
+static int
+restore_re(struct reader* r, struct nfc_device* nfc, uint32_t* index)
+{
+    struct nfc_re* re;
+    uint8_t rfproto, mode, id, connid;
+    const uint8_t* nfcid1;
+    const uint8_t* nfcid2;
+    const uint8_t* nfcid3;
+    uint8_t last_dsap, last_ssap, xmit_next, symm_adaptive, has_tag;
+    uint32_t lto, symm_delay, symm_next_delay;
+    uint16_t sbufsiz, rbufsiz;
+    const uint8_t* sbuf;
+    const uint8_t* rbuf;
+    uint32_t ndls, i;
+    unsigned int key;
+    int tag_type;
+
+    *index = get_u32(r);
+    rfproto = get_u8(r);
+    mode = get_u8(r);
+    nfcid1 = get(r, sizeof(re->nfcid1));
+    nfcid2 = get(r, sizeof(re->nfcid2));
+    nfcid3 = get(r, sizeof(re->nfcid3));
+    id = get_u8(r);
+    connid = get_u8(r);
+    last_dsap = get_u8(r);
+    last_ssap = get_u8(r);
+    xmit_next = get_u8(r);
+    symm_adaptive = get_u8(r);
+    lto = get_u32(r);
+    symm_delay = get_u32(r);
+    symm_next_delay = get_u32(r);
+    sbufsiz = get_u16(r);
+    sbuf = get(r, sbufsiz);
+    rbufsiz = get_u16(r);
+    rbuf = get(r, rbufsiz);
+
+    if (r->err) {
+        return -1;
+    }
+    /* REs are stored by increasing index */
+    if ((*index < r->nres) || (*index >= NFC_SNAPSHOT_MAXIMUM_RES) ||
+        !is_valid_rf(rfproto, mode) ||
+        (id > NFC_MAXIMUM_RE_ID) || (id && r->id_used[id]) ||
+        (last_dsap >= LLCP_NUMBER_OF_SAPS) ||
+        (last_ssap >= LLCP_NUMBER_OF_SAPS) ||
+        (sbufsiz > sizeof(re->sbuf)) || (rbufsiz > sizeof(re->rbuf))) {
+        NFC_D("invalid RE %u", *index);
+        return -1;
+    }
+    r->nres = *index + 1;
+    r->id_used[id] = !!id;
+
+    re = NULL;
+    if (nfc) {
+        re = malloc(sizeof(*re));
+        if (!re) {
+            NFC_D("malloc failed: %d (%s)", errno, strerror(errno));
+            return -1;
+        }
+        nfc_re_init(re, nfc, rfproto, mode, NULL,
+                    (const char*)nfcid1, (const char*)nfcid2);
+        /* from here on, the device owns the RE */
+        nfc->re[*index] = re;
+
+        memcpy(re->nfcid3, nfcid3, sizeof(re->nfcid3));
+        re->id = id;
+        if (id) {
+            nfc->re_by_id[id] = re;
+        }
+        re->connid = connid;
+        re->last_dsap = last_dsap;
+        re->last_ssap = last_ssap;
+        re->xmit_next = xmit_next;
+        re->symm_adaptive = symm_adaptive;
+        re->lto = lto;
+        re->symm_delay = symm_delay;
+        re->symm_next_delay = symm_next_delay;
+        memcpy(re->sbuf, sbuf, sbufsiz);
+        re->sbufsiz = sbufsiz;
+        memcpy(re->rbuf, rbuf, rbufsiz);
+        re->rbufsiz = rbufsiz;
+    }
+
+    if (restore_pdu_queue(r, re ? &nfc->pdu_pool : NULL,
+                          re ? &re->xmit_q : NULL) < 0) {
+        return -1;
+    }
+
+    ndls = get_u32(r);
+    if (r->err || (ndls > LLCP_NUMBER_OF_SAPS * LLCP_NUMBER_OF_SAPS)) {
+        return -1;
+    }
+    if (re && ndls) {
+        re->llcp_dl = malloc(ndls * sizeof(*re->llcp_dl));
+        if (!re->llcp_dl) {
+            NFC_D("malloc failed: %d (%s)", errno, strerror(errno));
+            return -1;
+        }
+        re->llcp_maxdls = ndls;
+    }
+    for (i = 0, key = 0; i < ndls; ++i) {
+        if (restore_dl(r, re, &key) < 0) {
+            return -1;
+        }
+    }
+
+    /* exactly the REs of tag protocols carry a tag */
+    tag_type = rf_tag_type(rfproto);
+    has_tag = get_u8(r);
+    if (r->err || (has_tag != (tag_type >= 0))) {
+        NFC_D("invalid tag of RE %u", *index);
+        return -1;
+    }
+    if (has_tag && (restore_tag(r, tag_type, re ? &re->tag : NULL) < 0)) {
+        return -1;
+    }
+
+    return r->err ? -1 : 0;
+}
+
+/* restores the device's fields and REs, unless 'nfc' is NULL; the
+ * device's RE array has to hold all of the snapshot's indices */
+static int
+restore_device(struct reader* r, struct nfc_device* nfc)
+{
+    uint32_t magic, snaplen, active_re, rx_len, nroutes, nres, index, i;
+    uint16_t version;
+    uint8_t state, rf_state, id, nids, max_dta_credits, dta_credits;
+    uint8_t active_rf, enabled, iso_dep, more;
+    const uint8_t* config_id_value;
+    const uint8_t* rx_buf;
+    int has_active_re;
+
+    magic = get_u32(r);
+    version = get_u16(r);
+    get_u16(r); /* reserved */
+    snaplen = get_u32(r);
+
+    if (r->err || (magic != NFC_SNAPSHOT_MAGIC) ||
+        (version != NFC_SNAPSHOT_VERSION) || (snaplen != r->len)) {
+        NFC_D("invalid snapshot header");
+        return -1;
+    }
+
+    state = get_u8(r);
+    rf_state = get_u8(r);
+    id = get_u8(r);
+    nids = get_u8(r);
+    max_dta_credits = get_u8(r);
+    dta_credits = get_u8(r);
+    active_rf = get_u8(r);
+    active_re = get_u32(r);
+    config_id_value = get(r, sizeof(nfc->config_id_value));
+    rx_len = get_u32(r);
+    rx_buf = get(r, rx_len);
+    enabled = get_u8(r);
+    iso_dep = get_u8(r);
+    more = get_u8(r);
+    nroutes = get_u32(r);
+
+    if (r->err) {
+        return -1;
+    }
+    if ((state >= NUMBER_OF_NFC_FSM_STATES) ||
+        (rf_state >= NUMBER_OF_NFC_RFSTS) ||
+        (id > NFC_MAXIMUM_RE_ID) || (nids > NFC_MAXIMUM_RE_ID) ||
+        ((active_rf != NFC_SNAPSHOT_NO_RF) &&
+         (active_rf >= NUMBER_OF_SUPPORTED_NCI_RF_INTERFACES)) ||
+        (rx_len > NFC_MAX_DTA_LENGTH)) {
+        NFC_D("invalid device state");
+        return -1;
+    }
+    if (nfc && rx_len && !nfc_device_rx_buf(nfc)) {
+        return -1;
+    }
+
+    if (nfc) {
+        nfc->state = state;
+        nfc->rf_state = rf_state;
+        nfc->id = id;
+        nfc->nids = nids;
+        nfc->max_dta_credits = max_dta_credits;
+        nfc->dta_credits = dta_credits;
+        nfc->active_rf = (active_rf != NFC_SNAPSHOT_NO_RF)
+                            ? nfc->rf + active_rf : NULL;
+        memcpy(nfc->config_id_value, config_id_value,
+               sizeof(nfc->config_id_value));
+        if (rx_len) {
+            memcpy(nfc->rx_buf, rx_buf, rx_len);
+        }
+        nfc->rx_len = rx_len;
+        nfc->nfcee.enabled = enabled;
+        nfc_routing_clear(&nfc->routing);
+        nfc->routing.iso_dep = iso_dep;
+        nfc->routing.more = more;
+    }
+
+    for (i = 0; i < nroutes; ++i) {
+        uint8_t aidlen, nfcee;
+        const uint8_t* aid;
+
+        aidlen = get_u8(r);
+        aid = get(r, aidlen);
+        nfcee = get_u8(r);
+
+        if (r->err) {
+            return -1;
+        }
+        if (!aidlen || (aidlen > NFC_AID_MAXIMUM_LENGTH)) {
+            NFC_D("invalid AID length %d", aidlen);
+            return -1;
+        }
+        if (nfc &&
+            (nfc_routing_add_aid(&nfc->routing, aid, aidlen, nfcee) < 0)) {
+            return -1;
+        }
+    }
+
+    nres = get_u32(r);
+    has_active_re = 0;
+
+    for (i = 0; (i < nres) && !r->err; ++i) {
+        if (restore_re(r, nfc, &index) < 0) {
+            return -1;
+        }
+        has_active_re |= (index == active_re);
+    }
+
+    if (r->err || (r->off != r->len)) {
+        NFC_D("invalid snapshot length");
+        return -1;
+    }
+    if ((active_re != NFC_SNAPSHOT_NO_INDEX) && !has_active_re) {
+        NFC_D("invalid active RE %u", active_re);
+        return -1;
+    }
+
+    if (nfc && (active_re != NFC_SNAPSHOT_NO_INDEX)) {
+        nfc->active_re = nfc->re[active_re];
+        /* the guest waits for the RE's LLCP PDUs */
+        nfc_re_restart_xmit_timeout(nfc->active_re);
+    }
+
+    return 0;
+}
+
+/* Removes all REs, including readers, and makes room for 'nres'
+ * empty slots. */
+static int
+reset_res(struct nfc_device* nfc, size_t nres)
+{
+    size_t i;
+
+    nfc->active_re = NULL;
+
+    for (i = 0; i < nfc->nres; ++i) {
+        nfc_device_remove_re(nfc, i);
+    }
+    nfc->nres = 0;
+    nfc->nids = 0;
+
+    if (nres > nfc->maxres) {
+        size_t maxres = nfc->maxres ? nfc->maxres : NFC_DEFAULT_MAXRES;
+        struct nfc_re** p;
+
+        while (maxres < nres) {
+            maxres *= 2;
+        }
+        p = realloc(nfc->re, maxres * sizeof(*p));
+        if (!p) {
+            NFC_D("realloc failed: %d (%s)", errno, strerror(errno));
+            return -1;
+        }
+        nfc->re = p;
+        nfc->maxres = maxres;
+    }
+    for (i = 0; i < nres; ++i) {
+        nfc->re[i] = NULL;
+    }
+    nfc->nres = nres;
+
+    return 0;
+}
+
+int
+nfc_device_restore(struct nfc_device* nfc, const void* buf, size_t len)
+{
+    struct reader check = {
+        .buf = buf,
+        .len = len
+    };
+    struct reader load = {
+        .buf = buf,
+        .len = len
+    };
+
+    assert(nfc);
+    assert(buf || !len);
+
+    if (restore_device(&check, NULL) < 0) {
+        return -1;
+    }
+    if (check.npdus > nfc->pdu_pool.nbufs) {
+        NFC_D("snapshot has %zu PDUs, pool only %zu", check.npdus,
+              nfc->pdu_pool.nbufs);
+        return -1;
+    }
+
+    if ((reset_res(nfc, check.nres) < 0) ||
+        (restore_device(&load, nfc) < 0)) {
+        goto err;
+    }
+
+    return 0;
+
+err:
+    /* out of memory; leave the device idle without REs */
+    reset_res(nfc, 0);
+    nfc_routing_clear(&nfc->routing);
+    nfc->nfcee.enabled = 0;
+    nfc->state = NFC_FSM_STATE_IDLE;
+    nfc->rf_state = NFC_RFST_IDLE;
+    nfc->active_rf = NULL;
+    nfc->rx_len = 0;
+    return -1;
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nfc-tag-cache.h"
+
+int
+nfc_tag_cache_init(struct nfc_tag_cache* cache, size_t nimages)
+{
+    size_t i;
+
+    assert(cache);
+    assert(nimages);
+
+    cache->image = calloc(nimages, sizeof(*cache->image));
+    if (!cache->image) {
+        return -1;
+    }
+    cache->nimages = nimages;
+
+    TAILQ_INIT(&cache->lru_q);
+    for (i = 0; i < nimages; ++i) {
+        TAILQ_INSERT_TAIL(&cache->lru_q, cache->image + i, entry);
+    }
+
+    return 0;
+}
+
+void
+nfc_tag_cache_uninit(struct nfc_tag_cache* cache)
+{
+    size_t i;
+
+    assert(cache);
+
+    for (i = 0; i < cache->nimages; ++i) {
+        free(cache->image[i].ndef_msg);
+        nfc_tag_mem_unref(cache->image[i].mem);
+    }
+    free(cache->image);
+    cache->image = NULL;
+    cache->nimages = 0;
+    TAILQ_INIT(&cache->lru_q);
+}
+
+/* FNV-1a */
+static uint32_t
+hash_ndef_msg(const uint8_t* ndef_msg, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        hash = (hash ^ ndef_msg[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int
+image_matches(const struct nfc_tag_image* image, uint32_t hash,
+              const struct nfc_tag* tag, const uint8_t* ndef_msg, size_t len)
+{
+    return image->mem &&
+           (image->hash == hash) &&
+           (image->type == tag->type) &&
+           (image->size == tag->size) &&
+           (image->max_read == tag->max_read) &&
+           (image->max_write == tag->max_write) &&
+           (image->ndef_len == len) &&
+           !memcmp(image->ndef_msg, ndef_msg, len);
+}
+
+static struct nfc_tag_image*
+find_image(struct nfc_tag_cache* cache, uint32_t hash,
+           const struct nfc_tag* tag, const uint8_t* ndef_msg, size_t len)
+{
+    struct nfc_tag_image* image;
+
+    TAILQ_FOREACH(image, &cache->lru_q, entry) {
+        if (image_matches(image, hash, tag, ndef_msg, len)) {
+            return image;
+        }
+    }
+    return NULL;
+}
+
+/* encodes the NDEF message into the least recently used image */
+static struct nfc_tag_image*
+build_image(struct nfc_tag_cache* cache, uint32_t hash,
+            const struct nfc_tag* tag, const uint8_t* ndef_msg, size_t len)
+{
+    struct nfc_tag_image* image;
+    struct nfc_tag img_tag;
+    uint8_t* buf;
+
+    image = TAILQ_LAST(&cache->lru_q, nfc_tag_image_queue);
+    assert(image);
+
+    /* tags that share the previous memory keep it */
+    nfc_tag_mem_unref(image->mem);
+    image->mem = NULL;
+
+    buf = realloc(image->ndef_msg, len ? len : 1);
+    if (!buf) {
+        return NULL;
+    }
+    image->ndef_msg = buf;
+
+    /* format a copy of the tag that lives in the image's memory */
+    img_tag = *tag;
+    img_tag.mem = nfc_tag_mem_create(tag->memsize);
+    if (!img_tag.mem) {
+        return NULL;
+    }
+    img_tag.t.mem = img_tag.mem->data;
+
+    if ((nfc_tag_format(&img_tag) < 0) ||
+        (nfc_tag_set_data(&img_tag, ndef_msg, len) < 0)) {
+        nfc_tag_mem_unref(img_tag.mem);
+        return NULL;
+    }
+    memcpy(image->ndef_msg, ndef_msg, len);
+
+    image->hash = hash;
+    image->type = tag->type;
+    image->size = tag->size;
+    image->max_read = tag->max_read;
+    image->max_write = tag->max_write;
+    image->ndef_len = len;
+    image->mem = img_tag.mem;
+
+    return image;
+}
+
+int
+nfc_tag_cache_set_data(struct nfc_tag_cache* cache, struct nfc_tag* tag,
+                       const uint8_t* ndef_msg, ssize_t len)
+{
+    struct nfc_tag_image* image;
+    uint32_t hash;
+
+    assert(cache);
+    assert(tag);
+    assert(ndef_msg || !len);
+
+    if (len < 0) {
+        return -1;
+    }
+
+    hash = hash_ndef_msg(ndef_msg, len);
+
+    image = find_image(cache, hash, tag, ndef_msg, len);
+    if (!image) {
+        image = build_image(cache, hash, tag, ndef_msg, len);
+        if (!image) {
+            return -1;
+        }
+    }
+
+    /* move to front of LRU order */
+    TAILQ_REMOVE(&cache->lru_q, image, entry);
+    TAILQ_INSERT_HEAD(&cache->lru_q, image, entry);
+
+    assert(image->mem->size == tag->memsize);
+    nfc_tag_set_mem(tag, image->mem);
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef nfc_tag_cache_h
+#define nfc_tag_cache_h
+
+#include <stdint.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+#include "nfc-tag.h"
+
+enum {
+    NFC_TAG_CACHE_DEFAULT_SIZE = 32
+};
+
+/* Fully encoded tag memory for an NDEF message. The image depends
+ * on the tag's type, size and limits, which are part of the key
+ * together with the NDEF message itself. Tags share the memory until
+ * they are written.
+ */
+struct nfc_tag_image {
+    TAILQ_ENTRY(nfc_tag_image) entry;
+    uint32_t hash;
+    enum nfc_tag_type type;
+    size_t size;
+    unsigned long max_read;
+    unsigned long max_write;
+    size_t ndef_len;
+    uint8_t* ndef_msg;
+    struct nfc_tag_mem* mem;
+};
+
+TAILQ_HEAD(nfc_tag_image_queue, nfc_tag_image);
+
+/* Cache of tag images, content-addressed by NDEF message. Images
+ * are kept in order of their last use; a miss replaces the least
+ * recently used one.
+ */
+struct nfc_tag_cache {
+    size_t nimages;
+    struct nfc_tag_image* image;
+    struct nfc_tag_image_queue lru_q;
+};
+
+int
+nfc_tag_cache_init(struct nfc_tag_cache* cache, size_t nimages);
+
+void
+nfc_tag_cache_uninit(struct nfc_tag_cache* cache);
+
+/* Replaces the tag's memory with a freshly formatted image that
+ * holds the NDEF message; the tag shares the cached image. The tag is
+ * left unchanged on errors. */
+int
+nfc_tag_cache_set_data(struct nfc_tag_cache* cache, struct nfc_tag* tag,
+                       const uint8_t* ndef_msg, ssize_t len);
+
+#endif
@@ -15,6 +15,7 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include "nfc-debug.h"
 #include "nfc.h"
@@ -43,15 +44,10 @@ static const uint8_t t1t_cc[4] = { 0xE1, 0x10, 0x0E, 0x00 };
 #define T3T_V 0x10                        // Version
 #define T3T_R 0x04                        // Number of blocks can be read using one Check Command
 #define T3T_W 0x01                        // Number of blocks can be written using one Update Command
-#define T3T_NB { 0x00, 0x0d }             // Maximum number of blocks available for NDEF data
 #define T3T_U { 0x00, 0x00, 0x00, 0x00 }  // Unused
 #define T3T_WF 0x00                       // 00h:Writing data finished, 0Fh:Writing data in progress
 #define T3T_RW 0x01                       // 00h:Read only, 01h:Read/Write available
 #define T3T_LN { 0x00, 0x00, 0x00 }       // Actual size of the stored NDEF data in bytes
-#define T3T_CS { 0x00, 0x23 }             // Checksum: Byte0 + Byte1 + ... + Byte 13
-
-/* [Type 4 Tag Operation Specification] */
-static enum t4t_file_select t4t_file_sel = NONE;
 
 /* [T4TOP] Table5 */
 #define T4T_PROPRIETARY_CC { 0x00, 0x0f, 0x20, 0x00, 0x3b, 0x00, 0x34, \
@@ -60,6 +56,9 @@ static enum t4t_file_select t4t_file_sel = NONE;
 #define T4T_NDEF_CC { 0x00, 0x0f, 0x20, 0x00, 0x3b, 0x00, 0x34, \
                       0x04, 0x06, 0xE1, 0x04, 0x04, 0x00, 0x00, 0x00 }
 
+#define T4T_MLE 0x003b                    // Maximum R-APDU data size
+#define T4T_MLC 0x0034                    // Maximum C-APDU data size
+
 /* [T4TOP] Table 10 */
 static const uint8_t t4t_app_apdu[13] = { 0x00, 0xa4, 0x04, 0x00, 0x07, 0xd2, 0x76,
                                           0x00, 0x00, 0x85, 0x01, 0x01, 0x00 };
@@ -70,20 +69,188 @@ static const uint8_t t4t_cc_apdu[7] = { 0x00, 0xa4, 0x00, 0x0c, 0x02, 0xe1, 0x03
 /* [T4TOP] Table 16 */
 static const uint8_t t4t_rb_apdu[2] = { 0x00, 0xb0 };
 
+/* [T4TOP] UPDATE BINARY */
+static const uint8_t t4t_ub_apdu[2] = { 0x00, 0xd6 };
+
 /* [T4TOP] Table 19 */
 static const uint8_t t4t_ndef_apdu[5] = { 0x00, 0xa4, 0x00, 0x0c, 0x02 };
 
-static uint8_t NDEF_MESSAGE_TLV = 0x03;
-static uint8_t NDEF_TERMINATOR_TLV = 0xFE;
+static const uint8_t NDEF_MESSAGE_TLV = 0x03;
+static const uint8_t NDEF_TERMINATOR_TLV = 0xFE;
+
+/* header and trailer around the data area of each tag type */
+static size_t
+tag_overhead(enum nfc_tag_type type)
+{
+    switch (type) {
+        case T1T:
+            return sizeof(struct nfc_t1t_format) -
+                   sizeof(((struct nfc_t1t_format*)NULL)->data);
+        case T2T:
+            return sizeof(struct nfc_t2t_format);
+        case T3T:
+            return sizeof(struct nfc_t3t_format);
+        case T4T:
+            return sizeof(struct nfc_t4t_format);
+        default:
+            assert(0);
+            return 0;
+    }
+}
+
+static size_t
+default_size(enum nfc_tag_type type)
+{
+    static const size_t size[] = {
+        [T1T] = sizeof(((struct nfc_t1t_format*)NULL)->data),
+        [T2T] = T2T_DEFAULT_DATA_SIZE,
+        [T3T] = T3T_DEFAULT_DATA_SIZE,
+        [T4T] = T4T_DEFAULT_DATA_SIZE
+    };
+
+    return size[type];
+}
+
+static int
+is_valid_size(enum nfc_tag_type type, size_t size)
+{
+    switch (type) {
+        case T1T:
+            /* static memory only */
+            return size == default_size(T1T);
+        case T2T:
+            /* CC announces the data area in multiples of 8 bytes */
+            return size && !(size % 8) && (size <= T2T_MAXIMUM_DATA_SIZE);
+        case T3T:
+            return size && !(size % T3T_BLOCK_SIZE) &&
+                   (size <= MAXIMUM_SUPPORTED_TAG_SIZE);
+        case T4T:
+            /* NDEF file has to hold at least its length field */
+            return (size > 2) && (size <= MAXIMUM_SUPPORTED_TAG_SIZE);
+        default:
+            return 0;
+    }
+}
+
+static int
+is_valid_limits(enum nfc_tag_type type, unsigned long max_read,
+                unsigned long max_write)
+{
+    switch (type) {
+        case T3T:
+            return max_read && (max_read <= T3T_MAXIMUM_NBR) &&
+                   max_write && (max_write <= T3T_MAXIMUM_NBW);
+        case T4T:
+            return (max_read >= T4T_MINIMUM_MLE) &&
+                   (max_read <= T4T_MAXIMUM_MLE) &&
+                   (max_write >= T4T_MINIMUM_MLC) &&
+                   (max_write <= T4T_MAXIMUM_MLC);
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Shared memory
+ */
+
+struct nfc_tag_mem*
+nfc_tag_mem_create(size_t size)
+{
+    struct nfc_tag_mem* mem;
+
+    mem = malloc(sizeof(*mem) + size);
+    if (!mem) {
+        return NULL;
+    }
+    mem->nrefs = 1;
+    mem->size = size;
+
+    return mem;
+}
+
+struct nfc_tag_mem*
+nfc_tag_mem_ref(struct nfc_tag_mem* mem)
+{
+    assert(mem);
+
+    __atomic_add_fetch(&mem->nrefs, 1, __ATOMIC_RELAXED);
+
+    return mem;
+}
+
+void
+nfc_tag_mem_unref(struct nfc_tag_mem* mem)
+{
+    if (mem && !__atomic_sub_fetch(&mem->nrefs, 1, __ATOMIC_ACQ_REL)) {
+        free(mem);
+    }
+}
+
+void
+nfc_tag_set_mem(struct nfc_tag* tag, struct nfc_tag_mem* mem)
+{
+    assert(tag);
+    assert(mem);
+    assert(mem->size == tag->memsize);
 
-struct nfc_tag nfc_tags[4] = {
-   INIT_NFC_T1T([0], T1T_UID, T1T_RES),
-   INIT_NFC_T2T([1], T2T_INTERNAL, T2T_LOCK, T2T_CC),
-   INIT_NFC_T3T([2], T3T_V, T3T_R, T3T_W, T3T_NB, T3T_U, T3T_WF, T3T_RW, T3T_LN, T3T_CS),
-   INIT_NFC_T4T([3], T4T_PROPRIETARY_CC)
-};
+    nfc_tag_mem_ref(mem);
+    nfc_tag_mem_unref(tag->mem);
+    tag->mem = mem;
+    tag->t.mem = mem->data;
+}
+
+/* Copies shared memory before the tag writes to it. With a single
+ * reference, no other tag can get hold of the memory, so it can be
+ * written in place. */
+static int
+unshare_mem(struct nfc_tag* tag)
+{
+    struct nfc_tag_mem* mem;
+
+    if (__atomic_load_n(&tag->mem->nrefs, __ATOMIC_ACQUIRE) == 1) {
+        return 0;
+    }
+    mem = nfc_tag_mem_create(tag->memsize);
+    if (!mem) {
+        NFC_D("couldn't copy %zu bytes of tag memory", tag->memsize);
+        return -1;
+    }
+    memcpy(mem->data, tag->t.mem, tag->memsize);
+    nfc_tag_mem_unref(tag->mem);
+    tag->mem = mem;
+    tag->t.mem = mem->data;
+
+    return 0;
+}
 
 static void
+update_t3t_checksum(struct nfc_tag* tag)
+{
+    uint16_t cs = 0;
+    uint8_t i;
+
+    for (i = 0; i < tag->t.t3->cs - &tag->t.t3->ver; i++) {
+        cs += tag->t.mem[i];
+    }
+
+    tag->t.t3->cs[0] = (cs >> 8) & 0xff;
+    tag->t.t3->cs[1] = cs & 0xff;
+}
+
+static void
+update_t4t_cc(struct nfc_tag* tag)
+{
+    /* [T4TOP] Table 5; MLe, MLc and maximum NDEF file size */
+    tag->t.t4->cc[3] = (tag->max_read >> 8) & 0xff;
+    tag->t.t4->cc[4] = tag->max_read & 0xff;
+    tag->t.t4->cc[5] = (tag->max_write >> 8) & 0xff;
+    tag->t.t4->cc[6] = tag->max_write & 0xff;
+    tag->t.t4->cc[11] = (tag->size >> 8) & 0xff;
+    tag->t.t4->cc[12] = tag->size & 0xff;
+}
+
+static int
 set_t1t_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len)
 {
     ssize_t offset = 0;
@@ -91,9 +258,13 @@ set_t1t_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len)
 
     assert(tag);
     assert(ndef_msg || !len);
-    assert(len < sizeof(tag->t.t1.format.data));
 
-    data = tag->t.t1.format.data;
+    if (len + sizeof(t1t_cc) + 3 > sizeof(tag->t.t1->data)) {
+        NFC_D("NDEF message of %zd bytes is too large for T1T", len);
+        return -1;
+    }
+
+    data = tag->t.t1->data;
 
     /* [Type 1 Tag Operation Specificatio] 6.1 NDEF Management */
     memcpy(data + offset, t1t_cc, sizeof(t1t_cc));
@@ -106,10 +277,12 @@ set_t1t_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len)
     offset += len;
 
     data[offset++] = NDEF_TERMINATOR_TLV;
-    memset(data + offset, 0, sizeof(tag->t.t1.format.data) - offset);
+    memset(data + offset, 0, sizeof(tag->t.t1->data) - offset);
+
+    return 0;
 }
 
-static void
+static int
 set_t2t_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len)
 {
     ssize_t offset = 0;
@@ -117,82 +290,276 @@ set_t2t_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len)
 
     assert(tag);
     assert(ndef_msg || !len);
-    assert(len < sizeof(tag->t.t2.format.data));
 
-    data = tag->t.t2.format.data;
+    /* TLV with 1- or 3-byte length field, plus terminator */
+    if (len + (len < 0xff ? 3 : 5) > tag->size) {
+        NFC_D("NDEF message of %zd bytes is too large for T2T", len);
+        return -1;
+    }
+
+    data = tag->t.t2->data;
 
     data[offset++] = NDEF_MESSAGE_TLV;
-    data[offset++] = len;
+    if (len < 0xff) {
+        data[offset++] = len;
+    } else {
+        /* [Type 2 Tag Operation Specification] 2.3; 3-byte format */
+        data[offset++] = 0xff;
+        data[offset++] = (len >> 8) & 0xff;
+        data[offset++] = len & 0xff;
+    }
 
     memcpy(data + offset, ndef_msg, len);
     offset += len;
 
     data[offset++] = NDEF_TERMINATOR_TLV;
-    memset(data + offset, 0, sizeof(tag->t.t2.format.data) - offset);
+    memset(data + offset, 0, tag->size - offset);
+
+    return 0;
 }
 
-static void
+static int
 set_t3t_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len)
 {
-    uint16_t cs = 0;
-    uint8_t i;
-
     assert(tag);
     assert(ndef_msg || !len);
-    assert(len < sizeof(tag->t.t3.format.data));
-
-    /* Re-calculate LN & Checksum */
-    tag->t.t3.format.ln[0] = (len >> 16) & 0xff;
-    tag->t.t3.format.ln[1] = (len >> 8) & 0xff;
-    tag->t.t3.format.ln[2] = len & 0xff;
 
-    for (i = 0; i < tag->t.t3.format.cs - &tag->t.t3.format.ver; i++) {
-        cs += tag->t.t3.raw.mem[i];
+    if (len > tag->size) {
+        NFC_D("NDEF message of %zd bytes is too large for T3T", len);
+        return -1;
     }
 
-    tag->t.t3.format.cs[0] = (cs >> 8) & 0xff;
-    tag->t.t3.format.cs[1] = cs & 0xff;
+    /* Re-calculate LN & Checksum */
+    tag->t.t3->ln[0] = (len >> 16) & 0xff;
+    tag->t.t3->ln[1] = (len >> 8) & 0xff;
+    tag->t.t3->ln[2] = len & 0xff;
+
+    update_t3t_checksum(tag);
 
     /* Copy NDEF data, start from BLOCK one */
-    memcpy(tag->t.t3.format.data , ndef_msg, len);
+    memcpy(tag->t.t3->data, ndef_msg, len);
+    memset((uint8_t*)tag->t.t3->data + len, 0, tag->size - len);
+
+    return 0;
 }
 
-static void
+static int
 set_t4t_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len)
 {
+    static const uint8_t cc[] = T4T_NDEF_CC;
+
     assert(tag);
     assert(ndef_msg || !len);
-    assert(len + 2 < sizeof(tag->t.t4.format.data));
 
-    uint8_t cc[] = T4T_NDEF_CC;
-    memcpy(tag->t.t4.format.cc, cc, sizeof(cc));
+    if (len + 2 > tag->size) {
+        NFC_D("NDEF message of %zd bytes is too large for T4T", len);
+        return -1;
+    }
+
+    memcpy(tag->t.t4->cc, cc, sizeof(cc));
+    update_t4t_cc(tag);
+
+    tag->t.t4->data[0] = (len >> 8) & 0xff;
+    tag->t.t4->data[1] = len & 0xff;
 
-    tag->t.t4.format.data[0] = (len >> 8) & 0xff;
-    tag->t.t4.format.data[1] = len & 0xff;
+    memcpy(tag->t.t4->data + 2 , ndef_msg, len);
 
-    memcpy(tag->t.t4.format.data + 2 , ndef_msg, len);
+    return 0;
 }
 
 int
 nfc_tag_set_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len)
 {
+    if (unshare_mem(tag) < 0) {
+        return -1;
+    }
     switch (tag->type) {
         case T1T:
-            set_t1t_data(tag, ndef_msg, len);
-            break;
+            return set_t1t_data(tag, ndef_msg, len);
         case T2T:
-            set_t2t_data(tag, ndef_msg, len);
-            break;
+            return set_t2t_data(tag, ndef_msg, len);
         case T3T:
-            set_t3t_data(tag, ndef_msg, len);
-            break;
+            return set_t3t_data(tag, ndef_msg, len);
         case T4T:
-            set_t4t_data(tag, ndef_msg, len);
-            break;
+            return set_t4t_data(tag, ndef_msg, len);
         default:
             assert(0);
             return -1;
     }
+}
+
+static int
+init_tag(struct nfc_tag* tag, enum nfc_tag_type type, size_t size,
+         unsigned long max_read, unsigned long max_write)
+{
+    assert(tag);
+
+    if (!size) {
+        size = default_size(type);
+    }
+    if (!is_valid_size(type, size)) {
+        NFC_D("invalid size %zu for tag type %d", size, type);
+        return -1;
+    }
+
+    tag->memsize = tag_overhead(type) + size;
+    tag->mem = nfc_tag_mem_create(tag->memsize);
+    if (!tag->mem) {
+        return -1;
+    }
+    tag->t.mem = tag->mem->data;
+
+    tag->type = type;
+    tag->t4t_file_sel = NONE;
+    tag->size = size;
+    tag->max_read = max_read;
+    tag->max_write = max_write;
+
+    if (nfc_tag_format(tag) < 0) {
+        nfc_tag_uninit(tag);
+        return -1;
+    }
+    return 0;
+}
+
+int
+nfc_tag_init(struct nfc_tag* tag, enum nfc_tag_type type, size_t size)
+{
+    switch (type) {
+        case T3T:
+            return init_tag(tag, type, size, T3T_R, T3T_W);
+        case T4T:
+            return init_tag(tag, type, size, T4T_MLE, T4T_MLC);
+        default:
+            return init_tag(tag, type, size, 0, 0);
+    }
+}
+
+void
+nfc_tag_uninit(struct nfc_tag* tag)
+{
+    assert(tag);
+
+    nfc_tag_mem_unref(tag->mem);
+    tag->mem = NULL;
+    tag->t.mem = NULL;
+}
+
+size_t
+nfc_tag_memsize(enum nfc_tag_type type, size_t size)
+{
+    if (!is_valid_size(type, size)) {
+        return 0;
+    }
+    return tag_overhead(type) + size;
+}
+
+int
+nfc_tag_limits_are_valid(enum nfc_tag_type type, unsigned long max_read,
+                         unsigned long max_write)
+{
+    switch (type) {
+        case T3T:
+        case T4T:
+            return is_valid_limits(type, max_read, max_write);
+        default:
+            return !max_read && !max_write;
+    }
+}
+
+struct nfcemu_tag_image*
+nfc_tag_create_image(const struct nfc_tag* tag)
+{
+    struct nfcemu_tag_image* image;
+
+    assert(tag);
+
+    image = malloc(sizeof(*image));
+    if (!image) {
+        return NULL;
+    }
+    image->type = tag->type;
+    image->size = tag->size;
+    image->max_read = tag->max_read;
+    image->max_write = tag->max_write;
+    image->mem = nfc_tag_mem_ref(tag->mem);
+
+    return image;
+}
+
+void
+nfc_tag_destroy_image(struct nfcemu_tag_image* image)
+{
+    if (!image) {
+        return;
+    }
+    nfc_tag_mem_unref(image->mem);
+    free(image);
+}
+
+int
+nfc_tag_set_image(struct nfc_tag* tag, const struct nfcemu_tag_image* image)
+{
+    assert(tag);
+    assert(image);
+
+    if (image->type != tag->type) {
+        NFC_D("image of type %d for tag of type %d", image->type,
+              tag->type);
+        return -1;
+    }
+    tag->size = image->size;
+    tag->memsize = image->mem->size;
+    tag->max_read = image->max_read;
+    tag->max_write = image->max_write;
+    tag->t4t_file_sel = NONE;
+    nfc_tag_set_mem(tag, image->mem);
+
+    return 0;
+}
+
+int
+nfc_tag_resize(struct nfc_tag* tag, size_t size)
+{
+    struct nfc_tag new_tag;
+
+    assert(tag);
+
+    if (init_tag(&new_tag, tag->type, size,
+                 tag->max_read, tag->max_write) < 0) {
+        return -1;
+    }
+    nfc_tag_uninit(tag);
+    *tag = new_tag;
+
+    return 0;
+}
+
+int
+nfc_tag_set_limits(struct nfc_tag* tag, unsigned long max_read,
+                   unsigned long max_write)
+{
+    assert(tag);
+
+    if (!is_valid_limits(tag->type, max_read, max_write)) {
+        NFC_D("invalid limits %lu/%lu for tag type %d",
+              max_read, max_write, tag->type);
+        return -1;
+    }
+    if (unshare_mem(tag) < 0) {
+        return -1;
+    }
+
+    tag->max_read = max_read;
+    tag->max_write = max_write;
+
+    if (tag->type == T3T) {
+        tag->t.t3->nbr = max_read;
+        tag->t.t3->nbw = max_write;
+        update_t3t_checksum(tag);
+    } else {
+        update_t4t_cc(tag);
+    }
 
     return 0;
 }
@@ -200,18 +567,28 @@ nfc_tag_set_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len)
 int
 nfc_tag_format(struct nfc_tag* tag)
 {
+    if (unshare_mem(tag) < 0) {
+        return -1;
+    }
     switch (tag->type) {
         case T1T:
             FORMAT_NFC_T1T(tag, T1T_UID, T1T_RES)
             break;
         case T2T:
             FORMAT_NFC_T2T(tag, T2T_INTERNAL, T2T_LOCK, T2T_CC)
+            /* [Type 2 Tag Operation Specification], 6.1; size of
+             * the data area in multiples of 8 bytes */
+            tag->t.t2->cc[2] = tag->size / 8;
             break;
         case T3T:
-            FORMAT_NFC_T3T(tag, T3T_V, T3T_R, T3T_W, T3T_NB, T3T_U, T3T_WF, T3T_RW, T3T_LN, T3T_CS)
+            FORMAT_NFC_T3T(tag, T3T_V, T3T_U, T3T_WF, T3T_RW, T3T_LN)
+            tag->t.t3->nmaxb[0] = (tag->size / T3T_BLOCK_SIZE >> 8) & 0xff;
+            tag->t.t3->nmaxb[1] = (tag->size / T3T_BLOCK_SIZE) & 0xff;
+            update_t3t_checksum(tag);
             break;
         case T4T:
             FORMAT_NFC_T4T(tag, T4T_PROPRIETARY_CC)
+            update_t4t_cc(tag);
             break;
         default:
             assert(0);
@@ -223,7 +600,7 @@ nfc_tag_format(struct nfc_tag* tag)
 
 static size_t
 process_t1t_rid(struct nfc_tag* tag, const struct t1t_rid_command* cmd,
-                uint8_t* consumed, struct t1t_rid_response* rsp)
+                size_t* consumed, struct t1t_rid_response* rsp)
 {
     assert(tag);
     assert(cmd);
@@ -233,7 +610,7 @@ process_t1t_rid(struct nfc_tag* tag, const struct t1t_rid_command* cmd,
     rsp->hr[0] = T1T_HRO;
     rsp->hr[1] = T1T_HR1;
 
-    memcpy(rsp->uid, tag->t.t1.format.uid, sizeof(rsp->uid));
+    memcpy(rsp->uid, tag->t.t1->uid, sizeof(rsp->uid));
 
     rsp->status = 0;
 
@@ -243,7 +620,7 @@ process_t1t_rid(struct nfc_tag* tag, const struct t1t_rid_command* cmd,
 }
 
 static size_t
-process_t1t_rall(const struct t1t_rall_command* cmd, uint8_t* consumed,
+process_t1t_rall(const struct t1t_rall_command* cmd, size_t* consumed,
                  uint8_t* mem, struct t1t_rall_response* rsp)
 {
     size_t i;
@@ -271,7 +648,7 @@ process_t1t_rall(const struct t1t_rall_command* cmd, uint8_t* consumed,
 
 size_t
 process_t1t(struct nfc_re* re, const union command_packet* cmd,
-            size_t len, uint8_t* consumed, union response_packet* rsp)
+            size_t len, size_t* consumed, union response_packet* rsp)
 {
     assert(cmd);
     assert(rsp);
@@ -281,14 +658,17 @@ process_t1t(struct nfc_re* re, const union command_packet* cmd,
             assert(re);
             assert(re->tag);
             len = process_t1t_rall(&cmd->rall_cmd, consumed,
-                                   re->tag->t.t1.raw.mem, &rsp->rall_rsp);
+                                   re->tag->t.mem, &rsp->rall_rsp);
             break;
         case RID_COMMAND:
             assert(re);
             len = process_t1t_rid(re->tag, &cmd->rid_cmd, consumed, &rsp->rid_rsp);
             break;
         default:
-            assert(0);
+            /* like T3T, no response to unknown commands */
+            NFC_D("unsupported T1T command 0x%x", cmd->t1t.cmd);
+            *consumed = len;
+            len = 0;
             break;
     }
 
@@ -296,8 +676,9 @@ process_t1t(struct nfc_re* re, const union command_packet* cmd,
 }
 
 static size_t
-process_t2t_read(const struct t2t_read_command* cmd, uint8_t* consumed,
-                 uint8_t* mem, struct t2t_read_response* rsp)
+process_t2t_read(const struct t2t_read_command* cmd, size_t* consumed,
+                 const uint8_t* mem, size_t memsize,
+                 struct t2t_read_response* rsp)
 {
     size_t i;
     size_t offset;
@@ -308,10 +689,10 @@ process_t2t_read(const struct t2t_read_command* cmd, uint8_t* consumed,
     assert(mem);
     assert(rsp);
 
-    offset = cmd->bno * 4;
+    offset = cmd->bno * T2T_BLOCK_SIZE;
     max_read = sizeof(rsp->payload);
 
-    for (i = 0; i < max_read && offset < T2T_STATIC_MEMORY_SIZE; i++, offset++) {
+    for (i = 0; i < max_read && offset < memsize; i++, offset++) {
         rsp->payload[i] = mem[offset];
     }
     rsp->status = 0;
@@ -321,9 +702,39 @@ process_t2t_read(const struct t2t_read_command* cmd, uint8_t* consumed,
     return sizeof(struct t2t_read_response);
 }
 
+static size_t
+process_t2t_write(struct nfc_tag* tag, const struct t2t_write_command* cmd,
+                  size_t len, size_t* consumed,
+                  struct t2t_write_response* rsp)
+{
+    size_t offset;
+
+    assert(tag);
+    assert(cmd);
+    assert(consumed);
+    assert(rsp);
+
+    offset = cmd->bno * T2T_BLOCK_SIZE;
+
+    /* blocks 0 and 1 hold the read-only serial number */
+    if ((len < sizeof(*cmd)) || (cmd->bno < 2) ||
+        (offset + T2T_BLOCK_SIZE > tag->memsize) ||
+        (unshare_mem(tag) < 0)) {
+        rsp->ack = T2T_NAK;
+    } else {
+        memcpy(tag->t.mem + offset, cmd->data, T2T_BLOCK_SIZE);
+        rsp->ack = T2T_ACK;
+    }
+    rsp->status = 0;
+
+    *consumed = sizeof(struct t2t_write_command);
+
+    return sizeof(struct t2t_write_response);
+}
+
 size_t
 process_t2t(struct nfc_re* re, const union command_packet* cmd,
-            size_t len, uint8_t* consumed, union response_packet* rsp)
+            size_t len, size_t* consumed, union response_packet* rsp)
 {
     assert(cmd);
     assert(rsp);
@@ -334,46 +745,100 @@ process_t2t(struct nfc_re* re, const union command_packet* cmd,
             assert(re->tag);
 
             len = process_t2t_read(&cmd->read_cmd, consumed,
-                                   re->tag->t.t2.raw.mem, &rsp->read_rsp);
+                                   re->tag->t.mem, re->tag->memsize,
+                                   &rsp->read_rsp);
+            break;
+        case WRITE_COMMAND:
+            assert(re);
+            assert(re->tag);
+
+            len = process_t2t_write(re->tag, &cmd->write_cmd, len,
+                                    consumed, &rsp->write_rsp);
             break;
         default:
-            assert(0);
+            NFC_D("unsupported T2T command 0x%x", cmd->t2t.cmd);
+            rsp->write_rsp.ack = T2T_NAK;
+            rsp->write_rsp.status = 0;
+            *consumed = len;
+            len = sizeof(struct t2t_write_response);
             break;
     }
 
     return len;
 }
 
+/* parses a block-list element; returns its length */
 static size_t
-process_t3t_check(const struct t3t_check_command* cmd, uint8_t* consumed,
-                  uint8_t* mem, struct t3t_check_response* rsp) {
+parse_t3t_block(const uint8_t* bl, uint32_t* bn)
+{
+    if (bl[0] & T3T_BLOCK_LEN_BIT) {
+      /* 2 byte block */
+      *bn = bl[1];
+      return 2;
+    }
+    /* 3 byte block */
+    *bn = bl[1] << 8 | bl[2];
+    return 3;
+}
+
+static size_t
+process_t3t_check(const struct nfc_tag* tag,
+                  const struct t3t_check_command* cmd, size_t* consumed,
+                  struct t3t_check_response* rsp) {
     struct t3t_check_command_tail* tail;
-    uint8_t bidx, i, j;
+    const uint8_t* run;
+    uint8_t bidx;
+    size_t i, j, runlen;
     uint32_t bn;
+    int valid;
 
     tail = (struct t3t_check_command_tail*)
         (cmd->scl + cmd->nsv);
 
-    /* [Digital] 5.4 Check Command */
+    valid = tail->nbl && (tail->nbl <= tag->max_read);
+
+    /* [Digital] 5.4 Check Command; runs of consecutive blocks are
+     * copied at once */
+    run = NULL;
+    runlen = 0;
+
     for (bidx = 0, i = 0, j = 0; bidx < tail->nbl; bidx++) {
-        if (tail->bl[i] & T3T_BLOCK_LEN_BIT) {
-          /* 2 byte block */
-          bn = tail->bl[i+1];
-          i += 2;
-        } else {
-          /* 3 byte block */
-          bn = tail->bl[i+1] << 8 | tail->bl[i+2];
-          i += 3;
+        const uint8_t* block;
+
+        i += parse_t3t_block(tail->bl + i, &bn);
+
+        if (!valid || ((bn + 1) * T3T_BLOCK_SIZE > tag->memsize)) {
+            valid = 0;
+            continue;
         }
+        block = tag->t.mem + bn*T3T_BLOCK_SIZE;
 
-        memcpy(rsp->data + j, mem + bn*T3T_BLOCK_SIZE, T3T_BLOCK_SIZE);
-        j += T3T_BLOCK_SIZE;
+        if (run && (run + runlen == block)) {
+            runlen += T3T_BLOCK_SIZE;
+            continue;
+        }
+        if (run) {
+            memcpy(rsp->data + j, run, runlen);
+            j += runlen;
+        }
+        run = block;
+        runlen = T3T_BLOCK_SIZE;
+    }
+    if (run && valid) {
+        memcpy(rsp->data + j, run, runlen);
     }
 
     memcpy(rsp->id, cmd->id, sizeof(cmd->id));
-    rsp->status1 = 0x00;
-    rsp->status2 = 0x00;
-    rsp->nbl = tail->nbl;
+    if (valid) {
+        rsp->status1 = 0x00;
+        rsp->status2 = 0x00;
+        rsp->nbl = tail->nbl;
+    } else {
+        /* too many blocks, or block number beyond the end of memory */
+        rsp->status1 = 0xff;
+        rsp->status2 = tail->nbl <= tag->max_read ? 0xa8 : 0xa2;
+        rsp->nbl = 0;
+    }
 
     /* This is status bit */
     rsp->data[T3T_BLOCK_SIZE * rsp->nbl] = 0x00;
@@ -389,22 +854,103 @@ process_t3t_check(const struct t3t_check_command* cmd, uint8_t* consumed,
     return rsp->len;
 }
 
+static size_t
+process_t3t_update(struct nfc_tag* tag,
+                   const struct t3t_update_command* cmd, size_t len,
+                   size_t* consumed, struct t3t_update_response* rsp)
+{
+    const struct t3t_check_command_tail* tail;
+    const uint8_t* data;
+    uint8_t* run;
+    uint8_t bidx;
+    size_t i, runlen;
+    uint32_t bn;
+    int valid;
+
+    tail = (const struct t3t_check_command_tail*)
+        (cmd->scl + cmd->nsv);
+
+    valid = tail->nbl && (tail->nbl <= tag->max_write);
+
+    /* the block data follows the block list; verify all block numbers,
+     * so that the update either succeeds or leaves the tag unchanged */
+    for (bidx = 0, i = 0; bidx < tail->nbl; bidx++) {
+        i += parse_t3t_block(tail->bl + i, &bn);
+        if ((bn + 1) * T3T_BLOCK_SIZE > tag->memsize) {
+            valid = 0;
+        }
+    }
+    data = tail->bl + i;
+
+    *consumed = (data - (const uint8_t*)cmd) + tail->nbl * T3T_BLOCK_SIZE;
+
+    if ((*consumed > len) || (valid && (unshare_mem(tag) < 0))) {
+        valid = 0;
+    }
+
+    /* [Digital] 5.5 Update Command; all blocks in a single pass, with
+     * runs of consecutive blocks written at once */
+    run = NULL;
+    runlen = 0;
+
+    for (bidx = 0, i = 0; valid && (bidx < tail->nbl); bidx++) {
+        uint8_t* block;
+
+        i += parse_t3t_block(tail->bl + i, &bn);
+        block = tag->t.mem + bn*T3T_BLOCK_SIZE;
+
+        if (run && (run + runlen == block)) {
+            runlen += T3T_BLOCK_SIZE;
+            continue;
+        }
+        if (run) {
+            memcpy(run, data, runlen);
+            data += runlen;
+        }
+        run = block;
+        runlen = T3T_BLOCK_SIZE;
+    }
+    if (run) {
+        memcpy(run, data, runlen);
+    }
+
+    memcpy(rsp->id, cmd->id, sizeof(cmd->id));
+    if (valid) {
+        rsp->status1 = 0x00;
+        rsp->status2 = 0x00;
+    } else {
+        rsp->status1 = 0xff;
+        rsp->status2 = tail->nbl <= tag->max_write ? 0xa8 : 0xa2;
+    }
+    rsp->status = 0x00;
+
+    rsp->len = sizeof(struct t3t_update_response);
+    rsp->code = UPDATE_RESPONSE;
+
+    return rsp->len;
+}
+
 size_t
 process_t3t(struct nfc_re* re, const union command_packet* cmd,
-            size_t len, uint8_t* consumed, union response_packet* rsp)
+            size_t len, size_t* consumed, union response_packet* rsp)
 {
     assert(cmd);
     assert(rsp);
 
     switch (cmd->t3t.cmd) {
         case CHECK_COMMAND:
-            len = process_t3t_check(&cmd->check_cmd, consumed,
-                                    re->tag->t.t3.raw.mem, &rsp->check_rsp);
+            len = process_t3t_check(re->tag, &cmd->check_cmd, consumed,
+                                    &rsp->check_rsp);
             break;
         case UPDATE_COMMAND:
+            len = process_t3t_update(re->tag, &cmd->update_cmd, len,
+                                     consumed, &rsp->update_rsp);
             break;
         default:
-            assert(0);
+            /* [Digital] 5.3; no response to unknown commands */
+            NFC_D("unsupported T3T command 0x%x", cmd->t3t.cmd);
+            *consumed = len;
+            len = 0;
             break;
     }
 
@@ -412,7 +958,7 @@ process_t3t(struct nfc_re* re, const union command_packet* cmd,
 }
 
 static size_t
-process_t4t_app_select(const struct t4t_app_sel_command* cmd, uint8_t* consumed,
+process_t4t_app_select(const struct t4t_app_sel_command* cmd, size_t* consumed,
                        struct t4t_app_sel_response* rsp)
 {
     assert(consumed);
@@ -427,13 +973,14 @@ process_t4t_app_select(const struct t4t_app_sel_command* cmd, uint8_t* consumed,
 }
 
 static size_t
-process_t4t_cc_select(const struct t4t_cc_sel_command* cmd, uint8_t* consumed,
-                      struct t4t_cc_sel_response* rsp)
+process_t4t_cc_select(struct nfc_tag* tag, const struct t4t_cc_sel_command* cmd,
+                      size_t* consumed, struct t4t_cc_sel_response* rsp)
 {
+    assert(tag);
     assert(consumed);
     assert(rsp);
 
-    t4t_file_sel = CC_SELECT;
+    tag->t4t_file_sel = CC_SELECT;
 
     // Assume capbility container always exists.
     rsp->sw1 = 0x90;
@@ -445,50 +992,155 @@ process_t4t_cc_select(const struct t4t_cc_sel_command* cmd, uint8_t* consumed,
 }
 
 static size_t
-process_t4t_read_binary(const struct t4t_rb_command* cmd, uint8_t* consumed,
-                        const struct nfc_t4t_format* mem, struct t4t_rb_response* rsp)
+process_t4t_read_binary(const struct nfc_tag* tag, const struct t4t_rb_command* cmd,
+                        size_t len, size_t* consumed, struct t4t_rb_response* rsp)
 {
+    const uint8_t* file;
+    size_t filelen, le;
     uint16_t offset;
+    uint8_t sw1, sw2;
 
+    assert(tag);
     assert(cmd);
     assert(consumed);
-    assert(mem);
     assert(rsp);
 
     offset = (cmd->p1 & 0xff) << 8 | (cmd->p2 & 0xff);
 
-    switch (t4t_file_sel) {
+    /* [ISO7816-4] 5.1; a zero Le requests the maximum length */
+    if (!cmd->le && (len >= sizeof(*cmd) + 2)) {
+        le = cmd->le_ext[0] << 8 | cmd->le_ext[1];
+        *consumed = sizeof(*cmd) + 2;
+        if (!le) {
+            le = 65536;
+        }
+    } else {
+        le = cmd->le ? cmd->le : 256;
+        *consumed = sizeof(*cmd);
+    }
+    /* we never send more than the MLe that the CC announces */
+    if (le > tag->max_read) {
+        le = tag->max_read;
+    }
+
+    switch (tag->t4t_file_sel) {
         case CC_SELECT:
-            assert(cmd->le + offset <= sizeof(mem->cc));
-            memcpy(rsp->data, mem->cc + offset, cmd->le);
+            file = tag->t.t4->cc;
+            filelen = sizeof(tag->t.t4->cc);
             break;
         case NDEF_SELECT:
-            assert(cmd->le + offset <= sizeof(mem->data));
-            memcpy(rsp->data, mem->data + offset, cmd->le);
+            file = tag->t.t4->data;
+            filelen = tag->size;
             break;
         default:
-            assert(0);
-            break;
+            /* [ISO7816-4]; no file selected */
+            rsp->data_tail[0] = 0x69;
+            rsp->data_tail[1] = 0x86;
+            return 2;
+    }
+
+    if (offset >= filelen) {
+        /* [ISO7816-4]; offset outside the file */
+        rsp->data_tail[0] = 0x6b;
+        rsp->data_tail[1] = 0x00;
+        return 2;
+    }
+
+    if (le > filelen - offset) {
+        /* [ISO7816-4]; end of file reached before reading Le bytes */
+        le = filelen - offset;
+        sw1 = 0x62;
+        sw2 = 0x82;
+    } else {
+        sw1 = 0x90;
+        sw2 = 0x00;
+    }
+
+    memcpy(rsp->data, file + offset, le);
+
+    *(rsp->data + le) = sw1;
+    *(rsp->data + le + 1) = sw2;
+
+    return le + 2;
+}
+
+static size_t
+process_t4t_update_binary(struct nfc_tag* tag,
+                          const struct t4t_ub_command* cmd, size_t len,
+                          size_t* consumed, struct t4t_ub_response* rsp)
+{
+    const uint8_t* data;
+    size_t lc;
+    uint16_t offset;
+
+    assert(tag);
+    assert(cmd);
+    assert(consumed);
+    assert(rsp);
+
+    offset = (cmd->p1 & 0xff) << 8 | (cmd->p2 & 0xff);
+
+    /* [ISO7816-4] 5.1; extended Lc follows a zero byte */
+    if (!cmd->lc && (len >= sizeof(*cmd) + 2)) {
+        lc = cmd->data[0] << 8 | cmd->data[1];
+        data = cmd->data + 2;
+    } else {
+        lc = cmd->lc;
+        data = cmd->data;
     }
 
-    *(rsp->data + cmd->le) = 0x90;
-    *(rsp->data + cmd->le + 1) = 0x00;
+    *consumed = (data - (const uint8_t*)cmd) + lc;
 
-    *consumed = sizeof(struct t4t_rb_command);
+    if (!lc || (lc > tag->max_write) || (*consumed > len)) {
+        /* [ISO7816-4]; wrong length, or more than the CC's MLc */
+        *consumed = len;
+        rsp->sw1 = 0x67;
+        rsp->sw2 = 0x00;
+        return sizeof(struct t4t_ub_response);
+    }
 
-    return cmd->le + 2;
+    switch (tag->t4t_file_sel) {
+        case CC_SELECT:
+            /* [ISO7816-4]; security status not satisfied */
+            rsp->sw1 = 0x69;
+            rsp->sw2 = 0x82;
+            break;
+        case NDEF_SELECT:
+            if (offset + lc > tag->size) {
+                rsp->sw1 = 0x6b;
+                rsp->sw2 = 0x00;
+                break;
+            }
+            if (unshare_mem(tag) < 0) {
+                /* [ISO7816-4]; memory failure */
+                rsp->sw1 = 0x65;
+                rsp->sw2 = 0x81;
+                break;
+            }
+            memcpy(tag->t.t4->data + offset, data, lc);
+            rsp->sw1 = 0x90;
+            rsp->sw2 = 0x00;
+            break;
+        default:
+            rsp->sw1 = 0x69;
+            rsp->sw2 = 0x86;
+            break;
+    }
+
+    return sizeof(struct t4t_ub_response);
 }
 
 static size_t
-process_t4t_ndef_select(const struct t4t_ndef_sel_command* cmd, uint8_t* consumed,
-                        struct t4t_ndef_sel_response* rsp)
+process_t4t_ndef_select(struct nfc_tag* tag, const struct t4t_ndef_sel_command* cmd,
+                        size_t* consumed, struct t4t_ndef_sel_response* rsp)
 {
+    assert(tag);
     assert(cmd);
     assert(consumed);
     assert(rsp);
 
     if (cmd->data[0] == 0xe1 && cmd->data[1] == 0x04) {
-      t4t_file_sel = NDEF_SELECT;
+      tag->t4t_file_sel = NDEF_SELECT;
 
       rsp->sw1 = 0x90;
       rsp->sw2 = 0x00;
@@ -504,7 +1156,7 @@ process_t4t_ndef_select(const struct t4t_ndef_sel_command* cmd, uint8_t* consume
 
 size_t
 process_t4t(struct nfc_re* re, const union command_packet* cmd,
-            size_t len, uint8_t* consumed, union response_packet* rsp)
+            size_t len, size_t* consumed, union response_packet* rsp)
 {
     assert(cmd);
     assert(rsp);
@@ -513,17 +1165,24 @@ process_t4t(struct nfc_re* re, const union command_packet* cmd,
         len = process_t4t_app_select(&cmd->app_sel_cmd, consumed,
                                      &rsp->app_sel_rsp);
     } else if (memcmp(&cmd->cc_sel_cmd, t4t_cc_apdu, sizeof(t4t_cc_apdu)) == 0) {
-        len = process_t4t_cc_select(&cmd->cc_sel_cmd, consumed,
+        len = process_t4t_cc_select(re->tag, &cmd->cc_sel_cmd, consumed,
                                     &rsp->cc_sel_rsp);
     } else if (memcmp(&cmd->rb_cmd, t4t_rb_apdu, sizeof(t4t_rb_apdu)) == 0) {
-        len = process_t4t_read_binary(&cmd->rb_cmd, consumed,
-                                      &re->tag->t.t4.format,
+        len = process_t4t_read_binary(re->tag, &cmd->rb_cmd, len, consumed,
                                       (struct t4t_rb_response*)&rsp->cc_sel_rsp);
-    } else if (memcmp(t4t_ndef_apdu, t4t_ndef_apdu, sizeof(t4t_ndef_apdu)) == 0) {
-        len = process_t4t_ndef_select(&cmd->ndef_sel_cmd, consumed,
+    } else if (memcmp(&cmd->ub_cmd, t4t_ub_apdu, sizeof(t4t_ub_apdu)) == 0) {
+        len = process_t4t_update_binary(re->tag, &cmd->ub_cmd, len, consumed,
+                                        &rsp->ub_rsp);
+    } else if (memcmp(&cmd->ndef_sel_cmd, t4t_ndef_apdu, sizeof(t4t_ndef_apdu)) == 0) {
+        len = process_t4t_ndef_select(re->tag, &cmd->ndef_sel_cmd, consumed,
                                       &rsp->ndef_sel_rsp);
     } else {
-        assert(0);
+        /* [ISO7816-4]; instruction not supported */
+        NFC_D("unsupported T4T command 0x%x", cmd->rb_cmd.ins);
+        rsp->ub_rsp.sw1 = 0x6d;
+        rsp->ub_rsp.sw2 = 0x00;
+        *consumed = len;
+        len = sizeof(struct t4t_ub_response);
     }
 
     return len;
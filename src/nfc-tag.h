@@ -17,8 +17,14 @@
 #ifndef nfc_tag_h
 #define nfc_tag_h
 
+#include <stdint.h>
+#include <sys/types.h>
+
+struct nfc_re;
+
 enum {
-    MAXIMUM_SUPPORTED_TAG_SIZE = 1024
+    /* largest data area of a tag */
+    MAXIMUM_SUPPORTED_TAG_SIZE = 32 * 1024
 };
 
 enum nfc_tag_type {
@@ -65,6 +71,13 @@ struct t1t_rid_response {
 enum t2t_command_set {
     READ_SEGMENT_COMMAND = 0x10,
     READ_COMMAND = 0x30,
+    WRITE_COMMAND = 0xa2
+};
+
+/* [Digital], Table 53; 4-bit acknowledgements */
+enum t2t_ack {
+    T2T_NAK = 0x00,
+    T2T_ACK = 0x0a
 };
 
 struct t2t_common_hdr {
@@ -85,6 +98,17 @@ struct t2t_read_response {
     uint8_t status;
 };
 
+struct t2t_write_command {
+    uint8_t cmd;
+    uint8_t bno;
+    uint8_t data[4];
+};
+
+struct t2t_write_response {
+    uint8_t ack;
+    uint8_t status; /* like for READ */
+};
+
 struct t3t_common_hdr {
     uint8_t len;
     uint8_t cmd;
@@ -129,6 +153,25 @@ struct t3t_check_response {
     uint8_t data[];
 } __attribute__((packed));
 
+/* [Digital] 5.5; same header and block list as CHECK, followed by
+ * the block data */
+struct t3t_update_command {
+    uint8_t len;
+    uint8_t cmd;
+    uint8_t id[8];
+    uint8_t nsv;
+    uint16_t scl[];
+} __attribute__((packed));
+
+struct t3t_update_response {
+    uint8_t len;
+    uint8_t code;
+    uint8_t id[8];
+    uint8_t status1;
+    uint8_t status2;
+    uint8_t status; /* like for CHECK */
+} __attribute__((packed));
+
 enum t4t_file_select{
     NONE,
     CC_SELECT,
@@ -178,12 +221,15 @@ struct t4t_ndef_sel_response {
     uint8_t sw2;
 } __attribute__((packed));
 
+/* [ISO7816-4] 5.1; an extended-length APDU has a zero byte in
+ * place of the short Le or Lc, followed by 2 length bytes */
 struct t4t_rb_command {
     uint8_t cla;
     uint8_t ins;
     uint8_t p1;
     uint8_t p2;
     uint8_t le;
+    uint8_t le_ext[];
 } __attribute__((packed));
 
 struct t4t_rb_response {
@@ -191,6 +237,20 @@ struct t4t_rb_response {
     uint8_t data_tail[];
 } __attribute__((packed));
 
+struct t4t_ub_command {
+    uint8_t cla;
+    uint8_t ins;
+    uint8_t p1;
+    uint8_t p2;
+    uint8_t lc;
+    uint8_t data[];
+} __attribute__((packed));
+
+struct t4t_ub_response {
+    uint8_t sw1;
+    uint8_t sw2;
+} __attribute__((packed));
+
 union command_packet {
     struct t1t_common_hdr t1t;
     struct t2t_common_hdr t2t;
@@ -199,22 +259,28 @@ union command_packet {
     struct t1t_rall_command rall_cmd;
     struct t1t_rid_command rid_cmd;
     struct t2t_read_command read_cmd;
+    struct t2t_write_command write_cmd;
     struct t3t_check_command check_cmd;
+    struct t3t_update_command update_cmd;
     struct t4t_app_sel_command app_sel_cmd;
     struct t4t_cc_sel_command cc_sel_cmd;
     struct t4t_ndef_sel_command ndef_sel_cmd;
     struct t4t_rb_command rb_cmd;
+    struct t4t_ub_command ub_cmd;
 };
 
 union response_packet {
     struct t1t_rall_response rall_rsp;
     struct t1t_rid_response rid_rsp;
     struct t2t_read_response read_rsp;
+    struct t2t_write_response write_rsp;
     struct t3t_check_response check_rsp;
+    struct t3t_update_response update_rsp;
     struct t4t_app_sel_response app_sel_rsp;
     struct t4t_cc_sel_response cc_sel_rsp;
     struct t4t_ndef_sel_response ndef_sel_rsp;
     struct t4t_rb_response rb_rsp;
+    struct t4t_ub_response ub_rsp;
 };
 
 /* [Type 1 Tag Operation Specification 2.1/2.2]
@@ -229,55 +295,44 @@ enum {
     T1T_STATIC_MEMORY_SIZE = 120
 };
 
-struct nfc_t1t_raw {
-    uint8_t mem[T1T_STATIC_MEMORY_SIZE];
-};
-
 struct nfc_t1t_format {
     uint8_t uid[8];
     uint8_t data[96];
     uint8_t res[16];
 } __attribute__((packed));
 
-union nfc_t1t {
-    struct nfc_t1t_raw raw;
-    struct nfc_t1t_format format;
-};
-
 /* [Type 2 Tag Operation Specification 2.1]
- * Static Memory Structure.
+ * The data area follows the 16-byte header. READ addresses 256
+ * blocks of 4 bytes, which limits the data area without SECTOR
+ * SELECT.
  */
 enum {
-    T2T_STATIC_MEMORY_SIZE = 64
-};
-
-struct nfc_t2t_raw {
-    uint8_t mem[T2T_STATIC_MEMORY_SIZE];
+    T2T_BLOCK_SIZE = 4,
+    T2T_DEFAULT_DATA_SIZE = 144,
+    T2T_MAXIMUM_DATA_SIZE = 256 * T2T_BLOCK_SIZE - 16
 };
 
 struct nfc_t2t_format {
     uint8_t internal[10];
     uint8_t lock[2];
     uint8_t cc[4];
-    uint8_t data[48];
+    uint8_t data[];
 } __attribute__((packed));
 
-union nfc_t2t {
-    struct nfc_t2t_raw raw;
-    struct nfc_t2t_format format;
-};
-
 /**
- * There is no specific size defined in T3T spec.
+ * There is no specific size defined in T3T spec. Block 0 is the
+ * attribute information block; NDEF data starts at block 1.
  */
 enum {
     T3T_BLOCK_SIZE = 16,
-    T3T_BLOCK_NUM = 64,
-    T3T_MEMORY_SIZE = T3T_BLOCK_NUM * T3T_BLOCK_SIZE
+    T3T_DEFAULT_DATA_SIZE = 13 * T3T_BLOCK_SIZE
 };
 
-struct nfc_t3t_raw {
-    uint8_t mem[T3T_MEMORY_SIZE];
+enum {
+    /* the 1-byte length of FeliCa frames limits the number of blocks
+     * in CHECK responses and UPDATE commands */
+    T3T_MAXIMUM_NBR = 15,
+    T3T_MAXIMUM_NBW = 13
 };
 
 struct nfc_t3t_format {
@@ -290,80 +345,81 @@ struct nfc_t3t_format {
     uint8_t rwflag;
     uint8_t ln[3];
     uint8_t cs[2];
-    uint8_t data[T3T_BLOCK_NUM - 1][T3T_BLOCK_SIZE];
+    uint8_t data[][T3T_BLOCK_SIZE];
 } __attribute__((packed));
 
-union nfc_t3t {
-    struct nfc_t3t_raw raw;
-    struct nfc_t3t_format format;
-};
-
 /**
- * There is no specific size defined in T3T spec.
- * CC size is defined in [T4TOP4] Table 5.
+ * There is no specific size defined in T4T spec.
+ * CC size is defined in [T4TOP4] Table 5; the data area is the NDEF
+ * file, starting with its 2-byte length.
  */
+enum {
+    T4T_DEFAULT_DATA_SIZE = 1024
+};
+
+enum {
+    /* [T4TOP] Table 5; values above 255 require extended-length
+     * APDUs */
+    T4T_MINIMUM_MLE = 0x000f,
+    T4T_MINIMUM_MLC = 0x0001,
+    T4T_MAXIMUM_MLE = 0xffff,
+    T4T_MAXIMUM_MLC = 0xffff
+};
+
 struct nfc_t4t_format {
     uint8_t cc[15];
-    uint8_t data[1024];
+    uint8_t data[];
 } __attribute__((packed));
 
-union nfc_t4t {
-    struct nfc_t4t_format format;
+/* Tag memory that any number of tags can share, also on different
+ * devices. It's immutable while it has more than one reference; the
+ * reference count is updated atomically. */
+struct nfc_tag_mem {
+    unsigned long nrefs;
+    size_t size;
+    uint8_t data[];
+};
+
+/* A tag's memory with the parameters of its layout, as handed out by
+ * nfc_device_get_tag_image() */
+struct nfcemu_tag_image {
+    enum nfc_tag_type type;
+    size_t size;
+    unsigned long max_read;
+    unsigned long max_write;
+    struct nfc_tag_mem* mem;
 };
 
 struct nfc_tag {
     enum nfc_tag_type type;
+    enum t4t_file_select t4t_file_sel; /* file selected by last T4T SELECT */
+    /* size of the data area, which follows the type's header in the
+     * tag memory; 'memsize' is the size of the whole memory */
+    size_t size;
+    size_t memsize;
+    /* announced maximum per READ and WRITE command; Nbr and Nbw
+     * blocks for T3T, MLe and MLc bytes for T4T */
+    unsigned long max_read;
+    unsigned long max_write;
+    /* the memory, possibly shared; the tag gets its own copy before
+     * it's written */
+    struct nfc_tag_mem* mem;
     union {
-        union nfc_t1t t1;
-        union nfc_t2t t2;
-        union nfc_t3t t3;
-        union nfc_t4t t4;
+        uint8_t* mem;
+        struct nfc_t1t_format* t1;
+        struct nfc_t2t_format* t2;
+        struct nfc_t3t_format* t3;
+        struct nfc_t4t_format* t4;
     }t;
 };
 
-#define INIT_NFC_T1T(tag_, uid_, res_) \
-    tag_ = { \
-        .type = T1T, \
-        .t.t1.format.uid = uid_, \
-        .t.t1.format.res = res_ \
-    }
-
-#define INIT_NFC_T2T(tag_, internal_, lock_, cc_) \
-    tag_ = { \
-        .type = T2T, \
-        .t.t2.format.internal = internal_, \
-        .t.t2.format.lock = lock_, \
-        .t.t2.format.cc = cc_ \
-    }
-
-#define INIT_NFC_T3T(tag_, v_, r_, w_, nb_, u_, wf_, rw_, ln_, cs_) \
-    tag_ = { \
-        .type = T3T, \
-        .t.t3.format.ver = v_, \
-        .t.t3.format.nbr = r_, \
-        .t.t3.format.nbw = w_, \
-        .t.t3.format.nmaxb = nb_, \
-        .t.t3.format.unused = u_, \
-        .t.t3.format.writef = wf_, \
-        .t.t3.format.rwflag = rw_, \
-        .t.t3.format.ln = ln_, \
-        .t.t3.format.cs = cs_, \
-    }
-
-#define INIT_NFC_T4T(tag_, cc_) \
-    tag_ = { \
-        .type = T4T, \
-        .t.t4.format.cc = cc_, \
-    }
-
 #define FORMAT_NFC_T1T(tag_, uid_, res_) \
     { \
     static const uint8_t uid[] = uid_; \
     static const uint8_t res[] = res_; \
-    tag_->type = T1T; \
-    memset(tag_->t.t1.format.data, 0, sizeof(tag_->t.t1.format.data)); \
-    memcpy(tag_->t.t1.format.uid, uid, sizeof(uid)); \
-    memcpy(tag_->t.t1.format.res, res, sizeof(res)); \
+    memset(tag_->t.t1->data, 0, sizeof(tag_->t.t1->data)); \
+    memcpy(tag_->t.t1->uid, uid, sizeof(uid)); \
+    memcpy(tag_->t.t1->res, res, sizeof(res)); \
     }
 
 #define FORMAT_NFC_T2T(tag_, itl_, lock_, cc_) \
@@ -371,41 +427,90 @@ struct nfc_tag {
     static const uint8_t itl[] = itl_; \
     static const uint8_t lock[] = lock_; \
     static const uint8_t cc[] = cc_; \
-    tag_->type = T2T; \
-    memset(tag_->t.t2.format.data, 0, sizeof(tag_->t.t2.format.data)); \
-    memcpy(tag_->t.t2.format.internal, itl, sizeof(itl)); \
-    memcpy(tag_->t.t2.format.lock, lock, sizeof(lock));   \
-    memcpy(tag_->t.t2.format.cc, cc, sizeof(cc)); \
+    memset(tag_->t.t2->data, 0, tag_->size); \
+    memcpy(tag_->t.t2->internal, itl, sizeof(itl)); \
+    memcpy(tag_->t.t2->lock, lock, sizeof(lock));   \
+    memcpy(tag_->t.t2->cc, cc, sizeof(cc)); \
     }
 
-#define FORMAT_NFC_T3T(tag_, v_, r_, w_, nb_, u_, wf_, rw_, ln_, cs_) \
+#define FORMAT_NFC_T3T(tag_, v_, u_, wf_, rw_, ln_) \
     { \
-    static const uint8_t nb[] = nb_; \
     static const uint8_t u[] = u_; \
     static const uint8_t ln[] = ln_; \
-    static const uint8_t cs[] = cs_; \
-    tag_->type = T3T; \
-    memset(tag_->t.t3.format.data, 0, sizeof(tag_->t.t3.format.data)); \
-    tag_->t.t3.format.ver = v_; \
-    tag_->t.t3.format.nbr = r_; \
-    tag_->t.t3.format.nbw = w_; \
-    memcpy(tag_->t.t3.format.nmaxb, nb, sizeof(nb)); \
-    memcpy(tag_->t.t3.format.unused, u, sizeof(u));   \
-    tag_->t.t3.format.writef = wf_; \
-    tag_->t.t3.format.rwflag = rw_; \
-    memcpy(tag_->t.t3.format.ln, ln, sizeof(ln)); \
-    memcpy(tag_->t.t3.format.cs, cs, sizeof(cs)); \
+    memset(tag_->t.t3->data, 0, tag_->size); \
+    tag_->t.t3->ver = v_; \
+    tag_->t.t3->nbr = tag_->max_read; \
+    tag_->t.t3->nbw = tag_->max_write; \
+    memcpy(tag_->t.t3->unused, u, sizeof(u));   \
+    tag_->t.t3->writef = wf_; \
+    tag_->t.t3->rwflag = rw_; \
+    memcpy(tag_->t.t3->ln, ln, sizeof(ln)); \
     }
 
 #define FORMAT_NFC_T4T(tag_, cc_) \
     { \
     static const uint8_t cc[] = cc_; \
-    tag_->type = T4T; \
-    memset(tag_->t.t4.format.data, 0, sizeof(tag_->t.t4.format.data)); \
-    memcpy(tag_->t.t4.format.cc, cc, sizeof(cc)); \
+    memset(tag_->t.t4->data, 0, tag_->size); \
+    memcpy(tag_->t.t4->cc, cc, sizeof(cc)); \
     }
 
-extern struct nfc_tag nfc_tags[4];
+/* Allocates the tag's memory with a data area of 'size' bytes, or the
+ * type's default size if 'size' is 0, and formats it. */
+int
+nfc_tag_init(struct nfc_tag* tag, enum nfc_tag_type type, size_t size);
+
+void
+nfc_tag_uninit(struct nfc_tag* tag);
+
+/* Returns new memory of 'size' bytes with a single reference. */
+struct nfc_tag_mem*
+nfc_tag_mem_create(size_t size);
+
+struct nfc_tag_mem*
+nfc_tag_mem_ref(struct nfc_tag_mem* mem);
+
+/* Drops a reference and frees the memory with the last one. */
+void
+nfc_tag_mem_unref(struct nfc_tag_mem* mem);
+
+/* Replaces the tag's memory with a reference to 'mem', which has to
+ * be of the same size. */
+void
+nfc_tag_set_mem(struct nfc_tag* tag, struct nfc_tag_mem* mem);
+
+/* Returns an image that shares the tag's memory. */
+struct nfcemu_tag_image*
+nfc_tag_create_image(const struct nfc_tag* tag);
+
+void
+nfc_tag_destroy_image(struct nfcemu_tag_image* image);
+
+/* Shares the image's memory and takes over its layout; the image's
+ * type has to match the tag's. */
+int
+nfc_tag_set_image(struct nfc_tag* tag, const struct nfcemu_tag_image* image);
+
+/* Returns the size of the whole memory of a tag with a data area of
+ * 'size' bytes, or 0 if the size isn't valid for the type. */
+size_t
+nfc_tag_memsize(enum nfc_tag_type type, size_t size);
+
+/* Returns true if a tag of the type can have these limits; T1T and
+ * T2T don't have any, so both are 0. */
+int
+nfc_tag_limits_are_valid(enum nfc_tag_type type, unsigned long max_read,
+                         unsigned long max_write);
+
+/* Replaces the tag's memory with a formatted one of the given size. */
+int
+nfc_tag_resize(struct nfc_tag* tag, size_t size);
+
+/* Sets the limits announced in the T3T attribute block or T4T CC;
+ * only valid for these types. Commands that exceed them fail, except
+ * T4T READ BINARY, which returns at most MLe bytes. */
+int
+nfc_tag_set_limits(struct nfc_tag* tag, unsigned long max_read,
+                   unsigned long max_write);
 
 int
 nfc_tag_set_data(struct nfc_tag* tag, const uint8_t* ndef_msg, ssize_t len);
@@ -415,17 +520,17 @@ nfc_tag_format(struct nfc_tag* tag);
 
 size_t
 process_t1t(struct nfc_re* re, const union command_packet* cmd,
-            size_t len, uint8_t* consumed, union response_packet* rsp);
+            size_t len, size_t* consumed, union response_packet* rsp);
 
 size_t
 process_t2t(struct nfc_re* re, const union command_packet* cmd,
-            size_t len, uint8_t* consumed, union response_packet* rsp);
+            size_t len, size_t* consumed, union response_packet* rsp);
 
 size_t
 process_t3t(struct nfc_re* re, const union command_packet* cmd,
-            size_t len, uint8_t* consumed, union response_packet* rsp);
+            size_t len, size_t* consumed, union response_packet* rsp);
 
 size_t
 process_t4t(struct nfc_re* re, const union command_packet* cmd,
-            size_t len, uint8_t* consumed, union response_packet* rsp);
+            size_t len, size_t* consumed, union response_packet* rsp);
 #endif
@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bswap.h"
+#include "nfc.h"
+#include "nfc-trace.h"
+
+static void
+copy_to_ring(struct nfc_trace* trace, size_t pos, const void* data,
+             size_t len)
+{
+    size_t off = pos & (trace->size - 1);
+    size_t n = len < trace->size - off ? len : trace->size - off;
+
+    memcpy(trace->buf + off, data, n);
+    memcpy(trace->buf, (const uint8_t*)data + n, len - n);
+}
+
+static void
+copy_from_ring(const struct nfc_trace* trace, size_t pos, void* data,
+               size_t len)
+{
+    size_t off = pos & (trace->size - 1);
+    size_t n = len < trace->size - off ? len : trace->size - off;
+
+    memcpy(data, trace->buf + off, n);
+    memcpy((uint8_t*)data + n, trace->buf, len - n);
+}
+
+/* appends a record with data from 2 pieces */
+static size_t
+append_record(struct nfc_trace* trace, size_t head, uint64_t timestamp,
+              uint8_t type, const void* data0, size_t len0,
+              const void* data1, size_t len1)
+{
+    struct nfcemu_trace_hdr hdr = {
+        .timestamp = cpu_to_le64(timestamp),
+        .id = cpu_to_le32(trace->id),
+        .len = cpu_to_le16(len0 + len1),
+        .type = type,
+        .reserved = 0
+    };
+
+    copy_to_ring(trace, head, &hdr, sizeof(hdr));
+    head += sizeof(hdr);
+    copy_to_ring(trace, head, data0, len0);
+    head += len0;
+    copy_to_ring(trace, head, data1, len1);
+    head += len1;
+
+    return head;
+}
+
+static void
+record(struct nfc_trace* trace, uint8_t type, const void* data0,
+       size_t len0, const void* data1, size_t len1)
+{
+    struct timespec ts;
+    uint64_t timestamp;
+    size_t head, avail, need;
+
+    assert(trace);
+    assert(len0 + len1 <= NFCEMU_TRACE_MAXIMUM_RECORD_LENGTH -
+                          sizeof(struct nfcemu_trace_hdr));
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    timestamp = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+    head = trace->head;
+    avail = trace->size - (head - __atomic_load_n(&trace->tail,
+                                                  __ATOMIC_ACQUIRE));
+
+    need = sizeof(struct nfcemu_trace_hdr) + len0 + len1;
+    if (trace->nlost) {
+        need += sizeof(struct nfcemu_trace_hdr) + sizeof(uint32_t);
+    }
+    if (need > avail) {
+        ++trace->nlost;
+        return;
+    }
+
+    if (trace->nlost) {
+        uint32_t nlost = cpu_to_le32(trace->nlost);
+        head = append_record(trace, head, timestamp, NFCEMU_TRACE_LOST,
+                             &nlost, sizeof(nlost), NULL, 0);
+        trace->nlost = 0;
+    }
+    head = append_record(trace, head, timestamp, type, data0, len0,
+                         data1, len1);
+
+    /* publish records to the reader */
+    __atomic_store_n(&trace->head, head, __ATOMIC_RELEASE);
+}
+
+void
+nfc_trace_record(struct nfc_trace* trace, uint8_t type,
+                 const void* pkt, size_t len)
+{
+    record(trace, type, pkt, len, NULL, 0);
+}
+
+void
+nfc_trace_record_console(struct nfc_trace* trace, const char* cmd,
+                         const char* args)
+{
+    char buf[16];
+    size_t len, alen;
+
+    assert(cmd);
+
+    len = strlen(cmd);
+    assert(len < sizeof(buf));
+    memcpy(buf, cmd, len);
+    buf[len++] = ' ';
+
+    alen = args ? strlen(args) : 0;
+    if (len + alen > NFCEMU_TRACE_MAXIMUM_RECORD_LENGTH -
+                     sizeof(struct nfcemu_trace_hdr)) {
+        ++trace->nlost;
+        return;
+    }
+    record(trace, NFCEMU_TRACE_CONSOLE, buf, len, args, alen);
+}
+
+ssize_t
+nfc_trace_read(struct nfc_trace* trace, void* buf, size_t len)
+{
+    size_t head, tail, off;
+
+    assert(trace);
+    assert(buf || !len);
+
+    head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    tail = trace->tail;
+
+    for (off = 0; tail != head;) {
+        struct nfcemu_trace_hdr hdr;
+        size_t reclen;
+
+        copy_from_ring(trace, tail, &hdr, sizeof(hdr));
+        reclen = sizeof(hdr) + le16_to_cpu(hdr.len);
+        if (reclen > len - off) {
+            if (!off) {
+                return -1;
+            }
+            break;
+        }
+        copy_from_ring(trace, tail, (uint8_t*)buf + off, reclen);
+        off += reclen;
+        tail += reclen;
+    }
+
+    /* release space to the device's thread */
+    __atomic_store_n(&trace->tail, tail, __ATOMIC_RELEASE);
+
+    return off;
+}
+
+/*
+ * Tracing callbacks
+ */
+
+struct trace_create_param {
+    uint8_t type;
+    ssize_t (*create)(void*, struct nfc_device*, size_t, union nci_packet*);
+    void* data;
+};
+
+static ssize_t
+trace_create(void* data, struct nfc_device* nfc, size_t maxlen,
+             union nci_packet* pkt)
+{
+    const struct trace_create_param* param = data;
+    ssize_t res;
+
+    assert(param);
+
+    res = param->create(param->data, nfc, maxlen, pkt);
+    if ((res > 0) && nfc->trace) {
+        nfc_trace_record(nfc->trace, param->type, pkt, res);
+    }
+    return res;
+}
+
+static int
+trace_send_ntf(struct nfc_device* nfc,
+               ssize_t (*create)(void*, struct nfc_device*, size_t,
+                                 union nci_packet*),
+               void* data)
+{
+    struct trace_create_param param = {
+        .type = NFCEMU_TRACE_NCI_TX,
+        .create = create,
+        .data = data
+    };
+
+    assert(nfc);
+    assert(nfc->trace);
+
+    return nfc->trace->host_cb->send_ntf(nfc, trace_create, &param);
+}
+
+static int
+trace_send_dta(struct nfc_device* nfc,
+               ssize_t (*create)(void*, struct nfc_device*, size_t,
+                                 union nci_packet*),
+               void* data)
+{
+    struct trace_create_param param = {
+        .type = NFCEMU_TRACE_NCI_TX,
+        .create = create,
+        .data = data
+    };
+
+    assert(nfc);
+    assert(nfc->trace);
+
+    return nfc->trace->host_cb->send_dta(nfc, trace_create, &param);
+}
+
+static ssize_t
+trace_delivery(void* data, union nci_packet* pkt)
+{
+    struct nfc_device* nfc = data;
+    ssize_t res;
+
+    assert(nfc);
+    assert(nfc->trace);
+
+    res = nfc->trace->delivery_func(nfc->trace->delivery_data, pkt);
+    if (res > 0) {
+        nfc_trace_record(nfc->trace, NFCEMU_TRACE_NCI_TX, pkt, res);
+    }
+    return res;
+}
+
+void
+nfc_trace_wrap_delivery(struct nfc_trace* trace, struct nfc_device* nfc,
+                        struct nfc_delivery_cb* cb)
+{
+    assert(trace);
+    assert(cb);
+
+    if (!cb->func) {
+        return;
+    }
+    trace->delivery_func = cb->func;
+    trace->delivery_data = cb->data;
+    cb->func = trace_delivery;
+    cb->data = nfc;
+}
+
+struct nfc_trace*
+nfc_trace_create(const struct nfcemu_cb* host_cb, uint32_t id, size_t size)
+{
+    struct nfc_trace* trace;
+    size_t ringsize;
+
+    assert(host_cb);
+
+    /* round up to power of 2; hold at least a LOST record and
+     * the largest packet */
+    for (ringsize = 1; (ringsize < size) ||
+                       (ringsize < 2 * NFCEMU_TRACE_MAXIMUM_RECORD_LENGTH);) {
+        ringsize *= 2;
+    }
+
+    trace = malloc(sizeof(*trace));
+    if (!trace) {
+        return NULL;
+    }
+    trace->buf = malloc(ringsize);
+    if (!trace->buf) {
+        goto err_malloc_buf;
+    }
+    trace->id = id;
+    trace->size = ringsize;
+    trace->head = 0;
+    trace->tail = 0;
+    trace->nlost = 0;
+    trace->host_cb = host_cb;
+    trace->cb = *host_cb;
+    trace->cb.send_ntf = trace_send_ntf;
+    trace->cb.send_dta = trace_send_dta;
+    trace->delivery_func = NULL;
+    trace->delivery_data = NULL;
+
+    return trace;
+
+err_malloc_buf:
+    free(trace);
+    return NULL;
+}
+
+void
+nfc_trace_destroy(struct nfc_trace* trace)
+{
+    if (!trace) {
+        return;
+    }
+    free(trace->buf);
+    free(trace);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2014  Mozilla Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef nfc_trace_h
+#define nfc_trace_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <nfcemu/types.h>
+#include "cb.h"
+
+/* Ring buffer of trace records. The device's thread appends
+ * records and any other thread can read them; 'head' and 'tail'
+ * are only written by the respective side, so neither needs a lock.
+ * Records that don't fit are counted and reported by a LOST record
+ * as soon as there is space again.
+ */
+struct nfc_trace {
+    uint32_t id;
+    size_t size; /* power of 2 */
+    uint8_t* buf;
+    size_t head; /* written by the device's thread */
+    size_t tail; /* written by the reader */
+    unsigned long nlost;
+
+    /* the device's callbacks while tracing; sending packets goes
+     * through the tracer */
+    struct nfcemu_cb cb;
+    const struct nfcemu_cb* host_cb;
+
+    /* delivery callback of the latest command */
+    ssize_t (*delivery_func)(void*, union nci_packet*);
+    void* delivery_data;
+};
+
+struct nfc_trace*
+nfc_trace_create(const struct nfcemu_cb* host_cb, uint32_t id, size_t size);
+
+void
+nfc_trace_destroy(struct nfc_trace* trace);
+
+void
+nfc_trace_record(struct nfc_trace* trace, uint8_t type,
+                 const void* pkt, size_t len);
+
+/* records "<cmd> <args>" */
+void
+nfc_trace_record_console(struct nfc_trace* trace, const char* cmd,
+                         const char* args);
+
+/* routes the delivery callback through the tracer */
+void
+nfc_trace_wrap_delivery(struct nfc_trace* trace, struct nfc_device* nfc,
+                        struct nfc_delivery_cb* cb);
+
+/* copies complete records; returns -1 if the next record doesn't fit
+ * into 'len' bytes */
+ssize_t
+nfc_trace_read(struct nfc_trace* trace, void* buf, size_t len);
+
+#endif
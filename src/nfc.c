@@ -15,15 +15,50 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "ptr.h"
+#include "cb.h"
+#include "nfc-debug.h"
 #include "nfc.h"
+#include "nfc-hce.h"
 #include "nfc-nci.h"
+#include "nfc-ring.h"
+#include "nfc-scenario.h"
+#include "nfc-trace.h"
+#include <nfcemu/nfcemu.h>
 
-void
-nfc_device_init(struct nfc_device* nfc)
+int
+nfc_device_init(struct nfc_device* nfc, const struct nfcemu_ctx* ctx,
+                void* data)
 {
+    /* NFCID2 is defined in [Digital] Table44 */
+    static const struct {
+        enum nci_rf_protocol rfproto;
+        const char* nfcid1;
+        const char* nfcid2;
+    } default_re[] = {
+        { NCI_RF_PROTOCOL_NFC_DEP, "deadbeaf0", "\x01\xfe\x0\x0\x0\x0\x0" },
+        { NCI_RF_PROTOCOL_NFC_DEP, "deadbeaf1", "\x01\xfe\x0\x0\x0\x0\x1" },
+        { NCI_RF_PROTOCOL_T1T, "deadbeaf2", "\x0\x0\x0\x0\x0\x0\x2" },
+        { NCI_RF_PROTOCOL_T2T, "deadbeaf3", "\x0\x0\x0\x0\x0\x0\x3" },
+        { NCI_RF_PROTOCOL_T3T, "deadbeaf4", "\x02\xfe\x0\x0\x0\x0\x4" },
+        { NCI_RF_PROTOCOL_ISO_DEP, "deadbeaf5", "\x00\x0\x0\x0\x0\x0\x5" }
+    };
+    size_t i;
+
     assert(nfc);
+    assert(ctx);
+
+    if (llcp_pdu_pool_init(&nfc->pdu_pool, ctx->pdu_pool_size) < 0) {
+        return -1;
+    }
+    if (nfc_tag_cache_init(&nfc->tag_cache, ctx->tag_cache_size) < 0) {
+        goto err_nfc_tag_cache_init;
+    }
 
     nfc->state = NFC_FSM_STATE_IDLE;
     nfc->rf_state = NFC_RFST_IDLE;
@@ -36,12 +71,88 @@ nfc_device_init(struct nfc_device* nfc)
     nfc_rf_init(&nfc->rf[5], NCI_RF_INTERFACE_ISO_DEP,  NCI_RF_NFC_A_PASSIVE_POLL_MODE);
     nfc_rf_init(&nfc->rf[6], NCI_RF_INTERFACE_ISO_DEP,  NCI_RF_NFC_B_PASSIVE_POLL_MODE);
     nfc_rf_init(&nfc->rf[7], NCI_RF_INTERFACE_ISO_DEP,  NCI_RF_NFC_F_PASSIVE_POLL_MODE);
+    /* card emulation for readers that poll the guest */
+    nfc_rf_init(&nfc->rf[8], NCI_RF_INTERFACE_ISO_DEP,  NCI_RF_NFC_A_PASSIVE_LISTEN_MODE);
 
     nfc->id = 0;
     nfc->active_re = NULL;
     nfc->active_rf = NULL;
 
     memset(nfc->config_id_value, 0, sizeof(nfc->config_id_value));
+    nfc->max_dta_credits = NCI_DTA_CREDITS_UNLIMITED;
+    nfc->dta_credits = 0;
+    nfc->rx_len = 0;
+    nfc->rx_buf = NULL;
+    nfc->tx_buf = NULL;
+
+    nfc->snep_max_msg_len = ctx->snep_max_msg_len;
+
+    memset(&nfc->stats, 0, sizeof(nfc->stats));
+    nfc->latency_sampling = ctx->latency_sampling;
+    nfc->latency_countdown = 1;
+    nfc->latency_rng = (uint32_t)(uintptr_t)nfc | 1; /* must not be 0 */
+
+    nfc->cb = &ctx->cb;
+    nfc->nci_cmd = &ctx->nci_cmd;
+    nfc->trace = NULL;
+    nfc->ring = NULL;
+    nfc->scenario = NULL;
+    nfc->data = data;
+
+    nfc->re = NULL;
+    nfc->nres = 0;
+    nfc->maxres = 0;
+    memset(nfc->re_by_id, 0, sizeof(nfc->re_by_id));
+    nfc->nids = 0;
+
+    nfc_nfcee_init(&nfc->nfcee);
+    nfc_routing_init(&nfc->routing);
+
+    for (i = 0; i < ARRAY_SIZE(default_re); ++i) {
+        if (nfc_device_add_re(nfc, default_re[i].rfproto,
+                              default_re[i].nfcid1,
+                              default_re[i].nfcid2) < 0) {
+            goto err_nfc_device_add_re;
+        }
+    }
+
+    return 0;
+
+err_nfc_device_add_re:
+    while (i) {
+        nfc_device_remove_re(nfc, --i);
+    }
+    free(nfc->re);
+    nfc_routing_uninit(&nfc->routing);
+    nfc_nfcee_uninit(&nfc->nfcee);
+    nfc_tag_cache_uninit(&nfc->tag_cache);
+err_nfc_tag_cache_init:
+    llcp_pdu_pool_uninit(&nfc->pdu_pool);
+    return -1;
+}
+
+void
+nfc_device_uninit(struct nfc_device* nfc)
+{
+    size_t i;
+
+    assert(nfc);
+
+    nfc_scenario_destroy(nfc->scenario);
+    nfc->active_re = NULL;
+
+    for (i = 0; i < nfc->nres; ++i) {
+        nfc_device_remove_re(nfc, i);
+    }
+    free(nfc->re);
+    nfc_routing_uninit(&nfc->routing);
+    nfc_nfcee_uninit(&nfc->nfcee);
+    nfc_tag_cache_uninit(&nfc->tag_cache);
+    llcp_pdu_pool_uninit(&nfc->pdu_pool);
+    nfc_trace_destroy(nfc->trace);
+    nfc_ring_destroy(nfc->ring);
+    free(nfc->rx_buf);
+    free(nfc->tx_buf);
 }
 
 void
@@ -64,6 +175,55 @@ nfc_device_get(const struct nfc_device* nfc, size_t off, size_t len,
     memcpy(value, nfc->config_id_value+off, len);
 }
 
+static uint8_t*
+get_dta_buf(uint8_t** buf)
+{
+    if (!*buf) {
+        *buf = malloc(NFC_MAX_DTA_LENGTH);
+        if (!*buf) {
+            NFC_D("malloc failed: %d (%s)", errno, strerror(errno));
+        }
+    }
+    return *buf;
+}
+
+uint8_t*
+nfc_device_rx_buf(struct nfc_device* nfc)
+{
+    assert(nfc);
+
+    return get_dta_buf(&nfc->rx_buf);
+}
+
+uint8_t*
+nfc_device_tx_buf(struct nfc_device* nfc)
+{
+    assert(nfc);
+
+    return get_dta_buf(&nfc->tx_buf);
+}
+
+uint64_t
+nfc_monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+nfc_count_latency(uint64_t* bucket, uint64_t ns)
+{
+    /* bucket of the highest bit set */
+    size_t i = 63 - __builtin_clzll(ns | 1);
+
+    if (i >= NFCEMU_STATS_NUMBER_OF_LATENCY_BUCKETS) {
+        i = NFCEMU_STATS_NUMBER_OF_LATENCY_BUCKETS - 1;
+    }
+    ++bucket[i];
+}
+
 uint8_t
 nfc_device_incr_id(struct nfc_device* nfc)
 {
@@ -99,23 +259,34 @@ nfc_find_rf_by_protocol_and_mode(struct nfc_device* nfc,
             rf_iface = NCI_RF_INTERFACE_NFC_DEP;
             break;
         default:
-            assert(0);
-            break;
+            NFC_D("no RF interface for RF protocol %d", proto);
+            return NULL;
     }
 
+    /* the device polls REs in listen mode, and listens to REs
+     * that poll */
     switch (mode) {
         case NCI_RF_NFC_A_PASSIVE_POLL_MODE:
+            rf_mode = NCI_RF_NFC_A_PASSIVE_LISTEN_MODE;
+            break;
+        case NCI_RF_NFC_B_PASSIVE_POLL_MODE:
+            rf_mode = NCI_RF_NFC_B_PASSIVE_LISTEN_MODE;
+            break;
+        case NCI_RF_NFC_F_PASSIVE_POLL_MODE:
+            rf_mode = NCI_RF_NFC_F_PASSIVE_LISTEN_MODE;
+            break;
         case NCI_RF_NFC_A_PASSIVE_LISTEN_MODE:
             rf_mode = NCI_RF_NFC_A_PASSIVE_POLL_MODE;
             break;
-        case NCI_RF_NFC_B_PASSIVE_POLL_MODE:
         case NCI_RF_NFC_B_PASSIVE_LISTEN_MODE:
             rf_mode = NCI_RF_NFC_B_PASSIVE_POLL_MODE;
             break;
-        case NCI_RF_NFC_F_PASSIVE_POLL_MODE:
         case NCI_RF_NFC_F_PASSIVE_LISTEN_MODE:
             rf_mode = NCI_RF_NFC_F_PASSIVE_POLL_MODE;
             break;
+        default:
+            NFC_D("no RF interface for mode %d", mode);
+            return NULL;
     }
 
     for (i = 0; i < ARRAY_SIZE(nfc->rf); i++) {
@@ -137,3 +308,261 @@ nfc_delivery_cb_setup(struct nfc_delivery_cb* cb, enum nfc_buf_type type,
     cb->data = data;
     cb->func = func;
 }
+
+/*
+ * Remote endpoints
+ */
+
+/* adds an RE with an empty tag of 'tag_type' unless it's negative */
+static ssize_t
+add_re(struct nfc_device* nfc, enum nci_rf_protocol rfproto,
+       enum nci_rf_tech_mode mode, int tag_type,
+       const char* nfcid1, const char* nfcid2)
+{
+    char id1[10], id2[8];
+    struct nfc_tag* tag;
+    struct nfc_re* re;
+    size_t i;
+
+    /* reuse the first free index, or append */
+    for (i = 0; (i < nfc->nres) && nfc->re[i]; ++i) { }
+
+    if (i == nfc->maxres) {
+        size_t maxres = nfc->maxres ? 2 * nfc->maxres : NFC_DEFAULT_MAXRES;
+        struct nfc_re** p = realloc(nfc->re, maxres * sizeof(*p));
+        if (!p) {
+            NFC_D("realloc failed: %d (%s)", errno, strerror(errno));
+            return -1;
+        }
+        nfc->re = p;
+        nfc->maxres = maxres;
+    }
+
+    if (!nfcid1) {
+        snprintf(id1, sizeof(id1), "dead%05zx", i);
+        nfcid1 = id1;
+    }
+    if (!nfcid2) {
+        /* F-mode NFCID2 prefixes as for the default REs */
+        memset(id2, 0, sizeof(id2));
+        if (mode == NCI_RF_NFC_F_PASSIVE_LISTEN_MODE) {
+            id2[0] = (tag_type == T3T) ? 0x02 : 0x01;
+            id2[1] = 0xfe;
+        }
+        id2[5] = i >> 8;
+        id2[6] = i;
+        nfcid2 = id2;
+    }
+
+    re = malloc(sizeof(*re));
+    if (!re) {
+        NFC_D("malloc failed: %d (%s)", errno, strerror(errno));
+        return -1;
+    }
+    tag = NULL;
+    if (tag_type >= 0) {
+        tag = malloc(sizeof(*tag));
+        if (!tag) {
+            NFC_D("malloc failed: %d (%s)", errno, strerror(errno));
+            goto err_malloc;
+        }
+        if (nfc_tag_init(tag, tag_type, 0) < 0) {
+            goto err_nfc_tag_init;
+        }
+    }
+    nfc_re_init(re, nfc, rfproto, mode, tag, nfcid1, nfcid2);
+
+    nfc->re[i] = re;
+    if (i == nfc->nres) {
+        ++nfc->nres;
+    }
+    return i;
+
+err_nfc_tag_init:
+    free(tag);
+err_malloc:
+    free(re);
+    return -1;
+}
+
+ssize_t
+nfc_device_add_re(struct nfc_device* nfc, enum nci_rf_protocol rfproto,
+                  const char* nfcid1, const char* nfcid2)
+{
+    enum nci_rf_tech_mode mode;
+    int tag_type;
+
+    assert(nfc);
+
+    switch (rfproto) {
+        case NCI_RF_PROTOCOL_NFC_DEP:
+            mode = NCI_RF_NFC_F_PASSIVE_LISTEN_MODE;
+            tag_type = -1;
+            break;
+        case NCI_RF_PROTOCOL_T1T:
+            mode = NCI_RF_NFC_A_PASSIVE_LISTEN_MODE;
+            tag_type = T1T;
+            break;
+        case NCI_RF_PROTOCOL_T2T:
+            mode = NCI_RF_NFC_A_PASSIVE_LISTEN_MODE;
+            tag_type = T2T;
+            break;
+        case NCI_RF_PROTOCOL_T3T:
+            mode = NCI_RF_NFC_F_PASSIVE_LISTEN_MODE;
+            tag_type = T3T;
+            break;
+        case NCI_RF_PROTOCOL_ISO_DEP:
+            mode = NCI_RF_NFC_A_PASSIVE_LISTEN_MODE;
+            tag_type = T4T;
+            break;
+        default:
+            NFC_D("unsupported RF protocol %d", rfproto);
+            return -1;
+    }
+
+    return add_re(nfc, rfproto, mode, tag_type, nfcid1, nfcid2);
+}
+
+ssize_t
+nfc_device_add_reader(struct nfc_device* nfc,
+                      nfcemu_reader_handler* process, void* data)
+{
+    struct nfc_hce_reader* reader;
+    ssize_t i;
+
+    assert(nfc);
+    assert(process);
+
+    reader = malloc(sizeof(*reader));
+    if (!reader) {
+        NFC_D("malloc failed: %d (%s)", errno, strerror(errno));
+        return -1;
+    }
+    nfc_hce_reader_init(reader, process, data);
+
+    /* readers talk ISO-DEP over NFC-A */
+    i = add_re(nfc, NCI_RF_PROTOCOL_ISO_DEP, NCI_RF_NFC_A_PASSIVE_POLL_MODE,
+               -1, NULL, NULL);
+    if (i < 0) {
+        free(reader);
+        return -1;
+    }
+    nfc->re[i]->reader = reader;
+
+    return i;
+}
+
+int
+nfc_device_remove_re(struct nfc_device* nfc, size_t i)
+{
+    struct nfc_re* re;
+    struct nfc_tag* tag;
+
+    assert(nfc);
+
+    re = nfc_device_get_re(nfc, i);
+    if (!re) {
+        return -1;
+    }
+    if (re == nfc->active_re) {
+        NFC_D("RE %zu is active", i);
+        return -1;
+    }
+    if (re->id) {
+        nfc->re_by_id[re->id] = NULL;
+    }
+
+    tag = re->tag;
+    if (re->reader) {
+        nfc_hce_reader_uninit(re->reader, nfc);
+        free(re->reader);
+    }
+    nfc_re_uninit(re);
+    free(re);
+    if (tag) {
+        nfc_tag_uninit(tag);
+        free(tag);
+    }
+
+    nfc->re[i] = NULL;
+    while (nfc->nres && !nfc->re[nfc->nres - 1]) {
+        --nfc->nres;
+    }
+    return 0;
+}
+
+struct nfc_re*
+nfc_device_get_re(const struct nfc_device* nfc, size_t i)
+{
+    assert(nfc);
+
+    return i < nfc->nres ? nfc->re[i] : NULL;
+}
+
+size_t
+nfc_device_get_undiscovered_res(const struct nfc_device* nfc,
+                                struct nfc_re** re, size_t n)
+{
+    size_t i, nres;
+
+    assert(nfc);
+    assert(re || !n);
+
+    for (i = 0, nres = 0; (i < nfc->nres) && (nres < n); ++i) {
+        /* readers don't get discovered, they activate the device's
+         * listen mode */
+        if (nfc->re[i] && !nfc->re[i]->id && !nfc->re[i]->reader) {
+            re[nres++] = nfc->re[i];
+        }
+    }
+    return nres;
+}
+
+void
+nfc_device_set_re_id(struct nfc_device* nfc, struct nfc_re* re)
+{
+    uint8_t id;
+    struct nfc_re* old;
+
+    assert(nfc);
+    assert(re);
+
+    if (re->id && (nfc->re_by_id[re->id] == re)) {
+        nfc->re_by_id[re->id] = NULL;
+    }
+
+    id = nfc_device_incr_id(nfc);
+
+    old = nfc->re_by_id[id];
+    if (old) {
+        /* more REs in this cycle than ids; the oldest owner loses
+         * its id */
+        old->id = 0;
+    }
+    re->id = id;
+    nfc->re_by_id[id] = re;
+
+    if (nfc->nids < NFC_MAXIMUM_RE_ID) {
+        ++nfc->nids;
+    }
+}
+
+void
+nfc_device_clear_re_ids(struct nfc_device* nfc)
+{
+    uint8_t id;
+    size_t i;
+
+    assert(nfc);
+
+    /* ids are handed out in sequence; walk back from the latest */
+    for (i = 0, id = nfc->id; i < nfc->nids; ++i) {
+        struct nfc_re* re = nfc->re_by_id[id];
+        if (re) {
+            re->id = 0;
+            nfc->re_by_id[id] = NULL;
+        }
+        id = (id > 1) ? id - 1 : NFC_MAXIMUM_RE_ID;
+    }
+    nfc->nids = 0;
+}
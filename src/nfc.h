@@ -22,12 +22,39 @@
 #include <sys/types.h>
 #include <nfcemu/types.h>
 #include "nfc-rf.h"
-
-struct nfc_re;
+#include "nfc-nfcee.h"
+#include "nfc-re.h"
+#include "nfc-tag.h"
+#include "nfc-tag-cache.h"
+
+struct nfcemu_ctx;
+struct nfcemu_cb;
+struct nfc_nci_cmd_table;
+struct nfc_ring;
+struct nfc_trace;
+struct nfc_scenario;
 union nci_packet;
 
 enum {
-    NUMBER_OF_SUPPORTED_NCI_RF_INTERFACES = 8
+    NUMBER_OF_SUPPORTED_NCI_RF_INTERFACES = 9
+};
+
+enum {
+    /* initial size of the device's RE array */
+    NFC_DEFAULT_MAXRES = 8,
+    /* RF discovery ids range from 1 to 254 */
+    NFC_MAXIMUM_RE_ID = 254
+};
+
+enum {
+    NFC_DEFAULT_LATENCY_SAMPLING = 16
+};
+
+enum {
+    /* largest data message that can be reassembled from, or split
+     * into, NCI data packets; large enough for extended-length APDUs
+     * that transfer a whole tag */
+    NFC_MAX_DTA_LENGTH = MAXIMUM_SUPPORTED_TAG_SIZE + 256
 };
 
 enum nfc_fsm_state {
@@ -37,6 +64,18 @@ enum nfc_fsm_state {
     NUMBER_OF_NFC_FSM_STATES
 };
 
+/* parameters of a pending delivery callback. Each command sets up at
+ * most one callback, so a single slot per device is sufficient. */
+union nfc_delivery_param {
+    struct {
+        uint8_t type;
+        uint8_t reason;
+    } deactivate;
+    struct {
+        struct nfc_re* re;
+    } t3t_polling;
+};
+
 struct nfc_device {
     enum nfc_fsm_state state;
     enum nfc_rfst rf_state;
@@ -50,10 +89,78 @@ struct nfc_device {
 
     /* stores all config options */
     uint8_t config_id_value[128];
+
+    /* host callbacks and the host's per-device data */
+    const struct nfcemu_cb* cb;
+    void* data;
+
+    /* the context's NCI command handlers */
+    const struct nfc_nci_cmd_table* nci_cmd;
+
+    /* packet tracer, if enabled */
+    struct nfc_trace* trace;
+
+    /* batched output, if set up; below the tracer */
+    struct nfc_ring* ring;
+
+    /* field scenario, if started */
+    struct nfc_scenario* scenario;
+
+    /* largest SNEP message that is sent or accepted */
+    size_t snep_max_msg_len;
+
+    /* counters; updated without atomics by the device's thread */
+    struct nfcemu_stats stats;
+
+    /* NCI messages until the next latency sample, and the state of
+     * the random number generator for the sampling interval */
+    unsigned long latency_sampling;
+    unsigned long latency_countdown;
+    uint32_t latency_rng;
+
+    /* data of the delivery callback of the latest command */
+    union nfc_delivery_param delivery;
+
+    /* buffers for LLCP PDUs queued by the device's REs */
+    struct llcp_pdu_pool pdu_pool;
+
+    /* emulated remote endpoints, by console index; removed REs leave
+     * NULL entries. Each RE owns the tag it carries. */
+    struct nfc_re** re;
+    size_t nres;
+    size_t maxres;
+
+    /* REs by RF discovery id, and the number of ids handed out since
+     * the last RF deactivation; these are the ones up to 'id' */
+    struct nfc_re* re_by_id[NFC_MAXIMUM_RE_ID + 1];
+    size_t nids;
+
+    /* encoded images of recently set NDEF messages */
+    struct nfc_tag_cache tag_cache;
+
+    /* the emulated secure element and the DH's listen-mode routing */
+    struct nfc_nfcee nfcee;
+    struct nfc_routing routing;
+
+    /* data flow control; [NCI], Sec 4.4.4. The host holds
+     * 'dta_credits' of at most 'max_dta_credits' credits */
+    uint8_t max_dta_credits;
+    uint8_t dta_credits;
+
+    /* data message that is reassembled from segmented packets */
+    size_t rx_len;
+    uint8_t* rx_buf;
+
+    /* response of the active RE; sent in segments if required */
+    uint8_t* tx_buf;
 };
 
+int
+nfc_device_init(struct nfc_device* nfc, const struct nfcemu_ctx* ctx,
+                void* data);
+
 void
-nfc_device_init(struct nfc_device* nfc);
+nfc_device_uninit(struct nfc_device* nfc);
 
 void
 nfc_device_set(struct nfc_device* nfc, size_t off, size_t len,
@@ -63,9 +170,57 @@ void
 nfc_device_get(const struct nfc_device* nfc, size_t off, size_t len,
                void* value);
 
+/* Return the buffers of NFC_MAX_DTA_LENGTH bytes for reassembled data
+ * messages and for responses; allocated on first use, NULL if out of
+ * memory. Most messages fit into a single packet and never need
+ * 'rx_buf'. */
+uint8_t*
+nfc_device_rx_buf(struct nfc_device* nfc);
+
+uint8_t*
+nfc_device_tx_buf(struct nfc_device* nfc);
+
+uint64_t
+nfc_monotonic_ns(void);
+
+/* Counts 'ns' in the latency histogram 'bucket' with
+ * NFCEMU_STATS_NUMBER_OF_LATENCY_BUCKETS entries. */
+void
+nfc_count_latency(uint64_t* bucket, uint64_t ns);
+
 uint8_t
 nfc_device_incr_id(struct nfc_device* nfc);
 
+/* Adds an RE for the given RF protocol and returns its index. REs
+ * for tag protocols carry an empty tag of the default size. NFCIDs
+ * are derived from the index if NULL. */
+ssize_t
+nfc_device_add_re(struct nfc_device* nfc, enum nci_rf_protocol rfproto,
+                  const char* nfcid1, const char* nfcid2);
+
+/* Removes the RE at index 'i'; fails for the active RE. */
+int
+nfc_device_remove_re(struct nfc_device* nfc, size_t i);
+
+/* returns the RE at index 'i', or NULL if there's none */
+struct nfc_re*
+nfc_device_get_re(const struct nfc_device* nfc, size_t i);
+
+/* Stores up to 'n' REs without an RF discovery id in 're', in the
+ * order of their indices; returns their number. */
+size_t
+nfc_device_get_undiscovered_res(const struct nfc_device* nfc,
+                                struct nfc_re** re, size_t n);
+
+/* Hands out the next RF discovery id to 're'. */
+void
+nfc_device_set_re_id(struct nfc_device* nfc, struct nfc_re* re);
+
+/* Resets the ids of all REs that were discovered or activated since
+ * the last call. */
+void
+nfc_device_clear_re_ids(struct nfc_device* nfc);
+
 struct nfc_rf*
 nfc_find_rf_by_protocol_and_mode(struct nfc_device* nfc,
                                  enum nci_rf_protocol proto, enum nci_rf_tech_mode mode);
@@ -16,12 +16,108 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include "cb.h"
+#include "llcp.h"
 #include "nfc.h"
 #include "nfc-hci.h"
 #include "nfc-nci.h"
+#include "nfc-ring.h"
+#include "nfc-scenario.h"
+#include "nfc-trace.h"
+#include "snep.h"
 #include <nfcemu/nfcemu.h>
 
+/* callbacks registered with nfcemu_init(); these don't know about
+ * devices, so the default context forwards to them */
+static struct {
+  int (*send_ntf)(ssize_t (*create)(void*, struct nfc_device*,
+                                    size_t, union nci_packet*),
+                  void* data);
+  int (*send_dta)(ssize_t (*create)(void*, struct nfc_device*,
+                                    size_t, union nci_packet*),
+                  void* data);
+  int (*recv_dta)(ssize_t (*handle)(void*, struct nfc_device*),
+                  void* data);
+} legacy_cb;
+
+static int
+legacy_send_ntf(struct nfc_device* nfc,
+                ssize_t (*create)(void*, struct nfc_device*,
+                                  size_t, union nci_packet*),
+                void* data)
+{
+  return legacy_cb.send_ntf(create, data);
+}
+
+static int
+legacy_send_dta(struct nfc_device* nfc,
+                ssize_t (*create)(void*, struct nfc_device*,
+                                  size_t, union nci_packet*),
+                void* data)
+{
+  return legacy_cb.send_dta(create, data);
+}
+
+static int
+legacy_recv_dta(struct nfc_device* nfc,
+                ssize_t (*handle)(void*, struct nfc_device*),
+                void* data)
+{
+  return legacy_cb.recv_dta(handle, data);
+}
+
+static void
+init_ctx(struct nfcemu_ctx* ctx,
+        void (*log_msg)(const char* fmtstr, ...),
+        void (*log_err)(const char* fmtstr, ...),
+        nfcemu_timeout* (*new_timeout)(void (*cb)(void*), void* data),
+        void (*mod_timeout)(nfcemu_timeout* t, unsigned long ms),
+        void (*del_timeout)(nfcemu_timeout* t),
+        int (*timeout_is_pending)(nfcemu_timeout* t),
+        int (*send_ntf)(struct nfc_device* nfc,
+                        ssize_t (*create)(void*, struct nfc_device*,
+                                          size_t, union nci_packet*),
+                        void* data),
+        int (*send_dta)(struct nfc_device* nfc,
+                        ssize_t (*create)(void*, struct nfc_device*,
+                                          size_t, union nci_packet*),
+                        void* data),
+        int (*recv_dta)(struct nfc_device* nfc,
+                        ssize_t (*handle)(void*, struct nfc_device*),
+                        void* data))
+{
+  struct nfcemu_cb* cb;
+
+  assert(ctx);
+  assert(new_timeout);
+  assert(mod_timeout);
+  assert(del_timeout);
+  assert(timeout_is_pending);
+  assert(send_ntf);
+  assert(send_dta);
+  assert(recv_dta);
+
+  cb = &ctx->cb;
+  cb->log_msg = log_msg;
+  cb->log_err = log_err;
+  cb->new_timeout = new_timeout;
+  cb->mod_timeout = mod_timeout;
+  cb->del_timeout = del_timeout;
+  cb->timeout_is_pending = timeout_is_pending;
+  cb->send_ntf = send_ntf;
+  cb->send_dta = send_dta;
+  cb->recv_dta = recv_dta;
+  cb->output = NULL;
+
+  ctx->pdu_pool_size = LLCP_PDU_POOL_DEFAULT_SIZE;
+  ctx->tag_cache_size = NFC_TAG_CACHE_DEFAULT_SIZE;
+  ctx->snep_max_msg_len = SNEP_DEFAULT_MAX_MSG_LENGTH;
+  ctx->latency_sampling = NFC_DEFAULT_LATENCY_SAMPLING;
+
+  memcpy(&ctx->nci_cmd, &nfc_nci_default_cmd_table, sizeof(ctx->nci_cmd));
+}
+
 int
 nfcemu_init(void (*log_msg)(const char* fmtstr, ...),
             void (*log_err)(const char* fmtstr, ...),
@@ -38,23 +134,17 @@ nfcemu_init(void (*log_msg)(const char* fmtstr, ...),
             int (*recv_dta)(ssize_t (*handle)(void*, struct nfc_device*),
                             void* data))
 {
-  assert(new_timeout);
-  assert(mod_timeout);
-  assert(del_timeout);
-  assert(timeout_is_pending);
   assert(send_ntf);
   assert(send_dta);
   assert(recv_dta);
 
-  cb.log_msg = log_msg;
-  cb.log_err = log_err;
-  cb.new_timeout = new_timeout;
-  cb.mod_timeout = mod_timeout;
-  cb.del_timeout = del_timeout;
-  cb.timeout_is_pending = timeout_is_pending;
-  cb.send_ntf = send_ntf;
-  cb.send_dta = send_dta;
-  cb.recv_dta = recv_dta;
+  legacy_cb.send_ntf = send_ntf;
+  legacy_cb.send_dta = send_dta;
+  legacy_cb.recv_dta = recv_dta;
+
+  init_ctx(&nfcemu_default_ctx, log_msg, log_err,
+          new_timeout, mod_timeout, del_timeout, timeout_is_pending,
+          legacy_send_ntf, legacy_send_dta, legacy_recv_dta);
 
   return 0;
 }
@@ -65,35 +155,461 @@ nfcemu_uninit()
   return;
 }
 
+struct nfcemu_ctx*
+nfcemu_ctx_create(void (*log_msg)(const char* fmtstr, ...),
+                  void (*log_err)(const char* fmtstr, ...),
+                  nfcemu_timeout* (*new_timeout)(void (*cb)(void*),
+                                                 void* data),
+                  void (*mod_timeout)(nfcemu_timeout* t, unsigned long ms),
+                  void (*del_timeout)(nfcemu_timeout* t),
+                  int (*timeout_is_pending)(nfcemu_timeout* t),
+                  int (*send_ntf)(struct nfc_device* nfc,
+                                  ssize_t (*create)(void*,
+                                                    struct nfc_device*,
+                                                    size_t,
+                                                    union nci_packet*),
+                                  void* data),
+                  int (*send_dta)(struct nfc_device* nfc,
+                                  ssize_t (*create)(void*,
+                                                    struct nfc_device*,
+                                                    size_t,
+                                                    union nci_packet*),
+                                  void* data),
+                  int (*recv_dta)(struct nfc_device* nfc,
+                                  ssize_t (*handle)(void*,
+                                                    struct nfc_device*),
+                                  void* data))
+{
+  struct nfcemu_ctx* ctx;
+
+  ctx = malloc(sizeof(*ctx));
+  if (!ctx) {
+    return NULL;
+  }
+  init_ctx(ctx, log_msg, log_err,
+          new_timeout, mod_timeout, del_timeout, timeout_is_pending,
+          send_ntf, send_dta, recv_dta);
+
+  return ctx;
+}
+
+int
+nfcemu_ctx_set_pdu_pool_size(struct nfcemu_ctx* ctx, size_t nbufs)
+{
+  assert(ctx);
+
+  if (!nbufs) {
+    return -1;
+  }
+  ctx->pdu_pool_size = nbufs;
+
+  return 0;
+}
+
+int
+nfcemu_ctx_set_output(struct nfcemu_ctx* ctx,
+                      int (*output)(struct nfc_device* nfc, size_t len,
+                                    ssize_t (*write)(void*,
+                                                     struct nfc_device*,
+                                                     size_t, char*),
+                                    void* data))
+{
+  assert(ctx);
+
+  ctx->cb.output = output;
+
+  return 0;
+}
+
+int
+nfcemu_ctx_set_tag_cache_size(struct nfcemu_ctx* ctx, size_t nimages)
+{
+  assert(ctx);
+
+  if (!nimages) {
+    return -1;
+  }
+  ctx->tag_cache_size = nimages;
+
+  return 0;
+}
+
+int
+nfcemu_ctx_set_snep_max_msg_length(struct nfcemu_ctx* ctx, size_t len)
+{
+  assert(ctx);
+
+  if ((len < sizeof(struct snep)) || (len > SNEP_MAX_MSG_LENGTH)) {
+    return -1;
+  }
+  ctx->snep_max_msg_len = len;
+
+  return 0;
+}
+
+int
+nfcemu_ctx_set_latency_sampling(struct nfcemu_ctx* ctx,
+                                unsigned long interval)
+{
+  assert(ctx);
+
+  ctx->latency_sampling = interval;
+
+  return 0;
+}
+
+int
+nfcemu_ctx_set_nci_cmd_handler(struct nfcemu_ctx* ctx, unsigned int states,
+                               unsigned int gid, unsigned int oid,
+                               nfcemu_nci_cmd_handler* handler)
+{
+  enum nfc_fsm_state state;
+
+  assert(ctx);
+
+  if (!states || (states >> NUMBER_OF_NFC_FSM_STATES) ||
+      (gid >= NUMBER_OF_NCI_GIDS) || (oid >= NUMBER_OF_NCI_CMDS)) {
+    return -1;
+  }
+  for (state = 0; state < NUMBER_OF_NFC_FSM_STATES; ++state) {
+    if (states & (1 << state)) {
+      ctx->nci_cmd.cmd[state][gid][oid] = handler;
+    }
+  }
+
+  return 0;
+}
+
+void
+nfcemu_ctx_destroy(struct nfcemu_ctx* ctx)
+{
+  assert(ctx);
+  assert(ctx != &nfcemu_default_ctx);
+
+  free(ctx);
+}
+
 struct nfc_device*
-nfc_device_create()
+nfc_device_create_ctx(struct nfcemu_ctx* ctx, void* data)
 {
   struct nfc_device* nfc;
 
+  assert(ctx);
+
   nfc = malloc(sizeof(*nfc));
   if (!nfc) {
     return NULL;
   }
-  nfc_device_init(nfc);
+  if (nfc_device_init(nfc, ctx, data) < 0) {
+    free(nfc);
+    return NULL;
+  }
 
   return nfc;
 }
 
+struct nfc_device*
+nfc_device_create()
+{
+  return nfc_device_create_ctx(&nfcemu_default_ctx, NULL);
+}
+
 void
 nfc_device_destroy(struct nfc_device* nfc)
 {
   assert(nfc);
 
+  nfc_device_uninit(nfc);
   free(nfc);
 }
 
+void*
+nfc_device_get_data(const struct nfc_device* nfc)
+{
+  assert(nfc);
+
+  return nfc->data;
+}
+
+int
+nfc_device_start_trace(struct nfc_device* nfc, uint32_t id, size_t size)
+{
+  struct nfc_trace* trace;
+
+  assert(nfc);
+
+  if (nfc->trace) {
+    return -1;
+  }
+  trace = nfc_trace_create(nfc->cb, id, size);
+  if (!trace) {
+    return -1;
+  }
+  nfc->trace = trace;
+  nfc->cb = &trace->cb;
+
+  return 0;
+}
+
+void
+nfc_device_stop_trace(struct nfc_device* nfc)
+{
+  assert(nfc);
+
+  if (!nfc->trace) {
+    return;
+  }
+  nfc->cb = nfc->trace->host_cb;
+  nfc_trace_destroy(nfc->trace);
+  nfc->trace = NULL;
+}
+
+ssize_t
+nfc_device_read_trace(struct nfc_device* nfc, void* buf, size_t len)
+{
+  assert(nfc);
+
+  if (!nfc->trace) {
+    return -1;
+  }
+  return nfc_trace_read(nfc->trace, buf, len);
+}
+
+int
+nfc_device_set_ring(struct nfc_device* nfc, struct nfcemu_ring* ring,
+                    nfcemu_ring_signal* signal)
+{
+  const struct nfcemu_cb** host_cb;
+  struct nfc_ring* nfc_ring;
+
+  assert(nfc);
+  assert(!ring || signal);
+
+  /* the ring sits below the tracer, so that traces include batched
+   * packets */
+  host_cb = nfc->trace ? &nfc->trace->host_cb : &nfc->cb;
+
+  if (nfc->ring) {
+    *host_cb = nfc->ring->host_cb;
+    nfc_ring_destroy(nfc->ring);
+    nfc->ring = NULL;
+  }
+  if (!ring) {
+    return 0;
+  }
+  nfc_ring = nfc_ring_create(*host_cb, ring, signal);
+  if (!nfc_ring) {
+    return -1;
+  }
+  nfc->ring = nfc_ring;
+  *host_cb = &nfc_ring->cb;
+
+  return 0;
+}
+
+int
+nfc_device_start_scenario(struct nfc_device* nfc,
+                          const struct nfcemu_scenario_event* event,
+                          size_t nevents, unsigned long nloops)
+{
+  struct nfc_scenario* scn;
+
+  assert(nfc);
+
+  if (nfc_device_scenario_is_running(nfc)) {
+    return -1;
+  }
+  scn = nfc_scenario_create(nfc, event, nevents, nloops);
+  if (!scn) {
+    return -1;
+  }
+  nfc_scenario_destroy(nfc->scenario);
+  nfc->scenario = scn;
+
+  return 0;
+}
+
+void
+nfc_device_stop_scenario(struct nfc_device* nfc)
+{
+  assert(nfc);
+
+  nfc_scenario_destroy(nfc->scenario);
+  nfc->scenario = NULL;
+}
+
+int
+nfc_device_scenario_is_running(const struct nfc_device* nfc)
+{
+  assert(nfc);
+
+  return nfc->scenario && !nfc->scenario->done;
+}
+
+int
+nfc_device_add_nfcee_applet(struct nfc_device* nfc,
+                            const uint8_t* aid, size_t aidlen,
+                            nfcemu_apdu_handler* process, void* data)
+{
+  assert(nfc);
+  assert(process);
+
+  return nfc_nfcee_add_applet(&nfc->nfcee, aid, aidlen, process, data,
+                              NULL, 0);
+}
+
+int
+nfc_device_remove_nfcee_applet(struct nfc_device* nfc,
+                               const uint8_t* aid, size_t aidlen)
+{
+  assert(nfc);
+
+  return nfc_nfcee_remove_applet(&nfc->nfcee, aid, aidlen);
+}
+
+ssize_t
+nfc_device_exchange_apdus(struct nfc_device* nfc,
+                          struct nfcemu_apdu* apdu, size_t napdus)
+{
+  struct nfc_apdu_session ses = NFC_APDU_SESSION_INIT;
+  size_t i;
+
+  assert(nfc);
+  assert(apdu || !napdus);
+
+  for (i = 0; i < napdus; ++i) {
+    ssize_t res = nfc_nfcee_transceive(nfc, &ses, apdu[i].cmd,
+                                       apdu[i].cmdlen, apdu[i].rsp,
+                                       apdu[i].rsplen);
+    if (res < 0) {
+      break;
+    }
+    apdu[i].rsplen = res;
+  }
+
+  return i;
+}
+
+struct nfcemu_tag_image*
+nfc_device_get_tag_image(struct nfc_device* nfc, size_t re)
+{
+  const struct nfc_re* nfc_re;
+
+  assert(nfc);
+
+  nfc_re = nfc_device_get_re(nfc, re);
+  if (!nfc_re || !nfc_re->tag) {
+    return NULL;
+  }
+  return nfc_tag_create_image(nfc_re->tag);
+}
+
+int
+nfc_device_set_tag_image(struct nfc_device* nfc, size_t re,
+                         const struct nfcemu_tag_image* image)
+{
+  struct nfc_re* nfc_re;
+
+  assert(nfc);
+  assert(image);
+
+  nfc_re = nfc_device_get_re(nfc, re);
+  if (!nfc_re || !nfc_re->tag) {
+    return -1;
+  }
+  return nfc_tag_set_image(nfc_re->tag, image);
+}
+
+void
+nfcemu_tag_image_destroy(struct nfcemu_tag_image* image)
+{
+  nfc_tag_destroy_image(image);
+}
+
+void
+nfc_device_get_stats(const struct nfc_device* nfc, struct nfcemu_stats* stats)
+{
+  size_t i, j;
+
+  assert(nfc);
+  assert(stats);
+
+  *stats = nfc->stats;
+
+  for (i = 0; i < nfc->nres; ++i) {
+    const struct nfc_re* re = nfc->re[i];
+
+    if (!re) {
+      continue;
+    }
+    stats->re_xmit_q_len += llcp_pdu_queue_len(&re->xmit_q);
+
+    for (j = 0; j < re->llcp_ndls; ++j) {
+      size_t len = llcp_pdu_queue_len(&re->llcp_dl[j]->xmit_q);
+
+      stats->dl_xmit_q_len += len;
+      if (len > stats->dl_xmit_q_max) {
+        stats->dl_xmit_q_max = len;
+      }
+    }
+  }
+  stats->pdu_bufs_max = nfc->pdu_pool.maxused;
+}
+
+/* returns true if the next NCI message is timed */
+static int
+sample_latency(struct nfc_device* nfc)
+{
+  uint32_t x;
+
+  if (!nfc->latency_sampling || --nfc->latency_countdown) {
+    return 0;
+  }
+
+  /* xorshift32; the next interval is uniform in [1, 2*sampling-1] */
+  x = nfc->latency_rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  nfc->latency_rng = x;
+
+  nfc->latency_countdown = 1 + x % (2 * nfc->latency_sampling - 1);
+
+  return 1;
+}
+
 int
 nfc_device_process_nci_msg(struct nfc_device* nfc,
                            const uint8_t* cmd, uint8_t* rsp,
                            struct nfc_delivery_cb* cb)
 {
-  return nfc_process_nci_msg((const union nci_packet*)cmd, nfc,
-                             (union nci_packet*)rsp, cb);
+  uint64_t t0 = 0;
+  int timed;
+  size_t len;
+
+  timed = sample_latency(nfc);
+  if (timed) {
+    t0 = nfc_monotonic_ns();
+  }
+
+  if (nfc->trace) {
+    nfc_trace_record(nfc->trace, NFCEMU_TRACE_NCI_RX, cmd, 3 + cmd[2]);
+  }
+  nfc_ring_begin(nfc);
+  len = nfc_process_nci_msg((const union nci_packet*)cmd, nfc,
+                            (union nci_packet*)rsp, cb);
+  nfc_ring_end(nfc);
+  if (nfc->trace) {
+    if (len) {
+      nfc_trace_record(nfc->trace, NFCEMU_TRACE_NCI_TX, rsp, len);
+    }
+    nfc_trace_wrap_delivery(nfc->trace, nfc, cb);
+  }
+  if (timed) {
+    nfc_count_latency(nfc->stats.nci_latency, nfc_monotonic_ns() - t0);
+  }
+
+  return len;
 }
 
 int
@@ -101,6 +617,15 @@ nfc_device_process_hci_msg(struct nfc_device* nfc,
                            const uint8_t* cmd, uint8_t* rsp,
                            struct nfc_delivery_cb* cb)
 {
-  return nfc_process_hci_cmd((const union hci_packet*)cmd, nfc,
-                             (union hci_answer*)rsp);
+  size_t len;
+
+  if (nfc->trace) {
+    nfc_trace_record(nfc->trace, NFCEMU_TRACE_HCI_RX, cmd, 3 + cmd[2]);
+  }
+  len = nfc_process_hci_cmd((const union hci_packet*)cmd, nfc,
+                            (union hci_answer*)rsp);
+  if (nfc->trace && len) {
+    nfc_trace_record(nfc->trace, NFCEMU_TRACE_HCI_TX, rsp, len);
+  }
+  return len;
 }
@@ -37,6 +37,12 @@ snep_create_req_put(struct snep* snep, uint32_t len)
     return snep_create_msg(snep, SNEP_REQ_PUT, len);
 }
 
+size_t
+snep_create_rsp_continue(struct snep* snep)
+{
+    return snep_create_msg(snep, SNEP_RSP_CONTINUE, 0);
+}
+
 size_t
 snep_create_rsp_success(struct snep* snep, uint32_t len)
 {
@@ -29,6 +29,14 @@ enum {
     SNEP_VERSION_MINOR = 0x00
 };
 
+enum {
+    /* default for the largest message we send or accept, including
+     * the header; see nfcemu_ctx_set_snep_max_msg_length() */
+    SNEP_DEFAULT_MAX_MSG_LENGTH = 64 * 1024,
+    /* the header's length field has 32 bits */
+    SNEP_MAX_MSG_LENGTH = 0xffffffff
+};
+
 enum snep_msg {
     /* request codes */
     SNEP_REQ_CONTINUE = 0x00,
@@ -69,6 +77,9 @@ snep_create_msg(struct snep* snep, enum snep_msg msg, uint32_t len);
 size_t
 snep_create_req_put(struct snep* snep, uint32_t len);
 
+size_t
+snep_create_rsp_continue(struct snep* snep);
+
 size_t
 snep_create_rsp_success(struct snep* snep, uint32_t len);
 